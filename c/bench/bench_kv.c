@@ -0,0 +1,694 @@
+/*
+ * Benchmarks for libkv
+ *
+ * Measures store, retrieve, patch and batch round trips: throughput,
+ * p50/p99/p999 latency, allocations made by libkv and libcurl per
+ * operation, and bytes on the wire per operation. Always runs against an
+ * embedded mock server on 127.0.0.1, so the numbers reflect the client's
+ * own cost, and optionally against a real endpoint. Run with:
+ *   make bench
+ *   make bench BENCH_URL=https://key-value.co BENCH_TOKEN=<token>
+ *
+ * Allocation counts come from a counting kv_allocator, so they cover libkv
+ * and libcurl but not json-c, which has no allocator hook.
+ *
+ * Also times kv_ingest_push from several producer threads at once, and
+ * kv_reduce on a column of several days of 1 Hz readings with each kernel
+ * the CPU can run, and kv_reduce_percentiles on the same.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <curl/curl.h>
+
+#include "kv.h"
+#include "kv_alloc.h"
+#include "kv_batch.h"
+#include "kv_codec.h"
+#include "kv_ingest.h"
+#include "kv_metrics.h"
+#include "kv_reduce.h"
+#include "kv_internal.h"
+
+#define BENCH_BATCH_OPS 10
+#define BENCH_INGEST_PUSHES 100000     /* per producer */
+#define BENCH_INGEST_TOKENS 64
+#define BENCH_REDUCE_VALUES 500000      /* almost 6 days at 1 Hz */
+#define BENCH_REDUCE_PASSES 50
+#define MOCK_BUFFER_MAX (4 * 1024 * 1024)
+
+/* ---- counting allocator ---- */
+
+/* The mock server thread uses plain malloc and json-c. The ingest
+ * benchmark's I/O threads allocate through libkv too, so the count is
+ * kept atomically. */
+static size_t allocations = 0;
+
+static void *count_malloc(size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+static void count_free(void *ptr) {
+    free(ptr);
+}
+
+static void *count_realloc(void *ptr, size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return realloc(ptr, size);
+}
+
+static char *count_strdup(const char *str) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return strdup(str);
+}
+
+static void *count_calloc(size_t nmemb, size_t size) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return calloc(nmemb, size);
+}
+
+static const struct kv_allocator counting_allocator = {
+    count_malloc, count_free, count_realloc, count_strdup, count_calloc
+};
+
+/* ---- embedded mock server ---- */
+
+/*
+ * Minimal HTTP/1.1 keep-alive server for the endpoints the benchmarks use.
+ * It holds a single document regardless of token and serves one
+ * connection at a time, which is all a single client needs.
+ */
+struct mock_server {
+    int listen_fd;
+    int port;
+    pthread_t thread;
+    struct json_object *data;       /* stored document, NULL if none */
+    long version;
+};
+
+static struct json_object *mock_store(struct mock_server *server, struct json_object *data) {
+    json_object_put(server->data);
+    server->data = json_object_get(data);
+    server->version++;
+
+    struct json_object *reply = json_object_new_object();
+    json_object_object_add(reply, "success", json_object_new_boolean(1));
+    json_object_object_add(reply, "version", json_object_new_int64(server->version));
+    return reply;
+}
+
+static struct json_object *mock_retrieve(struct mock_server *server) {
+    struct json_object *reply = json_object_new_object();
+    json_object_object_add(reply, "success", json_object_new_boolean(1));
+    json_object_object_add(reply, "data", json_object_get(server->data));
+    json_object_object_add(reply, "version", json_object_new_int64(server->version));
+    return reply;
+}
+
+/* Route one request. Returns the reply body and sets *status. */
+static struct json_object *mock_route(struct mock_server *server, const char *method,
+                                      const char *path, const char *body, int *status) {
+    struct json_object *request = body ? json_tokener_parse(body) : NULL;
+    struct json_object *reply = NULL, *value, *patch;
+    *status = 200;
+
+    if(strcmp(method, "POST") == 0 && strcmp(path, "/api/store") == 0 &&
+       request && json_object_object_get_ex(request, "data", &value)) {
+        reply = mock_store(server, value);
+    } else if(strcmp(method, "GET") == 0 && strcmp(path, "/api/retrieve") == 0) {
+        if(server->data) {
+            reply = mock_retrieve(server);
+        } else {
+            *status = 404;
+        }
+    } else if(strcmp(method, "PATCH") == 0 && strcmp(path, "/api/store") == 0 && request &&
+              json_object_object_get_ex(request, "patch", &patch) && server->data) {
+        if(!json_object_object_get_ex(request, "version", &value) ||
+           json_object_get_int64(value) != server->version) {
+            *status = 409;
+        } else {
+            struct json_object *set = NULL, *remove = NULL;
+            json_object_object_get_ex(patch, "set", &set);
+            json_object_object_get_ex(patch, "remove", &remove);
+            kv_patch_apply(server->data, set, remove);
+            server->version++;
+            reply = json_object_new_object();
+            json_object_object_add(reply, "success", json_object_new_boolean(1));
+            json_object_object_add(reply, "version", json_object_new_int64(server->version));
+        }
+    } else if(strcmp(method, "POST") == 0 && strcmp(path, "/api/batch") == 0 && request &&
+              json_object_object_get_ex(request, "operations", &value)) {
+        struct json_object *results = json_object_new_array();
+        size_t len = json_object_array_length(value);
+        for(size_t i = 0; i < len; i++) {
+            struct json_object *op = json_object_array_get_idx(value, i), *action, *data;
+            json_object_object_get_ex(op, "action", &action);
+            if(strcmp(json_object_get_string(action), "store") == 0 &&
+               json_object_object_get_ex(op, "data", &data)) {
+                json_object_array_add(results, mock_store(server, data));
+            } else {
+                json_object_array_add(results, mock_retrieve(server));
+            }
+        }
+        reply = json_object_new_object();
+        json_object_object_add(reply, "success", json_object_new_boolean(1));
+        json_object_object_add(reply, "results", results);
+    } else {
+        *status = 404;
+    }
+
+    if(!reply) {
+        reply = json_object_new_object();
+        json_object_object_add(reply, "error", json_object_new_string(*status == 409 ?
+                               "Version conflict" : "Not found"));
+    }
+    json_object_put(request);
+    return reply;
+}
+
+/* Value of header name in the header block, or NULL */
+static const char *mock_header(const char *headers, const char *name, char *out, size_t out_size) {
+    size_t name_len = strlen(name);
+    for(const char *line = strstr(headers, "\r\n"); line && line[2] != '\r';
+        line = strstr(line + 2, "\r\n")) {
+        if(strncasecmp(line + 2, name, name_len) != 0 || line[2 + name_len] != ':') continue;
+
+        const char *value = line + 3 + name_len;
+        while(*value == ' ') value++;
+        size_t n = strcspn(value, "\r");
+        if(n >= out_size) n = out_size - 1;
+        memcpy(out, value, n);
+        out[n] = 0;
+        return out;
+    }
+    return NULL;
+}
+
+static int mock_send(int fd, const char *data, size_t len) {
+    while(len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if(n <= 0) return 0;
+        data += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/* Headers and body in one write, so the reply is not split across
+ * segments waiting on a delayed ACK */
+static int mock_reply(int fd, const char *head, size_t head_len, const char *body, size_t body_len) {
+    struct iovec iov[2] = { { (void *)head, head_len }, { (void *)body, body_len } };
+    ssize_t n = writev(fd, iov, 2);
+    if(n < 0) return 0;
+    if((size_t)n < head_len) {
+        return mock_send(fd, head + n, head_len - n) && mock_send(fd, body, body_len);
+    }
+    return mock_send(fd, body + (n - head_len), body_len - (n - head_len));
+}
+
+/* Serve requests on one connection until the client closes it */
+static void mock_serve(struct mock_server *server, int fd) {
+    char *buf = malloc(MOCK_BUFFER_MAX + 1);
+    size_t used = 0;
+    int continued = 0;
+
+    while(buf) {
+        buf[used] = 0;
+        char *end = strstr(buf, "\r\n\r\n");
+        char value[64];
+
+        if(end) {
+            size_t header_len = end + 4 - buf;
+            size_t body_len = mock_header(buf, "Content-Length", value, sizeof(value)) ?
+                              strtoul(value, NULL, 10) : 0;
+
+            if(header_len + body_len <= used) {
+                char method[16], path[256];
+                if(sscanf(buf, "%15s %255s", method, path) != 2) break;
+                char *query = strchr(path, '?');
+                if(query) *query = 0;
+
+                /* The body is NUL-terminated in place for the parser */
+                char saved = buf[header_len + body_len];
+                buf[header_len + body_len] = 0;
+                int status;
+                struct json_object *reply = mock_route(server, method, path,
+                                                       body_len ? buf + header_len : NULL, &status);
+                buf[header_len + body_len] = saved;
+
+                const char *text = json_object_to_json_string_ext(reply, JSON_C_TO_STRING_PLAIN);
+                char head[256];
+                int head_len = snprintf(head, sizeof(head),
+                    "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\n"
+                    "Content-Length: %zu\r\nETag: \"%ld\"\r\n\r\n",
+                    status, status == 200 ? "OK" : status == 409 ? "Conflict" : "Not Found",
+                    strlen(text), server->version);
+                int sent = mock_reply(fd, head, head_len, text, strlen(text));
+                json_object_put(reply);
+                if(!sent) break;
+
+                used -= header_len + body_len;
+                memmove(buf, buf + header_len + body_len, used);
+                continued = 0;
+                continue;
+            }
+
+            if(!continued && mock_header(buf, "Expect", value, sizeof(value)) &&
+               strcasecmp(value, "100-continue") == 0) {
+                const char *go = "HTTP/1.1 100 Continue\r\n\r\n";
+                if(!mock_send(fd, go, strlen(go))) break;
+                continued = 1;
+            }
+        }
+
+        if(used == MOCK_BUFFER_MAX) break;
+        ssize_t n = recv(fd, buf + used, MOCK_BUFFER_MAX - used, 0);
+        if(n <= 0) break;
+        used += n;
+    }
+
+    free(buf);
+    close(fd);
+}
+
+static void *mock_thread(void *arg) {
+    struct mock_server *server = (struct mock_server *)arg;
+    int fd;
+
+    /* accept fails once mock_stop shuts the listening socket down */
+    while((fd = accept(server->listen_fd, NULL, NULL)) >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        mock_serve(server, fd);
+    }
+    return NULL;
+}
+
+static int mock_start(struct mock_server *server) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+
+    memset(server, 0, sizeof(*server));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(server->listen_fd < 0) return 0;
+    if(bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+       listen(server->listen_fd, 4) != 0 ||
+       getsockname(server->listen_fd, (struct sockaddr *)&addr, &addr_len) != 0 ||
+       pthread_create(&server->thread, NULL, mock_thread, server) != 0) {
+        close(server->listen_fd);
+        return 0;
+    }
+    server->port = ntohs(addr.sin_port);
+    return 1;
+}
+
+static void mock_stop(struct mock_server *server) {
+    shutdown(server->listen_fd, SHUT_RDWR);
+    pthread_join(server->thread, NULL);
+    close(server->listen_fd);
+    json_object_put(server->data);
+}
+
+/* ---- benchmarks ---- */
+
+struct bench_context {
+    kv_client *client;
+    struct json_object *document;   /* what store and batch write */
+    kv_batch *batch;
+    int iteration;
+};
+
+typedef int (*bench_op)(struct bench_context *ctx);
+
+static int op_store(struct bench_context *ctx) {
+    return kv_store(ctx->client, ctx->document);
+}
+
+static int op_retrieve(struct bench_context *ctx) {
+    struct json_object *data = kv_retrieve(ctx->client);
+    json_object_put(data);
+    return data != NULL;
+}
+
+/* What sensor_dashboard view does: the reading without a json-c tree */
+static int op_retrieve_raw(struct bench_context *ctx) {
+    struct kv_reading reading;
+    size_t len;
+    const char *data = kv_retrieve_raw(ctx->client, &len);
+    const char *current = data ? kv_json_member(data, len, "current", &len) : NULL;
+    return current && kv_reading_decode(current, len, &reading);
+}
+
+static int op_patch(struct bench_context *ctx) {
+    struct json_object *set = json_object_new_object();
+    json_object_object_add(set, "current.temperature",
+                           json_object_new_double(20.0 + (ctx->iteration % 100) / 10.0));
+    int ok = kv_patch(ctx->client, kv_client_version(ctx->client), set, NULL);
+    json_object_put(set);
+    return ok;
+}
+
+static int op_batch(struct bench_context *ctx) {
+    const char *token = kv_client_token(ctx->client);
+    for(int i = 0; i < BENCH_BATCH_OPS; i++) {
+        kv_batch_store(ctx->batch, token, ctx->document, 0, NULL, NULL);
+    }
+    return kv_batch_execute(ctx->batch, ctx->client) == BENCH_BATCH_OPS;
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of sorted samples */
+static double percentile(const double *sorted, int n, double p) {
+    int rank = (int)(p * n + 0.999999);
+    if(rank < 1) rank = 1;
+    if(rank > n) rank = n;
+    return sorted[rank - 1];
+}
+
+struct wire_count {
+    double sent;
+    double received;
+};
+
+/* CURLOPT_DEBUGFUNCTION: tally HTTP headers and bodies in each direction */
+static int count_wire(CURL *handle, curl_infotype type, char *data, size_t size, void *userp) {
+    struct wire_count *count = (struct wire_count *)userp;
+    (void)handle;
+    (void)data;
+
+    if(type == CURLINFO_HEADER_OUT || type == CURLINFO_DATA_OUT) count->sent += size;
+    if(type == CURLINFO_HEADER_IN || type == CURLINFO_DATA_IN) count->received += size;
+    return 0;
+}
+
+/* Average HTTP bytes per operation over a few extra rounds. Counted
+ * outside the timed loop, since the debug callback needs verbose mode. */
+static void wire_bytes(bench_op op, struct bench_context *ctx, double *sent, double *received) {
+    struct wire_count count = {0, 0};
+    CURL *curl = ctx->client->curl;
+    const int rounds = 10;
+
+    curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, count_wire);
+    curl_easy_setopt(curl, CURLOPT_DEBUGDATA, (void *)&count);
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+    for(int i = 0; i < rounds; i++) op(ctx);
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, 0L);
+    curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, NULL);
+
+    *sent = count.sent / rounds;
+    *received = count.received / rounds;
+}
+
+static int run_bench(const char *name, bench_op op, struct bench_context *ctx, int iterations) {
+    double *latency = malloc(sizeof(double) * iterations);
+    double sent = 0, received = 0;
+    int failures = 0;
+    if(!latency) return 0;
+
+    /* Warm up: connection, TLS session and buffers are set up once */
+    for(int i = 0; i < 10; i++) {
+        ctx->iteration = i;
+        op(ctx);
+    }
+
+    size_t allocations_before = allocations;
+    double start = now_us();
+    for(int i = 0; i < iterations; i++) {
+        ctx->iteration = i;
+        double t0 = now_us();
+        if(!op(ctx)) failures++;
+        latency[i] = now_us() - t0;
+    }
+    double elapsed = now_us() - start;
+    size_t allocated = allocations - allocations_before;
+    wire_bytes(op, ctx, &sent, &received);
+
+    qsort(latency, iterations, sizeof(double), compare_double);
+    printf("%-10s %9.0f %9.1f %9.1f %9.1f %10.1f %10.0f %10.0f",
+           name, iterations / (elapsed / 1e6),
+           percentile(latency, iterations, 0.50), percentile(latency, iterations, 0.99),
+           percentile(latency, iterations, 0.999),
+           (double)allocated / iterations, sent, received);
+    if(failures) printf("  (%d failed: %s)", failures, kv_client_error(ctx->client));
+    printf("\n");
+
+    free(latency);
+    return failures == 0;
+}
+
+/* A sensor_dashboard-sized document */
+static struct json_object *sample_document(void) {
+    struct json_object *doc = json_object_new_object();
+    struct json_object *current = json_object_new_object();
+    json_object_object_add(current, "temperature", json_object_new_double(23.5));
+    json_object_object_add(current, "humidity", json_object_new_double(45.2));
+    json_object_object_add(current, "pressure", json_object_new_double(1013.25));
+    json_object_object_add(doc, "current", current);
+
+    struct json_object *history = json_object_new_array();
+    for(int i = 0; i < 20; i++) {
+        struct json_object *reading = json_object_new_object();
+        json_object_object_add(reading, "timestamp", json_object_new_string("2025-01-14T09:30:00Z"));
+        json_object_object_add(reading, "temperature", json_object_new_double(20.0 + i / 4.0));
+        json_object_object_add(reading, "humidity", json_object_new_double(40.0 + i / 2.0));
+        json_object_array_add(history, reading);
+    }
+    json_object_object_add(doc, "history", history);
+    return doc;
+}
+
+static int run_suite(const char *label, const char *url, const char *token, int iterations) {
+    struct bench_context ctx = {0};
+    int ok = 1;
+
+    ctx.client = kv_client_new(url, token);
+    ctx.batch = kv_batch_new();
+    ctx.document = sample_document();
+    if(!ctx.client || !ctx.batch) {
+        fprintf(stderr, "Failed to create client\n");
+        ok = 0;
+        goto done;
+    }
+
+    printf("\n%s: %s, %d iterations, %d-op batches, %zu-byte document\n", label, url,
+           iterations, BENCH_BATCH_OPS, strlen(json_object_to_json_string(ctx.document)));
+    printf("%-10s %9s %9s %9s %9s %10s %10s %10s\n", "op", "ops/s", "p50 us", "p99 us",
+           "p999 us", "allocs/op", "sent B/op", "recv B/op");
+
+    /* store first so retrieve and patch have a document */
+    ok &= run_bench("store", op_store, &ctx, iterations);
+    ok &= run_bench("retrieve", op_retrieve, &ctx, iterations);
+    ok &= run_bench("raw get", op_retrieve_raw, &ctx, iterations);
+    ok &= run_bench("patch", op_patch, &ctx, iterations);
+    ok &= run_bench("batch", op_batch, &ctx, iterations);
+
+    /* What measuring costs: the same store with kv_metrics.h enabled */
+    if(kv_client_enable_metrics(ctx.client, 1)) {
+        ok &= run_bench("store+m", op_store, &ctx, iterations);
+        kv_client_enable_metrics(ctx.client, 0);
+    }
+
+done:
+    json_object_put(ctx.document);
+    kv_batch_free(ctx.batch);
+    kv_client_free(ctx.client);
+    return ok;
+}
+
+/* ---- multi-producer ingest ---- */
+
+struct ingest_producer {
+    kv_ingest *ingest;
+    kv_ingest_token **tokens;
+    int first;                      /* offset into tokens, so producers mix */
+    double *push_ns;                /* per push */
+    long accepted;
+};
+
+static void *ingest_produce(void *arg) {
+    struct ingest_producer *producer = (struct ingest_producer *)arg;
+    struct timespec before, after;
+
+    for(int i = 0; i < BENCH_INGEST_PUSHES; i++) {
+        struct json_object *reading = json_object_new_object();
+        json_object_object_add(reading, "n", json_object_new_int(i));
+        clock_gettime(CLOCK_MONOTONIC, &before);
+        producer->accepted += kv_ingest_push(producer->ingest,
+                                             producer->tokens[(producer->first + i) % BENCH_INGEST_TOKENS],
+                                             reading);
+        clock_gettime(CLOCK_MONOTONIC, &after);
+        producer->push_ns[i] = (after.tv_sec - before.tv_sec) * 1e9 + (after.tv_nsec - before.tv_nsec);
+    }
+    return NULL;
+}
+
+/* Producers push as fast as they can into one ingest with one I/O thread
+ * (the mock serves one connection at a time); what counts is that a push
+ * never waits on the network, so a full ring shows up as drops */
+static int run_ingest(const char *url) {
+    const int counts[] = { 1, 2, 4 };
+    struct ingest_producer producers[4];
+    pthread_t threads[4];
+    kv_ingest_token *tokens[BENCH_INGEST_TOKENS];
+    double *samples = malloc(sizeof(double) * BENCH_INGEST_PUSHES * 4);
+    char token[32];
+    int ok = samples != NULL;
+
+    printf("\nkv_ingest: %d pushes per producer over %d tokens, 1 I/O thread, 16 shards\n",
+           BENCH_INGEST_PUSHES, BENCH_INGEST_TOKENS);
+    printf("%-10s %12s %9s %9s %9s %10s %10s\n", "producers", "pushes/s", "p50 ns", "p99 ns",
+           "p999 ns", "dropped", "sent");
+
+    for(int c = 0; ok && c < 3; c++) {
+        kv_ingest *ingest = kv_ingest_new(url, 1, 16, 1024, 5);
+        if(!ingest) {
+            ok = 0;
+            break;
+        }
+        for(int t = 0; t < BENCH_INGEST_TOKENS; t++) {
+            snprintf(token, sizeof(token), "bench-%d", t);
+            tokens[t] = kv_ingest_add(ingest, token);
+        }
+
+        double start = now_us();
+        for(int p = 0; p < counts[c]; p++) {
+            producers[p].ingest = ingest;
+            producers[p].tokens = tokens;
+            producers[p].first = p * 17;
+            producers[p].push_ns = samples + (size_t)p * BENCH_INGEST_PUSHES;
+            producers[p].accepted = 0;
+            pthread_create(&threads[p], NULL, ingest_produce, &producers[p]);
+        }
+        for(int p = 0; p < counts[c]; p++) {
+            pthread_join(threads[p], NULL);
+        }
+        double elapsed = now_us() - start;
+        ok &= kv_ingest_flush(ingest);
+
+        struct kv_ingest_stats stats;
+        kv_ingest_stats(ingest, &stats);
+        int n = BENCH_INGEST_PUSHES * counts[c];
+        qsort(samples, n, sizeof(double), compare_double);
+        printf("%-10d %12.0f %9.0f %9.0f %9.0f %9.1f%% %10ld\n", counts[c], n / elapsed * 1e6,
+               percentile(samples, n, 0.50), percentile(samples, n, 0.99),
+               percentile(samples, n, 0.999), 100.0 * stats.dropped / n, stats.sent);
+        kv_ingest_free(ingest);
+    }
+
+    free(samples);
+    return ok;
+}
+
+/* ---- column reductions ---- */
+
+static int run_reduce(void) {
+    double *values = malloc(sizeof(double) * BENCH_REDUCE_VALUES);
+    if(!values) return 0;
+    for(int i = 0; i < BENCH_REDUCE_VALUES; i++) {
+        /* A daily swing, and a missed reading now and then */
+        values[i] = i % 97 == 0 ? NAN : 1013.25 + 4 * sin(i * 7.27e-5) + (i % 13) * 0.01;
+    }
+
+    printf("\nkv_reduce: %d values (%.1f MB) per column, %s picked\n", BENCH_REDUCE_VALUES,
+           BENCH_REDUCE_VALUES * sizeof(double) / 1e6, kv_reduce_kernel());
+    printf("%-10s %12s %10s %10s\n", "kernel", "Mvalues/s", "GB/s", "us/column");
+
+    const char *kernels[] = { "scalar", "sse2", "avx2", "neon" };
+    struct kv_reduce r;
+    for(int k = 0; k < 4; k++) {
+        if(!kv_reduce_set_kernel(kernels[k])) continue;
+        kv_reduce(values, BENCH_REDUCE_VALUES, &r);
+
+        double start = now_us();
+        for(int i = 0; i < BENCH_REDUCE_PASSES; i++) kv_reduce(values, BENCH_REDUCE_VALUES, &r);
+        double per_pass = (now_us() - start) / BENCH_REDUCE_PASSES;
+        printf("%-10s %12.0f %10.2f %10.0f\n", kernels[k], BENCH_REDUCE_VALUES / per_pass,
+               BENCH_REDUCE_VALUES * sizeof(double) / per_pass / 1e3, per_pass);
+    }
+    kv_reduce_set_kernel(NULL);
+
+    const double ps[] = { 50, 95, 99 };
+    double at[3];
+    double start = now_us();
+    int ok = kv_reduce_percentiles(values, BENCH_REDUCE_VALUES, ps, 3, at);
+    printf("%-10s %12s %10s %10.0f  (p50/p95/p99)\n", "percentile", "", "", now_us() - start);
+
+    free(values);
+    return ok;
+}
+
+static void print_usage(const char *prog) {
+    printf("Usage: %s [-n iterations] [-u url -t token [-r iterations]]\n", prog);
+    printf("  -n  iterations against the embedded mock server (default 2000)\n");
+    printf("  -u  also benchmark this endpoint, with -t token (-r iterations, default 50)\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *url = NULL, *token = NULL;
+    int iterations = 2000, remote_iterations = 50;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:r:u:t:h")) != -1) {
+        switch(opt) {
+        case 'n': iterations = atoi(optarg); break;
+        case 'r': remote_iterations = atoi(optarg); break;
+        case 'u': url = optarg; break;
+        case 't': token = optarg; break;
+        default: print_usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(iterations < 1 || remote_iterations < 1 || (url && !token)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if(!kv_global_init_allocator(&counting_allocator)) {
+        fprintf(stderr, "Failed to initialize libkv\n");
+        return 1;
+    }
+
+    struct mock_server server;
+    if(!mock_start(&server)) {
+        fprintf(stderr, "Failed to start mock server\n");
+        kv_global_cleanup();
+        return 1;
+    }
+
+    char mock_url[64];
+    snprintf(mock_url, sizeof(mock_url), "http://127.0.0.1:%d", server.port);
+    int ok = run_suite("mock", mock_url, "bench-token", iterations);
+    ok &= run_ingest(mock_url);
+    mock_stop(&server);
+
+    if(url) ok &= run_suite("remote", url, token, remote_iterations);
+    ok &= run_reduce();
+
+    kv_global_cleanup();
+    return ok ? 0 : 1;
+}
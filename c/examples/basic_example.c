@@ -6,152 +6,57 @@
  * - Retrieve data
  *
  * Compile:
- *   gcc -o basic_example basic_example.c -lcurl -ljson-c
+ *   make examples/basic_example
  *
  * Usage:
  *   ./basic_example <token>
  *   # or set KV_TOKEN environment variable:
  *   # KV_TOKEN=your-token ./basic_example
+ *
+ * With KV_PASSWORD set (and libkv built with WITH_OPENSSL=1) the data is
+ * encrypted on the client, so the server only stores ciphertext.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <curl/curl.h>
-#include <json-c/json.h>
+#include "kv.h"
+#include "kv_crypt.h"
 
 #ifndef API_URL
 #define API_URL "https://key-value.co"
 #endif
-#define MAX_RESPONSE_SIZE 100000
-
-/* Memory structure for curl response */
-struct memory {
-    char *response;
-    size_t size;
-};
-
-/* Callback function for curl to write response */
-static size_t write_callback(void *data, size_t size, size_t nmemb, void *userp) {
-    size_t realsize = size * nmemb;
-    struct memory *mem = (struct memory *)userp;
-
-    char *ptr = realloc(mem->response, mem->size + realsize + 1);
-    if(ptr == NULL) {
-        printf("Not enough memory (realloc returned NULL)\n");
-        return 0;
-    }
-
-    mem->response = ptr;
-    memcpy(&(mem->response[mem->size]), data, realsize);
-    mem->size += realsize;
-    mem->response[mem->size] = 0;
-
-    return realsize;
-}
 
 /* Store data with a token */
-int store_data(const char *token, const char *json_data) {
-    CURL *curl;
-    CURLcode res;
-    struct memory chunk = {0};
-    int success = 0;
-
-    curl = curl_easy_init();
-    if(curl) {
-        char url[256];
-        snprintf(url, sizeof(url), "%s/api/store", API_URL);
-
-        /* Build request JSON */
-        struct json_object *request = json_object_new_object();
-        struct json_object *data_obj = json_tokener_parse(json_data);
-        json_object_object_add(request, "data", data_obj);
-
-        const char *request_str = json_object_to_json_string(request);
-
-        /* Set headers */
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-        char token_header[512];
-        snprintf(token_header, sizeof(token_header), "X-KV-Token: %s", token);
-        headers = curl_slist_append(headers, token_header);
-
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request_str);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-
-        res = curl_easy_perform(curl);
-
-        if(res == CURLE_OK) {
-            long response_code;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-            success = (response_code >= 200 && response_code < 300);
-
-            if(chunk.response && chunk.size > 0) {
-                printf("Store response: %s\n", chunk.response);
-            }
-        } else {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-        }
-
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
-        json_object_put(request);
-        free(chunk.response);
+int store_data(kv_client *client, const char *json_data) {
+    int success = kv_store_string(client, json_data);
+
+    if(kv_client_status(client) == 0) {
+        fprintf(stderr, "Request failed: %s\n", kv_client_error(client));
+    } else if(kv_client_response(client)[0]) {
+        printf("Store response: %s\n", kv_client_response(client));
     }
 
     return success;
 }
 
 /* Retrieve data for a token */
-char* retrieve_data(const char *token) {
-    CURL *curl;
-    CURLcode res;
-    struct memory chunk = {0};
+char* retrieve_data(kv_client *client) {
     char *data_str = NULL;
 
-    curl = curl_easy_init();
-    if(curl) {
-        char url[256];
-        snprintf(url, sizeof(url), "%s/api/retrieve", API_URL);
-
-        struct curl_slist *headers = NULL;
-        char token_header[512];
-        snprintf(token_header, sizeof(token_header), "X-KV-Token: %s", token);
-        headers = curl_slist_append(headers, token_header);
-
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-
-        res = curl_easy_perform(curl);
-
-        if(res == CURLE_OK && chunk.response) {
-            struct json_object *parsed_json;
-            struct json_object *data_obj;
-
-            parsed_json = json_tokener_parse(chunk.response);
-            if(json_object_object_get_ex(parsed_json, "data", &data_obj)) {
-                data_str = strdup(json_object_to_json_string_ext(data_obj, JSON_C_TO_STRING_PRETTY));
-            }
-            json_object_put(parsed_json);
-        } else {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-        }
-
-        curl_easy_cleanup(curl);
-        curl_slist_free_all(headers);
-        free(chunk.response);
+    struct json_object *data_obj = kv_retrieve(client);
+    if(data_obj) {
+        data_str = strdup(json_object_to_json_string_ext(data_obj, JSON_C_TO_STRING_PRETTY));
+        json_object_put(data_obj);
+    } else if(kv_client_status(client) == 0) {
+        fprintf(stderr, "Request failed: %s\n", kv_client_error(client));
     }
 
     return data_str;
 }
 
 int main(int argc, char *argv[]) {
-    curl_global_init(CURL_GLOBAL_DEFAULT);
+    kv_global_init();
 
     printf("=== Key-Value Store - Basic Example ===\n\n");
 
@@ -164,19 +69,39 @@ int main(int argc, char *argv[]) {
 
     if(!token_source || strlen(token_source) == 0) {
         fprintf(stderr, "Token required. Pass it as the first argument or set KV_TOKEN.\n");
-        curl_global_cleanup();
+        kv_global_cleanup();
         return 1;
     }
 
     char *token = strdup(token_source);
     if(!token) {
         fprintf(stderr, "Failed to allocate memory for token\n");
-        curl_global_cleanup();
+        kv_global_cleanup();
+        return 1;
+    }
+
+    kv_client *client = kv_client_new(API_URL, token);
+    if(!client) {
+        fprintf(stderr, "Failed to create client\n");
+        free(token);
+        kv_global_cleanup();
+        return 1;
+    }
+
+    const char *password = getenv("KV_PASSWORD");
+    if(password && *password && !kv_client_set_encryption(client, password, KV_CIPHER_AUTO)) {
+        fprintf(stderr, "Cannot encrypt: %s\n", kv_client_error(client));
+        kv_client_free(client);
+        free(token);
+        kv_global_cleanup();
         return 1;
     }
 
     printf("1. Using provided token...\n");
-    printf("   Token: %s\n\n", token);
+    printf("   Token: %s\n", token);
+    if(kv_client_cipher(client) == KV_CIPHER_AES_GCM) printf("   Encrypting with AES-256-GCM\n");
+    if(kv_client_cipher(client) == KV_CIPHER_CHACHA20) printf("   Encrypting with ChaCha20-Poly1305\n");
+    printf("\n");
 
     /* Step 2: Store data */
     printf("2. Storing data...\n");
@@ -189,30 +114,32 @@ int main(int argc, char *argv[]) {
         "\"scores\":[95,87,92]"
     "}";
 
-    if(!store_data(token, data)) {
+    if(!store_data(client, data)) {
         fprintf(stderr, "Failed to store data\n");
+        kv_client_free(client);
         free(token);
-        curl_global_cleanup();
+        kv_global_cleanup();
         return 1;
     }
     printf("   ✓ Data stored successfully\n\n");
 
     /* Step 3: Retrieve data */
     printf("3. Retrieving data...\n");
-    char *retrieved = retrieve_data(token);
+    char *retrieved = retrieve_data(client);
     if(!retrieved) {
         fprintf(stderr, "Failed to retrieve data\n");
         free(token);
-        curl_global_cleanup();
+        kv_global_cleanup();
         return 1;
     }
     printf("   Retrieved data:\n%s\n\n", retrieved);
     printf("   ✓ Data successfully retrieved!\n");
 
     /* Cleanup */
+    kv_client_free(client);
     free(token);
     free(retrieved);
-    curl_global_cleanup();
+    kv_global_cleanup();
 
     return 0;
 }
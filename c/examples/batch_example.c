@@ -0,0 +1,106 @@
+/*
+ * Batch Operations Example in C
+ *
+ * Write to and read from many tokens with a handful of HTTPS requests:
+ * - kv_queue coalesces stores to many tokens into one /api/batch request
+ * - kv_batch retrieves every token in one more request
+ *
+ * Compile:
+ *   make examples/batch_example
+ *
+ * Usage:
+ *   ./batch_example <token> [<token> ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kv.h"
+#include "kv_batch.h"
+
+#ifndef API_URL
+#define API_URL "https://key-value.co"
+#endif
+
+/* Report one store result */
+static void on_stored(const struct kv_batch_result *result, void *userdata) {
+    int *stored = (int *)userdata;
+
+    if(result->success) {
+        (*stored)++;
+        printf("   ✓ store %s (version %ld)\n", result->token, result->version);
+    } else if(!result->superseded) {
+        printf("   ✗ store %s failed: %s\n", result->token, result->error);
+    }
+}
+
+/* Report one retrieve result */
+static void on_retrieved(const struct kv_batch_result *result, void *userdata) {
+    (void)userdata;
+
+    if(result->success && result->data) {
+        printf("   %s: %s\n", result->token,
+               json_object_to_json_string_ext(result->data, JSON_C_TO_STRING_PLAIN));
+    } else {
+        printf("   %s: %s\n", result->token, result->error);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if(argc < 2) {
+        printf("Usage: %s <token> [<token> ...]\n", argv[0]);
+        return 1;
+    }
+
+    int ntokens = argc - 1;
+    if(ntokens > KV_BATCH_MAX) {
+        fprintf(stderr, "At most %d tokens per batch\n", KV_BATCH_MAX);
+        return 1;
+    }
+
+    kv_global_init();
+
+    kv_client *client = kv_client_new(API_URL, NULL);
+    if(!client) {
+        fprintf(stderr, "Failed to create client\n");
+        kv_global_cleanup();
+        return 1;
+    }
+
+    /* 1. Buffer one write per token; they go out as a single batch */
+    printf("=== Key-Value Store - Batch Example ===\n\n");
+    printf("1. Storing a reading for %d token(s) in one request...\n", ntokens);
+
+    int stored = 0;
+    kv_queue *queue = kv_queue_new(client, KV_BATCH_MAX, 200);
+    for(int i = 0; i < ntokens; i++) {
+        struct json_object *reading = json_object_new_object();
+        json_object_object_add(reading, "sensor", json_object_new_int(i));
+        json_object_object_add(reading, "temperature", json_object_new_double(20.0 + i * 0.5));
+        kv_queue_store(queue, argv[i + 1], reading, on_stored, &stored);
+        json_object_put(reading);
+    }
+    if(kv_queue_flush(queue) < 0) {
+        fprintf(stderr, "   Batch store failed: %s\n", kv_client_error(client));
+    }
+    kv_queue_free(queue);
+    printf("   %d of %d stored\n\n", stored, ntokens);
+
+    /* 2. Read them all back in one request */
+    printf("2. Retrieving all tokens in one request...\n");
+
+    kv_batch *batch = kv_batch_new();
+    for(int i = 0; i < ntokens; i++) {
+        kv_batch_retrieve(batch, argv[i + 1], on_retrieved, NULL);
+    }
+    int ok = kv_batch_execute(batch, client);
+    if(ok < 0) {
+        fprintf(stderr, "   Batch retrieve failed: %s\n", kv_client_error(client));
+    }
+    kv_batch_free(batch);
+
+    kv_client_free(client);
+    kv_global_cleanup();
+
+    return (ok == ntokens && stored == ntokens) ? 0 : 1;
+}
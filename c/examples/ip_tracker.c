@@ -4,13 +4,40 @@
  * Track your external IP address and store it in the key-value store.
  * Useful for dynamic IP monitoring on embedded devices, routers, etc.
  *
+ * libkv and libcurl run from a preallocated pool, and each cycle's strings
+ * live in an arena that is reset afterwards, so a long-running monitor
+ * does not churn the heap. The lookups are decoded straight into C
+ * structs (kv_codec.h), so a check that finds the same IP builds no
+ * json-c tree at all.
+ *
+ * monitor runs its checks on a kv_sched at a fixed rate, up to a tenth of
+ * the interval late at random so routers started together spread their
+ * lookups. The lookups run on the async engine while the scheduler waits,
+ * and a check still waiting on a slow lookup when the next is due lets
+ * that one pass.
+ *
+ * The external IP comes from several providers asked at once (kv_extip.h):
+ * ipify, icanhazip and OpenDNS over DNS-over-HTTPS. The first answer wins
+ * and the other lookups are cancelled, so one provider being slow or down
+ * does not hold a check up. The answer is reused for IP_CACHE_SECONDS
+ * while the host's interfaces stay as they were.
+ *
  * Compile:
- *   gcc -o ip_tracker ip_tracker.c -lcurl -ljson-c
+ *   make examples/ip_tracker
  *
  * Usage:
  *   ./ip_tracker <token> update
  *   ./ip_tracker <token> get
  *   ./ip_tracker <token> monitor <interval_seconds>
+ *   ./ip_tracker <token> watch
+ *
+ * watch prints the stored record whenever it changes, for consumers that
+ * would otherwise run get in a loop. With a server that holds long polls
+ * it sends about one request per change.
+ *
+ * With KV_SNAPSHOT_DIR set, every command keeps a local copy of the record
+ * there (kv_snapshot.h), and get prints that copy at once and refreshes it
+ * in a background process.
  */
 
 #include <stdio.h>
@@ -18,241 +45,387 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
-#include <curl/curl.h>
-#include <json-c/json.h>
+#include "kv.h"
+#include "kv_async.h"
+#include "kv_alloc.h"
+#include "kv_codec.h"
+#include "kv_extip.h"
+#include "kv_sched.h"
+#include "kv_snapshot.h"
+#include "kv_watch.h"
 
 #ifndef API_URL
 #define API_URL "https://key-value.co"
 #endif
+#ifndef IP_CHECK_SERVICE
 #define IP_CHECK_SERVICE "https://api.ipify.org?format=json"
+#endif
+/* The other providers raced against it; "" leaves one out */
+#ifndef IP_CHECK_TEXT_SERVICE
+#define IP_CHECK_TEXT_SERVICE "https://ipv4.icanhazip.com"
+#endif
+#ifndef IP_CHECK_DNS_SERVICE
+#define IP_CHECK_DNS_SERVICE "https://doh.opendns.com/dns-query"
+#endif
 
-struct memory {
-    char *response;
-    size_t size;
+#define RETRY_ATTEMPTS 3
+#define MONITOR_JITTER_PERCENT 10
+#define IP_CHECK_TIMEOUT 10
+#define IP_CACHE_SECONDS 120
+#define WATCH_RETRY_SECONDS 10
+
+/* Get current UTC timestamp in ISO format */
+void get_timestamp(char *buffer, size_t size) {
+    time_t now = time(NULL);
+    struct tm *tm_info = gmtime(&now);
+    strftime(buffer, size, "%Y-%m-%dT%H:%M:%SZ", tm_info);
+}
+
+struct monitor;
+
+/* Results of the concurrent lookups in update_ip */
+struct update_state {
+    kv_arena *arena;
+    char *ip;
+    struct kv_ip_record stored;
+    int have_stored;                /* stored holds the decoded record */
+    long version;                   /* of stored, 0 if unknown */
+    int outstanding;                /* lookups not completed yet */
+    struct monitor *monitor;        /* a monitor check to finish, or NULL */
 };
 
-static size_t write_callback(void *data, size_t size, size_t nmemb, void *userp) {
-    size_t realsize = size * nmemb;
-    struct memory *mem = (struct memory *)userp;
+static void finish_check(struct monitor *monitor);
 
-    char *ptr = realloc(mem->response, mem->size + realsize + 1);
-    if(ptr == NULL) return 0;
+/* A lookup completed; a monitor check is finished by the last one */
+static void lookup_done(struct update_state *state) {
+    if(--state->outstanding == 0 && state->monitor) finish_check(state->monitor);
+}
 
-    mem->response = ptr;
-    memcpy(&(mem->response[mem->size]), data, realsize);
-    mem->size += realsize;
-    mem->response[mem->size] = 0;
+/* Completion of the external IP lookup */
+static void on_external_ip(const char *ip, void *userdata) {
+    struct update_state *state = (struct update_state *)userdata;
 
-    return realsize;
+    if(ip) state->ip = kv_arena_strdup(state->arena, ip);
+    lookup_done(state);
 }
 
-/* Get current UTC timestamp in ISO format */
-void get_timestamp(char *buffer, size_t size) {
-    time_t now = time(NULL);
-    struct tm *tm_info = gmtime(&now);
-    strftime(buffer, size, "%Y-%m-%dT%H:%M:%SZ", tm_info);
+/* Completion of the stored data retrieve */
+static void on_stored_data(const struct kv_async_result *result, void *userdata) {
+    struct update_state *state = (struct update_state *)userdata;
+    size_t len;
+
+    if(result->status >= 200 && result->status < 300) {
+        const char *data = kv_json_member(result->body, result->body_size, "data", &len);
+        state->have_stored = data && kv_ip_record_decode(data, len, &state->stored);
+
+        const char *version = kv_json_member(result->body, result->body_size, "version", &len);
+        if(version) state->version = strtol(version, NULL, 10);
+    }
+    lookup_done(state);
 }
 
-/* Get external IP address */
-char* get_external_ip(void) {
-    CURL *curl;
-    CURLcode res;
-    struct memory chunk = {0};
-    char *ip = NULL;
-
-    curl = curl_easy_init();
-    if(curl) {
-        curl_easy_setopt(curl, CURLOPT_URL, IP_CHECK_SERVICE);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
-
-        res = curl_easy_perform(curl);
-
-        if(res == CURLE_OK && chunk.response) {
-            struct json_object *parsed_json;
-            struct json_object *ip_obj;
-
-            parsed_json = json_tokener_parse(chunk.response);
-            if(json_object_object_get_ex(parsed_json, "ip", &ip_obj)) {
-                ip = strdup(json_object_get_string(ip_obj));
-            }
-            json_object_put(parsed_json);
+/*
+ * The patch for a new IP: ip, previous_ip and last_updated, changed set,
+ * and the previous IP with the time it was set appended to the history.
+ * history_len is the length of the stored history, which is not sent:
+ * the entry goes in at history.<len>, and the oldest entries are removed
+ * to keep the last KV_IP_HISTORY_MAX. With no stored history (0), the
+ * history is set whole.
+ */
+static void add_change(struct json_object *set, struct json_object *remove,
+                       const char *ip, const char *timestamp,
+                       const char *previous_ip, const char *previous_timestamp,
+                       int history_len) {
+    json_object_object_add(set, "changed", json_object_new_boolean(1));
+    json_object_object_add(set, "last_updated", json_object_new_string(timestamp));
+    json_object_object_add(set, "ip", json_object_new_string(ip));
+
+    struct json_object *entry = NULL;
+    if(previous_ip) {
+        json_object_object_add(set, "previous_ip", json_object_new_string(previous_ip));
+
+        entry = json_object_new_object();
+        json_object_object_add(entry, "ip", json_object_new_string(previous_ip));
+        if(previous_timestamp && previous_timestamp[0]) {
+            json_object_object_add(entry, "timestamp", json_object_new_string(previous_timestamp));
         }
-
-        curl_easy_cleanup(curl);
-        free(chunk.response);
     }
 
-    return ip;
+    if(history_len <= 0) {
+        struct json_object *history = json_object_new_array();
+        if(entry) json_object_array_add(history, entry);
+        json_object_object_add(set, "history", history);
+    } else if(entry) {
+        char path[32];
+        snprintf(path, sizeof(path), "history.%d", history_len);
+        json_object_object_add(set, path, entry);
+
+        /* Removes apply after sets, each to what the last one left */
+        for(int i = history_len + 1; i > KV_IP_HISTORY_MAX; i--) {
+            json_object_array_add(remove, json_object_new_string("history.0"));
+        }
+    }
 }
 
-/* Retrieve stored IP data */
-struct json_object* get_stored_data(const char *token) {
-    CURL *curl;
-    CURLcode res;
-    struct memory chunk = {0};
-    struct json_object *data = NULL;
-
-    curl = curl_easy_init();
-    if(curl) {
-        char url[256];
-        snprintf(url, sizeof(url), "%s/api/retrieve", API_URL);
-
-        struct curl_slist *headers = NULL;
-        char token_header[512];
-        snprintf(token_header, sizeof(token_header), "X-KV-Token: %s", token);
-        headers = curl_slist_append(headers, token_header);
-
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-
-        res = curl_easy_perform(curl);
-
-        if(res == CURLE_OK && chunk.response) {
-            struct json_object *parsed_json = json_tokener_parse(chunk.response);
-            if(parsed_json) {
-                struct json_object *data_obj;
-                if(json_object_object_get_ex(parsed_json, "data", &data_obj)) {
-                    data = json_object_get(data_obj); /* Increase ref count */
-                }
-                json_object_put(parsed_json);
-            }
-        }
+/* The new IP observation being patched into the stored record */
+struct ip_update {
+    kv_arena *arena;
+    const char *ip;
+    const char *timestamp;
+    char *previous_ip;
+    int changed;
+};
 
-        curl_easy_cleanup(curl);
-        curl_slist_free_all(headers);
-        free(chunk.response);
+/*
+ * kv_update builder for update_ip, when the record could not be patched
+ * from the decoded copy. The record is only written when something in it
+ * changes: a new IP rewrites ip, previous_ip and last_updated and extends
+ * the history, and the first check after that clears changed. Further
+ * checks that find the same IP send nothing, so last_updated is when the
+ * record last changed.
+ */
+static int build_ip_patch(struct json_object *stored, struct json_object *set,
+                          struct json_object *remove, void *userdata) {
+    struct ip_update *update = (struct ip_update *)userdata;
+    struct json_object *ip_obj;
+
+    /* May run again after a version conflict; start from the fresh copy */
+    update->previous_ip = NULL;
+    if(stored && json_object_object_get_ex(stored, "ip", &ip_obj)) {
+        update->previous_ip = kv_arena_strdup(update->arena, json_object_get_string(ip_obj));
     }
 
-    return data;
-}
+    /* Check if changed */
+    update->changed = (update->previous_ip == NULL || strcmp(update->ip, update->previous_ip) != 0);
+
+    /* Skip the write entirely if changed is already false */
+    if(!update->changed) {
+        json_object_object_add(set, "changed", json_object_new_boolean(0));
+        return kv_patch_prune(stored, set, remove) > 0;
+    }
 
-/* Store IP data */
-int store_ip_data(const char *token, struct json_object *data) {
-    CURL *curl;
-    CURLcode res;
-    struct memory chunk = {0};
-    int success = 0;
-
-    curl = curl_easy_init();
-    if(curl) {
-        char url[256];
-        snprintf(url, sizeof(url), "%s/api/store", API_URL);
-
-        /* Build request */
-        struct json_object *request = json_object_new_object();
-        json_object_object_add(request, "data", json_object_get(data));
-
-        const char *request_str = json_object_to_json_string(request);
-
-        /* Set headers */
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-        char token_header[512];
-        snprintf(token_header, sizeof(token_header), "X-KV-Token: %s", token);
-        headers = curl_slist_append(headers, token_header);
-
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request_str);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-
-        res = curl_easy_perform(curl);
-
-        if(res == CURLE_OK) {
-            long response_code;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-            success = (response_code >= 200 && response_code < 300);
+    struct json_object *old_timestamp = NULL, *history = NULL;
+    int history_len = 0;
+    if(stored) {
+        json_object_object_get_ex(stored, "last_updated", &old_timestamp);
+        if(json_object_object_get_ex(stored, "history", &history) &&
+           json_object_is_type(history, json_type_array)) {
+            history_len = (int)json_object_array_length(history);
         }
+    }
+
+    add_change(set, remove, update->ip, update->timestamp, update->previous_ip,
+               old_timestamp ? json_object_get_string(old_timestamp) : NULL, history_len);
+    return 1;
+}
 
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
-        json_object_put(request);
-        free(chunk.response);
+/*
+ * Write the change from the decoded copy at the version it was retrieved
+ * at, with no second retrieve: clear changed on the check after a change,
+ * or patch in a new IP. Returns as update_ip, or -2 if the record moved on
+ * (a version conflict, or changed found cleared by another writer) and
+ * has to be read again.
+ */
+static int patch_stored(kv_client *client, struct update_state *state, const char *timestamp) {
+    const struct kv_ip_record *stored = &state->stored;
+    struct json_object *set = json_object_new_object();
+    struct json_object *remove = json_object_new_array();
+    int result;
+
+    if(strcmp(stored->ip, state->ip) == 0) {
+        /* Only while the record still holds this IP: another writer may
+         * have put a new one in, with changed set for it */
+        struct json_object *expected = json_object_new_string(state->ip);
+        json_object_object_add(set, "changed", json_object_new_boolean(0));
+        result = kv_patch_if(client, state->version, "ip", expected, set, NULL);
+        json_object_put(expected);
+        if(result == 1) result = 0;
+        else if(result == 0 || kv_client_status(client) == 409) result = -2;
+    } else {
+        add_change(set, remove, state->ip, timestamp, stored->ip, stored->last_updated,
+                   stored->history_len);
+        if(kv_patch(client, state->version, set, remove)) result = 1;
+        else result = kv_client_status(client) == 409 ? -2 : -1;
     }
 
-    return success;
+    json_object_put(set);
+    json_object_put(remove);
+    return result;
 }
 
-/* Update IP and return if changed */
-int update_ip(const char *token, char **current_ip, char **previous_ip) {
-    /* Get current external IP */
-    char *ip = get_external_ip();
-    if(!ip) {
+/* Look up the external IP, unless the cached one still holds, and fetch
+ * the stored data concurrently. The lookups complete as async is polled. */
+static void start_update(kv_async *async, kv_client *client, kv_extip *finder,
+                         struct update_state *state) {
+    const char *cached = kv_extip_cached(finder);
+
+    state->outstanding = 0;
+    if(cached) {
+        state->ip = kv_arena_strdup(state->arena, cached);
+    } else if(kv_extip_lookup(finder, async, on_external_ip, state)) {
+        state->outstanding++;
+    }
+    if(kv_async_retrieve(async, client, on_stored_data, state)) state->outstanding++;
+}
+
+/* Once both lookups are in: write the record if the IP changed, and
+ * return as update_ip */
+static int finish_update(kv_client *client, struct update_state *state,
+                         char **current_ip, char **previous_ip) {
+    kv_arena *arena = state->arena;
+
+    if(!state->ip) {
         fprintf(stderr, "Failed to get external IP\n");
         return -1;
     }
 
-    *current_ip = ip;
+    *current_ip = state->ip;
 
-    /* Get stored data */
-    struct json_object *stored = get_stored_data(token);
-    *previous_ip = NULL;
+    /* The usual check: same IP, changed already cleared, nothing to write */
+    if(state->have_stored && !state->stored.changed && strcmp(state->stored.ip, state->ip) == 0) {
+        *previous_ip = kv_arena_strdup(arena, state->stored.ip);
+        return 0;
+    }
 
-    if(stored) {
-        struct json_object *ip_obj;
-        if(json_object_object_get_ex(stored, "ip", &ip_obj)) {
-            *previous_ip = strdup(json_object_get_string(ip_obj));
+    char timestamp[64];
+    get_timestamp(timestamp, sizeof(timestamp));
+
+    /* Something changes: patch the record from what the lookup returned */
+    if(state->have_stored && state->version > 0 && state->stored.ip[0]) {
+        int result = patch_stored(client, state, timestamp);
+        if(result != -2) {
+            *previous_ip = kv_arena_strdup(arena, state->stored.ip);
+            return result;
         }
     }
 
-    /* Check if changed */
-    int changed = (*previous_ip == NULL || strcmp(ip, *previous_ip) != 0);
+    /* It moved on, or is not what the codec expects: read it again as
+     * json-c, and patch only what changed, retrying on a version conflict */
+    struct ip_update update = { arena, state->ip, timestamp, NULL, 0 };
+    int success = kv_update(client, NULL, 0, build_ip_patch, &update, 3);
 
-    /* Build new data */
-    char timestamp[64];
-    get_timestamp(timestamp, sizeof(timestamp));
+    *previous_ip = update.previous_ip;
 
-    struct json_object *data = json_object_new_object();
-    json_object_object_add(data, "ip", json_object_new_string(ip));
-    json_object_object_add(data, "last_updated", json_object_new_string(timestamp));
-    json_object_object_add(data, "changed", json_object_new_boolean(changed));
+    return success ? (update.changed ? 1 : 0) : -1;
+}
 
-    if(*previous_ip) {
-        json_object_object_add(data, "previous_ip", json_object_new_string(*previous_ip));
-    }
+/* Update IP and return if changed. The returned strings live in arena. */
+int update_ip(kv_async *async, kv_client *client, kv_extip *finder, kv_arena *arena,
+              char **current_ip, char **previous_ip) {
+    struct update_state state = {0};
+    state.arena = arena;
 
-    /* Add history */
-    struct json_object *history = json_object_new_array();
-    if(stored) {
-        struct json_object *old_history;
-        if(json_object_object_get_ex(stored, "history", &old_history)) {
-            /* Copy up to last 9 entries */
-            int len = json_object_array_length(old_history);
-            int start = (len > 9) ? len - 9 : 0;
-            for(int i = start; i < len; i++) {
-                json_object_array_add(history, json_object_get(json_object_array_get_idx(old_history, i)));
-            }
-        }
+    start_update(async, client, finder, &state);
+    kv_async_run(async);
+    return finish_update(client, &state, current_ip, previous_ip);
+}
+
+/* One monitor check in flight at a time */
+struct monitor {
+    kv_async *async;
+    kv_client *client;
+    kv_extip *finder;
+    kv_arena *arena;
+    kv_sched_job *job;
+    struct update_state state;
+};
+
+static void print_check(int result, const char *current_ip, const char *previous_ip) {
+    time_t now = time(NULL);
+    char timestr[64];
+    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+    if(result == 1) {
+        printf("[%s] IP CHANGED!\n", timestr);
+        printf("  Old: %s\n", previous_ip);
+        printf("  New: %s\n", current_ip);
+    } else if(result == 0) {
+        printf("[%s] IP unchanged: %s\n", timestr, current_ip);
+    } else {
+        printf("[%s] Error updating IP\n", timestr);
     }
+    fflush(stdout);
+}
 
-    /* Add previous IP to history if changed */
-    if(changed && *previous_ip && stored) {
-        struct json_object *history_entry = json_object_new_object();
-        json_object_object_add(history_entry, "ip", json_object_new_string(*previous_ip));
+static void finish_check(struct monitor *monitor) {
+    char *current_ip = NULL, *previous_ip = NULL;
+    int result = finish_update(monitor->client, &monitor->state, &current_ip, &previous_ip);
 
-        struct json_object *old_timestamp;
-        if(json_object_object_get_ex(stored, "last_updated", &old_timestamp)) {
-            json_object_object_add(history_entry, "timestamp",
-                json_object_new_string(json_object_get_string(old_timestamp)));
-        }
+    print_check(result, current_ip, previous_ip);
+    kv_arena_reset(monitor->arena);
+    kv_sched_job_set_busy(monitor->job, 0);
+}
 
-        json_object_array_add(history, history_entry);
+/* kv_sched job: start a check, which finishes in the lookups' callbacks */
+static int start_check(kv_sched_job *job, void *userdata) {
+    struct monitor *monitor = (struct monitor *)userdata;
+
+    memset(&monitor->state, 0, sizeof(monitor->state));
+    monitor->state.arena = monitor->arena;
+    monitor->state.monitor = monitor;
+    start_update(monitor->async, monitor->client, monitor->finder, &monitor->state);
+
+    if(monitor->state.outstanding == 0) {
+        print_check(-1, NULL, NULL);
+    } else {
+        kv_sched_job_set_busy(job, 1);
     }
+    return 1;
+}
 
-    json_object_object_add(data, "history", history);
+/* kv_watch callback: a new version of the record */
+static int on_record_change(struct json_object *data, long version, void *userdata) {
+    struct json_object *ip, *changed;
+    (void)userdata;
 
-    /* Store */
-    int success = store_ip_data(token, data);
+    time_t now = time(NULL);
+    char timestr[64];
+    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+    if(!data) {
+        printf("[%s] Record deleted\n", timestr);
+    } else if(json_object_object_get_ex(data, "ip", &ip)) {
+        int is_new = json_object_object_get_ex(data, "changed", &changed) && json_object_get_boolean(changed);
+        printf("[%s] IP: %s%s (version %ld)\n", timestr, json_object_get_string(ip),
+               is_new ? " - CHANGED" : "", version);
+    }
+    fflush(stdout);
+    return 1;
+}
 
-    if(stored) json_object_put(stored);
-    json_object_put(data);
+/* The providers update_ip races, with its answer cached */
+static kv_extip *new_finder(void) {
+    kv_extip *finder = kv_extip_new();
+    if(!finder) return NULL;
+
+    kv_extip_add(finder, KV_EXTIP_JSON, IP_CHECK_SERVICE);
+    if(IP_CHECK_TEXT_SERVICE[0]) kv_extip_add(finder, KV_EXTIP_TEXT, IP_CHECK_TEXT_SERVICE);
+    if(IP_CHECK_DNS_SERVICE[0]) kv_extip_add(finder, KV_EXTIP_DNS, IP_CHECK_DNS_SERVICE);
+    kv_extip_set_timeout(finder, IP_CHECK_TIMEOUT);
+    kv_extip_set_cache(finder, IP_CACHE_SECONDS * 1000L);
+    return finder;
+}
 
-    return success ? (changed ? 1 : 0) : -1;
+static void print_record(struct json_object *data) {
+    if(data) {
+        printf("Stored IP data:\n%s\n", json_object_to_json_string_ext(data, JSON_C_TO_STRING_PRETTY));
+    } else {
+        printf("No data stored yet\n");
+    }
+}
+
+/* get from the local snapshot; 0 if there is none */
+static int print_snapshot(const char *dir, const char *token) {
+    kv_snapshot *snapshot = kv_snapshot_open(dir, token);
+    if(!snapshot) return 0;
+
+    struct json_object *data = kv_snapshot_parse(snapshot);
+    printf("(local copy: version %ld, confirmed %llds ago)\n", kv_snapshot_version(snapshot),
+           kv_snapshot_age_ms(snapshot) / 1000);
+    print_record(data);
+    json_object_put(data);
+    kv_snapshot_close(snapshot);
+    return 1;
 }
 
 void print_usage(const char *prog) {
@@ -260,6 +433,7 @@ void print_usage(const char *prog) {
     printf("  %s <token> update          - Update IP once\n", prog);
     printf("  %s <token> get             - Get stored IP data\n", prog);
     printf("  %s <token> monitor <secs>  - Monitor IP continuously\n", prog);
+    printf("  %s <token> watch           - Print stored IP data as it changes\n", prog);
 }
 
 int main(int argc, char *argv[]) {
@@ -271,11 +445,64 @@ int main(int argc, char *argv[]) {
     const char *token = argv[1];
     const char *command = argv[2];
 
-    curl_global_init(CURL_GLOBAL_DEFAULT);
+    /* get from a snapshot returns before curl and the pool are set up; a
+     * child process then refreshes the snapshot and does nothing else */
+    const char *snapshot_dir = getenv("KV_SNAPSHOT_DIR");
+    int refresh_only = 0;
+    if(snapshot_dir && *snapshot_dir && strcmp(command, "get") == 0 &&
+       print_snapshot(snapshot_dir, token)) {
+        fflush(stdout);
+        if(fork() != 0) return 0;
+        refresh_only = 1;
+    }
+
+    if(!kv_global_init_pool(NULL, 0)) {
+        fprintf(stderr, "Failed to set up memory pool\n");
+        return 1;
+    }
+
+    kv_client *client = kv_client_new(API_URL, token);
+    if(!client) {
+        fprintf(stderr, "Failed to create client\n");
+        kv_global_cleanup();
+        return 1;
+    }
+
+    /* A check that hits a brief outage is retried before it is reported */
+    kv_client_set_retry(client, RETRY_ATTEMPTS, 0, 0);
+
+    if(snapshot_dir && *snapshot_dir && !kv_client_set_snapshot_dir(client, snapshot_dir)) {
+        fprintf(stderr, "%s\n", kv_client_error(client));
+        kv_client_free(client);
+        kv_global_cleanup();
+        return 1;
+    }
+    if(refresh_only) {
+        /* A 304 for the snapshot's ETag just confirms it */
+        json_object_put(kv_retrieve(client));
+        kv_client_free(client);
+        kv_global_cleanup();
+        return 0;
+    }
+
+    kv_async *async = kv_async_new();
+    kv_extip *finder = new_finder();
+    kv_arena *arena = kv_arena_new(1024);
+    if(!async || !finder || !arena) {
+        fprintf(stderr, "Failed to create async engine\n");
+        kv_arena_free(arena);
+        kv_extip_free(finder);
+        kv_async_free(async);
+        kv_client_free(client);
+        kv_global_cleanup();
+        return 1;
+    }
+    /* update_ip decodes the retrieve itself */
+    kv_async_set_parse(async, 0);
 
     if(strcmp(command, "update") == 0) {
         char *current_ip = NULL, *previous_ip = NULL;
-        int result = update_ip(token, &current_ip, &previous_ip);
+        int result = update_ip(async, client, finder, arena, &current_ip, &previous_ip);
 
         if(result >= 0) {
             printf("Current IP: %s\n", current_ip);
@@ -286,63 +513,73 @@ int main(int argc, char *argv[]) {
                 printf("✓ IP unchanged\n");
             }
         }
-
-        free(current_ip);
-        free(previous_ip);
     }
     else if(strcmp(command, "get") == 0) {
-        struct json_object *data = get_stored_data(token);
-        if(data) {
-            printf("Stored IP data:\n%s\n",
-                json_object_to_json_string_ext(data, JSON_C_TO_STRING_PRETTY));
-            json_object_put(data);
-        } else {
-            printf("No data stored yet\n");
-        }
+        struct json_object *data = kv_retrieve(client);
+        print_record(data);
+        json_object_put(data);
     }
     else if(strcmp(command, "monitor") == 0) {
         if(argc < 4) {
             fprintf(stderr, "Error: monitor requires interval in seconds\n");
             print_usage(argv[0]);
-            curl_global_cleanup();
+            kv_arena_free(arena);
+            kv_extip_free(finder);
+            kv_async_free(async);
+            kv_client_free(client);
+            kv_global_cleanup();
             return 1;
         }
 
         int interval = atoi(argv[3]);
+        long period_ms = (interval > 0 ? interval : 1) * 1000L;
         printf("Starting IP monitor (checking every %d seconds)\n", interval);
         printf("Press Ctrl+C to stop\n\n");
 
-        while(1) {
-            char *current_ip = NULL, *previous_ip = NULL;
-            int result = update_ip(token, &current_ip, &previous_ip);
-
-            time_t now = time(NULL);
-            char timestr[64];
-            strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", localtime(&now));
-
-            if(result == 1) {
-                printf("[%s] IP CHANGED!\n", timestr);
-                printf("  Old: %s\n", previous_ip);
-                printf("  New: %s\n", current_ip);
-            } else if(result == 0) {
-                printf("[%s] IP unchanged: %s\n", timestr, current_ip);
-            } else {
-                printf("[%s] Error updating IP\n", timestr);
+        struct monitor monitor = { async, client, finder, arena, NULL, { 0 } };
+        kv_sched *sched = kv_sched_new(async);
+        if(sched) {
+            monitor.job = kv_sched_every(sched, period_ms, period_ms * MONITOR_JITTER_PERCENT / 100,
+                                         start_check, &monitor);
+        }
+        if(!monitor.job) {
+            fprintf(stderr, "Failed to create scheduler\n");
+        } else {
+            int result;
+            while((result = kv_sched_run(sched, 0)) == 0) {}
+            if(result < 0) fprintf(stderr, "Scheduler failed\n");
+        }
+        kv_sched_free(sched);
+    }
+    else if(strcmp(command, "watch") == 0) {
+        kv_watch *watch = kv_watch_new(client, 0, on_record_change, NULL);
+        if(!watch) {
+            fprintf(stderr, "Failed to create watch\n");
+        } else {
+            printf("Watching for changes (Ctrl+C to stop)\n");
+            while(kv_watch_run(watch, 0) < 0) {
+                fprintf(stderr, "Watch failed: %s, resuming in %d seconds\n",
+                        kv_client_error(client), WATCH_RETRY_SECONDS);
+                sleep(WATCH_RETRY_SECONDS);
             }
-
-            free(current_ip);
-            free(previous_ip);
-
-            sleep(interval);
+            kv_watch_free(watch);
         }
     }
     else {
         fprintf(stderr, "Unknown command: %s\n", command);
         print_usage(argv[0]);
-        curl_global_cleanup();
+        kv_arena_free(arena);
+        kv_extip_free(finder);
+        kv_async_free(async);
+        kv_client_free(client);
+        kv_global_cleanup();
         return 1;
     }
 
-    curl_global_cleanup();
+    kv_arena_free(arena);
+    kv_extip_free(finder);
+    kv_async_free(async);
+    kv_client_free(client);
+    kv_global_cleanup();
     return 0;
 }
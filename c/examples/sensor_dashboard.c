@@ -5,13 +5,50 @@
  * Perfect for embedded systems, IoT devices, Arduino, ESP32, etc.
  *
  * Compile:
- *   gcc -o sensor_dashboard sensor_dashboard.c -lcurl -ljson-c -lm
+ *   make examples/sensor_dashboard
  *
  * Usage:
  *   ./sensor_dashboard <token> log <temp> <humidity>
  *   ./sensor_dashboard <token> view
- *   ./sensor_dashboard <token> stats
- *   ./sensor_dashboard <token> monitor <interval_seconds>
+ *   ./sensor_dashboard <token> watch
+ *   ./sensor_dashboard <token> history
+ *   ./sensor_dashboard <token> stats [minutes]
+ *   ./sensor_dashboard <token> monitor <interval_seconds> [flush_seconds]
+ *   ./sensor_dashboard <tokens_file> fleet <interval_seconds> [workers]
+ *
+ * Fleet mode logs a reading for every token in tokens_file (one per line,
+ * # for comments) each interval, from one process and a small pool of
+ * worker threads instead of one monitor process per device.
+ *
+ * watch shows each new reading as it is stored, by another process or
+ * device, without polling the document.
+ *
+ * stats with a number of minutes reads the server's event history for
+ * that window instead of the stored document, page by page, into one
+ * column per sensor that kv_reduce (kv_reduce.h) summarizes.
+ *
+ * Responses are requested compressed. Set KV_COMPRESS=gzip or zstd to
+ * compress uploads too (libkv built with WITH_ZLIB=1 / WITH_ZSTD=1, and a
+ * server that accepts them), and KV_COMPRESS_DICT to a dictionary trained
+ * with zstd --train on stored documents.
+ *
+ * monitor takes readings and checks alerts on a kv_sched job of their own,
+ * at a fixed rate, so a slow write does not shift or pile up readings;
+ * writes are another job, spread over a tenth of the interval so a fleet
+ * of monitors does not write at the same moment.
+ *
+ * Set KV_SPOOL to a file path to keep the monitor's unwritten readings
+ * on disk, so an outage followed by a restart or power cut loses at most
+ * the last SPOOL_SYNC_READINGS of them; the next run writes them first.
+ *
+ * Set KV_METRICS=1 to time requests: log then shows where the request's
+ * time went, and monitor prints Prometheus metrics when it exits. Set
+ * KV_STATSD=host:port to have monitor push StatsD metrics every reading.
+ *
+ * Set KV_SNAPSHOT_DIR to a directory to keep a local copy of the document
+ * (kv_snapshot.h). view and stats then print the copy straight away, with
+ * no network at all, and bring it up to date in a background process, so
+ * the next run shows what is on the server by then.
  */
 
 #include <stdio.h>
@@ -19,273 +56,711 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <signal.h>
 #include <math.h>
-#include <curl/curl.h>
-#include <json-c/json.h>
+#include <pthread.h>
+#include "kv.h"
+#include "kv_series.h"
+#include "kv_stats.h"
+#include "kv_writer.h"
+#include "kv_fleet.h"
+#include "kv_history.h"
+#include "kv_spool.h"
+#include "kv_metrics.h"
+#include "kv_codec.h"
+#include "kv_sched.h"
+#include "kv_snapshot.h"
+#include "kv_reduce.h"
+#include "kv_watch.h"
 
 #ifndef API_URL
 #define API_URL "https://key-value.co"
 #endif
 #define MAX_HISTORY 100
+#define SERIES_SCALE 100                /* keep two decimals */
+#define MONITOR_CACHE_TTL_MS (15 * 60 * 1000L)
+#define MONITOR_FLUSH_SECS 60           /* default write interval for fast monitors */
+#define FLEET_WORKERS 4
+#define COMPRESS_MIN_BYTES 256          /* smaller bodies are not worth compressing */
+#define COMPRESS_DICT_MAX (112 * 1024)
+#define RETRY_ATTEMPTS 3
+#define RETRY_BASE_MS 500
+#define RETRY_MAX_MS 5000
+#define BREAKER_FAILURES 3              /* failed requests in a row... */
+#define BREAKER_OPEN_MS (2 * 60 * 1000L) /* ...stop calling for about this long */
+#define METRICS_TEXT_MAX 16384
+#define WATCH_RETRY_SECONDS 10
+#define WRITE_JITTER_PERCENT 10
+#define SPOOL_SYNC_READINGS 10          /* fsync the spool every this many readings... */
+#define SPOOL_SYNC_MS 5000              /* ...or once the oldest unsynced one is this old */
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_stop_signal(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
 
-struct memory {
-    char *response;
-    size_t size;
-};
+void get_timestamp(char *buffer, size_t size) {
+    time_t now = time(NULL);
+    struct tm tm_info;
+    gmtime_r(&now, &tm_info);       /* fleet workers call this concurrently */
+    strftime(buffer, size, "%Y-%m-%dT%H:%M:%SZ", &tm_info);
+}
 
-static size_t write_callback(void *data, size_t size, size_t nmemb, void *userp) {
-    size_t realsize = size * nmemb;
-    struct memory *mem = (struct memory *)userp;
+void check_alerts(double temperature, double humidity) {
+    if(temperature > 30.0) {
+        printf("⚠️  High temperature: %.1f°C\n", temperature);
+    } else if(temperature < 10.0) {
+        printf("⚠️  Low temperature: %.1f°C\n", temperature);
+    }
 
-    char *ptr = realloc(mem->response, mem->size + realsize + 1);
-    if(ptr == NULL) return 0;
+    if(humidity > 70.0) {
+        printf("⚠️  High humidity: %.1f%%\n", humidity);
+    } else if(humidity < 30.0) {
+        printf("⚠️  Low humidity: %.1f%%\n", humidity);
+    }
+}
 
-    mem->response = ptr;
-    memcpy(&(mem->response[mem->size]), data, realsize);
-    mem->size += realsize;
-    mem->response[mem->size] = 0;
+/* Parse an ISO-8601 UTC timestamp as written by get_timestamp */
+static time_t parse_timestamp(const char *text) {
+    struct tm tm_info = {0};
+    if(!text || sscanf(text, "%d-%d-%dT%d:%d:%d", &tm_info.tm_year, &tm_info.tm_mon,
+                       &tm_info.tm_mday, &tm_info.tm_hour, &tm_info.tm_min, &tm_info.tm_sec) != 6) {
+        return 0;
+    }
+    tm_info.tm_year -= 1900;
+    tm_info.tm_mon -= 1;
+    return timegm(&tm_info);
+}
 
-    return realsize;
+/*
+ * The stored history as a columnar series. Documents written before the
+ * "series" format keep a JSON "history" array (a ring whose oldest slot is
+ * "history_head"); that is converted once, oldest reading first, and
+ * *migrated is set so the caller can drop the old fields. Returns NULL if
+ * the stored series is malformed.
+ */
+static kv_series *load_series(struct json_object *current, int *migrated) {
+    struct json_object *encoded, *history, *head_obj, *timestamp;
+    kv_series *series = NULL;
+
+    *migrated = 0;
+    if(current && json_object_object_get_ex(current, "series", &encoded)) {
+        /* Never overwrite a series we cannot read */
+        return kv_series_decode(encoded);
+    }
+
+    series = kv_series_new(MAX_HISTORY, SERIES_SCALE);
+    if(!series || !current || !json_object_object_get_ex(current, "history", &history) ||
+       !json_object_is_type(history, json_type_array)) return series;
+
+    int len = json_object_array_length(history);
+    int head = 0;
+    if(len >= MAX_HISTORY && json_object_object_get_ex(current, "history_head", &head_obj)) {
+        head = json_object_get_int(head_obj);
+        if(head < 0 || head >= len) head = 0;
+    }
+    for(int i = 0; i < len; i++) {
+        struct json_object *reading = json_object_array_get_idx(history, (head + i) % len);
+        time_t epoch = 0;
+        if(json_object_object_get_ex(reading, "timestamp", &timestamp)) {
+            epoch = parse_timestamp(json_object_get_string(timestamp));
+        }
+        kv_series_append(series, epoch, reading, NULL, NULL);
+    }
+    *migrated = 1;
+    return series;
 }
 
-void get_timestamp(char *buffer, size_t size) {
-    time_t now = time(NULL);
-    struct tm *tm_info = gmtime(&now);
-    strftime(buffer, size, "%Y-%m-%dT%H:%M:%SZ", tm_info);
+/*
+ * Rolling stats for the stored series, restored from "stats_state" when
+ * that lines up with the series. Otherwise (first run, migration, or a
+ * writer that did not keep the state) they are rebuilt in one pass,
+ * oldest reading first. The reading at slot s is always reading number s
+ * modulo MAX_HISTORY, so when the ring is full the numbering is first
+ * advanced to the next slot with empty readings.
+ */
+static kv_stats *load_stats(struct json_object *current, const kv_series *series) {
+    struct json_object *state;
+    kv_stats *stats = NULL;
+    int count = kv_series_count(series);
+    int full = (count == kv_series_capacity(series));
+    int next = kv_series_next_slot(series);
+
+    if(current && json_object_object_get_ex(current, "stats_state", &state)) {
+        stats = kv_stats_from_state(state, MAX_HISTORY);
+    }
+    if(stats) {
+        long long total = kv_stats_total(stats);
+        if(full ? total % MAX_HISTORY == next : total == count) return stats;
+        kv_stats_free(stats);
+    }
+
+    stats = kv_stats_new(MAX_HISTORY);
+    if(!stats) return NULL;
+    if(full) {
+        for(int i = 0; i < next; i++) kv_stats_add(stats, NULL, NULL);
+    }
+    for(int i = 0; i < count; i++) {
+        struct json_object *reading = kv_series_reading(series, i);
+        kv_stats_add(stats, reading, NULL);
+        json_object_put(reading);
+    }
+    return stats;
 }
 
-struct json_object* get_stored_data(const char *token) {
-    CURL *curl;
-    CURLcode res;
-    struct memory chunk = {0};
-    struct json_object *data = NULL;
-
-    curl = curl_easy_init();
-    if(curl) {
-        char url[256];
-        snprintf(url, sizeof(url), "%s/api/retrieve", API_URL);
-
-        struct curl_slist *headers = NULL;
-        char token_header[512];
-        snprintf(token_header, sizeof(token_header), "X-KV-Token: %s", token);
-        headers = curl_slist_append(headers, token_header);
-
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-
-        res = curl_easy_perform(curl);
-
-        if(res == CURLE_OK && chunk.response) {
-            struct json_object *parsed_json = json_tokener_parse(chunk.response);
-            if(parsed_json) {
-                struct json_object *data_obj;
-                if(json_object_object_get_ex(parsed_json, "data", &data_obj)) {
-                    data = json_object_get(data_obj);
-                }
-                json_object_put(parsed_json);
-            }
+/*
+ * kv_writer builder: fold the new readings (each with its "timestamp"),
+ * oldest first, into the document, sending only their slots in the
+ * series plus current, stats and last_updated instead of the whole
+ * document.
+ *
+ * The series holds up to MAX_HISTORY readings. Once it is full a reading
+ * overwrites the oldest slot.
+ */
+static int build_readings_patch(struct json_object *current, struct json_object *readings,
+                                struct json_object *set, struct json_object *remove,
+                                void *userdata) {
+    int migrated, ok = 1;
+    (void)userdata;
+
+    kv_series *series = load_series(current, &migrated);
+    kv_stats *stats = series ? load_stats(current, series) : NULL;
+    if(!stats) {
+        kv_series_free(series);
+        return -1;
+    }
+
+    int len = json_object_array_length(readings);
+    struct json_object *reading = NULL, *timestamp = NULL;
+    for(int i = 0; ok && i < len; i++) {
+        reading = json_object_array_get_idx(readings, i);
+        if(!json_object_object_get_ex(reading, "timestamp", &timestamp)) timestamp = NULL;
+
+        /* The reading about to be overwritten leaves the stats window */
+        struct json_object *evicted = NULL;
+        if(kv_series_count(series) == kv_series_capacity(series)) {
+            evicted = kv_series_reading(series, 0);
         }
 
-        curl_easy_cleanup(curl);
-        curl_slist_free_all(headers);
-        free(chunk.response);
+        /* Stats see the value as stored, so a rebuild from the series
+         * gives the same figures */
+        time_t epoch = parse_timestamp(timestamp ? json_object_get_string(timestamp) : NULL);
+        ok = kv_series_append(series, epoch, reading, set, "series");
+        struct json_object *stored = ok ? kv_series_reading(series, kv_series_count(series) - 1) : NULL;
+        ok = ok && kv_stats_add(stats, stored, evicted);
+        json_object_put(stored);
+        json_object_put(evicted);
+    }
+
+    if(ok && reading) {
+        json_object_object_add(set, "current", json_object_get(reading));
+        if(timestamp) json_object_object_add(set, "last_updated", json_object_get(timestamp));
+        json_object_object_add(set, "stats", kv_stats_to_json(stats));
+        json_object_object_add(set, "stats_state", kv_stats_state(stats));
+        if(migrated) {
+            json_object_array_add(remove, json_object_new_string("history"));
+            json_object_array_add(remove, json_object_new_string("history_head"));
+        }
     }
 
-    return data;
+    kv_stats_free(stats);
+    kv_series_free(series);
+    return ok ? 1 : -1;
 }
 
-int store_data(const char *token, struct json_object *data) {
-    CURL *curl;
-    CURLcode res;
-    struct memory chunk = {0};
-    int success = 0;
+/* kv_update builder for a single reading */
+static int build_reading_patch(struct json_object *current, struct json_object *set,
+                               struct json_object *remove, void *userdata) {
+    struct json_object *readings = json_object_new_array();
+    json_object_array_add(readings, json_object_get((struct json_object *)userdata));
 
-    curl = curl_easy_init();
-    if(curl) {
-        char url[256];
-        snprintf(url, sizeof(url), "%s/api/store", API_URL);
+    int build = build_readings_patch(current, readings, set, remove, NULL);
+    json_object_put(readings);
+    return build;
+}
 
-        struct json_object *request = json_object_new_object();
-        json_object_object_add(request, "data", json_object_get(data));
+/* A reading stamped with the current time; NAN values are left out */
+static struct json_object *make_reading(double temperature, double humidity, double pressure) {
+    char timestamp[64];
+    get_timestamp(timestamp, sizeof(timestamp));
 
-        const char *request_str = json_object_to_json_string(request);
+    struct json_object *reading = json_object_new_object();
+    json_object_object_add(reading, "timestamp", json_object_new_string(timestamp));
 
-        struct curl_slist *headers = NULL;
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-        char token_header[512];
-        snprintf(token_header, sizeof(token_header), "X-KV-Token: %s", token);
-        headers = curl_slist_append(headers, token_header);
+    if(!isnan(temperature)) {
+        json_object_object_add(reading, "temperature", json_object_new_double(temperature));
+    }
+    if(!isnan(humidity)) {
+        json_object_object_add(reading, "humidity", json_object_new_double(humidity));
+    }
+    if(!isnan(pressure)) {
+        json_object_object_add(reading, "pressure", json_object_new_double(pressure));
+    }
+    return reading;
+}
 
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request_str);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+int log_reading(kv_client *client, double temperature, double humidity, double pressure) {
+    struct json_object *reading = make_reading(temperature, humidity, pressure);
 
-        res = curl_easy_perform(curl);
+    /* Patch it in, retrying if another writer updated the document first */
+    int success = kv_update(client, NULL, 0, build_reading_patch, reading, 3);
 
-        if(res == CURLE_OK) {
-            long response_code;
-            curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-            success = (response_code >= 200 && response_code < 300);
-        }
+    json_object_put(reading);
+
+    return success;
+}
+
+void print_usage(const char *prog) {
+    printf("Usage:\n");
+    printf("  %s <token> log <temp> <humidity> [pressure]  - Log sensor reading\n", prog);
+    printf("  %s <token> view                              - View current readings\n", prog);
+    printf("  %s <token> watch                             - Show readings as they are stored\n", prog);
+    printf("  %s <token> history                           - View stored readings\n", prog);
+    printf("  %s <token> stats [minutes]                   - View statistics (of the last minutes)\n", prog);
+    printf("  %s <token> monitor <secs> [flush_secs]       - Monitor continuously\n", prog);
+    printf("  %s <tokens_file> fleet <secs> [workers]      - Monitor every token in a file\n", prog);
+}
 
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
-        json_object_put(request);
-        free(chunk.response);
+/* view: the current reading of the document text in len bytes, NULL if
+ * nothing is stored */
+static void show_current(const char *data, size_t len) {
+    /* Only current is shown: decode it from the text rather than parsing
+     * the whole series and stats into a tree */
+    struct kv_reading reading;
+    const char *current = data ? kv_json_member(data, len, "current", &len) : NULL;
+    if(!data) {
+        printf("No data stored yet\n");
+    } else if(!current) {
+        printf("No readings yet\n");
+    } else if(kv_reading_decode(current, len, &reading)) {
+        printf("Current readings:\n");
+        if(reading.timestamp[0]) printf("  Time: %s\n", reading.timestamp);
+        if(!isnan(reading.temperature)) printf("  Temperature: %.1f°C\n", reading.temperature);
+        if(!isnan(reading.humidity)) printf("  Humidity: %.1f%%\n", reading.humidity);
+        if(!isnan(reading.pressure)) printf("  Pressure: %.1f hPa\n", reading.pressure);
+    } else {
+        printf("Current readings:\n%.*s\n", (int)len, current);
     }
+}
 
-    return success;
+/* stats: the stats member of the document, NULL if nothing is stored */
+static void show_stats(struct json_object *data) {
+    struct json_object *stats;
+    if(!data) {
+        printf("No data stored yet\n");
+    } else if(json_object_object_get_ex(data, "stats", &stats)) {
+        printf("Statistics:\n%s\n", json_object_to_json_string_ext(stats, JSON_C_TO_STRING_PRETTY));
+    } else {
+        printf("No statistics yet\n");
+    }
 }
 
-void calculate_stats(struct json_object *history, const char *key,
-                     double *min, double *max, double *avg, int *count) {
-    *min = INFINITY;
-    *max = -INFINITY;
-    *avg = 0;
-    *count = 0;
+/* view or stats from the local snapshot; 0 if there is none */
+static int show_snapshot(const char *dir, const char *token, const char *command) {
+    kv_snapshot *snapshot = kv_snapshot_open(dir, token);
+    if(!snapshot) return 0;
+
+    size_t len;
+    const char *data = kv_snapshot_data(snapshot, &len);
+    printf("(local copy: version %ld, confirmed %llds ago)\n", kv_snapshot_version(snapshot),
+           kv_snapshot_age_ms(snapshot) / 1000);
+
+    if(strcmp(command, "view") == 0) {
+        show_current(data, len);
+    } else {
+        struct json_object *doc = kv_snapshot_parse(snapshot);
+        show_stats(doc);
+        json_object_put(doc);
+    }
+    kv_snapshot_close(snapshot);
+    return 1;
+}
 
-    int len = json_object_array_length(history);
-    double sum = 0;
+/* Simulated sensor reading (replace with real sensor code) */
+void read_sensor(double *temp, double *humidity, double *pressure) {
+    /* Simulate sensor readings */
+    *temp = 20.0 + ((double)rand() / RAND_MAX) * 10.0;
+    *humidity = 40.0 + ((double)rand() / RAND_MAX) * 30.0;
+    *pressure = 1000.0 + ((double)rand() / RAND_MAX) * 50.0;
+}
 
-    for(int i = 0; i < len; i++) {
-        struct json_object *reading = json_object_array_get_idx(history, i);
-        struct json_object *value_obj;
-
-        if(json_object_object_get_ex(reading, key, &value_obj)) {
-            double value = json_object_get_double(value_obj);
-            if(value < *min) *min = value;
-            if(value > *max) *max = value;
-            sum += value;
-            (*count)++;
+/* The reading a history event wrote: "current" in a stored document or
+ * in a patch's set. A write-behind flush of several readings is one
+ * event, of which only the newest reading is current. */
+static struct json_object *event_reading(struct json_object *event) {
+    struct json_object *payload = kv_history_event_payload(event), *body, *reading;
+    if(!payload) return NULL;
+
+    if(json_object_object_get_ex(payload, "data", &body) ||
+       (json_object_object_get_ex(payload, "patch", &body) &&
+        json_object_object_get_ex(body, "set", &body))) {
+        if(json_object_object_get_ex(body, "current", &reading)) return reading;
+    }
+    return NULL;
+}
+
+/* The window's readings column by column, NAN where a reading lacks the
+ * sensor, which is how kv_reduce takes them */
+static const char *const window_sensors[] = { "temperature", "humidity", "pressure" };
+#define WINDOW_SENSORS 3
+
+struct window {
+    double *columns[WINDOW_SENSORS];
+    size_t count;
+    size_t capacity;
+};
+
+static int window_add(struct window *window, struct json_object *reading) {
+    if(window->count == window->capacity) {
+        size_t capacity = window->capacity ? window->capacity * 2 : 1024;
+        for(int s = 0; s < WINDOW_SENSORS; s++) {
+            double *grown = realloc(window->columns[s], capacity * sizeof(double));
+            if(!grown) return 0;
+            window->columns[s] = grown;
         }
+        window->capacity = capacity;
     }
 
-    if(*count > 0) {
-        *avg = sum / *count;
+    for(int s = 0; s < WINDOW_SENSORS; s++) {
+        struct json_object *value;
+        int has = json_object_object_get_ex(reading, window_sensors[s], &value) &&
+                  (json_object_is_type(value, json_type_double) ||
+                   json_object_is_type(value, json_type_int));
+        window->columns[s][window->count] = has ? json_object_get_double(value) : NAN;
     }
+    window->count++;
+    return 1;
 }
 
-struct json_object* build_stats(struct json_object *history) {
-    struct json_object *stats = json_object_new_object();
+/* {"<sensor>": {"min", "max", "avg", "stddev", "p50", "p95", "count"}, ...,
+ * "total_readings": n}, in the shape of kv_stats_to_json */
+static struct json_object *window_summary(const struct window *window) {
+    static const double ps[] = { 50, 95 };
+    struct json_object *summary = json_object_new_object();
+
+    for(int s = 0; s < WINDOW_SENSORS; s++) {
+        struct kv_reduce figures;
+        double at[2];
+        kv_reduce(window->columns[s], window->count, &figures);
+        if(figures.count == 0 || !kv_reduce_percentiles(window->columns[s], window->count, ps, 2, at)) {
+            continue;
+        }
 
-    const char *sensors[] = {"temperature", "humidity", "pressure"};
-    for(int i = 0; i < 3; i++) {
-        double min, max, avg;
-        int count;
+        struct json_object *sensor_stats = json_object_new_object();
+        json_object_object_add(sensor_stats, "min", json_object_new_double(figures.min));
+        json_object_object_add(sensor_stats, "max", json_object_new_double(figures.max));
+        json_object_object_add(sensor_stats, "avg", json_object_new_double(figures.mean));
+        json_object_object_add(sensor_stats, "stddev", json_object_new_double(sqrt(figures.variance)));
+        json_object_object_add(sensor_stats, "p50", json_object_new_double(at[0]));
+        json_object_object_add(sensor_stats, "p95", json_object_new_double(at[1]));
+        json_object_object_add(sensor_stats, "count", json_object_new_int64((int64_t)figures.count));
+        json_object_object_add(summary, window_sensors[s], sensor_stats);
+    }
 
-        calculate_stats(history, sensors[i], &min, &max, &avg, &count);
+    json_object_object_add(summary, "total_readings", json_object_new_int64((int64_t)window->count));
+    return summary;
+}
 
-        if(count > 0) {
-            struct json_object *sensor_stats = json_object_new_object();
-            json_object_object_add(sensor_stats, "min", json_object_new_double(min));
-            json_object_object_add(sensor_stats, "max", json_object_new_double(max));
-            json_object_object_add(sensor_stats, "avg", json_object_new_double(avg));
-            json_object_object_add(sensor_stats, "count", json_object_new_int(count));
-            json_object_object_add(stats, sensors[i], sensor_stats);
-        }
+/* Statistics over the readings written in the last minutes, from the
+ * event history rather than the whole stored document. Readings are kept
+ * as columns of doubles, not JSON, since a window of days at 1 Hz holds
+ * hundreds of thousands of them. */
+static int show_window_stats(kv_client *client, int minutes) {
+    char since[64];
+    time_t start = time(NULL) - (time_t)minutes * 60;
+    struct tm tm_info;
+    gmtime_r(&start, &tm_info);
+    strftime(since, sizeof(since), "%Y-%m-%dT%H:%M:%SZ", &tm_info);
+
+    struct kv_history_query query = { 0 };
+    query.since = since;
+    kv_history_iter *iter = kv_history_iter_new(client, &query);
+    if(!iter) return 0;
+
+    /* Each page is dropped as the iterator moves on, once its readings
+     * are in the columns */
+    struct window window = { { NULL }, 0, 0 };
+    struct json_object *event, *reading;
+    int ok = 1;
+    while(ok && (event = kv_history_next(iter))) {
+        if((reading = event_reading(event))) ok = window_add(&window, reading);
+    }
+    if(!ok) fprintf(stderr, "Out of memory after %zu readings\n", window.count);
+    ok = ok && !kv_history_failed(iter);
+
+    if(ok && window.count == 0) {
+        printf("No readings in the last %d minutes\n", minutes);
+    } else if(ok) {
+        struct json_object *summary = window_summary(&window);
+        printf("Statistics for the last %d minutes (%d pages of history):\n%s\n", minutes,
+               kv_history_pages(iter), json_object_to_json_string_ext(summary, JSON_C_TO_STRING_PRETTY));
+        json_object_put(summary);
     }
+    for(int s = 0; s < WINDOW_SENSORS; s++) free(window.columns[s]);
+    kv_history_iter_free(iter);
+    return ok;
+}
 
-    json_object_object_add(stats, "total_readings",
-        json_object_new_int(json_object_array_length(history)));
+/* Fill buf with the zstd dictionary at path. Returns its length, 0 on failure. */
+static size_t load_dictionary(const char *path, char *buf, size_t size) {
+    FILE *file = fopen(path, "rb");
+    if(!file) return 0;
+    size_t len = fread(buf, 1, size, file);
+    fclose(file);
+    return len;
+}
 
-    return stats;
+/* kv_watch callback: show the reading a new version brought */
+static int on_document_change(struct json_object *data, long version, void *userdata) {
+    struct json_object *current, *value;
+    (void)version;
+    (void)userdata;
+    if(!data || !json_object_object_get_ex(data, "current", &current)) return 1;
+
+    printf("[%s]", json_object_object_get_ex(current, "timestamp", &value) ?
+                   json_object_get_string(value) : "?");
+    if(json_object_object_get_ex(current, "temperature", &value)) {
+        printf(" Temp: %.1f°C", json_object_get_double(value));
+    }
+    if(json_object_object_get_ex(current, "humidity", &value)) {
+        printf(", Humidity: %.1f%%", json_object_get_double(value));
+    }
+    if(json_object_object_get_ex(current, "pressure", &value)) {
+        printf(", Pressure: %.1f hPa", json_object_get_double(value));
+    }
+    printf("\n");
+    fflush(stdout);
+    return 1;
 }
 
-void check_alerts(double temperature, double humidity) {
-    if(temperature > 30.0) {
-        printf("⚠️  High temperature: %.1f°C\n", temperature);
-    } else if(temperature < 10.0) {
-        printf("⚠️  Low temperature: %.1f°C\n", temperature);
+/* Where the last request's time went, if metrics are on */
+static void show_last_timing(kv_client *client) {
+    static const char *phases[KV_PHASES] = {
+        "dns", "connect", "tls", "wait", "receive", "parse", "serialize"
+    };
+    struct kv_timing timing;
+    if(!kv_client_last_timing(client, &timing)) return;
+
+    printf("  Request: %.1f ms, %d attempt%s,", timing.total / 1000.0,
+           timing.attempts, timing.attempts == 1 ? "" : "s");
+    for(int i = 0; i < KV_PHASES; i++) {
+        if(timing.phases[i] > 0) printf(" %s %.1f", phases[i], timing.phases[i] / 1000.0);
     }
+    printf(" ms, %lld B out, %lld B in\n", timing.bytes_sent, timing.bytes_received);
+}
 
-    if(humidity > 70.0) {
-        printf("⚠️  High humidity: %.1f%%\n", humidity);
-    } else if(humidity < 30.0) {
-        printf("⚠️  Low humidity: %.1f%%\n", humidity);
+/* Push StatsD metrics to KV_STATSD (host:port), if set */
+static void push_statsd(kv_client *client, const char *prefix) {
+    const char *target = getenv("KV_STATSD");
+    const char *colon = target ? strrchr(target, ':') : NULL;
+    char host[256];
+    if(!colon || colon == target || (size_t)(colon - target) >= sizeof(host)) return;
+
+    memcpy(host, target, colon - target);
+    host[colon - target] = '\0';
+    if(!kv_metrics_statsd_send(client, host, atoi(colon + 1), prefix)) {
+        fprintf(stderr, "Failed to send metrics to %s\n", target);
     }
 }
 
-int log_reading(const char *token, double temperature, double humidity, double pressure) {
-    /* Get existing data */
-    struct json_object *data = get_stored_data(token);
-    if(!data) {
-        data = json_object_new_object();
+/* The monitor's jobs */
+struct sensor_monitor {
+    kv_client *client;
+    kv_writer *writer;
+    kv_spool *spool;
+    kv_sched *sched;
+};
+
+static void report_written(const kv_writer *writer, int written) {
+    if(written > 0) {
+        printf("  ✓ %d reading%s written\n", written, written == 1 ? "" : "s");
+    } else if(written < 0) {
+        fprintf(stderr, "Failed to write %d readings, will retry\n", kv_writer_pending(writer));
     }
+}
 
-    /* Create new reading */
-    char timestamp[64];
-    get_timestamp(timestamp, sizeof(timestamp));
+/* kv_sched job: take a reading and buffer it */
+static int take_reading(kv_sched_job *job, void *userdata) {
+    struct sensor_monitor *monitor = (struct sensor_monitor *)userdata;
+    double temp, humidity, pressure;
+    (void)job;
 
-    struct json_object *reading = json_object_new_object();
-    json_object_object_add(reading, "timestamp", json_object_new_string(timestamp));
+    if(stop_requested) {
+        kv_sched_stop(monitor->sched);
+        return 1;
+    }
+    read_sensor(&temp, &humidity, &pressure);
 
-    if(!isnan(temperature)) {
-        json_object_object_add(reading, "temperature", json_object_new_double(temperature));
+    struct json_object *reading = make_reading(temp, humidity, pressure);
+    int before = kv_writer_pending(monitor->writer);
+    int buffered = kv_writer_add(monitor->writer, reading);
+    json_object_put(reading);
+
+    time_t now = time(NULL);
+    char timestr[64];
+    strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+    printf("[%s] Temp: %.1f°C, Humidity: %.1f%%\n", timestr, temp, humidity);
+    check_alerts(temp, humidity);
+
+    /* A full buffer is written by kv_writer_add itself */
+    if(!buffered || kv_writer_pending(monitor->writer) == 0) {
+        report_written(monitor->writer, buffered ? before + 1 : -1);
     }
-    if(!isnan(humidity)) {
-        json_object_object_add(reading, "humidity", json_object_new_double(humidity));
+    fflush(stdout);
+    return 1;
+}
+
+/* kv_sched job: write the buffered readings once the flush is due */
+static int write_readings(kv_sched_job *job, void *userdata) {
+    struct sensor_monitor *monitor = (struct sensor_monitor *)userdata;
+    (void)job;
+
+    report_written(monitor->writer, kv_writer_poll(monitor->writer));
+    if(monitor->spool) kv_spool_poll(monitor->spool);
+    push_statsd(monitor->client, "sensor_dashboard");
+    fflush(stdout);
+    return 1;
+}
+
+/* Client options shared by every mode */
+static int setup_client(kv_client *client) {
+    /* The history document can be large; keep only its parsed form */
+    kv_client_set_keep_body(client, 0);
+    kv_client_accept_compressed(client, 1);
+
+    /* Ride out short outages; after repeated failures stop calling for a
+     * while, so a fleet that lost the server does not keep hammering it */
+    kv_client_set_retry(client, RETRY_ATTEMPTS, RETRY_BASE_MS, RETRY_MAX_MS);
+    kv_client_set_breaker(client, BREAKER_FAILURES, BREAKER_OPEN_MS);
+
+    const char *metrics = getenv("KV_METRICS");
+    const char *statsd = getenv("KV_STATSD");
+    if(((metrics && strcmp(metrics, "1") == 0) || (statsd && *statsd)) &&
+       !kv_client_enable_metrics(client, 1)) {
+        fprintf(stderr, "Failed to enable metrics\n");
+        return 0;
     }
-    if(!isnan(pressure)) {
-        json_object_object_add(reading, "pressure", json_object_new_double(pressure));
+
+    const char *method = getenv("KV_COMPRESS");
+    if(!method || !*method) return 1;
+
+    int compress = strcmp(method, "gzip") == 0 ? KV_COMPRESS_GZIP :
+                   strcmp(method, "zstd") == 0 ? KV_COMPRESS_ZSTD : -1;
+    if(!kv_client_set_compression(client, compress, COMPRESS_MIN_BYTES)) {
+        fprintf(stderr, "KV_COMPRESS=%s is not available in this build\n", method);
+        return 0;
     }
 
-    /* Get/create history */
-    struct json_object *history;
-    if(!json_object_object_get_ex(data, "history", &history)) {
-        history = json_object_new_array();
-        json_object_object_add(data, "history", history);
+    const char *dict_path = getenv("KV_COMPRESS_DICT");
+    if(compress == KV_COMPRESS_ZSTD && dict_path && *dict_path) {
+        char *dict = malloc(COMPRESS_DICT_MAX);
+        size_t len = dict ? load_dictionary(dict_path, dict, COMPRESS_DICT_MAX) : 0;
+        int ok = len > 0 && kv_client_set_compression_dictionary(client, dict, len);
+        free(dict);
+        if(!ok) {
+            fprintf(stderr, "Cannot use dictionary %s\n", dict_path);
+            return 0;
+        }
     }
+    return 1;
+}
 
-    /* Add to history (keep last MAX_HISTORY) */
-    int len = json_object_array_length(history);
-    if(len >= MAX_HISTORY) {
-        /* Remove oldest entries */
-        struct json_object *new_history = json_object_new_array();
-        for(int i = len - MAX_HISTORY + 1; i < len; i++) {
-            json_object_array_add(new_history,
-                json_object_get(json_object_array_get_idx(history, i)));
+/* read_sensor uses rand(), which is not thread-safe */
+static pthread_mutex_t sensor_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Fleet job: one reading for one device */
+static int log_device(kv_client *client, const char *token, void *device, void *ctx) {
+    double temp, humidity, pressure;
+    (void)device;
+    (void)ctx;
+
+    pthread_mutex_lock(&sensor_lock);
+    read_sensor(&temp, &humidity, &pressure);
+    pthread_mutex_unlock(&sensor_lock);
+
+    if(!log_reading(client, temp, humidity, pressure)) {
+        fprintf(stderr, "[%s] Failed to log reading: %s\n", token, kv_client_error(client));
+        return 0;
+    }
+    return 1;
+}
+
+/* Load tokens from path into fleet. Returns the number added, -1 on error. */
+static int load_tokens(kv_fleet *fleet, const char *path) {
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char line[256];
+    int added = 0;
+
+    if(!file) return -1;
+    while(fgets(line, sizeof(line), file)) {
+        char *token = line + strspn(line, " \t");
+        token[strcspn(token, " \t\r\n#")] = 0;
+        if(!*token) continue;
+        if(!kv_fleet_add(fleet, token, NULL)) {
+            added = -1;
+            break;
         }
-        json_object_object_del(data, "history");
-        history = new_history;
-        json_object_object_add(data, "history", history);
+        added++;
     }
+    if(file != stdin) fclose(file);
+    return added;
+}
 
-    json_object_array_add(history, reading);
+static int run_fleet(const char *path, int interval, int workers) {
+    kv_fleet *fleet = kv_fleet_new(API_URL, workers);
+    if(!fleet) {
+        fprintf(stderr, "Failed to start worker pool\n");
+        return 1;
+    }
 
-    /* Update current and stats */
-    json_object_object_add(data, "current", json_object_get(reading));
+    int devices = load_tokens(fleet, path);
+    if(devices <= 0) {
+        fprintf(stderr, devices < 0 ? "Failed to read %s\n" : "No tokens in %s\n", path);
+        kv_fleet_free(fleet);
+        return 1;
+    }
 
-    struct json_object *stats = build_stats(history);
-    json_object_object_add(data, "stats", stats);
+    /* Devices stay on their worker from pass to pass, so each worker's
+     * cache serves its share of documents without a retrieve */
+    int share = (devices + workers - 1) / workers;
+    for(int i = 0; i < kv_fleet_workers(fleet); i++) {
+        kv_client *client = kv_fleet_client(fleet, i);
+        if(!setup_client(client)) {
+            kv_fleet_free(fleet);
+            return 1;
+        }
+        kv_client_enable_cache(client, share + share / 4 + 1, MONITOR_CACHE_TTL_MS);
+    }
 
-    json_object_object_add(data, "last_updated", json_object_new_string(timestamp));
+    printf("Starting fleet monitor: %d devices, %d workers, every %d seconds\n",
+           devices, kv_fleet_workers(fleet), interval);
+    printf("Note: Using simulated sensor data. Replace read_sensor() with real sensor code.\n");
+    printf("Press Ctrl+C to stop\n\n");
 
-    /* Store */
-    int success = store_data(token, data);
+    signal(SIGINT, on_stop_signal);
+    signal(SIGTERM, on_stop_signal);
 
-    json_object_put(data);
+    while(!stop_requested) {
+        time_t started = time(NULL);
+        long steals = kv_fleet_steals(fleet);
+        int logged = kv_fleet_run(fleet, log_device, NULL);
 
-    return success;
-}
+        time_t now = time(NULL);
+        char timestr[64];
+        strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", localtime(&now));
+        printf("[%s] %d/%d devices logged in %lds (%ld rebalanced)\n", timestr, logged, devices,
+               (long)(now - started), kv_fleet_steals(fleet) - steals);
 
-void print_usage(const char *prog) {
-    printf("Usage:\n");
-    printf("  %s <token> log <temp> <humidity> [pressure]  - Log sensor reading\n", prog);
-    printf("  %s <token> view                              - View current readings\n", prog);
-    printf("  %s <token> stats                             - View statistics\n", prog);
-    printf("  %s <token> monitor <secs>                    - Monitor continuously\n", prog);
-}
+        /* Keep the pass rate steady however long the pass took */
+        long remaining = interval - (long)(now - started);
+        if(remaining > 0 && !stop_requested) sleep(remaining);
+    }
 
-/* Simulated sensor reading (replace with real sensor code) */
-void read_sensor(double *temp, double *humidity, double *pressure) {
-    /* Simulate sensor readings */
-    *temp = 20.0 + ((double)rand() / RAND_MAX) * 10.0;
-    *humidity = 40.0 + ((double)rand() / RAND_MAX) * 30.0;
-    *pressure = 1000.0 + ((double)rand() / RAND_MAX) * 50.0;
+    kv_fleet_free(fleet);
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -297,14 +772,66 @@ int main(int argc, char *argv[]) {
     const char *token = argv[1];
     const char *command = argv[2];
 
+    /* view and stats from a snapshot return before curl is initialised;
+     * a child process then refreshes the snapshot and does nothing else */
+    const char *snapshot_dir = getenv("KV_SNAPSHOT_DIR");
+    int refresh_only = 0;
+    if(snapshot_dir && *snapshot_dir && argc == 3 &&
+       (strcmp(command, "view") == 0 || strcmp(command, "stats") == 0) &&
+       show_snapshot(snapshot_dir, token, command)) {
+        fflush(stdout);
+        if(fork() != 0) return 0;
+        refresh_only = 1;
+    }
+
     srand(time(NULL));
-    curl_global_init(CURL_GLOBAL_DEFAULT);
+    kv_global_init();
+
+    if(strcmp(command, "fleet") == 0) {
+        if(argc < 4) {
+            fprintf(stderr, "Error: fleet requires interval in seconds\n");
+            print_usage(argv[0]);
+            kv_global_cleanup();
+            return 1;
+        }
+        int workers = (argc > 4) ? atoi(argv[4]) : FLEET_WORKERS;
+        int result = run_fleet(argv[1], atoi(argv[3]), workers > 0 ? workers : 1);
+        kv_global_cleanup();
+        return result;
+    }
+
+    kv_client *client = kv_client_new(API_URL, token);
+    if(!client) {
+        fprintf(stderr, "Failed to create client\n");
+        kv_global_cleanup();
+        return 1;
+    }
+    if(!setup_client(client)) {
+        kv_client_free(client);
+        kv_global_cleanup();
+        return 1;
+    }
+    if(snapshot_dir && *snapshot_dir && !kv_client_set_snapshot_dir(client, snapshot_dir)) {
+        fprintf(stderr, "%s\n", kv_client_error(client));
+        kv_client_free(client);
+        kv_global_cleanup();
+        return 1;
+    }
+
+    if(refresh_only) {
+        /* A 304 for the snapshot's ETag just confirms it */
+        json_object_put(kv_retrieve(client));
+        kv_client_free(client);
+        kv_global_cleanup();
+        return 0;
+    }
 
     if(strcmp(command, "log") == 0) {
         if(argc < 5) {
             fprintf(stderr, "Error: log requires temperature and humidity\n");
             print_usage(argv[0]);
-            curl_global_cleanup();
+            kv_client_free(client);
+            kv_global_cleanup();
             return 1;
         }
 
@@ -312,85 +839,170 @@ int main(int argc, char *argv[]) {
         double humidity = atof(argv[4]);
         double pressure = (argc > 5) ? atof(argv[5]) : NAN;
 
-        if(log_reading(token, temp, humidity, pressure)) {
+        if(log_reading(client, temp, humidity, pressure)) {
             printf("✓ Reading logged\n");
             printf("  Temperature: %.1f°C\n", temp);
             printf("  Humidity: %.1f%%\n", humidity);
             if(!isnan(pressure)) {
                 printf("  Pressure: %.1f hPa\n", pressure);
             }
+            show_last_timing(client);
         } else {
             fprintf(stderr, "Failed to log reading\n");
         }
     }
     else if(strcmp(command, "view") == 0) {
-        struct json_object *data = get_stored_data(token);
-        if(data) {
-            struct json_object *current;
-            if(json_object_object_get_ex(data, "current", &current)) {
-                printf("Current readings:\n%s\n",
-                    json_object_to_json_string_ext(current, JSON_C_TO_STRING_PRETTY));
-            } else {
-                printf("No readings yet\n");
-            }
-            json_object_put(data);
+        size_t len;
+        const char *data = kv_retrieve_raw(client, &len);
+        show_current(data, len);
+    }
+    else if(strcmp(command, "watch") == 0) {
+        kv_watch *watch = kv_watch_new(client, 0, on_document_change, NULL);
+        if(!watch) {
+            fprintf(stderr, "Failed to create watch\n");
         } else {
-            printf("No data stored yet\n");
+            printf("Watching for readings (Ctrl+C to stop)\n");
+            while(kv_watch_run(watch, 0) < 0) {
+                fprintf(stderr, "Watch failed: %s, resuming in %d seconds\n",
+                        kv_client_error(client), WATCH_RETRY_SECONDS);
+                sleep(WATCH_RETRY_SECONDS);
+            }
+            kv_watch_free(watch);
         }
     }
-    else if(strcmp(command, "stats") == 0) {
-        struct json_object *data = get_stored_data(token);
+    else if(strcmp(command, "history") == 0) {
+        struct json_object *data = kv_retrieve(client);
         if(data) {
-            struct json_object *stats;
-            if(json_object_object_get_ex(data, "stats", &stats)) {
-                printf("Statistics:\n%s\n",
-                    json_object_to_json_string_ext(stats, JSON_C_TO_STRING_PRETTY));
+            /* Expand the columnar series into readings only for display */
+            int migrated;
+            kv_series *series = load_series(data, &migrated);
+            if(series && kv_series_count(series) > 0) {
+                struct json_object *readings = kv_series_to_json(series);
+                printf("History (%d readings, oldest first):\n%s\n", kv_series_count(series),
+                    json_object_to_json_string_ext(readings, JSON_C_TO_STRING_PRETTY));
+                json_object_put(readings);
             } else {
-                printf("No statistics yet\n");
+                printf("No readings yet\n");
             }
+            kv_series_free(series);
             json_object_put(data);
         } else {
             printf("No data stored yet\n");
         }
     }
+    else if(strcmp(command, "stats") == 0 && argc > 3) {
+        if(!show_window_stats(client, atoi(argv[3]))) {
+            fprintf(stderr, "Failed to read history: %s\n", kv_client_error(client));
+        }
+    }
+    else if(strcmp(command, "stats") == 0) {
+        struct json_object *data = kv_retrieve(client);
+        show_stats(data);
+        json_object_put(data);
+    }
     else if(strcmp(command, "monitor") == 0) {
         if(argc < 4) {
             fprintf(stderr, "Error: monitor requires interval in seconds\n");
             print_usage(argv[0]);
-            curl_global_cleanup();
+            kv_client_free(client);
+            kv_global_cleanup();
             return 1;
         }
 
         int interval = atoi(argv[3]);
-        printf("Starting sensor monitor (reading every %d seconds)\n", interval);
+        int flush_secs = (argc > 4) ? atoi(argv[4]) :
+                         (interval < MONITOR_FLUSH_SECS ? MONITOR_FLUSH_SECS : 0);
+        printf("Starting sensor monitor (reading every %d seconds, writing every %d)\n",
+               interval, flush_secs > interval ? flush_secs : interval);
         printf("Note: Using simulated sensor data. Replace read_sensor() with real sensor code.\n");
         printf("Press Ctrl+C to stop\n\n");
 
-        while(1) {
-            double temp, humidity, pressure;
-            read_sensor(&temp, &humidity, &pressure);
+        /* This device is the document's only regular writer, and the cache
+         * follows our own patches, so each write can skip the retrieve and
+         * send just the PATCH. A conflict drops the entry and re-reads. */
+        kv_client_enable_cache(client, 1, MONITOR_CACHE_TTL_MS);
+
+        /* Readings are written behind, several per PATCH. Buffering more
+         * than the series holds would only overwrite itself. */
+        kv_writer *writer = kv_writer_new(client, build_readings_patch, NULL,
+                                          flush_secs * 1000L, MAX_HISTORY, KV_WRITER_DEDUPE);
+        if(!writer) {
+            fprintf(stderr, "Failed to create writer\n");
+            kv_client_free(client);
+            kv_global_cleanup();
+            return 1;
+        }
+
+        /* Optionally keep unwritten readings across restarts */
+        const char *spool_path = getenv("KV_SPOOL");
+        kv_spool *spool = NULL;
+        if(spool_path && *spool_path) {
+            spool = kv_spool_open(spool_path, SPOOL_SYNC_READINGS, SPOOL_SYNC_MS);
+            if(!spool || !kv_writer_set_spool(writer, spool)) {
+                fprintf(stderr, "Failed to open spool %s\n", spool_path);
+                kv_writer_free(writer);
+                kv_spool_close(spool);
+                kv_client_free(client);
+                kv_global_cleanup();
+                return 1;
+            }
+            if(kv_writer_pending(writer) > 0) {
+                printf("%d unwritten reading%s loaded from %s\n", kv_writer_pending(writer),
+                       kv_writer_pending(writer) == 1 ? "" : "s", spool_path);
+            }
+        }
 
-            if(log_reading(token, temp, humidity, pressure)) {
-                time_t now = time(NULL);
-                char timestr[64];
-                strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", localtime(&now));
+        /* Write what is buffered before exiting */
+        signal(SIGINT, on_stop_signal);
+        signal(SIGTERM, on_stop_signal);
+
+        long period_ms = (interval > 0 ? interval : 1) * 1000L;
+        struct sensor_monitor monitor = { client, writer, spool, kv_sched_new(NULL) };
+        if(!monitor.sched ||
+           !kv_sched_every(monitor.sched, period_ms, 0, take_reading, &monitor) ||
+           !kv_sched_every(monitor.sched, period_ms, period_ms * WRITE_JITTER_PERCENT / 100,
+                           write_readings, &monitor)) {
+            fprintf(stderr, "Failed to create scheduler\n");
+            stop_requested = 1;
+        }
+        while(!stop_requested && kv_sched_run(monitor.sched, 0) == 0) {}
+        kv_sched_free(monitor.sched);
 
-                printf("[%s] Temp: %.1f°C, Humidity: %.1f%%\n", timestr, temp, humidity);
-                check_alerts(temp, humidity);
+        int pending = kv_writer_pending(writer);
+        if(pending > 0) {
+            if(kv_writer_flush(writer) >= 0) {
+                printf("\n✓ %d buffered reading%s written\n", pending, pending == 1 ? "" : "s");
             } else {
-                fprintf(stderr, "Failed to log reading\n");
+                fprintf(stderr, "\nFailed to write %d buffered readings\n", kv_writer_pending(writer));
             }
-
-            sleep(interval);
+        }
+        if(kv_writer_dropped(writer) > 0) {
+            fprintf(stderr, "%ld readings were dropped while writes failed\n", kv_writer_dropped(writer));
+        }
+        if(spool && kv_spool_count(spool) > 0) {
+            fprintf(stderr, "%d readings kept in %s for the next run\n", kv_spool_count(spool), spool_path);
+        }
+        kv_writer_free(writer);
+        kv_spool_close(spool);
+
+        const char *metrics = getenv("KV_METRICS");
+        if(metrics && strcmp(metrics, "1") == 0) {
+            char *text = malloc(METRICS_TEXT_MAX);
+            if(text && kv_metrics_prometheus(client, NULL, text, METRICS_TEXT_MAX) < METRICS_TEXT_MAX) {
+                fputs(text, stderr);
+            }
+            free(text);
         }
     }
     else {
         fprintf(stderr, "Unknown command: %s\n", command);
         print_usage(argv[0]);
-        curl_global_cleanup();
+        kv_client_free(client);
+        kv_global_cleanup();
         return 1;
     }
 
-    curl_global_cleanup();
+    kv_client_free(client);
+    kv_global_cleanup();
     return 0;
 }
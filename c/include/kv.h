@@ -0,0 +1,336 @@
+/*
+ * libkv - C client library for the Key-Value Store
+ *
+ * A kv_client owns one long-lived libcurl easy handle. Consecutive requests
+ * made through the same client reuse its TCP connection and TLS session
+ * instead of paying a fresh handshake per call, which matters on slow or
+ * battery-powered links.
+ *
+ * Build:
+ *   make lib
+ *
+ * Link:
+ *   gcc -Iinclude -o app app.c build/libkv.a -lcurl -ljson-c -lm -lpthread
+ *
+ * Usage:
+ *   kv_global_init();
+ *   kv_client *client = kv_client_new("https://key-value.co", token);
+ *   kv_store_string(client, "{\"temperature\":23.5}");
+ *   struct json_object *data = kv_retrieve(client);
+ *   ...
+ *   json_object_put(data);
+ *   kv_client_free(client);
+ *   kv_global_cleanup();
+ *
+ * A client is not thread-safe; use one client per thread.
+ */
+
+#ifndef KV_H
+#define KV_H
+
+#include <stddef.h>
+#include <json-c/json.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KV_DEFAULT_URL "https://key-value.co"
+
+typedef struct kv_client kv_client;
+
+/* Process-wide setup and teardown (wraps curl_global_init/cleanup).
+ * Returns 1 on success, 0 on failure. */
+int kv_global_init(void);
+void kv_global_cleanup(void);
+
+/* Create a client for base_url (NULL for KV_DEFAULT_URL). token may be NULL
+ * and set later with kv_client_set_token. Returns NULL on failure. */
+kv_client *kv_client_new(const char *base_url, const char *token);
+void kv_client_free(kv_client *client);
+
+/* Change the token used for subsequent requests. Returns 1 on success. */
+int kv_client_set_token(kv_client *client, const char *token);
+const char *kv_client_token(const kv_client *client);
+
+/* HTTP status of the last request, or 0 if it failed at the transport level */
+long kv_client_status(const kv_client *client);
+
+/* Human-readable description of the last failure ("" if none) */
+const char *kv_client_error(const kv_client *client);
+
+/* Raw body of the last response. Valid until the next request on the
+ * client. "" when the body is not being kept (see below). */
+const char *kv_client_response(const kv_client *client);
+
+/* Responses are parsed incrementally while they download. By default the
+ * raw body is also kept for kv_client_response; on memory-constrained
+ * devices pass keep = 0 so a large document is only ever held once, as
+ * parsed JSON. */
+void kv_client_set_keep_body(kv_client *client, int keep);
+
+/*
+ * Shared caches
+ *
+ * Clients normally keep their DNS results and TLS sessions to themselves.
+ * Attaching several clients to one kv_share lets them reuse each other's
+ * resolved addresses and resume each other's TLS sessions, even when they
+ * run on different threads; the share locks around every access.
+ *
+ * KV_SHARE_CONNECTIONS also pools kept-alive connections, but libcurl
+ * does not support that between concurrently running threads: only use it
+ * for clients driven from one thread.
+ */
+
+typedef struct kv_share kv_share;
+
+#define KV_SHARE_DNS         1
+#define KV_SHARE_TLS         2  /* TLS session resumption */
+#define KV_SHARE_CONNECTIONS 4  /* single-threaded use only */
+
+/* Create a share for the given KV_SHARE_* flags. Returns NULL on failure. */
+kv_share *kv_share_new(int what);
+
+/* Free a share. Every client attached to it must be freed or detached
+ * first. */
+void kv_share_free(kv_share *share);
+
+/* Attach client to share, or detach it with NULL. Returns 1 on success. */
+int kv_client_set_share(kv_client *client, kv_share *share);
+
+/*
+ * Timeouts, retries and the circuit breaker
+ *
+ * Each attempt gives up after connect_ms without a connection or total_ms
+ * in all (10 s and 30 s unless set), so a stalled link cannot block a
+ * monitor loop. With retries enabled, an attempt that fails with a
+ * network error, a timeout, 429 or a 5xx is repeated after a backoff
+ * drawn at random between base_ms and three times the previous one
+ * ("decorrelated jitter"), at most max_ms; a Retry-After from the server
+ * is waited for when it is no longer than max_ms, and ends the retries
+ * otherwise. Backoffs block the calling thread; a signal ends them early.
+ *
+ * With the breaker enabled, once failures requests in a row have failed
+ * that way (after their retries) the client stops calling the server:
+ * requests fail at once with "Circuit open" for a random 50-100% of
+ * open_ms, or for as long as a Retry-After asked. The first request after
+ * that is a single attempt; if it succeeds the breaker closes, otherwise
+ * it opens again. The jitter keeps a fleet that lost the server together
+ * from coming back together.
+ *
+ * Usage:
+ *   kv_client_set_retry(client, 4, 200, 10000);
+ *   kv_client_set_breaker(client, 3, 60000);
+ */
+
+#define KV_BREAKER_CLOSED    0
+#define KV_BREAKER_OPEN      1  /* failing fast */
+#define KV_BREAKER_HALF_OPEN 2  /* the next request is a probe */
+
+/* Per-attempt timeouts in milliseconds, 0 for none */
+void kv_client_set_timeouts(kv_client *client, long connect_ms, long total_ms);
+
+/* Make up to max_attempts attempts per request (1, the default, for no
+ * retries). base_ms and max_ms of 0 select 200 and 10000. */
+void kv_client_set_retry(kv_client *client, int max_attempts, long base_ms, long max_ms);
+
+/* Open the breaker after failures failed requests in a row (0, the
+ * default, disables it) for about open_ms (0 for 30000) */
+void kv_client_set_breaker(kv_client *client, int failures, long open_ms);
+
+/* KV_BREAKER_* */
+int kv_client_breaker_state(const kv_client *client);
+
+/* Attempts made by the last request, 0 if the breaker refused it */
+int kv_client_attempts(const kv_client *client);
+
+/* Document version reported by the last store/retrieve/patch, 0 if unknown */
+long kv_client_version(const kv_client *client);
+
+/* Store data for the client's token. Takes its own reference on data.
+ * Returns 1 on a 2xx response, 0 otherwise. */
+int kv_store(kv_client *client, struct json_object *data);
+
+/* Same as kv_store, but data is a JSON document in text form */
+int kv_store_string(kv_client *client, const char *json_data);
+
+/* Store len bytes of already-serialized JSON (not necessarily
+ * NUL-terminated) without parsing or copying them: the text is streamed
+ * to the socket inside the {"data": ...} envelope. The caller vouches
+ * that it is valid JSON. Useful when the document is kept serialized or
+ * built by a template. Returns 1 on a 2xx response, 0 otherwise. */
+int kv_store_raw(kv_client *client, const char *json, size_t len);
+
+/* Retrieve the stored data for the client's token. Returns a new reference
+ * the caller must json_object_put, or NULL if nothing is stored or the
+ * request failed. */
+struct json_object *kv_retrieve(kv_client *client);
+
+/* Retrieve without parsing: returns the text of the stored data inside
+ * the raw response body (*len bytes, not NUL-terminated), valid until
+ * the next request on the client, or NULL as kv_retrieve. Only the
+ * envelope is scanned, for the data and version, so a caller that
+ * decodes the text itself (kv_codec.h) never builds a json-c tree. The
+ * retrieve cache is not used. */
+const char *kv_retrieve_raw(kv_client *client, size_t *len);
+
+/* GET an arbitrary JSON URL (no token header) over the client's handle.
+ * timeout is in seconds, 0 for none. Returns a new reference or NULL. */
+struct json_object *kv_get_json(kv_client *client, const char *url, long timeout);
+
+/*
+ * Retrieve cache
+ *
+ * With the cache enabled, kv_retrieve remembers the last document per
+ * token and revalidates it with If-None-Match: an unchanged document costs
+ * a 304 without a body or a parse. With ttl_ms > 0 a document confirmed
+ * less than ttl_ms ago is returned without contacting the server at all.
+ * Stores and patches made through the client keep their entry current.
+ *
+ * The object kv_retrieve returns is then shared with the cache: treat it
+ * as read-only (json_object_deep_copy it to modify).
+ */
+
+#define KV_CACHE_OFF         0  /* cache disabled */
+#define KV_CACHE_MISS        1  /* downloaded in full */
+#define KV_CACHE_REVALIDATED 2  /* server answered 304 Not Modified */
+#define KV_CACHE_FRESH       3  /* served within the TTL, no request made */
+
+/* Cache up to max_entries tokens (0 disables and frees the cache). ttl_ms
+ * is 0 to always revalidate. Returns 1 on success, 0 on failure. */
+int kv_client_enable_cache(kv_client *client, int max_entries, long ttl_ms);
+
+/* Forget every cached document */
+void kv_client_cache_clear(kv_client *client);
+
+/* How the last kv_retrieve was served (KV_CACHE_*). Revalidated and fresh
+ * results both report kv_client_status() == 304. */
+int kv_client_cache_outcome(const kv_client *client);
+
+/*
+ * Compression
+ *
+ * kv_client_accept_compressed offers the encodings libcurl can decode
+ * (gzip, and usually brotli and zstd) and responses are decoded before
+ * they are parsed, so kv_retrieve is unchanged apart from the bytes on the
+ * wire. Request bodies are only compressed when asked for, since the
+ * server has to accept their Content-Encoding. gzip needs libkv built
+ * with KV_WITH_ZLIB (make WITH_ZLIB=1), zstd with KV_WITH_ZSTD (make
+ * WITH_ZSTD=1).
+ *
+ * Repetitive documents such as a sensor history compress far better with
+ * a zstd dictionary trained on samples of them (zstd --train), which the
+ * server must decode with as well.
+ */
+
+#define KV_COMPRESS_NONE 0
+#define KV_COMPRESS_GZIP 1
+#define KV_COMPRESS_ZSTD 2
+
+/* Whether KV_COMPRESS_* method is built in (KV_COMPRESS_NONE always is) */
+int kv_compress_available(int method);
+
+/* Ask for compressed responses (enable = 1) or stop (0) */
+void kv_client_accept_compressed(kv_client *client, int enable);
+
+/* Compress request bodies of at least min_size bytes with method
+ * (KV_COMPRESS_NONE turns it off). Returns 0 if method is not built in. */
+int kv_client_set_compression(kv_client *client, int method, size_t min_size);
+
+/* zstd dictionary for request bodies (copied; NULL to drop it). Returns 0
+ * if zstd is not built in or dict is not usable. */
+int kv_client_set_compression_dictionary(kv_client *client, const void *dict, size_t len);
+
+/*
+ * Wire format
+ *
+ * With KV_WIRE_CBOR, kv_store, kv_patch and kv_batch_execute send their
+ * documents as CBOR (RFC 8949, Content-Type: application/cbor) and
+ * requests to the server ask for CBOR back, falling back to JSON. Numbers
+ * travel as 1 to 9 binary bytes instead of digits, and nothing has to be
+ * escaped or tokenized. Documents are the same json-c trees either way;
+ * responses are decoded by their Content-Type, so a server answering JSON
+ * still works. A server that refuses a CBOR body with 415 Unsupported
+ * Media Type gets it again as JSON, and the client stays on JSON.
+ *
+ * kv_store_raw, kv_retrieve_raw and kv_async stay on JSON text. With the
+ * body kept, kv_client_response holds whatever the server sent, CBOR
+ * included.
+ */
+
+#define KV_WIRE_JSON 0
+#define KV_WIRE_CBOR 1
+
+/* Use KV_WIRE_* format. Returns 0 if format is unknown. */
+int kv_client_set_wire_format(kv_client *client, int format);
+
+/* Format in use, KV_WIRE_JSON after a fallback */
+int kv_client_wire_format(const kv_client *client);
+
+/*
+ * Partial updates (PATCH /api/store)
+ *
+ * A patch is a "set" object mapping dot-notation paths to new values
+ * ({"current.temperature": 23.5, "history.7": {...}}) and/or a "remove"
+ * array of paths. Numeric path segments address array elements; an index
+ * equal to the array length appends. The server applies the patch only if
+ * version still matches the stored document, otherwise it answers
+ * 409 Conflict.
+ */
+
+/* Send a patch. set and remove may each be NULL. Returns 1 on success and
+ * updates kv_client_version; 0 on failure (kv_client_status() == 409 on a
+ * version conflict). */
+int kv_patch(kv_client *client, long version, struct json_object *set,
+             struct json_object *remove);
+
+/* Apply a patch to a local document the same way the server does. Missing
+ * intermediate objects are created. Returns 1 on success, 0 if a path
+ * cannot be applied (e.g. indexes past the end of an array). */
+int kv_patch_apply(struct json_object *doc, struct json_object *set,
+                   struct json_object *remove);
+
+/* Drop the entries of a patch that would not change current: set paths
+ * that already hold an equal value and removals of paths that do not
+ * exist. current may be NULL (nothing stored), in which case every set
+ * entry is kept. Returns the number of entries left, so 0 means the patch
+ * can be skipped. Only as accurate as current: against a stale copy a
+ * needed write may be dropped. */
+int kv_patch_prune(struct json_object *current, struct json_object *set,
+                   struct json_object *remove);
+
+/* Fill set (an empty object) and remove (an empty array) with the changes
+ * to make to current, which is NULL when nothing is stored yet. Return 1
+ * to send the patch, 0 if there is nothing to change, -1 to abort. */
+typedef int (*kv_patch_builder)(struct json_object *current, struct json_object *set,
+                                struct json_object *remove, void *userdata);
+
+/* Read-modify-write with optimistic concurrency: retrieve the document,
+ * let builder describe the delta, and PATCH only that delta. On a 409 the
+ * document is re-read and builder is called again, up to max_attempts
+ * times. When nothing is stored yet the delta is applied to an empty
+ * document and stored in full.
+ *
+ * If current is non-NULL it is used (with version) for the first attempt
+ * instead of a retrieve, for callers that already fetched the document.
+ * Returns 1 on success (including "nothing to change"), 0 on failure. */
+int kv_update(kv_client *client, struct json_object *current, long version,
+              kv_patch_builder builder, void *userdata, int max_attempts);
+
+/* Compare-and-set: send the patch only while the member at path holds a
+ * value equal to expected (NULL for null or absent). With version > 0 the
+ * caller has seen path hold expected at that version, and the patch is
+ * sent right away with nothing retrieved. Otherwise, or after a conflict,
+ * the document is retrieved (served from the cache if enabled) and checked
+ * first. The patch must not depend on anything but that condition, since
+ * a retry sends it against a newer version. Returns 1 if the patch was
+ * applied, 0 if path no longer holds expected or nothing is stored (no
+ * patch sent), -1 on failure. */
+int kv_patch_if(kv_client *client, long version, const char *path, struct json_object *expected,
+                struct json_object *set, struct json_object *remove);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_H */
@@ -0,0 +1,104 @@
+/*
+ * libkv memory management
+ *
+ * Long-running loops on uClibc/musl devices fragment the heap when every
+ * request mallocs and frees buffers of varying size. Two tools help:
+ *
+ * - A process-wide allocator for libkv and libcurl, either your own
+ *   (kv_global_init_allocator) or a fixed-capacity pool of preallocated
+ *   blocks (kv_global_init_pool). Either replaces kv_global_init.
+ *
+ * - kv_arena, a fixed-size bump allocator for the scratch strings of one
+ *   cycle (an IP address, a timestamp), released in one step with
+ *   kv_arena_reset.
+ *
+ * json-c has no allocator hook, so JSON trees still come from malloc.
+ *
+ * Usage:
+ *   kv_global_init_pool(NULL, 0);           // default size classes
+ *   kv_arena *arena = kv_arena_new(4096);
+ *   while(1) {
+ *       char *ip = kv_arena_strdup(arena, ...);
+ *       ...
+ *       kv_arena_reset(arena);
+ *   }
+ */
+
+#ifndef KV_ALLOC_H
+#define KV_ALLOC_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The same five functions libcurl's curl_global_init_mem takes */
+struct kv_allocator {
+    void *(*malloc_fn)(size_t size);
+    void (*free_fn)(void *ptr);
+    void *(*realloc_fn)(void *ptr, size_t size);
+    char *(*strdup_fn)(const char *str);
+    void *(*calloc_fn)(size_t nmemb, size_t size);
+};
+
+/* Like kv_global_init, but route every allocation made by libkv and
+ * libcurl through allocator, which must stay valid until
+ * kv_global_cleanup. Returns 1 on success, 0 on failure. */
+int kv_global_init_allocator(const struct kv_allocator *allocator);
+
+/* Pool mode */
+
+#define KV_POOL_MAX_CLASSES 8
+
+/* count blocks of size bytes each */
+struct kv_pool_class {
+    size_t size;
+    size_t count;
+};
+
+struct kv_pool_stats {
+    size_t capacity;             /* bytes preallocated */
+    size_t in_use;               /* blocks currently handed out */
+    size_t peak;                 /* most blocks ever handed out at once */
+    size_t fallbacks;            /* allocations that had to use malloc */
+};
+
+/* Like kv_global_init, but serve libkv and libcurl from one preallocated
+ * slab split into the given size classes (ascending size, at most
+ * KV_POOL_MAX_CLASSES; NULL for a default of 560 KB). An allocation takes
+ * the smallest free block that fits; when none does it falls back to
+ * malloc and is counted in kv_pool_stats.fallbacks. Everything allocated
+ * from the pool must be freed before kv_global_cleanup releases it.
+ * Returns 1 on success, 0 on failure. */
+int kv_global_init_pool(const struct kv_pool_class *classes, int nclasses);
+
+/* Snapshot of the pool counters (all zero when pool mode is not active) */
+void kv_pool_get_stats(struct kv_pool_stats *stats);
+
+/* Arena */
+
+typedef struct kv_arena kv_arena;
+
+/* Create an arena with capacity bytes, allocated once up front */
+kv_arena *kv_arena_new(size_t capacity);
+void kv_arena_free(kv_arena *arena);
+
+/* Allocate size bytes aligned for any type. Returns NULL once the arena is
+ * full; it never grows. */
+void *kv_arena_alloc(kv_arena *arena, size_t size);
+
+/* Copy str into the arena. Returns NULL if str is NULL or it does not fit. */
+char *kv_arena_strdup(kv_arena *arena, const char *str);
+
+/* Release everything allocated from the arena at once */
+void kv_arena_reset(kv_arena *arena);
+
+/* Bytes currently allocated from the arena */
+size_t kv_arena_used(const kv_arena *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_ALLOC_H */
@@ -0,0 +1,118 @@
+/*
+ * libkv async engine
+ *
+ * Runs many requests concurrently on one curl_multi handle. Requests to the
+ * same host are multiplexed over a single HTTP/2 connection where the
+ * server supports it, so independent operations (e.g. an external IP
+ * lookup and a retrieve) cost the latency of the slowest one instead of
+ * the sum of all of them.
+ *
+ * Usage:
+ *   kv_async *async = kv_async_new();
+ *   kv_async_get(async, "https://api.ipify.org?format=json", 10L, on_ip, &state);
+ *   kv_async_retrieve(async, client, on_data, &state);
+ *   kv_async_run(async);            // blocks until both callbacks have run
+ *   kv_async_free(async);
+ *
+ * Event loop integration (Linux):
+ *   int fd = kv_async_fd(async);    // add to your epoll set for EPOLLIN
+ *   ...when fd is readable:
+ *   kv_async_poll(async, 0);        // never blocks with a 0 timeout
+ *
+ * Callbacks run from inside kv_async_poll/kv_async_run on the calling
+ * thread and may submit further requests. An engine is not thread-safe.
+ */
+
+#ifndef KV_ASYNC_H
+#define KV_ASYNC_H
+
+#include <stddef.h>
+#include <json-c/json.h>
+
+#include "kv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct kv_async kv_async;
+
+struct kv_async_result {
+    long status;                /* HTTP status, 0 on transport failure */
+    const char *error;          /* "" on success */
+    const char *body;           /* raw response body, NUL-terminated; "" if not kept */
+    size_t body_size;
+    struct json_object *json;   /* parsed body, NULL if not JSON */
+    struct json_object *data;   /* "data" member of json, NULL if absent */
+};
+
+/* Completion callback. The result and the JSON objects it points to are
+ * only valid during the call; take a reference with json_object_get to
+ * keep them. */
+typedef void (*kv_async_callback)(const struct kv_async_result *result, void *userdata);
+
+kv_async *kv_async_new(void);
+
+/* Frees the engine. Requests still in flight are abandoned without
+ * invoking their callbacks. */
+void kv_async_free(kv_async *async);
+
+/* Queue a GET of an arbitrary URL (no token header). timeout in seconds,
+ * 0 for none. Returns 1 if queued, 0 on failure (callback not invoked). */
+int kv_async_get(kv_async *async, const char *url, long timeout,
+                 kv_async_callback callback, void *userdata);
+
+/* As kv_async_get, whatever kv_async_set_parse says: the body is kept
+ * raw and not parsed, for responses that are not JSON. accept, if not
+ * NULL, is sent as the Accept header (e.g. "application/dns-message"). */
+int kv_async_get_raw(kv_async *async, const char *url, long timeout, const char *accept,
+                     kv_async_callback callback, void *userdata);
+
+/* Queue a retrieve for client's base URL and token */
+int kv_async_retrieve(kv_async *async, const kv_client *client,
+                      kv_async_callback callback, void *userdata);
+
+/* Queue a store of data for client's base URL and token. data is
+ * serialized immediately and may be released after the call. Fails for a
+ * client that encrypts (kv_crypt.h), which async stores cannot seal. */
+int kv_async_store(kv_async *async, const kv_client *client, struct json_object *data,
+                   kv_async_callback callback, void *userdata);
+
+/* Abandon the queued or running requests submitted with userdata, without
+ * invoking their callbacks; for a caller that no longer needs them, e.g.
+ * the losers of a race. May be called from any callback. Returns how many
+ * were cancelled. */
+int kv_async_cancel(kv_async *async, void *userdata);
+
+/* Drive transfers and dispatch completed callbacks, waiting at most
+ * timeout_ms for activity (0 to return immediately). Returns the number of
+ * requests still pending, or -1 on error. A signal that interrupts the wait
+ * is not an error: the call returns early, with errno set to EINTR. */
+int kv_async_poll(kv_async *async, int timeout_ms);
+
+/* Poll until no requests are pending. Returns 1 on success, 0 on error. */
+int kv_async_run(kv_async *async);
+
+/* Whether requests submitted from now on keep their raw body for
+ * kv_async_result.body (the default). Bodies are parsed as they arrive
+ * either way; turning this off keeps only the parsed JSON in memory. */
+void kv_async_set_keep_body(kv_async *async, int keep);
+
+/* Whether responses of requests submitted from now on are parsed (the
+ * default). With parse = 0 the raw body is always kept and result.json
+ * and result.data are NULL, for callers that decode it themselves
+ * (kv_codec.h). */
+void kv_async_set_parse(kv_async *async, int parse);
+
+/* Number of queued or running requests */
+int kv_async_pending(const kv_async *async);
+
+/* A file descriptor that becomes readable whenever kv_async_poll has work
+ * to do, for use with epoll/poll/select. Returns -1 where unsupported. */
+int kv_async_fd(const kv_async *async);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_ASYNC_H */
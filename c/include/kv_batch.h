@@ -0,0 +1,112 @@
+/*
+ * libkv batch operations
+ *
+ * kv_batch collects up to KV_BATCH_MAX store/retrieve/delete/patch
+ * operations, for any mix of tokens, and sends them as one
+ * POST /api/batch. Each operation's outcome is reported through its own
+ * callback.
+ *
+ * kv_queue sits on top and coalesces writes automatically: stores are
+ * buffered and flushed as one batch once max_ops are waiting or the
+ * oldest has lingered for linger_ms, whichever comes first.
+ *
+ * Usage:
+ *   kv_queue *queue = kv_queue_new(client, 100, 200);
+ *   for(...) kv_queue_store(queue, tokens[i], reading, on_stored, ctx);
+ *   ...in the main loop:
+ *   kv_queue_poll(queue);           // flushes once the linger time is up
+ *   ...on shutdown:
+ *   kv_queue_free(queue);           // flushes whatever is left
+ */
+
+#ifndef KV_BATCH_H
+#define KV_BATCH_H
+
+#include <json-c/json.h>
+
+#include "kv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Server limit on operations per /api/batch request */
+#define KV_BATCH_MAX 100
+
+typedef struct kv_batch kv_batch;
+typedef struct kv_queue kv_queue;
+
+struct kv_batch_result {
+    int index;                  /* position of the operation in the batch */
+    int success;
+    int superseded;             /* kv_queue: replaced by a newer store to the same token */
+    const char *action;         /* "store", "retrieve", "delete" or "patch" */
+    const char *token;
+    struct json_object *data;   /* retrieved/patched data, NULL if none */
+    long version;               /* 0 if not reported */
+    const char *error;          /* "" on success */
+};
+
+/* Per-operation callback. result and result->data are only valid during
+ * the call. */
+typedef void (*kv_batch_callback)(const struct kv_batch_result *result, void *userdata);
+
+kv_batch *kv_batch_new(void);
+void kv_batch_free(kv_batch *batch);
+
+/* Drop all queued operations without sending them or calling callbacks */
+void kv_batch_clear(kv_batch *batch);
+
+int kv_batch_count(const kv_batch *batch);
+
+/* Queue operations. callback may be NULL. ttl is in seconds, 0 for none.
+ * Each returns 1 if queued, 0 if the batch is full (KV_BATCH_MAX). */
+int kv_batch_store(kv_batch *batch, const char *token, struct json_object *data,
+                   long ttl, kv_batch_callback callback, void *userdata);
+int kv_batch_retrieve(kv_batch *batch, const char *token,
+                      kv_batch_callback callback, void *userdata);
+int kv_batch_delete(kv_batch *batch, const char *token,
+                    kv_batch_callback callback, void *userdata);
+int kv_batch_patch(kv_batch *batch, const char *token, long version,
+                   struct json_object *set, struct json_object *remove,
+                   kv_batch_callback callback, void *userdata);
+
+/* Send every queued operation in one request over client's connection
+ * (its token is not used) and dispatch the per-operation callbacks. If
+ * the request itself fails, every callback gets the failure. The batch is
+ * empty afterwards. Returns the number of operations that succeeded, or
+ * -1 if the request failed. */
+int kv_batch_execute(kv_batch *batch, kv_client *client);
+
+/* Coalescing write queue. max_ops is clamped to 1..KV_BATCH_MAX;
+ * linger_ms is how long the oldest buffered write may wait. */
+kv_queue *kv_queue_new(kv_client *client, int max_ops, long linger_ms);
+
+/* Flushes buffered writes, then frees the queue */
+void kv_queue_free(kv_queue *queue);
+
+/* Buffer a store. A store to a token that already has one buffered
+ * replaces it; the replaced write's callback is invoked right away with
+ * superseded set. Flushes immediately once max_ops writes are buffered.
+ * Returns 1 on success, 0 on failure. */
+int kv_queue_store(kv_queue *queue, const char *token, struct json_object *data,
+                   kv_batch_callback callback, void *userdata);
+
+/* Flush if the linger time has expired. Returns the number of writes sent
+ * (0 if not yet due), or -1 if a flush failed. */
+int kv_queue_poll(kv_queue *queue);
+
+/* Flush every buffered write now. Same return value as kv_queue_poll. */
+int kv_queue_flush(kv_queue *queue);
+
+/* Milliseconds until the next flush is due, 0 if overdue, -1 if nothing
+ * is buffered. Useful as a poll()/epoll_wait() timeout. */
+long kv_queue_timeout(const kv_queue *queue);
+
+int kv_queue_pending(const kv_queue *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_BATCH_H */
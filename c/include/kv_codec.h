@@ -0,0 +1,102 @@
+/*
+ * libkv fixed-schema codecs
+ *
+ * The examples' documents have fixed shapes: a sensor reading is a
+ * timestamp and up to three numbers, an IP record an address, a couple
+ * of flags and a short history. For those, building a json-c tree to
+ * write one or walking one to read it costs an allocation per member and
+ * a hash lookup per field. The codecs here go straight between a C
+ * struct and JSON text instead:
+ *   - an encoder writes the text directly into a caller's buffer;
+ *   - a decoder makes a single pass over the text, copying the fields it
+ *     knows into the struct and skipping any other member, nested or not.
+ * Neither allocates. Anything that is not of the expected shape (a
+ * field of the wrong type, a string too long for its array, malformed
+ * JSON) fails the decode, so callers can fall back to json-c for it.
+ *
+ * With kv_retrieve_raw (kv.h) or kv_async_set_parse (kv_async.h), a
+ * response can be decoded without json-c building a tree at all.
+ *
+ * Usage:
+ *   size_t len;
+ *   const char *data = kv_retrieve_raw(client, &len);
+ *   const char *current = data ? kv_json_member(data, len, "current", &len) : NULL;
+ *   struct kv_reading reading;
+ *   if(current && kv_reading_decode(current, len, &reading)) ...
+ *
+ *   char text[KV_READING_TEXT_MAX];
+ *   int n = kv_reading_encode(&reading, text, sizeof(text));
+ *   kv_store_raw(client, text, n);
+ */
+
+#ifndef KV_CODEC_H
+#define KV_CODEC_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KV_TIMESTAMP_MAX  32        /* "2025-01-14T09:30:00Z" and then some */
+#define KV_IP_MAX         46        /* an IPv6 address in text form */
+#define KV_IP_HISTORY_MAX 10
+
+/* Enough for any encoded reading */
+#define KV_READING_TEXT_MAX 320
+
+/* {"timestamp": "...", "temperature": t, "humidity": h, "pressure": p}.
+ * A NAN number and an empty timestamp are absent members. */
+struct kv_reading {
+    char timestamp[KV_TIMESTAMP_MAX];
+    double temperature;
+    double humidity;
+    double pressure;
+};
+
+/* One entry of an IP record's history: an address and when it was seen */
+struct kv_ip_change {
+    char ip[KV_IP_MAX];
+    char timestamp[KV_TIMESTAMP_MAX];
+};
+
+/* {"ip": "...", "last_updated": "...", "changed": b, "previous_ip": "...",
+ * "history": [{"ip": "...", "timestamp": "..."}, ...]}, oldest change
+ * first. Empty strings are absent members. */
+struct kv_ip_record {
+    char ip[KV_IP_MAX];
+    char last_updated[KV_TIMESTAMP_MAX];
+    int changed;
+    char previous_ip[KV_IP_MAX];
+    int history_count;
+    struct kv_ip_change history[KV_IP_HISTORY_MAX];
+    int history_len;                /* entries in the decoded text, which may be more */
+};
+
+/* Write the reading as compact JSON into out. Returns the length of the
+ * full text, as snprintf does; it is truncated if that is size or more. */
+int kv_reading_encode(const struct kv_reading *reading, char *out, size_t size);
+
+/* Decode len bytes of JSON text into *reading. Returns 1 on success, 0 if
+ * the text is not an object of this shape (*reading is then undefined). */
+int kv_reading_decode(const char *json, size_t len, struct kv_reading *reading);
+
+/* As kv_reading_encode, for an IP record */
+int kv_ip_record_encode(const struct kv_ip_record *record, char *out, size_t size);
+
+/* As kv_reading_decode, for an IP record. A longer history keeps its
+ * newest KV_IP_HISTORY_MAX entries; history_len says how long it was. The
+ * encoder writes history_count entries and ignores history_len. */
+int kv_ip_record_decode(const char *json, size_t len, struct kv_ip_record *record);
+
+/* Find the member name of the JSON object in len bytes of json, without
+ * decoding anything else. Returns a pointer to its value's text inside
+ * json and sets *value_len, or returns NULL if json is not an object or
+ * has no such member. */
+const char *kv_json_member(const char *json, size_t len, const char *name, size_t *value_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_CODEC_H */
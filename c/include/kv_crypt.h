@@ -0,0 +1,77 @@
+/*
+ * libkv client-side encryption
+ *
+ * With a password set, kv_store, kv_store_raw and kv_store_string send the
+ * document sealed with an AEAD cipher, and kv_retrieve and kv_retrieve_raw
+ * open it again, so the server only ever holds ciphertext. The stored
+ * value has the shape the Python SDK's encrypted example uses:
+ *   {"encrypted": true, "payload": "<base64>"}
+ * but the payload is not a Fernet token and the two do not interoperate.
+ *
+ * Ciphers are AES-256-GCM, through OpenSSL, which runs it on AES-NI or the
+ * ARMv8 crypto extensions where the CPU has them, and ChaCha20-Poly1305,
+ * which is faster than AES in software. KV_CIPHER_AUTO picks AES-GCM when
+ * the CPU has AES instructions and ChaCha20-Poly1305 when it does not.
+ * Retrieves open either, whatever the client stores with.
+ *
+ * The key is derived from the password and the token (PBKDF2-HMAC-SHA256,
+ * KV_CRYPT_ITERATIONS rounds), so every token has its own key. Derivation
+ * is slow on purpose; keys are kept per token in the client, so it is paid
+ * once per token, not per request.
+ *
+ * Sealing encrypts the document in blocks and writes each block's base64
+ * straight into the request body, which is reused from store to store.
+ * Opening works on the response as it downloads: the payload is decoded
+ * and decrypted chunk by chunk and the plaintext handed to the JSON parser
+ * as it comes, so neither the ciphertext nor its base64 is ever held
+ * whole. Nothing is returned until the authentication tag has checked out.
+ *
+ * Only the calls above are encrypted. The server cannot patch what it
+ * cannot read, so kv_patch fails on an encrypting client and kv_update
+ * applies its delta locally and stores the whole document, which is no
+ * longer checked against concurrent writers. kv_async_store fails too,
+ * rather than store plaintext the client could not read back; batch,
+ * async retrieve and watch requests are sent and read as they are. Local
+ * snapshots (kv_snapshot.h) are not written for it and kv_writer_set_spool
+ * refuses a spool, so no plaintext reaches the disk.
+ *
+ * Usage:
+ *   kv_client_set_encryption(client, password, KV_CIPHER_AUTO);
+ *   kv_store(client, data);
+ *   struct json_object *back = kv_retrieve(client);
+ *
+ * Needs libkv built with `make WITH_OPENSSL=1`; without it,
+ * kv_client_set_encryption fails.
+ */
+
+#ifndef KV_CRYPT_H
+#define KV_CRYPT_H
+
+#include "kv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KV_CIPHER_AUTO     0
+#define KV_CIPHER_AES_GCM  1        /* AES-256-GCM */
+#define KV_CIPHER_CHACHA20 2        /* ChaCha20-Poly1305 */
+
+#define KV_CRYPT_ITERATIONS 100000
+
+/* Whether cipher (KV_CIPHER_*) is built in; KV_CIPHER_AUTO if any is */
+int kv_cipher_available(int cipher);
+
+/* Encrypt stores and decrypt retrieves with password; NULL turns it off.
+ * Returns 1 on success, 0 if cipher is not available. */
+int kv_client_set_encryption(kv_client *client, const char *password, int cipher);
+
+/* The cipher stores are sealed with (never KV_CIPHER_AUTO), or 0 if the
+ * client does not encrypt */
+int kv_client_cipher(const kv_client *client);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_CRYPT_H */
@@ -0,0 +1,93 @@
+/*
+ * libkv external IP discovery
+ *
+ * Finds the address the host is seen from by asking several providers at
+ * once on a kv_async engine. The first address that enough providers agree
+ * on is the answer, and the lookups still running are cancelled, so one
+ * slow or unreachable provider costs nothing while another answers.
+ * Providers are:
+ *   - KV_EXTIP_JSON: a JSON object with an "ip" member (api.ipify.org);
+ *   - KV_EXTIP_TEXT: the address as plain text (icanhazip.com);
+ *   - KV_EXTIP_DNS: a DNS-over-HTTPS resolver asked for myip.opendns.com,
+ *     which OpenDNS answers with the address the query came from.
+ *
+ * The answer is remembered. Within the cache TTL, and as long as the
+ * host's own interfaces and their addresses are as they were when it was
+ * found, kv_extip_cached returns it and no provider needs to be asked. A
+ * new lease or a link that went down and up changes the interfaces, so
+ * the next check looks again however fresh the cached address is.
+ *
+ * Usage:
+ *   kv_extip *finder = kv_extip_new();
+ *   kv_extip_add(finder, KV_EXTIP_JSON, "https://api.ipify.org?format=json");
+ *   kv_extip_add(finder, KV_EXTIP_DNS, "https://doh.opendns.com/dns-query");
+ *   kv_extip_set_cache(finder, 300000);
+ *   const char *ip = kv_extip_cached(finder);
+ *   if(!ip) kv_extip_lookup(finder, async, on_ip, &state);
+ *   ...kv_async_run(async): on_ip(ip or NULL, &state)
+ *   kv_extip_free(finder);
+ *
+ * A finder is not thread-safe, and runs one lookup at a time.
+ */
+
+#ifndef KV_EXTIP_H
+#define KV_EXTIP_H
+
+#include "kv_async.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KV_EXTIP_JSON 0
+#define KV_EXTIP_TEXT 1
+#define KV_EXTIP_DNS  2
+
+#define KV_EXTIP_MAX_PROVIDERS 8
+#define KV_EXTIP_ADDR_MAX      46   /* INET6_ADDRSTRLEN */
+
+typedef struct kv_extip kv_extip;
+
+/* The outcome of a lookup: the address, or NULL if the providers failed
+ * or did not agree. ip is only valid during the call. */
+typedef void (*kv_extip_callback)(const char *ip, void *userdata);
+
+/* A finder with no providers, a 10 s timeout, agreement of one provider
+ * and no cache. Returns NULL on failure. */
+kv_extip *kv_extip_new(void);
+
+/* Must not be called while a lookup is running */
+void kv_extip_free(kv_extip *finder);
+
+/* Add a provider of kind KV_EXTIP_*. Returns 1, or 0 for an unknown kind
+ * or once KV_EXTIP_MAX_PROVIDERS have been added. */
+int kv_extip_add(kv_extip *finder, int kind, const char *url);
+
+/* Per-provider timeout in seconds */
+void kv_extip_set_timeout(kv_extip *finder, long timeout);
+
+/* How many providers must give the same address (at least 1) */
+void kv_extip_set_agree(kv_extip *finder, int agree);
+
+/* Keep the answer for ttl_ms (0 to turn the cache off) */
+void kv_extip_set_cache(kv_extip *finder, long ttl_ms);
+
+/* The cached address if it is fresh and the host's interfaces have not
+ * changed since it was found, else NULL. Valid until the next lookup. */
+const char *kv_extip_cached(kv_extip *finder);
+
+/* Ask every provider at once on async; callback runs as async is polled,
+ * with the first agreed address, or with NULL once the providers are done
+ * without one. Returns 1 if started, 0 if none could be (callback not
+ * invoked) or a lookup is already running. */
+int kv_extip_lookup(kv_extip *finder, kv_async *async,
+                    kv_extip_callback callback, void *userdata);
+
+/* Drop the cached address, e.g. after the store reported a change */
+void kv_extip_forget(kv_extip *finder);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_EXTIP_H */
@@ -0,0 +1,75 @@
+/*
+ * libkv fleet mode
+ *
+ * kv_fleet serves many tokens from one process: a fixed pool of worker
+ * threads, each owning one kv_client, runs a job for every registered
+ * device once per pass. A worker switches its client to the device's
+ * token for each job, so a handful of connections serve thousands of
+ * devices instead of one process (and TLS stack) per device. The workers'
+ * clients share one kv_share, so a name is resolved and a TLS session
+ * negotiated once for the whole pool.
+ *
+ * Devices are dealt out to per-worker queues, so a device normally lands
+ * on the same worker (and its client's retrieve cache) every pass. A
+ * worker that runs out of work steals from the back of another's queue,
+ * so a few slow devices do not hold the whole pass up.
+ *
+ * Usage:
+ *   kv_fleet *fleet = kv_fleet_new(KV_DEFAULT_URL, 8);
+ *   for(...) kv_fleet_add(fleet, tokens[i], &devices[i]);
+ *   while(1) {
+ *       kv_fleet_run(fleet, log_device, NULL);   // returns when every job is done
+ *       sleep(interval);
+ *   }
+ *   kv_fleet_free(fleet);
+ *
+ * Jobs run concurrently on different threads: anything they share beyond
+ * their own device's userdata needs its own locking.
+ */
+
+#ifndef KV_FLEET_H
+#define KV_FLEET_H
+
+#include "kv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct kv_fleet kv_fleet;
+
+/* One device's work for a pass. client is the worker's client, already
+ * set to token; device is what kv_fleet_add was given and ctx what
+ * kv_fleet_run was given. Return 1 on success, 0 on failure. */
+typedef int (*kv_fleet_job)(kv_client *client, const char *token, void *device, void *ctx);
+
+/* Start workers threads (at least 1), each with its own client for
+ * base_url (NULL for KV_DEFAULT_URL). Call after kv_global_init. Returns
+ * NULL on failure. */
+kv_fleet *kv_fleet_new(const char *base_url, int workers);
+
+/* Stop the workers and free the fleet. Must not be called during a pass. */
+void kv_fleet_free(kv_fleet *fleet);
+
+/* Register a device. Not allowed during a pass. Returns 1 on success. */
+int kv_fleet_add(kv_fleet *fleet, const char *token, void *device);
+
+int kv_fleet_devices(const kv_fleet *fleet);
+int kv_fleet_workers(const kv_fleet *fleet);
+
+/* The client of one worker, for setup before the first pass (e.g.
+ * kv_client_enable_cache). Do not use it during a pass. */
+kv_client *kv_fleet_client(kv_fleet *fleet, int worker);
+
+/* Run job once for every device across the workers and wait for all of
+ * them. Returns the number of jobs that succeeded. */
+int kv_fleet_run(kv_fleet *fleet, kv_fleet_job job, void *ctx);
+
+/* Jobs taken from another worker's queue, over all passes so far */
+long kv_fleet_steals(const kv_fleet *fleet);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_FLEET_H */
@@ -0,0 +1,81 @@
+/*
+ * libkv event history (GET /api/history)
+ *
+ * The server records an event for every store and patch of a token, with
+ * its payload, creation time and a classified type. kv_history_page
+ * fetches one page of them, newest first and filtered on the server.
+ * kv_history_iter walks as many pages as there are, fetching the next one
+ * (the cursor is the seq of the oldest event so far) only once the
+ * current one is used up, so a long history is never held in memory at
+ * once.
+ *
+ * Usage:
+ *   struct kv_history_query query = { 0 };
+ *   query.since = "2025-10-23T00:00:00Z";
+ *   kv_history_iter *iter = kv_history_iter_new(client, &query);
+ *   struct json_object *event;
+ *   while((event = kv_history_next(iter))) {
+ *       ...kv_history_event_seq(event), kv_history_event_payload(event)...
+ *   }
+ *   if(kv_history_failed(iter)) ...kv_client_error(client)...
+ *   kv_history_iter_free(iter);
+ */
+
+#ifndef KV_HISTORY_H
+#define KV_HISTORY_H
+
+#include <json-c/json.h>
+
+#include "kv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Server limit on events per page */
+#define KV_HISTORY_PAGE_MAX 200
+
+/* Filters, all optional: zero-initialize and set what is needed */
+struct kv_history_query {
+    int limit;                  /* events per page, 0 for KV_HISTORY_PAGE_MAX */
+    long before;                /* only events with seq < before, 0 for the newest */
+    const char *since;          /* only events created at or after this ISO 8601 time */
+    const char *type;           /* only events with this classified_type */
+};
+
+typedef struct kv_history_iter kv_history_iter;
+
+/* Fetch one page for the client's token. Returns the "events" array (new
+ * reference, newest first) or NULL on failure. *next_before is set to the
+ * before value for the following page, or 0 if there is none. */
+struct json_object *kv_history_page(kv_client *client, const struct kv_history_query *query,
+                                    long *next_before);
+
+/* Iterate over every event matching query, starting at query->before.
+ * The query is copied. Returns NULL on failure. */
+kv_history_iter *kv_history_iter_new(kv_client *client, const struct kv_history_query *query);
+void kv_history_iter_free(kv_history_iter *iter);
+
+/* Next event, newest first, fetching a page when needed. The event is
+ * borrowed and valid until the next call. Returns NULL after the last
+ * event or when a page cannot be fetched (see kv_history_failed). */
+struct json_object *kv_history_next(kv_history_iter *iter);
+
+/* Whether the iteration stopped because a request failed */
+int kv_history_failed(const kv_history_iter *iter);
+
+/* Pages fetched so far */
+int kv_history_pages(const kv_history_iter *iter);
+
+/* Event members: seq (0 if missing), created_at (NULL if missing) and
+ * payload, which says what was written, e.g. {"type": "store", "data":
+ * {...}} (borrowed, NULL if missing) */
+long kv_history_event_seq(struct json_object *event);
+const char *kv_history_event_time(struct json_object *event);
+struct json_object *kv_history_event_payload(struct json_object *event);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_HISTORY_H */
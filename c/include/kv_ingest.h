@@ -0,0 +1,109 @@
+/*
+ * libkv multi-producer ingest
+ *
+ * kv_ingest takes readings from any number of producer threads, for any
+ * number of tokens, and stores them from a small pool of I/O threads, so
+ * a thread sampling a sensor never waits on the network. A push is a few
+ * atomic operations on a bounded lock-free ring and allocates nothing;
+ * only when the I/O thread behind it is asleep does it take that thread's
+ * lock, briefly, to signal it awake.
+ *
+ * Tokens are registered once and dealt round-robin over the shards, each
+ * a ring that many producers push into and one I/O thread drains. Every
+ * I/O thread owns a share of the shards, its own kv_client and a kv_queue
+ * (kv_batch.h), so readings go out as /api/batch requests of up to
+ * KV_BATCH_MAX stores; a newer reading for a token still waiting in the
+ * queue replaces the older one. More shards keep producers of different
+ * tokens off each other's cache lines, more I/O threads keep more
+ * requests in flight. The I/O threads' clients share one kv_share, as a
+ * kv_fleet's workers do.
+ *
+ * When a shard's ring is full the push fails and the reading is dropped
+ * and counted; it is never queued somewhere that blocks. A failed batch is
+ * counted too, and is not retried beyond the clients' retry policy (see
+ * kv_ingest_client): the next reading for the token takes its place.
+ *
+ * Usage:
+ *   kv_ingest *ingest = kv_ingest_new(KV_DEFAULT_URL, 2, 16, 1024, 200);
+ *   kv_ingest_token *sensor = kv_ingest_add(ingest, token);
+ *   ...on any reader thread:
+ *   kv_ingest_push(ingest, sensor, reading);    // takes over the reference
+ *   ...on shutdown, once the readers have stopped:
+ *   kv_ingest_free(ingest);                     // sends whatever is left
+ */
+
+#ifndef KV_INGEST_H
+#define KV_INGEST_H
+
+#include <json-c/json.h>
+
+#include "kv.h"
+#include "kv_batch.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct kv_ingest kv_ingest;
+typedef struct kv_ingest_token kv_ingest_token;
+
+struct kv_ingest_stats {
+    long pushed;                /* readings accepted into a ring */
+    long dropped;               /* pushes refused because the ring was full */
+    long sent;                  /* stored by the server */
+    long superseded;            /* replaced by a newer reading before it was sent */
+    long failed;                /* in a batch or an operation that failed */
+    long pending;               /* accepted but not yet sent, superseded or failed */
+};
+
+/* Start threads I/O threads (at least 1) with clients for base_url (NULL
+ * for KV_DEFAULT_URL), over shards rings (at least threads) of capacity
+ * readings each, rounded up to a power of two. linger_ms is how long the
+ * first reading of a batch may wait for more. Call after kv_global_init.
+ * Returns NULL on failure. */
+kv_ingest *kv_ingest_new(const char *base_url, int threads, int shards, int capacity,
+                         long linger_ms);
+
+/* Send everything pushed so far, stop the I/O threads and free the
+ * ingest and its tokens. No push may be running or follow. */
+void kv_ingest_free(kv_ingest *ingest);
+
+/* Register token and return the handle to push its readings with, owned
+ * by the ingest; registering it again returns the same handle. A token's
+ * readings all go through one shard, so they are sent in push order.
+ * Thread-safe, but takes a lock: register before sampling starts.
+ * Returns NULL on failure. */
+kv_ingest_token *kv_ingest_add(kv_ingest *ingest, const char *token);
+
+/* Queue reading for token's next store. Takes over the caller's reference
+ * on reading, pushed or not, so the caller must not use or put it
+ * afterwards. Never blocks. Returns 1 if queued, 0 if the shard was full
+ * (the reading is dropped). */
+int kv_ingest_push(kv_ingest *ingest, kv_ingest_token *token, struct json_object *reading);
+
+/* Have the I/O threads send what they hold without waiting out the
+ * linger time, and wait until every reading pushed before the call has
+ * been sent, superseded or failed. Returns 1 if no store failed
+ * meanwhile, 0 otherwise. */
+int kv_ingest_flush(kv_ingest *ingest);
+
+/* Be told about each reading's outcome, on the I/O thread that sent it;
+ * result is as for a kv_queue store. Set before the first push. */
+void kv_ingest_set_callback(kv_ingest *ingest, kv_batch_callback callback, void *userdata);
+
+/* The client of one I/O thread, for setup before the first push (e.g.
+ * kv_client_set_retry). Do not use it afterwards. */
+kv_client *kv_ingest_client(kv_ingest *ingest, int thread);
+
+int kv_ingest_threads(const kv_ingest *ingest);
+int kv_ingest_shards(const kv_ingest *ingest);
+
+/* Counters so far, summed over the shards and threads. Safe to call from
+ * any thread; the figures are each exact but not taken at one instant. */
+void kv_ingest_stats(const kv_ingest *ingest, struct kv_ingest_stats *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_INGEST_H */
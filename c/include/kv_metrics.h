@@ -0,0 +1,128 @@
+/*
+ * libkv request metrics
+ *
+ * With metrics enabled, a client times each request it sends and keeps
+ * what it measured both for the last request and summed up per
+ * operation:
+ *   - the libcurl phases of every attempt: DNS lookup, TCP connect, TLS
+ *     handshake (only when a new connection was made), waiting for the
+ *     first response byte, and receiving the rest;
+ *   - the time libkv spent serializing the request body and parsing the
+ *     response (json-c's time, as seen from libkv);
+ *   - bytes sent and received, headers included, and allocations made by
+ *     libkv and libcurl (json-c's cannot be counted).
+ * Durations go into log-linear histograms in the style of HdrHistogram:
+ * exact below 16 us, then 8 buckets per power of two, so any quantile is
+ * exact to 12.5% from 16 us up to 19 hours in 1 KB per histogram, and
+ * recording one is a few shifts and an increment.
+ *
+ * The figures can be read directly (kv_client_last_timing,
+ * kv_client_op_metrics, kv_client_phase_quantile) or exported as
+ * Prometheus text or StatsD lines.
+ *
+ * Usage:
+ *   kv_client_enable_metrics(client, 1);
+ *   ...requests...
+ *   struct kv_timing timing;
+ *   kv_client_last_timing(client, &timing);     // why was that one slow?
+ *   char text[8192];
+ *   kv_metrics_prometheus(client, "device=\"42\"", text, sizeof(text));
+ *   kv_metrics_statsd_send(client, "10.0.0.5", 8125, "sensors.42");
+ */
+
+#ifndef KV_METRICS_H
+#define KV_METRICS_H
+
+#include <stddef.h>
+
+#include "kv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Operations, by endpoint and method */
+#define KV_OP_STORE    0
+#define KV_OP_RETRIEVE 1
+#define KV_OP_PATCH    2
+#define KV_OP_BATCH    3
+#define KV_OP_HISTORY  4
+#define KV_OP_WATCH    5            /* kv_watch long polls, held by the server */
+#define KV_OP_OTHER    6            /* kv_get_json and other URLs */
+#define KV_OPS         7
+
+/* Phases, across every operation */
+#define KV_PHASE_DNS       0
+#define KV_PHASE_CONNECT   1
+#define KV_PHASE_TLS       2
+#define KV_PHASE_WAIT      3        /* request sent to first response byte */
+#define KV_PHASE_RECEIVE   4        /* first to last response byte */
+#define KV_PHASE_PARSE     5
+#define KV_PHASE_SERIALIZE 6
+#define KV_PHASES          7
+
+/* The last request. Times in microseconds; the network phases (dns up to
+ * receive) are those of its last attempt, and are 0 when a kept-alive
+ * connection was reused. */
+struct kv_timing {
+    int op;                         /* KV_OP_* */
+    int attempts;
+    long phases[KV_PHASES];         /* KV_PHASE_* */
+    long total;                     /* the whole request, retries and backoffs included */
+    long long bytes_sent;           /* over every attempt */
+    long long bytes_received;
+    long allocations;
+};
+
+/* Totals for one operation, and quantiles of its total time in us */
+struct kv_op_metrics {
+    long requests;
+    long failures;                  /* transport failures and non-2xx responses */
+    long long bytes_sent;
+    long long bytes_received;
+    long long allocations;
+    long long total_us;
+    long p50, p90, p99, p999, max;
+};
+
+/* Start (enable = 1) or stop (0, which frees the figures) measuring.
+ * Returns 1 on success, 0 if they could not be allocated. */
+int kv_client_enable_metrics(kv_client *client, int enable);
+
+/* Forget every figure so far */
+void kv_client_metrics_reset(kv_client *client);
+
+/* Fill *timing with the last request. Returns 0 if metrics are off or no
+ * request has been measured yet. */
+int kv_client_last_timing(const kv_client *client, struct kv_timing *timing);
+
+/* Fill *metrics for a KV_OP_*. Returns 0 if metrics are off. */
+int kv_client_op_metrics(const kv_client *client, int op, struct kv_op_metrics *metrics);
+
+/* The q quantile (0 to 1) of a KV_PHASE_* in us, -1 if none recorded */
+long kv_client_phase_quantile(const kv_client *client, int phase, double q);
+
+/* Write the figures as Prometheus text exposition into out: counters per
+ * operation and summaries (p50/p90/p99/p999, sum, count) of request time
+ * per operation and of each phase, in seconds. labels (e.g.
+ * "device=\"42\"", may be NULL) is added to every sample. Returns the
+ * length of the full text, as snprintf does; it is truncated if that is
+ * size or more. */
+int kv_metrics_prometheus(const kv_client *client, const char *labels, char *out, size_t size);
+
+/* Write the figures as StatsD lines under prefix: counters as increments
+ * since the last StatsD export ("|c") and quantiles as gauges in ms
+ * ("|g"). Returns the length as kv_metrics_prometheus. Only a complete
+ * export advances the counters. */
+int kv_metrics_statsd(kv_client *client, const char *prefix, char *out, size_t size);
+
+/* Send kv_metrics_statsd to a StatsD server over UDP, split into packets
+ * that fit a 1500-byte MTU. The counters only advance once every packet
+ * is sent. Returns 1 on success. */
+int kv_metrics_statsd_send(kv_client *client, const char *host, int port, const char *prefix);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_METRICS_H */
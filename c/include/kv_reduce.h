@@ -0,0 +1,65 @@
+/*
+ * libkv column reductions
+ *
+ * Figures over a whole column of samples at once, for windows far larger
+ * than kv_stats keeps: days of 1 Hz readings are hundreds of thousands of
+ * values per sensor. kv_reduce makes a single pass that yields min, max,
+ * count, sum, mean and variance together, on SIMD kernels picked for the
+ * CPU at run time (AVX2 or SSE2 on x86-64, NEON on ARMv8, otherwise a
+ * scalar loop), so a column costs about what reading it from memory does.
+ *
+ * NaN marks a gap, as kv_series_column writes it and as the examples use
+ * it for a sensor that gave no reading: NaNs are skipped, and a column of
+ * nothing but gaps has count 0.
+ *
+ * Usage:
+ *   double *values = ...;                  // n samples, NAN for gaps
+ *   struct kv_reduce r;
+ *   kv_reduce(values, n, &r);              // r.min, r.max, r.mean, ...
+ *   const double ps[] = { 50, 95, 99 };
+ *   double at[3];
+ *   kv_reduce_percentiles(values, n, ps, 3, at);
+ */
+
+#ifndef KV_REDUCE_H
+#define KV_REDUCE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct kv_reduce {
+    double min;
+    double max;
+    double sum;
+    double mean;
+    double variance;            /* population: over count, not count - 1 */
+    size_t count;               /* values that are not NaN */
+};
+
+/* Reduce n values. With no values left after skipping NaNs, count is 0
+ * and every figure is NAN. */
+void kv_reduce(const double *values, size_t n, struct kv_reduce *out);
+
+/* Percentiles ps[0..nps) (0 to 100) of the non-NaN values, interpolated
+ * linearly between the closest ranks like numpy's default, into out. Sorts
+ * nothing in place: values are copied once into a scratch buffer and
+ * selected there, O(n) per percentile. Returns 1, or 0 on allocation
+ * failure; out is NAN for an empty column or a p outside 0 to 100. */
+int kv_reduce_percentiles(const double *values, size_t n, const double *ps, int nps, double *out);
+
+/* Name of the kernel in use: "avx2", "sse2", "neon" or "scalar" */
+const char *kv_reduce_kernel(void);
+
+/* Use the kernel named instead of the one picked for the CPU, or NULL to
+ * go back to that. Returns 0 if it is unknown or the CPU cannot run it.
+ * Meant for tests and benchmarks; not safe while other threads reduce. */
+int kv_reduce_set_kernel(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_REDUCE_H */
@@ -0,0 +1,101 @@
+/*
+ * libkv scheduler
+ *
+ * Runs periodic jobs from one thread in place of a loop around
+ * sleep(interval). A sleep loop runs a little late every time, by the
+ * time its work took, and anything slow holds up everything after it. A
+ * kv_sched runs each job at a fixed rate instead:
+ *   - run n of a job is due at start + n * period, however long the
+ *     earlier runs took, so the period does not drift;
+ *   - a run that comes too late for one or more ticks runs once, and the
+ *     ticks it missed are counted as skipped rather than run in a burst;
+ *   - each run can be moved up to jitter_ms later at random, so a fleet
+ *     started together does not call the server at the same moment.
+ * Jobs are kept on a timer wheel, so a scheduler can hold many of them.
+ *
+ * Jobs should not block. One that starts requests on the scheduler's
+ * kv_async engine returns at once, and the requests complete while the
+ * scheduler waits for the next due job: I/O of different jobs overlaps,
+ * and none of them delays the others. A job whose requests are still
+ * running can mark itself busy; its ticks are then skipped until it is
+ * done, so a slow server never piles requests up.
+ *
+ * Usage:
+ *   kv_sched *sched = kv_sched_new(async);
+ *   kv_sched_job *check = kv_sched_every(sched, 60000, 5000, start_check, &state);
+ *   ...start_check: kv_sched_job_set_busy(check, 1), then kv_async_get(...);
+ *   ...its completion callback: kv_sched_job_set_busy(check, 0)
+ *   while(kv_sched_run(sched, 0) == 0 && !stop_requested) {}
+ *   kv_sched_free(sched);
+ *
+ * A scheduler and its jobs are not thread-safe.
+ */
+
+#ifndef KV_SCHED_H
+#define KV_SCHED_H
+
+#include "kv_async.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct kv_sched kv_sched;
+typedef struct kv_sched_job kv_sched_job;
+
+/* A run of job. Return 1 to keep the job, 0 to cancel it. */
+typedef int (*kv_sched_callback)(kv_sched_job *job, void *userdata);
+
+/* How a job has kept to its schedule */
+struct kv_sched_stats {
+    long runs;
+    long skipped;                   /* ticks missed or passed while busy */
+    long late_ms;                   /* how late the last run started */
+    long max_late_ms;
+};
+
+/* A scheduler that drives async (may be NULL) while it waits. Returns
+ * NULL on failure. */
+kv_sched *kv_sched_new(kv_async *async);
+
+/* Cancels every job. Not to be called from a job. */
+void kv_sched_free(kv_sched *sched);
+
+/* Run callback every period_ms (at least 1), the first run within
+ * jitter_ms from now and each one up to jitter_ms (0 for none) after its
+ * tick. Returns the job, or NULL on failure. */
+kv_sched_job *kv_sched_every(kv_sched *sched, long period_ms, long jitter_ms,
+                             kv_sched_callback callback, void *userdata);
+
+/* Remove job; it does not run again. May be called from any job,
+ * including this one. */
+void kv_sched_cancel(kv_sched *sched, kv_sched_job *job);
+
+/* While busy is set, the job's ticks pass without running it */
+void kv_sched_job_set_busy(kv_sched_job *job, int busy);
+
+void kv_sched_job_stats(const kv_sched_job *job, struct kv_sched_stats *stats);
+
+/* Run due jobs, then wait at most timeout_ms (0 not to wait) for the next
+ * one while driving the async engine, and run what has become due.
+ * Returns 1, 0 if a signal cut the wait short, -1 if the engine failed. */
+int kv_sched_poll(kv_sched *sched, long timeout_ms);
+
+/* Poll until kv_sched_stop is called or no job is left (returns 1),
+ * duration_ms has passed or a signal cut a wait short (returns 0;
+ * duration_ms 0 for no limit), or the engine failed (returns -1). Call
+ * again to resume. */
+int kv_sched_run(kv_sched *sched, long duration_ms);
+
+/* Make kv_sched_run return once the job that calls it is done */
+void kv_sched_stop(kv_sched *sched);
+
+/* Milliseconds until the next job is due (0 if one is), -1 if there are
+ * none, for callers with their own event loop */
+long kv_sched_next_ms(kv_sched *sched);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_SCHED_H */
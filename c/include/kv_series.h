@@ -0,0 +1,94 @@
+/*
+ * libkv columnar time series
+ *
+ * kv_series stores a fixed-capacity ring of readings column by column
+ * instead of as an array of JSON objects: one fixed-point integer column
+ * per sensor, epoch timestamps delta-encoded against the previous
+ * reading, and a head index for the oldest slot. Key names and ISO
+ * timestamps are not repeated per reading, which makes the stored form
+ * several times smaller.
+ *
+ * Appending is O(1): it overwrites one slot, and when given a patch "set"
+ * object it records only the handful of paths that changed, so the
+ * stored copy is kept current with a small PATCH.
+ *
+ * Stored form (under whatever key the caller chooses):
+ *   {"capacity": 100, "count": 3, "head": 0,
+ *    "scale": 100,                                 // of columns added later
+ *    "t0": 1736846400, "t_last": 1736847000,     // oldest and newest epoch
+ *    "dt": [0, 300, 300],                          // seconds since previous reading
+ *    "columns": {"temperature": {"scale": 100, "values": [2350, 2410, null]}}}
+ *
+ * Usage:
+ *   kv_series *series = kv_series_decode(stored);
+ *   if(!series) series = kv_series_new(100, 100);
+ *   kv_series_append(series, time(NULL), reading, set, "series");
+ *   kv_patch(client, version, set, NULL);
+ *   kv_series_free(series);
+ */
+
+#ifndef KV_SERIES_H
+#define KV_SERIES_H
+
+#include <json-c/json.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct kv_series kv_series;
+
+/* Scale of new columns in a stored form that does not give one */
+#define KV_SERIES_DEFAULT_SCALE 100
+
+/* Create an empty series of capacity readings. Values are stored as
+ * integers of value * scale (scale 100 keeps two decimals). */
+kv_series *kv_series_new(int capacity, long scale);
+void kv_series_free(kv_series *series);
+
+/* Load the stored form, with the scale it was created with for columns
+ * added later. Returns NULL if encoded is missing or malformed. */
+kv_series *kv_series_decode(struct json_object *encoded);
+
+/* Stored form. New reference. */
+struct json_object *kv_series_encode(const kv_series *series);
+
+/* Append a reading taken at epoch (seconds), overwriting the oldest once
+ * the series is full. Every int or double member of reading becomes a
+ * value in the column of that name (created on first use; names
+ * containing '.' are skipped); columns the reading lacks get a gap.
+ *
+ * If set is non-NULL, the patch entries that bring the stored form up to
+ * date are added to it with paths under prefix: the changed slot and
+ * counters, or the whole series under prefix if it was never stored.
+ * Several appends may share one set. Returns 1 on success, 0 on failure. */
+int kv_series_append(kv_series *series, long long epoch, struct json_object *reading,
+                     struct json_object *set, const char *prefix);
+
+int kv_series_count(const kv_series *series);
+int kv_series_capacity(const kv_series *series);
+
+/* Slot the next append will write to (the oldest reading once full) */
+int kv_series_next_slot(const kv_series *series);
+
+/* Epoch of reading i, oldest first */
+long long kv_series_time(const kv_series *series, int i);
+
+/* Copy one column, oldest first, into out (room for kv_series_count
+ * values; gaps are NAN). Returns the number copied, or -1 if there is no
+ * such column. */
+int kv_series_column(const kv_series *series, const char *name, double *out);
+
+/* JSON view of reading i, oldest first, as {"timestamp": ISO-8601,
+ * "<column>": value, ...} with gaps omitted. New reference, or NULL if i
+ * is out of range. */
+struct json_object *kv_series_reading(const kv_series *series, int i);
+
+/* JSON view of every reading, oldest first. New reference. */
+struct json_object *kv_series_to_json(const kv_series *series);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_SERIES_H */
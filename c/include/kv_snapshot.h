@@ -0,0 +1,91 @@
+/*
+ * libkv local snapshots
+ *
+ * A snapshot is a file holding the last document a client saw for a
+ * token: its JSON text, version and ETag. With a snapshot directory set,
+ * the client rewrites the file after every successful retrieve, store and
+ * patch, so a process that starts later can show the document straight
+ * from disk, before curl is even initialised and whether or not the
+ * network is up, and revalidate it afterwards. kv_retrieve also uses the
+ * snapshot's ETag when the retrieve cache has no entry, so the first
+ * retrieve of a cold start is a 304 with no body when nothing changed.
+ * Retrieves on a kv_async engine save the snapshot too, without an ETag,
+ * since the engine does not keep response headers.
+ *
+ * kv_snapshot_open maps the file read-only: the text is used in place,
+ * without being copied or parsed, so a codec (kv_codec.h) can decode only
+ * the members it shows. A snapshot is replaced by writing a new file and
+ * renaming it over the old one, so a mapping stays valid, on the version
+ * it was opened at, while the client writes.
+ *
+ * File format, integers little-endian:
+ *   header  "KVSNAP01", u64 version, u64 saved_ms, u64 confirmed_ms
+ *           (wall clock), u32 token, ETag and data lengths, u32 CRC-32 of
+ *           the body
+ *   body    token, ETag ("" if none), data (compact JSON text), each
+ *           followed by a NUL
+ * confirmed_ms is updated in place when the server confirms the version
+ * (304), and is not covered by the CRC. A torn or foreign file fails the
+ * checks and is treated as no snapshot.
+ *
+ * Usage:
+ *   kv_snapshot *snapshot = kv_snapshot_open(dir, token);
+ *   if(snapshot) {
+ *       size_t len;
+ *       const char *data = kv_snapshot_data(snapshot, &len);
+ *       ...show it, kv_snapshot_age_ms(snapshot) old
+ *       kv_snapshot_close(snapshot);
+ *   }
+ *   ...then, or instead:
+ *   kv_client_set_snapshot_dir(client, dir);
+ *   kv_retrieve(client);            // 304 if the snapshot is current
+ *
+ * Files are named after a hash of the token and created mode 0600. Only
+ * one process should write a token's snapshot at a time; the last rename
+ * wins.
+ */
+
+#ifndef KV_SNAPSHOT_H
+#define KV_SNAPSHOT_H
+
+#include <stddef.h>
+#include <json-c/json.h>
+
+#include "kv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct kv_snapshot kv_snapshot;
+
+/* Keep a snapshot per token in dir, created (mode 0700) if missing; NULL
+ * stops writing them. Returns 1 on success, 0 on failure. */
+int kv_client_set_snapshot_dir(kv_client *client, const char *dir);
+
+/* Map token's snapshot in dir. Returns NULL, with errno set, if there is
+ * none or it does not pass its checks. Needs no client and no network. */
+kv_snapshot *kv_snapshot_open(const char *dir, const char *token);
+
+void kv_snapshot_close(kv_snapshot *snapshot);
+
+/* The document's JSON text, NUL-terminated, *len bytes without the NUL.
+ * Valid until kv_snapshot_close. */
+const char *kv_snapshot_data(const kv_snapshot *snapshot, size_t *len);
+
+/* The document parsed, as a new reference, or NULL */
+struct json_object *kv_snapshot_parse(const kv_snapshot *snapshot);
+
+long kv_snapshot_version(const kv_snapshot *snapshot);
+
+/* The ETag it was served with, "" if none */
+const char *kv_snapshot_etag(const kv_snapshot *snapshot);
+
+/* Milliseconds since the server last confirmed this version */
+long long kv_snapshot_age_ms(const kv_snapshot *snapshot);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_SNAPSHOT_H */
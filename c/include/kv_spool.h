@@ -0,0 +1,101 @@
+/*
+ * libkv durable spool
+ *
+ * kv_spool is an append-only file of records, each a token and a JSON
+ * value, that outlives network failures, crashes and restarts. Appends
+ * only touch the local file, so they cost the same whether the link is
+ * up or down; fsync is batched, every sync_every records or once the
+ * oldest unsynced record is sync_ms old. Records are read oldest first
+ * and consumed once they have been delivered, so delivery is at least
+ * once: the records after the last synced consume may be delivered again
+ * after a crash.
+ *
+ * A spool can be drained two ways:
+ *   - kv_spool_replay stores each record as its token's document through
+ *     POST /api/batch, a bounded number of requests per call;
+ *   - kv_writer_set_spool (kv_writer.h) keeps a writer's buffered samples
+ *     in it, so they are folded into the document by one patch as usual.
+ *
+ * File format, all integers little-endian:
+ *   header  "KVSPOOL1", u64 offset of the oldest unconsumed record, u64
+ *           end of the records while a compaction is cut short (else 0)
+ *   record  u32 data length, u16 token length, u32 CRC-32 of token and
+ *           data, token bytes, data (compact JSON text)
+ * A record torn by a crash fails its length or CRC check and is cut off,
+ * along with anything after it, when the spool is next opened. A header
+ * pointing at or past the end of the file opens as an empty spool.
+ *
+ * Usage:
+ *   kv_spool *spool = kv_spool_open("/var/spool/sensor.kv", 10, 5000);
+ *   ...when a store fails:
+ *   kv_spool_append(spool, token, data);
+ *   ...every loop, cheap while the spool is empty:
+ *   kv_spool_replay(spool, client, 4);
+ *   ...on shutdown:
+ *   kv_spool_close(spool);
+ *
+ * A spool is not thread-safe, and only one process may have it open.
+ */
+
+#ifndef KV_SPOOL_H
+#define KV_SPOOL_H
+
+#include <json-c/json.h>
+
+#include "kv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct kv_spool kv_spool;
+
+/* Called for each record, oldest first. token and record are only valid
+ * during the call. Return 1 to continue, 0 to stop. */
+typedef int (*kv_spool_visitor)(const char *token, struct json_object *record, void *userdata);
+
+/* Open or create the spool at path. sync_every (at least 1) and sync_ms
+ * (0 for no time limit) bound how much an append may leave unsynced.
+ * Returns NULL on failure, with errno set. */
+kv_spool *kv_spool_open(const char *path, int sync_every, long sync_ms);
+
+/* Sync and close */
+void kv_spool_close(kv_spool *spool);
+
+/* Append a record. Returns 1 on success, 0 on failure (nothing is
+ * appended). */
+int kv_spool_append(kv_spool *spool, const char *token, struct json_object *record);
+
+/* Visit up to max (0 for all) of the oldest records without consuming
+ * them. Returns the number visited, or -1 if the file could not be read. */
+int kv_spool_read(kv_spool *spool, int max, kv_spool_visitor visitor, void *userdata);
+
+/* Drop the n oldest records. Returns 1 on success, 0 on a write failure. */
+int kv_spool_consume(kv_spool *spool, int n);
+
+/* Write unsynced records and the read position to disk now. Also done by
+ * kv_spool_poll once sync_ms has passed. Returns 1 on success. */
+int kv_spool_sync(kv_spool *spool);
+
+/* Sync if the oldest unsynced change is due. Returns 1 on success. */
+int kv_spool_poll(kv_spool *spool);
+
+/* Records waiting */
+int kv_spool_count(const kv_spool *spool);
+
+/* Store the oldest records through the batch API: up to KV_BATCH_MAX per
+ * request and at most max_requests requests. Records for the same token
+ * within a request collapse to the newest. A record the server rejects is
+ * consumed as well and counted by kv_spool_rejected; if a request fails,
+ * its records stay for the next call. Returns the number of records
+ * consumed, or -1 if the first request failed. */
+int kv_spool_replay(kv_spool *spool, kv_client *client, int max_requests);
+
+/* Records dropped by kv_spool_replay because the server rejected them */
+long kv_spool_rejected(const kv_spool *spool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_SPOOL_H */
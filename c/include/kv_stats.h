@@ -0,0 +1,77 @@
+/*
+ * libkv rolling statistics
+ *
+ * kv_stats keeps min/max/avg/count over the last `window` readings for
+ * every numeric member it sees, in O(1) amortized work per sample: a
+ * running sum and count per series, plus monotonic deques for the
+ * windowed min and max.
+ *
+ * The aggregator does not hold the window itself. The caller already
+ * stores the readings (e.g. a history ring) and passes the reading that
+ * drops out of the window along with each new one. The aggregator's state
+ * serializes to a small JSON object that can be stored next to that
+ * history and restored later, so a process that logs one reading and
+ * exits does not have to rescan the history.
+ *
+ * Usage:
+ *   kv_stats *stats = kv_stats_from_state(stored_state, 100);  // or kv_stats_new(100)
+ *   kv_stats_add(stats, reading, history_full ? oldest : NULL);
+ *   struct json_object *summary = kv_stats_to_json(stats);
+ *   struct json_object *state = kv_stats_state(stats);
+ *   kv_stats_free(stats);
+ */
+
+#ifndef KV_STATS_H
+#define KV_STATS_H
+
+#include <json-c/json.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct kv_stats kv_stats;
+
+struct kv_series_stats {
+    double min;
+    double max;
+    double avg;
+    double sum;
+    int count;                  /* samples of this series in the window */
+};
+
+/* Create an empty aggregator over the last window readings */
+kv_stats *kv_stats_new(int window);
+void kv_stats_free(kv_stats *stats);
+
+/* Restore from kv_stats_state output. Returns NULL if state is missing,
+ * malformed, or was saved with a different window. */
+kv_stats *kv_stats_from_state(struct json_object *state, int window);
+
+/* Add one reading. Every int or double member is a sample of the series
+ * with that name; other members are ignored. evicted is the reading that
+ * leaves the window as this one enters (the window-th most recent before
+ * this call), or NULL while the window is not yet full. Returns 1 on
+ * success, 0 on allocation failure. */
+int kv_stats_add(kv_stats *stats, struct json_object *reading, struct json_object *evicted);
+
+/* Current figures for one series. Returns 0 if it has no samples in the
+ * window. */
+int kv_stats_get(const kv_stats *stats, const char *key, struct kv_series_stats *out);
+
+/* Number of readings added so far, and how many are in the window */
+long long kv_stats_total(const kv_stats *stats);
+int kv_stats_window_count(const kv_stats *stats);
+
+/* Summary as {"<key>": {"min":..,"max":..,"avg":..,"count":..}, ...,
+ * "total_readings": n}, series with no samples omitted. New reference. */
+struct json_object *kv_stats_to_json(const kv_stats *stats);
+
+/* Serializable state for kv_stats_from_state. New reference. */
+struct json_object *kv_stats_state(const kv_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_STATS_H */
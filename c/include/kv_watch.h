@@ -0,0 +1,83 @@
+/*
+ * libkv change watch
+ *
+ * A kv_watch waits for a token's document to change instead of
+ * retrieving it over and over. Each request is a long poll of the
+ * retrieve endpoint on the last version seen:
+ *   GET /api/retrieve?wait=<seconds>&version=<version>
+ *   If-None-Match: <ETag of that version>
+ * A server that holds such requests answers once a newer version is
+ * stored, or with a 304 when wait runs out, so a watcher sends about one
+ * request per change. A server that does not hold them answers at once,
+ * with a bodyless 304 while nothing changed; the watch notices the early
+ * answer and spaces its requests poll_ms apart instead. Either way the
+ * callback only runs for a new version.
+ *
+ * The watch resumes from the last version it delivered, after a failed
+ * request or, given the version saved by the caller, a restart. Several
+ * changes made meanwhile arrive as one callback with the newest document.
+ * New documents also refresh the client's retrieve cache, if enabled.
+ *
+ * Usage:
+ *   kv_watch *watch = kv_watch_new(client, 0, on_change, ctx);  // current first
+ *   while(kv_watch_run(watch, 0) < 0) {
+ *       ...kv_client_error(client), then keep watching...
+ *   }
+ *   kv_watch_free(watch);
+ *
+ * A watch uses its client's connection while it runs, and is not
+ * thread-safe.
+ */
+
+#ifndef KV_WATCH_H
+#define KV_WATCH_H
+
+#include <json-c/json.h>
+
+#include "kv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KV_WATCH_WAIT_S  30         /* default hold asked of the server */
+#define KV_WATCH_POLL_MS 5000       /* default spacing when it does not hold */
+
+typedef struct kv_watch kv_watch;
+
+/* A new version: data is the document (borrowed, valid during the call),
+ * or NULL with version 0 if it was deleted. Return 1 to keep watching, 0
+ * to stop. */
+typedef int (*kv_watch_callback)(struct json_object *data, long version, void *userdata);
+
+/* Watch client's token for versions after since_version; 0 delivers the
+ * current document first, if there is one. Returns NULL on failure. */
+kv_watch *kv_watch_new(kv_client *client, long since_version,
+                       kv_watch_callback callback, void *userdata);
+void kv_watch_free(kv_watch *watch);
+
+/* Ask the server to hold each request up to wait_s seconds (at least 1),
+ * and space requests poll_ms apart when it does not */
+void kv_watch_set_wait(kv_watch *watch, int wait_s, long poll_ms);
+
+/* Send one request. Returns 1 if the callback ran, 0 if nothing changed,
+ * -1 on failure (see kv_client_error). Never sleeps between requests. */
+int kv_watch_poll(kv_watch *watch);
+
+/* Poll until the callback returns 0 (returns 1), duration_ms has passed
+ * or a signal cut a wait short (returns 0; duration_ms 0 for no limit),
+ * or a request fails (returns -1). Call again to resume. */
+int kv_watch_run(kv_watch *watch, long duration_ms);
+
+/* Last version delivered, to resume from after a restart */
+long kv_watch_version(const kv_watch *watch);
+
+/* Whether the last unchanged answer was held by the server (1), came
+ * back at once (0), or none has come yet (-1) */
+int kv_watch_held(const kv_watch *watch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_WATCH_H */
@@ -0,0 +1,103 @@
+/*
+ * libkv write-behind
+ *
+ * kv_writer buffers samples for the client's document and writes them
+ * together as one read-modify-write patch once max_samples are waiting or
+ * the oldest has waited flush_ms, whichever comes first. A monitor that
+ * samples every second can then send one PATCH a minute instead of sixty.
+ *
+ * At flush time the builder gets the current document and every buffered
+ * sample, oldest first, and fills set/remove like a kv_update builder; on
+ * a version conflict it is called again with the fresh document. With
+ * KV_WRITER_DEDUPE the patch is passed through kv_patch_prune, so a flush
+ * that would not change anything sends no request.
+ *
+ * Samples live only in memory until they are flushed: flush or free the
+ * writer before the process exits, or give it a kv_spool (kv_spool.h) so
+ * they survive a crash or a restart while the server is out of reach.
+ *
+ * Usage:
+ *   kv_writer *writer = kv_writer_new(client, build, NULL, 60000, 60, KV_WRITER_DEDUPE);
+ *   ...every second:
+ *   kv_writer_add(writer, reading);
+ *   kv_writer_poll(writer);         // writes once the flush interval is up
+ *   ...on shutdown:
+ *   kv_writer_free(writer);         // writes whatever is left
+ */
+
+#ifndef KV_WRITER_H
+#define KV_WRITER_H
+
+#include <json-c/json.h>
+
+#include "kv.h"
+#include "kv_spool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Skip patch entries that would not change the stored document */
+#define KV_WRITER_DEDUPE 1
+
+typedef struct kv_writer kv_writer;
+
+/* Describe the change that folds samples (an array, oldest first) into
+ * current, which is NULL when nothing is stored yet. Return values as for
+ * kv_patch_builder: 1 to send, 0 for nothing to change, -1 to abort (the
+ * samples are then discarded). */
+typedef int (*kv_writer_builder)(struct json_object *current, struct json_object *samples,
+                                 struct json_object *set, struct json_object *remove,
+                                 void *userdata);
+
+/* Create a writer for client's token. flush_ms is how long the oldest
+ * sample may wait (0 writes on every poll), max_samples (at least 1) how
+ * many may be buffered before a write is forced; flags is 0 or
+ * KV_WRITER_DEDUPE. Returns NULL on failure. */
+kv_writer *kv_writer_new(kv_client *client, kv_writer_builder builder, void *userdata,
+                         long flush_ms, int max_samples, int flags);
+
+/* Keep buffered samples in spool as well, so they outlive the process.
+ * Call before the first kv_writer_add. Samples already in the spool (left
+ * by an earlier run) are buffered again, the oldest dropped if there are
+ * more than max_samples, and are due for a write at the next poll. From
+ * then on every sample is appended to the spool before it is buffered and
+ * consumed once written or dropped. The spool is not owned by the writer.
+ * Returns 1 on success, 0 if the spool could not be read or the client
+ * encrypts (kv_crypt.h), whose samples must not reach the disk in plain. */
+int kv_writer_set_spool(kv_writer *writer, kv_spool *spool);
+
+/* Flushes buffered samples, then frees the writer */
+void kv_writer_free(kv_writer *writer);
+
+/* Buffer a sample (takes its own reference). Writes immediately once
+ * max_samples are buffered. If a write fails the samples stay buffered and
+ * the next attempt waits another flush_ms; while the buffer is full the
+ * oldest sample is dropped to make room. Returns 1 on success, 0 if the
+ * sample could not be buffered (or spooled) or the forced write failed. */
+int kv_writer_add(kv_writer *writer, struct json_object *sample);
+
+/* Write if a flush is due. Returns the number of samples written (0 if
+ * not yet due or nothing is buffered), or -1 if the write failed. */
+int kv_writer_poll(kv_writer *writer);
+
+/* Write every buffered sample now. Same return value as kv_writer_poll. */
+int kv_writer_flush(kv_writer *writer);
+
+/* Milliseconds until the next write is due, 0 if overdue, -1 if nothing
+ * is buffered. Useful as a sleep or poll() timeout. */
+long kv_writer_timeout(const kv_writer *writer);
+
+int kv_writer_pending(const kv_writer *writer);
+
+/* Samples dropped so far because the buffer was full while writes failed */
+long kv_writer_dropped(const kv_writer *writer);
+
+/* Writes skipped so far because KV_WRITER_DEDUPE found nothing to change */
+long kv_writer_skipped(const kv_writer *writer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* KV_WRITER_H */
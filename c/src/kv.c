@@ -0,0 +1,811 @@
+/*
+ * libkv core: client lifecycle and the synchronous store/retrieve calls.
+ *
+ * Every request goes through kv_perform on the client's single easy handle.
+ * Options that never change (write callback, keep-alive, error buffer) are
+ * set once in kv_client_new; only the URL, method, headers and body are set
+ * per request, so libcurl keeps the connection and TLS session alive
+ * between calls.
+ *
+ * The endpoint URLs are built once per client and the header lists once
+ * per token, out of nodes the client owns, so a request allocates nothing
+ * for them. libcurl copies the URL and custom method on every setopt, so
+ * those are only set when they differ from what the handle already has.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "kv_codec.h"
+#include "kv_snapshot.h"
+#include "kv_internal.h"
+
+#define KV_BUFFER_MIN 1024
+
+#define KV_TOKEN_HEADER "X-KV-Token: "
+
+/* curl_slist data is not const, though libcurl only reads header lines */
+static char content_type_header[] = "Content-Type: application/json";
+static char cbor_type_header[] = "Content-Type: application/cbor";
+static char cbor_accept_header[] = "Accept: application/cbor, application/json;q=0.5";
+
+static const char *const endpoint_paths[KV_ENDPOINTS] = {
+    "/api/store",           /* KV_ENDPOINT_STORE */
+    "/api/retrieve",        /* KV_ENDPOINT_RETRIEVE */
+    "/api/batch",           /* KV_ENDPOINT_BATCH */
+    "/api/history",         /* KV_ENDPOINT_HISTORY */
+};
+
+int kv_buffer_reserve(struct kv_buffer *buf, size_t extra) {
+    size_t needed = buf->size + extra + 1;
+    if(needed <= buf->capacity) return 1;
+
+    size_t capacity = buf->capacity ? buf->capacity : KV_BUFFER_MIN;
+    while(capacity < needed) capacity *= 2;
+
+    char *ptr = kv_realloc(buf->data, capacity);
+    if(ptr == NULL) return 0;
+
+    buf->data = ptr;
+    buf->capacity = capacity;
+    return 1;
+}
+
+int kv_buffer_append(struct kv_buffer *buf, const void *data, size_t len) {
+    if(!kv_buffer_reserve(buf, len)) return 0;
+
+    memcpy(buf->data + buf->size, data, len);
+    buf->size += len;
+    buf->data[buf->size] = 0;
+    return 1;
+}
+
+void kv_buffer_reset(struct kv_buffer *buf) {
+    buf->size = 0;
+    if(buf->data) buf->data[0] = 0;
+}
+
+void kv_buffer_free(struct kv_buffer *buf) {
+    kv_free(buf->data);
+    buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+}
+
+void kv_response_reset(struct kv_response *response) {
+    kv_buffer_reset(&response->body);
+    if(response->tokener) json_tokener_reset(response->tokener);
+    json_object_put(response->json);
+    response->json = NULL;
+    response->size = 0;
+    response->state = KV_PARSE_PENDING;
+    response->cbor = 0;
+    if(response->crypt) kv_crypt_reset(response->crypt);
+}
+
+void kv_response_free(struct kv_response *response) {
+    kv_buffer_free(&response->body);
+    if(response->tokener) json_tokener_free(response->tokener);
+    response->tokener = NULL;
+    json_object_put(response->json);
+    response->json = NULL;
+}
+
+const char *kv_response_body(const struct kv_response *response) {
+    return response->body.data ? response->body.data : "";
+}
+
+/* Feed len bytes to the tokener, settling the state once it knows */
+void kv_response_parse(struct kv_response *response, const char *data, int len) {
+    if(!response->tokener) {
+        response->tokener = json_tokener_new();
+        if(!response->tokener) {
+            response->state = KV_PARSE_INVALID;
+            return;
+        }
+    }
+
+    long long start = response->timed ? kv_now_us() : 0;
+    response->json = json_tokener_parse_ex(response->tokener, data, len);
+    if(response->timed) response->parse_us += kv_now_us() - start;
+    if(response->json) {
+        response->state = KV_PARSE_DONE;
+    } else if(json_tokener_get_error(response->tokener) != json_tokener_continue) {
+        response->state = KV_PARSE_INVALID;
+    }
+}
+
+size_t kv_response_write(void *data, size_t size, size_t nmemb, void *userp) {
+    size_t realsize = size * nmemb;
+    struct kv_response *response = (struct kv_response *)userp;
+
+    if(response->crypt) {
+        if(!kv_crypt_write(response, data, realsize)) return 0;
+        response->size += realsize;
+        return realsize;
+    }
+
+    /* CBOR is decoded in one go once the body is complete */
+    int keep = response->keep_body || response->raw || response->cbor;
+    if(keep && !kv_buffer_append(&response->body, data, realsize)) return 0;
+    response->size += realsize;
+
+    /* libcurl hands over at most CURL_MAX_WRITE_SIZE bytes per call, well
+     * within int range; anything after the end of the document is ignored */
+    if(response->state == KV_PARSE_PENDING && !response->raw && !response->cbor) {
+        kv_response_parse(response, data, (int)realsize);
+    }
+    return realsize;
+}
+
+static void response_decode_cbor(struct kv_response *response) {
+    struct json_object *json = NULL;
+    long long start = response->timed ? kv_now_us() : 0;
+    int ok = response->body.size > 0 && kv_cbor_decode(response->body.data, response->body.size, &json);
+    if(response->timed) response->parse_us += kv_now_us() - start;
+
+    response->json = json;
+    response->state = ok ? KV_PARSE_DONE : KV_PARSE_INVALID;
+    if(!response->keep_body) kv_buffer_reset(&response->body);
+}
+
+struct json_object *kv_response_take(struct kv_response *response) {
+    if(response->state == KV_PARSE_PENDING && response->cbor) response_decode_cbor(response);
+
+    /* A bare top-level number is only complete once the tokener sees the
+     * end of input, which the terminating NUL signals */
+    if(response->state == KV_PARSE_PENDING && response->size > 0 && !response->raw) {
+        kv_response_parse(response, "", 1);
+    }
+
+    struct json_object *json = response->json;
+    response->json = NULL;
+    return json;
+}
+
+/* Whether the header line data of len bytes is name (with the colon),
+ * pointing *value and *value_len at its trimmed value */
+static int header_value(const char *data, size_t len, const char *name,
+                        const char **value, size_t *value_len) {
+    size_t n = strlen(name);
+    if(len <= n || strncasecmp(data, name, n) != 0) return 0;
+
+    const char *start = data + n;
+    const char *end = data + len;
+    while(start < end && (*start == ' ' || *start == '\t')) start++;
+    while(end > start && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' ')) end--;
+    *value = start;
+    *value_len = (size_t)(end - start);
+    return 1;
+}
+
+/* CURLOPT_HEADERFUNCTION: remember the ETag of the response */
+static size_t header_callback(char *data, size_t size, size_t nitems, void *userp) {
+    size_t len = size * nitems;
+    kv_client *client = (kv_client *)userp;
+
+    const char *value;
+    size_t n;
+
+    if(len > 5 && strncmp(data, "HTTP/", 5) == 0) {
+        /* A new response (after a 100 Continue or a redirect) */
+        client->response.cbor = 0;
+    } else if(header_value(data, len, "ETag:", &value, &n)) {
+        if(n < sizeof(client->etag)) {
+            memcpy(client->etag, value, n);
+            client->etag[n] = 0;
+        }
+    } else if(header_value(data, len, "Retry-After:", &value, &n)) {
+        kv_retry_after_header(client, value, n);
+    } else if(header_value(data, len, "Content-Type:", &value, &n)) {
+        client->response.cbor = n >= 16 && strncasecmp(value, "application/cbor", 16) == 0;
+    }
+    return len;
+}
+
+/* CURLOPT_READFUNCTION: stream the pieces of client->upload in order */
+size_t kv_upload_read(char *dest, size_t size, size_t nmemb, void *userp) {
+    struct kv_upload *upload = (struct kv_upload *)userp;
+    size_t room = size * nmemb, copied = 0;
+
+    while(room > 0 && upload->part < KV_UPLOAD_PARTS) {
+        size_t left = upload->lens[upload->part] - upload->offset;
+        if(left == 0) {
+            upload->part++;
+            upload->offset = 0;
+            continue;
+        }
+        size_t n = left < room ? left : room;
+        memcpy(dest + copied, upload->parts[upload->part] + upload->offset, n);
+        upload->offset += n;
+        copied += n;
+        room -= n;
+    }
+    return copied;
+}
+
+/* CURLOPT_SEEKFUNCTION: libcurl rewinds when it has to resend the body,
+ * e.g. after a kept-alive connection turned out to be closed */
+int kv_upload_seek(void *userp, curl_off_t offset, int origin) {
+    struct kv_upload *upload = (struct kv_upload *)userp;
+    if(origin != SEEK_SET || offset < 0) return CURL_SEEKFUNC_CANTSEEK;
+
+    size_t remaining = (size_t)offset;
+    upload->part = 0;
+    while(upload->part < KV_UPLOAD_PARTS && remaining > upload->lens[upload->part]) {
+        remaining -= upload->lens[upload->part++];
+    }
+    if(upload->part == KV_UPLOAD_PARTS) return CURL_SEEKFUNC_FAIL;
+    upload->offset = remaining;
+    return CURL_SEEKFUNC_OK;
+}
+
+long long kv_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long kv_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int kv_global_init(void) {
+    return kv_alloc_init();
+}
+
+void kv_global_cleanup(void) {
+    curl_global_cleanup();
+    kv_alloc_cleanup();
+}
+
+kv_client *kv_client_new(const char *base_url, const char *token) {
+    kv_client *client = kv_calloc(1, sizeof(*client));
+    if(!client) return NULL;
+
+    if(!base_url) base_url = KV_DEFAULT_URL;
+    client->base_url = kv_strdup(base_url);
+    client->curl = curl_easy_init();
+    if(!client->base_url || !client->curl || (token && !kv_client_set_token(client, token))) {
+        kv_client_free(client);
+        return NULL;
+    }
+
+    /* Strip trailing slashes so paths can always be appended as "/api/..." */
+    size_t len = strlen(client->base_url);
+    while(len > 0 && client->base_url[len - 1] == '/') client->base_url[--len] = 0;
+
+    for(int i = 0; i < KV_ENDPOINTS; i++) {
+        size_t size = len + strlen(endpoint_paths[i]) + 1;
+        client->endpoints[i] = kv_malloc(size);
+        if(!client->endpoints[i]) {
+            kv_client_free(client);
+            return NULL;
+        }
+        snprintf(client->endpoints[i], size, "%s%s", client->base_url, endpoint_paths[i]);
+    }
+
+    client->header_nodes[KV_HEADER_BODY_TOKEN].data = content_type_header;
+    client->header_nodes[KV_HEADER_BODY_TOKEN].next = &client->header_nodes[KV_HEADER_TOKEN];
+    client->header_nodes[KV_HEADER_BODY].data = content_type_header;
+
+    client->response.keep_body = 1;
+    curl_easy_setopt(client->curl, CURLOPT_WRITEFUNCTION, kv_response_write);
+    curl_easy_setopt(client->curl, CURLOPT_WRITEDATA, (void *)&client->response);
+    curl_easy_setopt(client->curl, CURLOPT_HEADERFUNCTION, header_callback);
+    curl_easy_setopt(client->curl, CURLOPT_HEADERDATA, (void *)client);
+    curl_easy_setopt(client->curl, CURLOPT_READFUNCTION, kv_upload_read);
+    curl_easy_setopt(client->curl, CURLOPT_READDATA, (void *)&client->upload);
+    curl_easy_setopt(client->curl, CURLOPT_SEEKFUNCTION, kv_upload_seek);
+    curl_easy_setopt(client->curl, CURLOPT_SEEKDATA, (void *)&client->upload);
+    curl_easy_setopt(client->curl, CURLOPT_ERRORBUFFER, client->error);
+    curl_easy_setopt(client->curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(client->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(client->curl, CURLOPT_TCP_KEEPIDLE, 60L);
+    curl_easy_setopt(client->curl, CURLOPT_TCP_KEEPINTVL, 30L);
+    kv_retry_init(client);
+
+    return client;
+}
+
+void kv_client_free(kv_client *client) {
+    if(!client) return;
+
+    if(client->curl) curl_easy_cleanup(client->curl);
+    kv_response_free(&client->response);
+    kv_cache_free(client);
+    kv_free(client->snapshot_dir);
+    kv_compress_free(&client->compress);
+    kv_crypt_free(client->crypt);
+    kv_buffer_free(&client->cbor);
+    kv_free(client->metrics);
+    for(int i = 0; i < KV_ENDPOINTS; i++) kv_free(client->endpoints[i]);
+    kv_free(client->base_url);
+    kv_free(client->token_header);
+    kv_free(client);
+}
+
+int kv_client_set_token(kv_client *client, const char *token) {
+    /* Same token again (a fleet worker coming back to a device): keep the
+     * header and the version it last saw */
+    if(token && client->token && strcmp(token, client->token) == 0) return 1;
+
+    char *header = NULL;
+    if(token) {
+        size_t size = sizeof(KV_TOKEN_HEADER) + strlen(token);
+        header = kv_malloc(size);
+        if(!header) return 0;
+        snprintf(header, size, "%s%s", KV_TOKEN_HEADER, token);
+    }
+
+    /* Only read during a request, so the node can be repointed in place */
+    kv_free(client->token_header);
+    client->token_header = header;
+    client->token = header ? header + sizeof(KV_TOKEN_HEADER) - 1 : NULL;
+    client->header_nodes[KV_HEADER_TOKEN].data = header;
+    client->version = 0;
+    return 1;
+}
+
+const char *kv_client_token(const kv_client *client) {
+    return client->token;
+}
+
+long kv_client_status(const kv_client *client) {
+    return client->status;
+}
+
+const char *kv_client_error(const kv_client *client) {
+    return client->error;
+}
+
+const char *kv_client_response(const kv_client *client) {
+    return kv_response_body(&client->response);
+}
+
+void kv_client_set_keep_body(kv_client *client, int keep) {
+    client->response.keep_body = keep ? 1 : 0;
+}
+
+long kv_client_version(const kv_client *client) {
+    return client->version;
+}
+
+int kv_client_url(const kv_client *client, const char *path, char *out, size_t out_size) {
+    int n = snprintf(out, out_size, "%s%s", client->base_url, path);
+    return n > 0 && (size_t)n < out_size;
+}
+
+int kv_client_set_wire_format(kv_client *client, int format) {
+    if(format != KV_WIRE_JSON && format != KV_WIRE_CBOR) return 0;
+    client->wire = format;
+    return 1;
+}
+
+int kv_client_wire_format(const kv_client *client) {
+    return client->wire;
+}
+
+const char *kv_client_endpoint(const kv_client *client, int endpoint) {
+    return client->endpoints[endpoint];
+}
+
+struct curl_slist *kv_client_headers(kv_client *client, int with_body, int with_token) {
+    with_token = with_token && client->token;
+
+    if(with_body && with_token) return &client->header_nodes[KV_HEADER_BODY_TOKEN];
+    if(with_token) return &client->header_nodes[KV_HEADER_TOKEN];
+    if(with_body) return &client->header_nodes[KV_HEADER_BODY];
+    return NULL;
+}
+
+struct curl_slist *kv_request_headers(const kv_client *client, int with_body, int with_token) {
+    struct curl_slist *headers = NULL;
+
+    if(with_body) {
+        headers = curl_slist_append(headers, content_type_header);
+    }
+    if(with_token && client->token_header) {
+        headers = curl_slist_append(headers, client->token_header);
+    }
+    if(client->if_none_match) {
+        char match_header[160];
+        snprintf(match_header, sizeof(match_header), "If-None-Match: %s", client->if_none_match);
+        headers = curl_slist_append(headers, match_header);
+    }
+
+    return headers;
+}
+
+/* Point the handle at url, skipping the copy libcurl makes when it is the
+ * endpoint already set */
+static void set_url(kv_client *client, const char *url) {
+    if(url == client->url_set) return;
+
+    curl_easy_setopt(client->curl, CURLOPT_URL, url);
+    client->url_set = NULL;
+    for(int i = 0; i < KV_ENDPOINTS; i++) {
+        if(url == client->endpoints[i]) client->url_set = url;
+    }
+}
+
+/* CURLOPT_CUSTOMREQUEST is method unless it is the default (NULL) */
+static void set_method(kv_client *client, const char *method, const char *standard) {
+    const char *custom = strcmp(method, standard) == 0 ? "" : method;
+    if(strcmp(custom, client->method_set) == 0) return;
+
+    curl_easy_setopt(client->curl, CURLOPT_CUSTOMREQUEST, custom[0] ? custom : NULL);
+    snprintf(client->method_set, sizeof(client->method_set), "%s", custom);
+}
+
+/* Shared by kv_perform and kv_perform_parts: body is a NUL-terminated
+ * string, or NULL with upload set for a streamed body, or both NULL.
+ * timeout is in seconds, 0 for the client's own (see kv_retry.c). */
+static int perform(kv_client *client, const char *method, const char *url,
+                   const char *body, const struct kv_upload *upload, int with_token, long timeout) {
+    CURL *curl = client->curl;
+    struct curl_slist *headers;
+    struct curl_slist match_node, encoding_node, type_node, accept_node;
+    char match_header[160];
+    CURLcode res;
+    int cbor_body = client->cbor_body;
+
+    client->cbor_body = 0;
+    client->status = 0;
+    client->error[0] = 0;
+    client->etag[0] = 0;
+    kv_response_reset(&client->response);
+
+    if(with_token && !client->token) {
+        client->if_none_match = NULL;
+        snprintf(client->error, sizeof(client->error), "Token required");
+        return 0;
+    }
+    if(!kv_retry_begin(client)) {
+        client->if_none_match = NULL;
+        return 0;
+    }
+    kv_metrics_begin(client);
+
+    int has_body = body != NULL || upload != NULL;
+    headers = kv_client_headers(client, has_body && !cbor_body, with_token);
+    if(has_body && cbor_body) {
+        type_node.data = cbor_type_header;
+        type_node.next = headers;
+        headers = &type_node;
+    }
+    if(client->wire == KV_WIRE_CBOR && !client->response.raw && !client->response.crypt &&
+       strncmp(url, client->base_url, strlen(client->base_url)) == 0) {
+        /* Only the key-value server is asked, not lookups through kv_get_json */
+        accept_node.data = cbor_accept_header;
+        accept_node.next = headers;
+        headers = &accept_node;
+    }
+    if(client->if_none_match) {
+        /* One-shot header: chained in front of the client's list for this
+         * request only */
+        snprintf(match_header, sizeof(match_header), "If-None-Match: %s", client->if_none_match);
+        match_node.data = match_header;
+        match_node.next = headers;
+        headers = &match_node;
+    }
+    client->if_none_match = NULL;
+
+    set_url(client, url);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout > 0 ? timeout * 1000 : client->retry.timeout_ms);
+
+    struct kv_upload parts = { { body, "", "" }, { body ? strlen(body) : 0, 0, 0 }, 0, 0 };
+    if(has_body) {
+        curl_off_t total = 0;
+        if(upload) {
+            parts = *upload;
+            parts.part = 0;
+            parts.offset = 0;
+        }
+        for(int i = 0; i < KV_UPLOAD_PARTS; i++) total += (curl_off_t)parts.lens[i];
+
+        char *encoding = kv_compress_body(client, &parts, (size_t)total);
+        if(encoding) {
+            encoding_node.data = encoding;
+            encoding_node.next = headers;
+            headers = &encoding_node;
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, client->compress.out.data);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)client->compress.out.size);
+            upload = NULL;
+        } else if(body) {
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, total);
+        } else {
+            /* No POSTFIELDS: libcurl pulls the body through kv_upload_read */
+            curl_easy_setopt(curl, CURLOPT_POST, 1L);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDS, NULL);
+            curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, total);
+        }
+        set_method(client, method, "POST");
+    } else {
+        curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+        set_method(client, method, "GET");
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+    do {
+        /* Each attempt starts from a clean response and the start of the body */
+        if(client->retry.attempts > 0) {
+            client->status = 0;
+            client->error[0] = 0;
+            client->etag[0] = 0;
+            kv_response_reset(&client->response);
+        }
+        client->retry.retry_after_ms = -1;
+        if(upload) client->upload = parts;
+
+        res = curl_easy_perform(curl);
+        if(res == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &client->status);
+        kv_metrics_attempt(client, res);
+    } while(kv_retry_next(client, res));
+    kv_retry_end(client, res);
+    kv_metrics_end(client, method, url, res == CURLE_OK &&
+                   ((client->status >= 200 && client->status < 300) || client->status == 304));
+
+    /* The handle keeps a pointer to the list, which may be on this stack */
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+
+    if(res != CURLE_OK) {
+        client->status = 0;
+        if(client->error[0] == 0) {
+            snprintf(client->error, sizeof(client->error), "%s", curl_easy_strerror(res));
+        }
+        return 0;
+    }
+    return 1;
+}
+
+int kv_perform(kv_client *client, const char *method, const char *url,
+               const char *body, int with_token, long timeout) {
+    return perform(client, method, url, body, NULL, with_token, timeout);
+}
+
+int kv_perform_parts(kv_client *client, const char *method, const char *url,
+                     const char *prefix, const char *data, size_t len, const char *suffix,
+                     int with_token, long timeout) {
+    struct kv_upload upload = {
+        { prefix ? prefix : "", data, suffix ? suffix : "" },
+        { prefix ? strlen(prefix) : 0, len, suffix ? strlen(suffix) : 0 },
+        0, 0
+    };
+    return perform(client, method, url, NULL, &upload, with_token, timeout);
+}
+
+int kv_perform_document(kv_client *client, const char *method, const char *url,
+                        const char *envelope, struct json_object *obj, int json_flags,
+                        int with_token, long timeout) {
+    size_t len;
+
+    if(client->wire == KV_WIRE_CBOR) {
+        const unsigned char *cbor = kv_serialize_cbor(client, envelope, obj, &len);
+        if(!cbor) {
+            client->status = 0;
+            snprintf(client->error, sizeof(client->error), "CBOR encoding failed");
+            return 0;
+        }
+        client->cbor_body = 1;
+        int ok = kv_perform_parts(client, method, url, NULL, (const char *)cbor, len, NULL,
+                                  with_token, timeout);
+        if(!ok || client->status != 415) return ok;
+
+        /* The server only takes JSON: resend, and stay on it */
+        client->wire = KV_WIRE_JSON;
+    }
+
+    const char *json = kv_serialize(client, obj, json_flags, &len);
+    if(!envelope) return kv_perform(client, method, url, json, with_token, timeout);
+
+    /* Wrapped as it is sent, instead of building a wrapper object */
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "{\"%s\":", envelope);
+    return kv_perform_parts(client, method, url, prefix, json, len, "}", with_token, timeout);
+}
+
+/* Settle a POST /api/store that kv_perform* returned ok for */
+static int store_result(kv_client *client, int ok) {
+    if(ok && (client->status < 200 || client->status >= 300)) {
+        snprintf(client->error, sizeof(client->error), "HTTP %ld", client->status);
+        ok = 0;
+    }
+    if(ok) json_object_put(kv_parse_response(client));
+    return ok;
+}
+
+/* Send a store of text, len bytes, sealed by the client's cipher */
+static int perform_sealed(kv_client *client, const char *url, const char *text, size_t len) {
+    size_t sealed_len;
+    const char *sealed = kv_crypt_seal(client, text, len, &sealed_len);
+    if(!sealed) {
+        client->status = 0;
+        return 0;
+    }
+    return kv_perform_parts(client, "POST", url, "{\"data\":{\"encrypted\":true,\"payload\":\"",
+                            sealed, sealed_len, "\"}}", 1, 0);
+}
+
+int kv_store(kv_client *client, struct json_object *data) {
+    /* As JSON, serialized into data's own buffer, which json-c keeps and
+     * reuses for the next store of the same object */
+    const char *url = kv_client_endpoint(client, KV_ENDPOINT_STORE);
+    int ok;
+    if(client->crypt) {
+        size_t len;
+        const char *json = kv_serialize(client, data, JSON_C_TO_STRING_PLAIN, &len);
+        ok = store_result(client, perform_sealed(client, url, json, len));
+    } else {
+        ok = store_result(client, kv_perform_document(client, "POST", url, "data", data,
+                                                      JSON_C_TO_STRING_PLAIN, 1, 0));
+    }
+    if(ok) {
+        kv_snapshot_save(client, client->etag, client->version, data);
+
+        /* The caller may keep modifying data; cache a copy of what was sent */
+        struct json_object *copy = NULL;
+        if(client->cache && json_object_deep_copy(data, &copy, NULL) == 0) {
+            kv_cache_put(client, client->etag, client->version, copy);
+        } else {
+            kv_cache_drop(client);
+        }
+        json_object_put(copy);
+    }
+    return ok;
+}
+
+int kv_store_raw(kv_client *client, const char *json, size_t len) {
+    const char *url = kv_client_endpoint(client, KV_ENDPOINT_STORE);
+    int ok = store_result(client, client->crypt ? perform_sealed(client, url, json, len) :
+                                  kv_perform_parts(client, "POST", url, "{\"data\":", json, len,
+                                                   "}", 1, 0));
+    /* The text is not parsed, so there is nothing to cache */
+    if(ok) {
+        kv_snapshot_save_text(client, client->etag, client->version, json, len);
+        kv_cache_drop(client);
+    }
+    return ok;
+}
+
+int kv_store_string(kv_client *client, const char *json_data) {
+    struct json_object *data = json_tokener_parse(json_data);
+    if(!data) {
+        snprintf(client->error, sizeof(client->error), "Invalid JSON data");
+        return 0;
+    }
+
+    int ok = kv_store(client, data);
+    json_object_put(data);
+    return ok;
+}
+
+struct json_object *kv_parse_response(kv_client *client) {
+    struct json_object *parsed_json = kv_response_take(&client->response);
+    struct json_object *version_obj;
+
+    if(parsed_json && json_object_object_get_ex(parsed_json, "version", &version_obj)) {
+        client->version = (long)json_object_get_int64(version_obj);
+    }
+    return parsed_json;
+}
+
+/* Parse the last response and return a new reference to its "data" member */
+static struct json_object *response_data(kv_client *client) {
+    struct json_object *data = NULL;
+    struct json_object *parsed_json = kv_parse_response(client);
+    if(parsed_json) {
+        struct json_object *data_obj;
+        if(json_object_object_get_ex(parsed_json, "data", &data_obj)) {
+            data = json_object_get(data_obj);
+        }
+        json_object_put(parsed_json);
+    }
+    return data;
+}
+
+struct json_object *kv_retrieve(kv_client *client) {
+    const char *url = kv_client_endpoint(client, KV_ENDPOINT_RETRIEVE);
+
+    struct kv_cache_entry *entry = kv_cache_find(client);
+    client->cache_outcome = client->cache ? KV_CACHE_MISS : KV_CACHE_OFF;
+    if(entry && kv_cache_fresh(client, entry)) {
+        client->status = 304;
+        client->error[0] = 0;
+        return kv_cache_hit(client, entry, KV_CACHE_FRESH);
+    }
+    /* Without an entry, a snapshot left by an earlier run validates the
+     * same way */
+    struct kv_snapshot *snapshot = entry ? NULL : kv_snapshot_open_client(client);
+    if(entry) client->if_none_match = kv_cache_etag(entry);
+    else if(snapshot && kv_snapshot_etag(snapshot)[0]) client->if_none_match = kv_snapshot_etag(snapshot);
+    if(client->crypt && !kv_crypt_begin(client)) {
+        client->if_none_match = NULL;
+        client->status = 0;
+        return NULL;
+    }
+
+    int ok = kv_perform(client, "GET", url, NULL, 1, 0);
+    client->response.crypt = NULL;
+    if(ok && client->status == 304 && (entry || snapshot)) {
+        kv_snapshot_confirm(client);
+        if(entry) return kv_cache_hit(client, entry, KV_CACHE_REVALIDATED);
+
+        struct json_object *data = kv_snapshot_parse(snapshot);
+        if(data) {
+            client->version = kv_snapshot_version(snapshot);
+            client->cache_outcome = KV_CACHE_REVALIDATED;
+            kv_cache_put(client, kv_snapshot_etag(snapshot), client->version, data);
+        } else {
+            snprintf(client->error, sizeof(client->error), "Invalid snapshot");
+        }
+        kv_snapshot_close(snapshot);
+        return data;
+    }
+    kv_snapshot_close(snapshot);
+    if(!ok) return NULL;
+    if(client->status < 200 || client->status >= 300) {
+        if(client->status == 404) {
+            kv_cache_drop(client);
+            kv_snapshot_drop(client);
+        }
+        snprintf(client->error, sizeof(client->error), "HTTP %ld", client->status);
+        return NULL;
+    }
+
+    struct json_object *data = client->crypt ? kv_crypt_data(client) : response_data(client);
+    kv_cache_put(client, client->etag, client->version, data);
+    kv_snapshot_save(client, client->etag, client->version, data);
+    return data;
+}
+
+const char *kv_retrieve_raw(kv_client *client, size_t *len) {
+    const char *url = kv_client_endpoint(client, KV_ENDPOINT_RETRIEVE);
+
+    if(client->crypt && !kv_crypt_begin(client)) {
+        client->status = 0;
+        return NULL;
+    }
+    client->response.raw = 1;
+    int ok = kv_perform(client, "GET", url, NULL, 1, 0);
+    client->response.raw = 0;
+    client->response.crypt = NULL;
+    if(!ok) return NULL;
+    if(client->status < 200 || client->status >= 300) {
+        if(client->status == 404) {
+            kv_cache_drop(client);
+            kv_snapshot_drop(client);
+        }
+        snprintf(client->error, sizeof(client->error), "HTTP %ld", client->status);
+        return NULL;
+    }
+
+    if(client->crypt) return kv_crypt_text(client, len);
+
+    /* Only the envelope's two members are looked at */
+    const char *body = kv_response_body(&client->response);
+    size_t size = client->response.body.size, version_len;
+    const char *version = kv_json_member(body, size, "version", &version_len);
+    if(version) client->version = strtol(version, NULL, 10);
+
+    const char *data = kv_json_member(body, size, "data", len);
+    if(!data) snprintf(client->error, sizeof(client->error), "No data in response");
+    else kv_snapshot_save_text(client, client->etag, client->version, data, *len);
+    return data;
+}
+
+struct json_object *kv_get_json(kv_client *client, const char *url, long timeout) {
+    if(!kv_perform(client, "GET", url, NULL, 0, timeout)) return NULL;
+    if(client->status < 200 || client->status >= 300) {
+        snprintf(client->error, sizeof(client->error), "HTTP %ld", client->status);
+        return NULL;
+    }
+
+    return kv_response_take(&client->response);
+}
@@ -0,0 +1,321 @@
+/*
+ * libkv allocator plumbing: the process-wide allocator shared with
+ * libcurl, the fixed-capacity block pool, and kv_arena.
+ *
+ * The pool is one malloc'd slab carved into size classes, each with its
+ * own free list threaded through the free blocks. A pointer's class is
+ * found from the slab range it falls into, so blocks carry no header.
+ * libcurl may allocate from its resolver thread, so pool operations take
+ * a spinlock.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <curl/curl.h>
+
+#include "kv_alloc.h"
+#include "kv_internal.h"
+
+#define KV_ALIGN 16
+#define KV_ALIGN_UP(n) (((n) + KV_ALIGN - 1) & ~(size_t)(KV_ALIGN - 1))
+
+static const struct kv_pool_class default_classes[] = {
+    {64, 256}, {256, 128}, {1024, 64}, {4096, 32}, {16384, 8}, {65536, 3}
+};
+
+struct pool_class {
+    size_t size;
+    size_t count;
+    char *base;
+    void *free_list;
+};
+
+static struct {
+    char *slab;
+    size_t slab_size;
+    struct pool_class classes[KV_POOL_MAX_CLASSES];
+    int nclasses;
+    size_t in_use;
+    size_t peak;
+    size_t fallbacks;
+    atomic_flag lock;
+} pool = { .lock = ATOMIC_FLAG_INIT };
+
+static struct kv_allocator allocator = { malloc, free, realloc, strdup, calloc };
+
+/* Allocations made by libkv and libcurl on this thread (kv_metrics) */
+static _Thread_local unsigned long thread_allocations;
+
+void *kv_malloc(size_t size) {
+    thread_allocations++;
+    return allocator.malloc_fn(size);
+}
+
+void kv_free(void *ptr) {
+    allocator.free_fn(ptr);
+}
+
+void *kv_realloc(void *ptr, size_t size) {
+    thread_allocations++;
+    return allocator.realloc_fn(ptr, size);
+}
+
+void *kv_calloc(size_t nmemb, size_t size) {
+    thread_allocations++;
+    return allocator.calloc_fn(nmemb, size);
+}
+
+char *kv_strdup(const char *str) {
+    thread_allocations++;
+    return allocator.strdup_fn(str);
+}
+
+unsigned long kv_alloc_count(void) {
+    return thread_allocations;
+}
+
+/* libcurl allocates through these too, so they are counted alike */
+static void *curl_malloc(size_t size) {
+    return kv_malloc(size);
+}
+
+static void *curl_realloc(void *ptr, size_t size) {
+    return kv_realloc(ptr, size);
+}
+
+static void *curl_calloc(size_t nmemb, size_t size) {
+    return kv_calloc(nmemb, size);
+}
+
+static char *curl_strdup(const char *str) {
+    return kv_strdup(str);
+}
+
+static int install(const struct kv_allocator *with) {
+    if(curl_global_init_mem(CURL_GLOBAL_DEFAULT, curl_malloc, kv_free,
+                            curl_realloc, curl_strdup, curl_calloc) != CURLE_OK) {
+        return 0;
+    }
+    allocator = *with;
+    return 1;
+}
+
+int kv_alloc_init(void) {
+    static const struct kv_allocator system_allocator = { malloc, free, realloc, strdup, calloc };
+    return install(&system_allocator);
+}
+
+int kv_global_init_allocator(const struct kv_allocator *with) {
+    if(!with || !with->malloc_fn || !with->free_fn || !with->realloc_fn ||
+       !with->strdup_fn || !with->calloc_fn) return 0;
+    return install(with);
+}
+
+/* ---- pool ---- */
+
+static void pool_lock(void) {
+    while(atomic_flag_test_and_set_explicit(&pool.lock, memory_order_acquire)) {
+        /* spin; critical sections are a few instructions */
+    }
+}
+
+static void pool_unlock(void) {
+    atomic_flag_clear_explicit(&pool.lock, memory_order_release);
+}
+
+/* The class whose slab range contains ptr, or NULL for a malloc'd pointer */
+static struct pool_class *pool_owner(const void *ptr) {
+    const char *p = (const char *)ptr;
+    if(!p || p < pool.slab || p >= pool.slab + pool.slab_size) return NULL;
+
+    for(int i = 0; i < pool.nclasses; i++) {
+        struct pool_class *cls = &pool.classes[i];
+        if(p >= cls->base && p < cls->base + cls->size * cls->count) return cls;
+    }
+    return NULL;
+}
+
+static void *pool_malloc(size_t size) {
+    pool_lock();
+    for(int i = 0; i < pool.nclasses; i++) {
+        struct pool_class *cls = &pool.classes[i];
+        if(cls->size < size || !cls->free_list) continue;
+
+        void *block = cls->free_list;
+        cls->free_list = *(void **)block;
+        if(++pool.in_use > pool.peak) pool.peak = pool.in_use;
+        pool_unlock();
+        return block;
+    }
+    pool.fallbacks++;
+    pool_unlock();
+    return malloc(size);
+}
+
+static void pool_free(void *ptr) {
+    struct pool_class *cls = pool_owner(ptr);
+    if(!cls) {
+        free(ptr);
+        return;
+    }
+
+    pool_lock();
+    *(void **)ptr = cls->free_list;
+    cls->free_list = ptr;
+    pool.in_use--;
+    pool_unlock();
+}
+
+static void *pool_realloc(void *ptr, size_t size) {
+    if(!ptr) return pool_malloc(size);
+    if(size == 0) {
+        pool_free(ptr);
+        return NULL;
+    }
+
+    struct pool_class *cls = pool_owner(ptr);
+    if(!cls) return realloc(ptr, size);
+    if(size <= cls->size) return ptr;
+
+    void *moved = pool_malloc(size);
+    if(!moved) return NULL;
+    memcpy(moved, ptr, cls->size);
+    pool_free(ptr);
+    return moved;
+}
+
+static void *pool_calloc(size_t nmemb, size_t size) {
+    if(size && nmemb > (size_t)-1 / size) return NULL;
+
+    void *ptr = pool_malloc(nmemb * size);
+    if(ptr) memset(ptr, 0, nmemb * size);
+    return ptr;
+}
+
+static char *pool_strdup(const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = pool_malloc(len);
+    if(copy) memcpy(copy, str, len);
+    return copy;
+}
+
+int kv_global_init_pool(const struct kv_pool_class *classes, int nclasses) {
+    static const struct kv_allocator pool_allocator = {
+        pool_malloc, pool_free, pool_realloc, pool_strdup, pool_calloc
+    };
+
+    if(!classes) {
+        classes = default_classes;
+        nclasses = (int)(sizeof(default_classes) / sizeof(default_classes[0]));
+    }
+    if(pool.slab || nclasses < 1 || nclasses > KV_POOL_MAX_CLASSES) return 0;
+
+    size_t total = 0;
+    for(int i = 0; i < nclasses; i++) {
+        if(classes[i].size < sizeof(void *) || classes[i].count == 0) return 0;
+        if(i > 0 && classes[i].size <= classes[i - 1].size) return 0;
+        total += KV_ALIGN_UP(classes[i].size) * classes[i].count;
+    }
+
+    pool.slab = malloc(total);
+    if(!pool.slab) return 0;
+    pool.slab_size = total;
+    pool.nclasses = nclasses;
+    pool.in_use = pool.peak = pool.fallbacks = 0;
+
+    /* Carve the slab and thread each class's free list through it */
+    char *base = pool.slab;
+    for(int i = 0; i < nclasses; i++) {
+        struct pool_class *cls = &pool.classes[i];
+        cls->size = KV_ALIGN_UP(classes[i].size);
+        cls->count = classes[i].count;
+        cls->base = base;
+        cls->free_list = NULL;
+        for(size_t j = cls->count; j > 0; j--) {
+            void *block = base + (j - 1) * cls->size;
+            *(void **)block = cls->free_list;
+            cls->free_list = block;
+        }
+        base += cls->size * cls->count;
+    }
+
+    if(!install(&pool_allocator)) {
+        kv_alloc_cleanup();
+        return 0;
+    }
+    return 1;
+}
+
+void kv_pool_get_stats(struct kv_pool_stats *stats) {
+    pool_lock();
+    stats->capacity = pool.slab_size;
+    stats->in_use = pool.in_use;
+    stats->peak = pool.peak;
+    stats->fallbacks = pool.fallbacks;
+    pool_unlock();
+}
+
+void kv_alloc_cleanup(void) {
+    static const struct kv_allocator system_allocator = { malloc, free, realloc, strdup, calloc };
+
+    free(pool.slab);
+    pool.slab = NULL;
+    pool.slab_size = 0;
+    pool.nclasses = 0;
+    pool.in_use = pool.peak = pool.fallbacks = 0;
+    allocator = system_allocator;
+}
+
+/* ---- arena ---- */
+
+struct kv_arena {
+    size_t capacity;
+    size_t used;
+    char *data;
+};
+
+kv_arena *kv_arena_new(size_t capacity) {
+    kv_arena *arena = kv_malloc(sizeof(*arena));
+    if(!arena) return NULL;
+
+    arena->data = kv_malloc(capacity ? capacity : 1);
+    if(!arena->data) {
+        kv_free(arena);
+        return NULL;
+    }
+    arena->capacity = capacity;
+    arena->used = 0;
+    return arena;
+}
+
+void kv_arena_free(kv_arena *arena) {
+    if(!arena) return;
+    kv_free(arena->data);
+    kv_free(arena);
+}
+
+void *kv_arena_alloc(kv_arena *arena, size_t size) {
+    size_t offset = KV_ALIGN_UP(arena->used);
+    if(offset > arena->capacity || size > arena->capacity - offset) return NULL;
+
+    arena->used = offset + size;
+    return arena->data + offset;
+}
+
+char *kv_arena_strdup(kv_arena *arena, const char *str) {
+    if(!str) return NULL;
+
+    size_t len = strlen(str) + 1;
+    char *copy = kv_arena_alloc(arena, len);
+    if(copy) memcpy(copy, str, len);
+    return copy;
+}
+
+void kv_arena_reset(kv_arena *arena) {
+    arena->used = 0;
+}
+
+size_t kv_arena_used(const kv_arena *arena) {
+    return arena->used;
+}
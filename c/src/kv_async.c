@@ -0,0 +1,493 @@
+/*
+ * libkv async engine: curl_multi with HTTP/2 multiplexing.
+ *
+ * On Linux the engine drives libcurl through the multi_socket API: libcurl
+ * reports the sockets it cares about via CURLMOPT_SOCKETFUNCTION and its
+ * next deadline via CURLMOPT_TIMERFUNCTION, and both are mirrored into a
+ * private epoll set (sockets + a timerfd). That epoll descriptor is what
+ * kv_async_fd hands out, so an application can nest it in its own event
+ * loop. Elsewhere the engine falls back to curl_multi_poll and has no fd.
+ *
+ * Finished requests keep their easy handle, response buffer and tokener
+ * on a free list, so steady-state submits do not re-create them.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv_async.h"
+#include "kv_codec.h"
+#include "kv_internal.h"
+
+#ifdef __linux__
+#define KV_ASYNC_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+#define KV_ASYNC_MAX_EVENTS 16
+
+struct kv_async_request {
+    CURL *curl;
+    struct curl_slist *headers;
+    struct kv_response response;
+    struct kv_buffer body;          /* a store's request body */
+    kv_async_callback callback;
+    void *userdata;
+    char *snapshot_dir;             /* a retrieve's snapshot to save, or NULL */
+    char *snapshot_token;
+    char error[CURL_ERROR_SIZE];
+    struct kv_async_request *prev;  /* active list links; next doubles as */
+    struct kv_async_request *next;  /* the free list link */
+};
+
+struct kv_async {
+    CURLM *multi;
+    int pending;
+    int keep_body;
+    int parse;
+    struct kv_async_request *active;
+    struct kv_async_request *free_list;
+#ifdef KV_ASYNC_EPOLL
+    int epoll_fd;
+    int timer_fd;
+#endif
+};
+
+#ifdef KV_ASYNC_EPOLL
+/* CURLMOPT_SOCKETFUNCTION: mirror libcurl's interest set into epoll */
+static int socket_callback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp) {
+    kv_async *async = (kv_async *)userp;
+    struct epoll_event ev = {0};
+    (void)easy;
+
+    if(what == CURL_POLL_REMOVE) {
+        epoll_ctl(async->epoll_fd, EPOLL_CTL_DEL, s, NULL);
+        curl_multi_assign(async->multi, s, NULL);
+        return 0;
+    }
+
+    ev.data.fd = s;
+    if(what & CURL_POLL_IN) ev.events |= EPOLLIN;
+    if(what & CURL_POLL_OUT) ev.events |= EPOLLOUT;
+
+    if(socketp) {
+        epoll_ctl(async->epoll_fd, EPOLL_CTL_MOD, s, &ev);
+    } else {
+        epoll_ctl(async->epoll_fd, EPOLL_CTL_ADD, s, &ev);
+        /* Any non-NULL marker tells us next time that s is already added */
+        curl_multi_assign(async->multi, s, async);
+    }
+    return 0;
+}
+
+/* CURLMOPT_TIMERFUNCTION: arm the timerfd for libcurl's next deadline */
+static int timer_callback(CURLM *multi, long timeout_ms, void *userp) {
+    kv_async *async = (kv_async *)userp;
+    struct itimerspec its = {0};
+    (void)multi;
+
+    if(timeout_ms > 0) {
+        its.it_value.tv_sec = timeout_ms / 1000;
+        its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    } else if(timeout_ms == 0) {
+        /* "As soon as possible"; an all-zero value would disarm the timer */
+        its.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(async->timer_fd, 0, &its, NULL);
+    return 0;
+}
+#endif
+
+kv_async *kv_async_new(void) {
+    kv_async *async = kv_calloc(1, sizeof(*async));
+    if(!async) return NULL;
+
+#ifdef KV_ASYNC_EPOLL
+    async->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    async->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(async->epoll_fd < 0 || async->timer_fd < 0) {
+        if(async->epoll_fd >= 0) close(async->epoll_fd);
+        if(async->timer_fd >= 0) close(async->timer_fd);
+        kv_free(async);
+        return NULL;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.fd = async->timer_fd;
+    epoll_ctl(async->epoll_fd, EPOLL_CTL_ADD, async->timer_fd, &ev);
+#endif
+
+    async->keep_body = 1;
+    async->parse = 1;
+    async->multi = curl_multi_init();
+    if(!async->multi) {
+        kv_async_free(async);
+        return NULL;
+    }
+
+    curl_multi_setopt(async->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#ifdef KV_ASYNC_EPOLL
+    curl_multi_setopt(async->multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+    curl_multi_setopt(async->multi, CURLMOPT_SOCKETDATA, async);
+    curl_multi_setopt(async->multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+    curl_multi_setopt(async->multi, CURLMOPT_TIMERDATA, async);
+#endif
+
+    return async;
+}
+
+static void request_free(struct kv_async_request *req) {
+    if(req->curl) curl_easy_cleanup(req->curl);
+    kv_free(req->snapshot_dir);
+    kv_free(req->snapshot_token);
+    curl_slist_free_all(req->headers);
+    kv_response_free(&req->response);
+    kv_buffer_free(&req->body);
+    kv_free(req);
+}
+
+void kv_async_free(kv_async *async) {
+    if(!async) return;
+
+    /* Abandon in-flight transfers */
+    while(async->active) {
+        struct kv_async_request *req = async->active;
+        async->active = req->next;
+        curl_multi_remove_handle(async->multi, req->curl);
+        request_free(req);
+    }
+    if(async->multi) curl_multi_cleanup(async->multi);
+
+    while(async->free_list) {
+        struct kv_async_request *req = async->free_list;
+        async->free_list = req->next;
+        request_free(req);
+    }
+
+#ifdef KV_ASYNC_EPOLL
+    close(async->epoll_fd);
+    close(async->timer_fd);
+#endif
+    kv_free(async);
+}
+
+/* Take a request from the free list (or create one) with a freshly reset
+ * handle carrying the options every request shares */
+static struct kv_async_request *request_acquire(kv_async *async) {
+    struct kv_async_request *req = async->free_list;
+    if(req) {
+        async->free_list = req->next;
+        curl_easy_reset(req->curl);
+    } else {
+        req = kv_calloc(1, sizeof(*req));
+        if(!req) return NULL;
+        req->curl = curl_easy_init();
+        if(!req->curl) {
+            kv_free(req);
+            return NULL;
+        }
+    }
+
+    req->prev = NULL;
+    req->next = NULL;
+    req->error[0] = 0;
+    kv_response_reset(&req->response);
+    req->response.keep_body = async->keep_body;
+    req->response.raw = !async->parse;
+
+    curl_easy_setopt(req->curl, CURLOPT_PRIVATE, (char *)req);
+    curl_easy_setopt(req->curl, CURLOPT_WRITEFUNCTION, kv_response_write);
+    curl_easy_setopt(req->curl, CURLOPT_WRITEDATA, (void *)&req->response);
+    curl_easy_setopt(req->curl, CURLOPT_ERRORBUFFER, req->error);
+    curl_easy_setopt(req->curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(req->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(req->curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+
+    return req;
+}
+
+static void request_set_url(struct kv_async_request *req, const char *url) {
+    curl_easy_setopt(req->curl, CURLOPT_URL, url);
+
+    /* HTTP/2 is only negotiated over TLS. There, wait for an existing
+     * connection to the host so the request can be multiplexed onto it
+     * instead of racing to open a second one; for plain HTTP waiting would
+     * just serialize requests behind each other. */
+    curl_easy_setopt(req->curl, CURLOPT_PIPEWAIT, strncmp(url, "https://", 8) == 0 ? 1L : 0L);
+}
+
+/* Take req off the active list; a no-op once it is off */
+static void request_unlink(kv_async *async, struct kv_async_request *req) {
+    if(req->prev) req->prev->next = req->next;
+    else if(async->active == req) async->active = req->next;
+    if(req->next) req->next->prev = req->prev;
+    req->prev = NULL;
+    req->next = NULL;
+}
+
+static void request_release(kv_async *async, struct kv_async_request *req) {
+    request_unlink(async, req);
+
+    curl_slist_free_all(req->headers);
+    req->headers = NULL;
+    kv_free(req->snapshot_dir);
+    kv_free(req->snapshot_token);
+    req->snapshot_dir = req->snapshot_token = NULL;
+    req->callback = NULL;
+    req->userdata = NULL;
+    req->next = async->free_list;
+    async->free_list = req;
+}
+
+static int request_submit(kv_async *async, struct kv_async_request *req,
+                          kv_async_callback callback, void *userdata) {
+    req->callback = callback;
+    req->userdata = userdata;
+
+    if(curl_multi_add_handle(async->multi, req->curl) != CURLM_OK) {
+        request_release(async, req);
+        return 0;
+    }
+
+    req->next = async->active;
+    if(async->active) async->active->prev = req;
+    async->active = req;
+    async->pending++;
+    return 1;
+}
+
+static int submit_get(kv_async *async, const char *url, long timeout, int raw,
+                      const char *accept, kv_async_callback callback, void *userdata) {
+    struct kv_async_request *req = request_acquire(async);
+    if(!req) return 0;
+
+    if(raw) req->response.raw = 1;
+    if(accept) {
+        char accept_header[128];
+        snprintf(accept_header, sizeof(accept_header), "Accept: %s", accept);
+        req->headers = curl_slist_append(NULL, accept_header);
+        curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, req->headers);
+    }
+    request_set_url(req, url);
+    curl_easy_setopt(req->curl, CURLOPT_TIMEOUT, timeout);
+    curl_easy_setopt(req->curl, CURLOPT_CONNECTTIMEOUT_MS, 0L);     /* may be recycled from a retrieve */
+
+    return request_submit(async, req, callback, userdata);
+}
+
+int kv_async_get(kv_async *async, const char *url, long timeout,
+                 kv_async_callback callback, void *userdata) {
+    return submit_get(async, url, timeout, 0, NULL, callback, userdata);
+}
+
+int kv_async_get_raw(kv_async *async, const char *url, long timeout, const char *accept,
+                     kv_async_callback callback, void *userdata) {
+    return submit_get(async, url, timeout, 1, accept, callback, userdata);
+}
+
+int kv_async_retrieve(kv_async *async, const kv_client *client,
+                      kv_async_callback callback, void *userdata) {
+    if(!client->token) return 0;
+
+    struct kv_async_request *req = request_acquire(async);
+    if(!req) return 0;
+
+    req->headers = kv_request_headers(client, 0, 1);
+    request_set_url(req, kv_client_endpoint(client, KV_ENDPOINT_RETRIEVE));
+    kv_retry_timeouts(client, req->curl);
+    curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, req->headers);
+
+    /* The client may be gone by the time the document arrives */
+    if(client->snapshot_dir) {
+        req->snapshot_dir = kv_strdup(client->snapshot_dir);
+        req->snapshot_token = kv_strdup(client->token);
+    }
+
+    return request_submit(async, req, callback, userdata);
+}
+
+int kv_async_store(kv_async *async, const kv_client *client, struct json_object *data,
+                   kv_async_callback callback, void *userdata) {
+    /* An encrypting client's retrieves would reject the plaintext */
+    if(!client->token || client->crypt) return 0;
+
+    struct kv_async_request *req = request_acquire(async);
+    if(!req) return 0;
+
+    /* {"data": ...} written around the document's text in one buffer the
+     * request owns, so data may go before the transfer does */
+    size_t len;
+    const char *json = json_object_to_json_string_length(data, JSON_C_TO_STRING_PLAIN, &len);
+    struct kv_buffer *body = &req->body;
+    kv_buffer_reset(body);
+    if(!kv_buffer_reserve(body, len + 9)) {
+        request_release(async, req);
+        return 0;
+    }
+    kv_buffer_append(body, "{\"data\":", 8);
+    kv_buffer_append(body, json, len);
+    kv_buffer_append(body, "}", 1);
+
+    req->headers = kv_request_headers(client, 1, 1);
+    request_set_url(req, kv_client_endpoint(client, KV_ENDPOINT_STORE));
+    kv_retry_timeouts(client, req->curl);
+    curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, req->headers);
+    curl_easy_setopt(req->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)body->size);
+    curl_easy_setopt(req->curl, CURLOPT_POSTFIELDS, body->data);
+
+    return request_submit(async, req, callback, userdata);
+}
+
+/* Keep the snapshot of a retrieve that succeeded, from the parsed data if
+ * there is one and from the raw text otherwise */
+static void save_snapshot(struct kv_async_request *req, const struct kv_async_result *result) {
+    if(!req->snapshot_dir || result->status < 200 || result->status >= 300) return;
+
+    long version = 0;
+    size_t len;
+    if(result->data) {
+        struct json_object *version_obj;
+        if(json_object_object_get_ex(result->json, "version", &version_obj)) {
+            version = (long)json_object_get_int64(version_obj);
+        }
+        const char *text = json_object_to_json_string_length(result->data, JSON_C_TO_STRING_PLAIN, &len);
+        kv_snapshot_write(req->snapshot_dir, req->snapshot_token, NULL, version, text, len);
+        return;
+    }
+
+    const char *member = kv_json_member(result->body, result->body_size, "version", &len);
+    if(member) version = strtol(member, NULL, 10);
+    member = kv_json_member(result->body, result->body_size, "data", &len);
+    if(member) kv_snapshot_write(req->snapshot_dir, req->snapshot_token, NULL, version, member, len);
+}
+
+/* Hand every finished transfer to its callback and recycle the request */
+static void dispatch_completed(kv_async *async) {
+    CURLMsg *msg;
+    int queued;
+
+    while((msg = curl_multi_info_read(async->multi, &queued))) {
+        if(msg->msg != CURLMSG_DONE) continue;
+
+        CURL *easy = msg->easy_handle;
+        CURLcode res = msg->data.result;
+        struct kv_async_request *req = NULL;
+        curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **)&req);
+        curl_multi_remove_handle(async->multi, easy);
+        request_unlink(async, req);     /* out of reach of kv_async_cancel */
+        async->pending--;
+
+        struct kv_async_result result = {0};
+        result.body = kv_response_body(&req->response);
+        result.body_size = req->response.body.size;
+
+        if(res == CURLE_OK) {
+            curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &result.status);
+            if(result.status < 200 || result.status >= 300) {
+                snprintf(req->error, sizeof(req->error), "HTTP %ld", result.status);
+            }
+        } else if(req->error[0] == 0) {
+            snprintf(req->error, sizeof(req->error), "%s", curl_easy_strerror(res));
+        }
+        result.error = req->error;
+
+        result.json = kv_response_take(&req->response);
+        if(result.json) json_object_object_get_ex(result.json, "data", &result.data);
+
+        save_snapshot(req, &result);
+        if(req->callback) req->callback(&result, req->userdata);
+
+        json_object_put(result.json);
+        request_release(async, req);
+    }
+}
+
+int kv_async_cancel(kv_async *async, void *userdata) {
+    int cancelled = 0;
+    struct kv_async_request *next;
+
+    for(struct kv_async_request *req = async->active; req; req = next) {
+        next = req->next;
+        if(req->userdata != userdata) continue;
+
+        /* Also drops a completion of it that is still to be dispatched */
+        curl_multi_remove_handle(async->multi, req->curl);
+        request_release(async, req);
+        async->pending--;
+        cancelled++;
+    }
+    return cancelled;
+}
+
+int kv_async_poll(kv_async *async, int timeout_ms) {
+    int running;
+
+    if(async->pending == 0) return 0;
+
+#ifdef KV_ASYNC_EPOLL
+    struct epoll_event events[KV_ASYNC_MAX_EVENTS];
+    int n = epoll_wait(async->epoll_fd, events, KV_ASYNC_MAX_EVENTS, timeout_ms);
+    /* A signal only cuts the wait short; the transfers carry on */
+    if(n < 0) return errno == EINTR ? async->pending : -1;
+
+    for(int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+
+        if(fd == async->timer_fd) {
+            unsigned long long expirations;
+            if(read(async->timer_fd, &expirations, sizeof(expirations)) < 0) {
+                /* Spurious wakeup; libcurl still gets its timeout call */
+            }
+            curl_multi_socket_action(async->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+        } else {
+            int mask = 0;
+            if(events[i].events & EPOLLIN) mask |= CURL_CSELECT_IN;
+            if(events[i].events & EPOLLOUT) mask |= CURL_CSELECT_OUT;
+            if(events[i].events & (EPOLLERR | EPOLLHUP)) mask |= CURL_CSELECT_ERR;
+            curl_multi_socket_action(async->multi, fd, mask, &running);
+        }
+    }
+#else
+    if(curl_multi_perform(async->multi, &running) != CURLM_OK) return -1;
+    if(running > 0 && timeout_ms > 0) {
+        if(curl_multi_poll(async->multi, NULL, 0, timeout_ms, NULL) != CURLM_OK) return -1;
+        if(curl_multi_perform(async->multi, &running) != CURLM_OK) return -1;
+    }
+#endif
+
+    dispatch_completed(async);
+    return async->pending;
+}
+
+int kv_async_run(kv_async *async) {
+    while(async->pending > 0) {
+        if(kv_async_poll(async, 1000) < 0) return 0;
+    }
+    return 1;
+}
+
+void kv_async_set_keep_body(kv_async *async, int keep) {
+    async->keep_body = keep ? 1 : 0;
+}
+
+void kv_async_set_parse(kv_async *async, int parse) {
+    async->parse = parse ? 1 : 0;
+}
+
+int kv_async_pending(const kv_async *async) {
+    return async->pending;
+}
+
+int kv_async_fd(const kv_async *async) {
+#ifdef KV_ASYNC_EPOLL
+    return async->epoll_fd;
+#else
+    (void)async;
+    return -1;
+#endif
+}
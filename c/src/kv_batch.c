@@ -0,0 +1,289 @@
+/*
+ * libkv batch operations and the coalescing write queue.
+ *
+ * A kv_batch keeps each operation as the JSON object that goes on the wire
+ * plus its callback, so executing is one serialization of the operations
+ * array. Results come back in request order and are matched by index.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv_batch.h"
+#include "kv_internal.h"
+
+struct kv_batch_op {
+    struct json_object *op;      /* {"action": ..., "token": ..., ...} */
+    kv_batch_callback callback;
+    void *userdata;
+};
+
+struct kv_batch {
+    struct kv_batch_op ops[KV_BATCH_MAX];
+    int count;
+};
+
+struct kv_queue {
+    kv_client *client;
+    kv_batch *batch;
+    int max_ops;
+    long linger_ms;
+    long long oldest_ms;         /* when the oldest buffered write arrived */
+};
+
+kv_batch *kv_batch_new(void) {
+    return kv_calloc(1, sizeof(kv_batch));
+}
+
+void kv_batch_free(kv_batch *batch) {
+    if(!batch) return;
+    kv_batch_clear(batch);
+    kv_free(batch);
+}
+
+void kv_batch_clear(kv_batch *batch) {
+    for(int i = 0; i < batch->count; i++) {
+        json_object_put(batch->ops[i].op);
+    }
+    memset(batch->ops, 0, sizeof(batch->ops[0]) * batch->count);
+    batch->count = 0;
+}
+
+int kv_batch_count(const kv_batch *batch) {
+    return batch->count;
+}
+
+/* Append an operation skeleton; returns its JSON object or NULL if full */
+static struct json_object *batch_add(kv_batch *batch, const char *action, const char *token,
+                                     kv_batch_callback callback, void *userdata) {
+    if(batch->count >= KV_BATCH_MAX || !token) return NULL;
+
+    struct json_object *op = json_object_new_object();
+    json_object_object_add(op, "action", json_object_new_string(action));
+    json_object_object_add(op, "token", json_object_new_string(token));
+
+    struct kv_batch_op *slot = &batch->ops[batch->count++];
+    slot->op = op;
+    slot->callback = callback;
+    slot->userdata = userdata;
+    return op;
+}
+
+int kv_batch_store(kv_batch *batch, const char *token, struct json_object *data,
+                   long ttl, kv_batch_callback callback, void *userdata) {
+    struct json_object *op = batch_add(batch, "store", token, callback, userdata);
+    if(!op) return 0;
+
+    json_object_object_add(op, "data", json_object_get(data));
+    if(ttl > 0) json_object_object_add(op, "ttl", json_object_new_int64(ttl));
+    return 1;
+}
+
+int kv_batch_retrieve(kv_batch *batch, const char *token,
+                      kv_batch_callback callback, void *userdata) {
+    return batch_add(batch, "retrieve", token, callback, userdata) != NULL;
+}
+
+int kv_batch_delete(kv_batch *batch, const char *token,
+                    kv_batch_callback callback, void *userdata) {
+    return batch_add(batch, "delete", token, callback, userdata) != NULL;
+}
+
+int kv_batch_patch(kv_batch *batch, const char *token, long version,
+                   struct json_object *set, struct json_object *remove,
+                   kv_batch_callback callback, void *userdata) {
+    struct json_object *op = batch_add(batch, "patch", token, callback, userdata);
+    if(!op) return 0;
+
+    struct json_object *patch = json_object_new_object();
+    if(set) json_object_object_add(patch, "set", json_object_get(set));
+    if(remove) json_object_object_add(patch, "remove", json_object_get(remove));
+    json_object_object_add(op, "patch", patch);
+    json_object_object_add(op, "version", json_object_new_int64(version));
+    return 1;
+}
+
+static const char *op_string(struct json_object *op, const char *key) {
+    struct json_object *value;
+    if(!json_object_object_get_ex(op, key, &value)) return "";
+    return json_object_get_string(value);
+}
+
+/* Report the same failure to every operation */
+static void fail_all(kv_batch *batch, const char *error) {
+    for(int i = 0; i < batch->count; i++) {
+        struct kv_batch_op *slot = &batch->ops[i];
+        if(!slot->callback) continue;
+
+        struct kv_batch_result result = {0};
+        result.index = i;
+        result.action = op_string(slot->op, "action");
+        result.token = op_string(slot->op, "token");
+        result.error = error;
+        slot->callback(&result, slot->userdata);
+    }
+}
+
+int kv_batch_execute(kv_batch *batch, kv_client *client) {
+    if(batch->count == 0) return 0;
+
+    /* Build request: {"operations": [...]} */
+    struct json_object *request = json_object_new_object();
+    struct json_object *operations = json_object_new_array_ext(batch->count);
+    for(int i = 0; i < batch->count; i++) {
+        json_object_array_add(operations, json_object_get(batch->ops[i].op));
+    }
+    json_object_object_add(request, "operations", operations);
+
+    int ok = kv_perform_document(client, "POST", kv_client_endpoint(client, KV_ENDPOINT_BATCH),
+                                 NULL, request, JSON_C_TO_STRING_PLAIN, 0, 0);
+    json_object_put(request);
+
+    struct json_object *response = NULL, *results = NULL;
+    if(ok) {
+        response = kv_response_take(&client->response);
+        if(client->status < 200 || client->status >= 300) {
+            struct json_object *message;
+            if(response && json_object_object_get_ex(response, "error", &message)) {
+                snprintf(client->error, sizeof(client->error), "HTTP %ld: %s",
+                         client->status, json_object_get_string(message));
+            } else {
+                snprintf(client->error, sizeof(client->error), "HTTP %ld", client->status);
+            }
+            ok = 0;
+        } else if(!response || !json_object_object_get_ex(response, "results", &results) ||
+                  !json_object_is_type(results, json_type_array)) {
+            snprintf(client->error, sizeof(client->error), "Malformed batch response");
+            ok = 0;
+        }
+    }
+
+    if(!ok) {
+        fail_all(batch, client->error);
+        json_object_put(response);
+        kv_batch_clear(batch);
+        return -1;
+    }
+
+    int succeeded = 0;
+    int nresults = json_object_array_length(results);
+    for(int i = 0; i < batch->count; i++) {
+        struct kv_batch_op *slot = &batch->ops[i];
+        struct json_object *item = (i < nresults) ? json_object_array_get_idx(results, i) : NULL;
+        struct json_object *value;
+
+        struct kv_batch_result result = {0};
+        result.index = i;
+        result.action = op_string(slot->op, "action");
+        result.token = op_string(slot->op, "token");
+        result.error = "";
+
+        if(!item) {
+            result.error = "Missing result";
+        } else {
+            if(json_object_object_get_ex(item, "success", &value)) {
+                result.success = json_object_get_boolean(value);
+            }
+            if(json_object_object_get_ex(item, "data", &value)) {
+                result.data = value;
+            }
+            if(json_object_object_get_ex(item, "version", &value)) {
+                result.version = (long)json_object_get_int64(value);
+            }
+            if(!result.success) {
+                result.error = json_object_object_get_ex(item, "error", &value) ?
+                               json_object_get_string(value) : "Operation failed";
+            }
+        }
+
+        if(result.success) succeeded++;
+        if(slot->callback) slot->callback(&result, slot->userdata);
+    }
+
+    json_object_put(response);
+    kv_batch_clear(batch);
+    return succeeded;
+}
+
+kv_queue *kv_queue_new(kv_client *client, int max_ops, long linger_ms) {
+    kv_queue *queue = kv_calloc(1, sizeof(*queue));
+    if(!queue) return NULL;
+
+    queue->batch = kv_batch_new();
+    if(!queue->batch) {
+        kv_free(queue);
+        return NULL;
+    }
+
+    if(max_ops < 1) max_ops = 1;
+    if(max_ops > KV_BATCH_MAX) max_ops = KV_BATCH_MAX;
+    queue->client = client;
+    queue->max_ops = max_ops;
+    queue->linger_ms = linger_ms > 0 ? linger_ms : 0;
+    return queue;
+}
+
+void kv_queue_free(kv_queue *queue) {
+    if(!queue) return;
+    kv_queue_flush(queue);
+    kv_batch_free(queue->batch);
+    kv_free(queue);
+}
+
+int kv_queue_store(kv_queue *queue, const char *token, struct json_object *data,
+                   kv_batch_callback callback, void *userdata) {
+    kv_batch *batch = queue->batch;
+
+    /* Last write wins: replace a buffered store to the same token in place */
+    for(int i = 0; i < batch->count; i++) {
+        struct kv_batch_op *slot = &batch->ops[i];
+        if(strcmp(op_string(slot->op, "token"), token) != 0) continue;
+
+        if(slot->callback) {
+            struct kv_batch_result result = {0};
+            result.index = i;
+            result.superseded = 1;
+            result.action = "store";
+            result.token = token;
+            result.error = "Superseded by a newer write";
+            slot->callback(&result, slot->userdata);
+        }
+
+        json_object_object_add(slot->op, "data", json_object_get(data));
+        slot->callback = callback;
+        slot->userdata = userdata;
+        return 1;
+    }
+
+    if(!kv_batch_store(batch, token, data, 0, callback, userdata)) return 0;
+    if(batch->count == 1) queue->oldest_ms = kv_now_ms();
+
+    if(batch->count >= queue->max_ops) {
+        return kv_queue_flush(queue) >= 0;
+    }
+    return 1;
+}
+
+int kv_queue_flush(kv_queue *queue) {
+    int count = queue->batch->count;
+    if(count == 0) return 0;
+
+    return kv_batch_execute(queue->batch, queue->client) < 0 ? -1 : count;
+}
+
+long kv_queue_timeout(const kv_queue *queue) {
+    if(queue->batch->count == 0) return -1;
+
+    long long remaining = queue->oldest_ms + queue->linger_ms - kv_now_ms();
+    return remaining > 0 ? (long)remaining : 0;
+}
+
+int kv_queue_poll(kv_queue *queue) {
+    if(kv_queue_timeout(queue) != 0) return 0;
+    return kv_queue_flush(queue);
+}
+
+int kv_queue_pending(const kv_queue *queue) {
+    return queue->batch->count;
+}
@@ -0,0 +1,171 @@
+/*
+ * libkv retrieve cache: the last document seen for each token, with the
+ * ETag and version it was served with.
+ *
+ * kv_retrieve revalidates an entry with If-None-Match, so an unchanged
+ * document costs a 304 with no body and no parse. With a TTL, an entry
+ * younger than the TTL is returned without any request. Writes made
+ * through the same client update their entry in place (a successful patch
+ * is applied locally, as the server applied it), and a version conflict
+ * drops it, so a TTL-cached kv_update loop stays correct while skipping
+ * its retrieves.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv_internal.h"
+
+struct kv_cache_entry {
+    char *token;
+    char *etag;                     /* NULL if the server sent none */
+    long version;
+    struct json_object *data;
+    long long fetched_ms;           /* when the entry was last confirmed */
+};
+
+struct kv_cache {
+    struct kv_cache_entry *entries;
+    int count;
+    int max_entries;
+    long ttl_ms;
+};
+
+static void entry_clear(struct kv_cache_entry *entry) {
+    kv_free(entry->token);
+    kv_free(entry->etag);
+    json_object_put(entry->data);
+    memset(entry, 0, sizeof(*entry));
+}
+
+int kv_client_enable_cache(kv_client *client, int max_entries, long ttl_ms) {
+    kv_cache_free(client);
+    if(max_entries <= 0) return 1;
+
+    struct kv_cache *cache = kv_calloc(1, sizeof(*cache));
+    if(!cache) return 0;
+    cache->entries = kv_calloc((size_t)max_entries, sizeof(*cache->entries));
+    if(!cache->entries) {
+        kv_free(cache);
+        return 0;
+    }
+
+    cache->max_entries = max_entries;
+    cache->ttl_ms = ttl_ms > 0 ? ttl_ms : 0;
+    client->cache = cache;
+    return 1;
+}
+
+void kv_client_cache_clear(kv_client *client) {
+    struct kv_cache *cache = client->cache;
+    if(!cache) return;
+
+    for(int i = 0; i < cache->count; i++) entry_clear(&cache->entries[i]);
+    cache->count = 0;
+}
+
+int kv_client_cache_outcome(const kv_client *client) {
+    return client->cache_outcome;
+}
+
+void kv_cache_free(kv_client *client) {
+    if(!client->cache) return;
+
+    kv_client_cache_clear(client);
+    kv_free(client->cache->entries);
+    kv_free(client->cache);
+    client->cache = NULL;
+}
+
+struct kv_cache_entry *kv_cache_find(const kv_client *client) {
+    struct kv_cache *cache = client->cache;
+    if(!cache || !client->token) return NULL;
+
+    for(int i = 0; i < cache->count; i++) {
+        if(strcmp(cache->entries[i].token, client->token) == 0) return &cache->entries[i];
+    }
+    return NULL;
+}
+
+int kv_cache_fresh(const kv_client *client, const struct kv_cache_entry *entry) {
+    long ttl_ms = client->cache->ttl_ms;
+    return ttl_ms > 0 && kv_now_ms() - entry->fetched_ms < ttl_ms;
+}
+
+const char *kv_cache_etag(const struct kv_cache_entry *entry) {
+    return entry->etag;
+}
+
+struct json_object *kv_cache_hit(kv_client *client, struct kv_cache_entry *entry, int outcome) {
+    entry->fetched_ms = kv_now_ms();
+    client->version = entry->version;
+    client->cache_outcome = outcome;
+    return json_object_get(entry->data);
+}
+
+void kv_cache_put(kv_client *client, const char *etag, long version, struct json_object *data) {
+    struct kv_cache *cache = client->cache;
+    if(!cache || !client->token || !data) return;
+
+    struct kv_cache_entry *entry = kv_cache_find(client);
+    if(!entry) {
+        if(cache->count < cache->max_entries) {
+            entry = &cache->entries[cache->count++];
+        } else {
+            /* Evict the entry confirmed longest ago */
+            entry = &cache->entries[0];
+            for(int i = 1; i < cache->count; i++) {
+                if(cache->entries[i].fetched_ms < entry->fetched_ms) entry = &cache->entries[i];
+            }
+        }
+        entry_clear(entry);
+        entry->token = kv_strdup(client->token);
+        if(!entry->token) {
+            *entry = cache->entries[--cache->count];
+            memset(&cache->entries[cache->count], 0, sizeof(*entry));
+            return;
+        }
+    }
+
+    kv_free(entry->etag);
+    entry->etag = (etag && *etag) ? kv_strdup(etag) : NULL;
+    json_object_put(entry->data);
+    entry->data = json_object_get(data);
+    entry->version = version;
+    entry->fetched_ms = kv_now_ms();
+}
+
+void kv_cache_patched(kv_client *client, long version, struct json_object *set,
+                      struct json_object *remove) {
+    struct kv_cache_entry *entry = kv_cache_find(client);
+    if(!entry) {
+        kv_snapshot_patched(client, version, set, remove);
+        return;
+    }
+
+    /* The patch went in against the cached version only if that is what
+     * was sent; otherwise the entry is of unknown age */
+    struct json_object *doc = NULL;
+    if(entry->version == version && json_object_deep_copy(entry->data, &doc, NULL) != 0) {
+        doc = NULL;
+    }
+    if(!doc || !kv_patch_apply(doc, set, remove)) {
+        json_object_put(doc);
+        kv_cache_drop(client);
+        return;
+    }
+
+    kv_cache_put(client, client->etag, client->version, doc);
+    kv_snapshot_save(client, client->etag, client->version, doc);
+    json_object_put(doc);
+}
+
+void kv_cache_drop(kv_client *client) {
+    struct kv_cache *cache = client->cache;
+    struct kv_cache_entry *entry = kv_cache_find(client);
+    if(!entry) return;
+
+    entry_clear(entry);
+    *entry = cache->entries[--cache->count];
+    memset(&cache->entries[cache->count], 0, sizeof(*entry));
+}
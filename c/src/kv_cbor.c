@@ -0,0 +1,304 @@
+/*
+ * libkv CBOR (RFC 8949) for the binary wire format.
+ *
+ * Documents are json-c trees either way, so this maps the JSON data model
+ * onto CBOR and back: integers as major types 0/1 in the shortest head,
+ * doubles as float32 when that is exact and float64 otherwise (so a
+ * reading costs 5 or 9 bytes instead of up to 24 digits of text), strings,
+ * arrays and maps with text keys, and the simple values false, true and
+ * null. The decoder also takes what other encoders may send: half floats,
+ * indefinite-length strings, arrays and maps, tags (skipped) and
+ * undefined (as null). Byte strings become strings of the same bytes.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kv_internal.h"
+
+#define KV_CBOR_DEPTH 64                /* nesting accepted when decoding */
+
+#define CBOR_UINT   0
+#define CBOR_NEGINT 1
+#define CBOR_BYTES  2
+#define CBOR_TEXT   3
+#define CBOR_ARRAY  4
+#define CBOR_MAP    5
+#define CBOR_TAG    6
+#define CBOR_SIMPLE 7
+
+#define CBOR_INDEFINITE 31
+#define CBOR_BREAK      0xFF
+
+/* ---- encoding ---- */
+
+static int put_head(struct kv_buffer *out, int major, uint64_t value) {
+    unsigned char head[9];
+    size_t n;
+
+    head[0] = (unsigned char)(major << 5);
+    if(value < 24) {
+        head[0] |= (unsigned char)value;
+        n = 1;
+    } else if(value <= 0xFF) {
+        head[0] |= 24;
+        n = 2;
+    } else if(value <= 0xFFFF) {
+        head[0] |= 25;
+        n = 3;
+    } else if(value <= 0xFFFFFFFFu) {
+        head[0] |= 26;
+        n = 5;
+    } else {
+        head[0] |= 27;
+        n = 9;
+    }
+    /* Big-endian argument after the initial byte */
+    for(size_t i = n - 1; i > 0; i--) {
+        head[i] = (unsigned char)(value & 0xFF);
+        value >>= 8;
+    }
+    return kv_buffer_append(out, head, n);
+}
+
+static int put_text(struct kv_buffer *out, const char *text, size_t len) {
+    return put_head(out, CBOR_TEXT, len) && kv_buffer_append(out, text, len);
+}
+
+static int put_double(struct kv_buffer *out, double value) {
+    unsigned char bytes[9];
+    uint64_t bits;
+    size_t n;
+
+    float narrow = (float)value;
+    if((double)narrow == value) {
+        uint32_t bits32;
+        memcpy(&bits32, &narrow, sizeof(bits32));
+        bytes[0] = 0xFA;
+        bits = bits32;
+        n = 5;
+    } else {
+        memcpy(&bits, &value, sizeof(bits));
+        bytes[0] = 0xFB;
+        n = 9;
+    }
+    for(size_t i = n - 1; i > 0; i--) {
+        bytes[i] = (unsigned char)(bits & 0xFF);
+        bits >>= 8;
+    }
+    return kv_buffer_append(out, bytes, n);
+}
+
+static int put_item(struct kv_buffer *out, struct json_object *obj) {
+    static const unsigned char simple_false = 0xF4, simple_true = 0xF5, simple_null = 0xF6;
+
+    switch(json_object_get_type(obj)) {
+    case json_type_null:
+        return kv_buffer_append(out, &simple_null, 1);
+    case json_type_boolean:
+        return kv_buffer_append(out, json_object_get_boolean(obj) ? &simple_true : &simple_false, 1);
+    case json_type_int: {
+        int64_t value = json_object_get_int64(obj);
+        return value >= 0 ? put_head(out, CBOR_UINT, (uint64_t)value)
+                          : put_head(out, CBOR_NEGINT, (uint64_t)(-(value + 1)));
+    }
+    case json_type_double:
+        return put_double(out, json_object_get_double(obj));
+    case json_type_string:
+        return put_text(out, json_object_get_string(obj), (size_t)json_object_get_string_len(obj));
+    case json_type_array: {
+        size_t len = json_object_array_length(obj);
+        if(!put_head(out, CBOR_ARRAY, len)) return 0;
+        for(size_t i = 0; i < len; i++) {
+            if(!put_item(out, json_object_array_get_idx(obj, i))) return 0;
+        }
+        return 1;
+    }
+    case json_type_object: {
+        if(!put_head(out, CBOR_MAP, (uint64_t)json_object_object_length(obj))) return 0;
+        json_object_object_foreach(obj, key, value) {
+            if(!put_text(out, key, strlen(key)) || !put_item(out, value)) return 0;
+        }
+        return 1;
+    }
+    }
+    return 0;
+}
+
+int kv_cbor_encode(struct kv_buffer *out, const char *envelope, struct json_object *obj) {
+    kv_buffer_reset(out);
+    if(envelope && (!put_head(out, CBOR_MAP, 1) || !put_text(out, envelope, strlen(envelope)))) {
+        return 0;
+    }
+    return put_item(out, obj);
+}
+
+/* ---- decoding ---- */
+
+struct cbor_input {
+    const unsigned char *p;
+    const unsigned char *end;
+};
+
+/* The initial byte and argument of the next item. An indefinite length
+ * sets *value to UINT64_MAX. */
+static int read_head(struct cbor_input *in, int *major, int *info, uint64_t *value) {
+    if(in->p >= in->end) return 0;
+    unsigned char initial = *in->p++;
+    *major = initial >> 5;
+    *info = initial & 31;
+
+    size_t n = *info < 24 ? 0 : *info == 24 ? 1 : *info == 25 ? 2 : *info == 26 ? 4 : *info == 27 ? 8 : 0;
+    if(*info >= 28 && *info <= 30) return 0;
+    if(*info == CBOR_INDEFINITE) {
+        /* Only strings, arrays and maps come in indefinite form */
+        if(*major < CBOR_BYTES || *major > CBOR_MAP) return 0;
+        *value = UINT64_MAX;
+        return 1;
+    }
+    if((size_t)(in->end - in->p) < n) return 0;
+
+    *value = n ? 0 : (uint64_t)*info;
+    for(size_t i = 0; i < n; i++) *value = *value << 8 | *in->p++;
+    return 1;
+}
+
+static int at_break(struct cbor_input *in) {
+    if(in->p < in->end && *in->p == CBOR_BREAK) {
+        in->p++;
+        return 1;
+    }
+    return 0;
+}
+
+/* A byte or text string, definite or indefinite in chunks of the same type */
+static struct json_object *read_string(struct cbor_input *in, int major, uint64_t len) {
+    if(len != UINT64_MAX) {
+        if(len > (uint64_t)(in->end - in->p)) return NULL;
+        struct json_object *text = json_object_new_string_len((const char *)in->p, (int)len);
+        in->p += len;
+        return text;
+    }
+
+    struct kv_buffer joined = { 0 };
+    int ok = 1;
+    while(ok && !at_break(in)) {
+        int chunk_major, info;
+        uint64_t chunk_len;
+        ok = read_head(in, &chunk_major, &info, &chunk_len) && chunk_major == major &&
+             chunk_len != UINT64_MAX && chunk_len <= (uint64_t)(in->end - in->p) &&
+             kv_buffer_append(&joined, in->p, (size_t)chunk_len);
+        if(ok) in->p += chunk_len;
+    }
+    struct json_object *text = ok ? json_object_new_string_len(joined.data ? joined.data : "", (int)joined.size)
+                                  : NULL;
+    kv_buffer_free(&joined);
+    return text;
+}
+
+static double half_to_double(unsigned half) {
+    int exponent = (half >> 10) & 0x1F;
+    int mantissa = half & 0x3FF;
+    double value = exponent == 0 ? ldexp(mantissa, -24) :
+                   exponent != 31 ? ldexp(mantissa + 1024, exponent - 25) :
+                   mantissa == 0 ? INFINITY : NAN;
+    return half & 0x8000 ? -value : value;
+}
+
+static int read_item(struct cbor_input *in, int depth, struct json_object **out);
+
+static int read_array(struct cbor_input *in, uint64_t len, int depth, struct json_object **out) {
+    *out = json_object_new_array();
+    if(!*out) return 0;
+    for(uint64_t i = 0; len == UINT64_MAX ? !at_break(in) : i < len; i++) {
+        struct json_object *item;
+        int ok = read_item(in, depth + 1, &item);
+        json_object_array_add(*out, item);
+        if(!ok) return 0;
+    }
+    return 1;
+}
+
+static int read_map(struct cbor_input *in, uint64_t len, int depth, struct json_object **out) {
+    *out = json_object_new_object();
+    if(!*out) return 0;
+    for(uint64_t i = 0; len == UINT64_MAX ? !at_break(in) : i < len; i++) {
+        struct json_object *key, *value;
+        int major, info;
+        uint64_t key_len;
+
+        /* JSON has only string keys */
+        if(!read_head(in, &major, &info, &key_len) || (major != CBOR_TEXT && major != CBOR_BYTES)) return 0;
+        key = read_string(in, major, key_len);
+        if(!key) return 0;
+        int ok = read_item(in, depth + 1, &value);
+        json_object_object_add(*out, json_object_get_string(key), value);
+        json_object_put(key);
+        if(!ok) return 0;
+    }
+    return 1;
+}
+
+/* Decode one item into *out, which is NULL for null. On failure *out
+ * holds what was built so far, for the caller to put. */
+static int read_item(struct cbor_input *in, int depth, struct json_object **out) {
+    int major, info;
+    uint64_t value;
+
+    *out = NULL;
+    if(depth > KV_CBOR_DEPTH || !read_head(in, &major, &info, &value)) return 0;
+
+    switch(major) {
+    case CBOR_UINT:
+        *out = value <= INT64_MAX ? json_object_new_int64((int64_t)value)
+                                  : json_object_new_double((double)value);
+        return *out != NULL;
+    case CBOR_NEGINT:
+        *out = value <= INT64_MAX ? json_object_new_int64(-(int64_t)value - 1)
+                                  : json_object_new_double(-1.0 - (double)value);
+        return *out != NULL;
+    case CBOR_BYTES:
+    case CBOR_TEXT:
+        *out = read_string(in, major, value);
+        return *out != NULL;
+    case CBOR_ARRAY:
+        return read_array(in, value, depth, out);
+    case CBOR_MAP:
+        return read_map(in, value, depth, out);
+    case CBOR_TAG:
+        /* The tagged item stands for itself (a date is its string or number) */
+        return read_item(in, depth + 1, out);
+    }
+
+    /* Simple values and floats */
+    if(info == 20 || info == 21) {
+        *out = json_object_new_boolean(info == 21);
+        return *out != NULL;
+    }
+    if(info == 22 || info == 23) return 1;
+    if(info == 25) {
+        *out = json_object_new_double(half_to_double((unsigned)value));
+    } else if(info == 26) {
+        uint32_t bits = (uint32_t)value;
+        float narrow;
+        memcpy(&narrow, &bits, sizeof(narrow));
+        *out = json_object_new_double(narrow);
+    } else if(info == 27) {
+        double wide;
+        memcpy(&wide, &value, sizeof(wide));
+        *out = json_object_new_double(wide);
+    } else {
+        return 0;
+    }
+    return *out != NULL;
+}
+
+int kv_cbor_decode(const void *data, size_t len, struct json_object **out) {
+    struct cbor_input in = { (const unsigned char *)data, (const unsigned char *)data + len };
+    if(read_item(&in, 0, out) && in.p == in.end) return 1;
+
+    json_object_put(*out);
+    *out = NULL;
+    return 0;
+}
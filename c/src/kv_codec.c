@@ -0,0 +1,452 @@
+/*
+ * libkv fixed-schema codecs.
+ *
+ * Each document shape is a table of fields: a member name, a type and
+ * where the value lives in the struct. The decoder walks the text once
+ * with a cursor, looks every member name up in the table (a handful of
+ * entries, so a linear scan beats hashing) and converts its value in
+ * place; members not in the table are skipped by matching brackets. The
+ * encoder writes the table out in order. Strings are unescaped into, and
+ * escaped out of, the struct's fixed arrays, so neither side allocates.
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv_codec.h"
+
+#define KV_CODEC_DEPTH 64           /* nesting allowed inside skipped values */
+#define KV_NAME_MAX    32           /* no table has a longer member name */
+#define KV_NUMBER_MAX  64
+
+#define FIELD_STRING  0
+#define FIELD_NUMBER  1
+#define FIELD_BOOL    2
+#define FIELD_HISTORY 3             /* array of kv_ip_change */
+
+struct field {
+    const char *name;
+    int type;
+    size_t offset;
+    size_t size;                    /* of a FIELD_STRING array */
+};
+
+#define FIELD(type, member, kind) \
+    { #member, kind, offsetof(type, member), sizeof(((type *)0)->member) }
+
+static const struct field reading_fields[] = {
+    FIELD(struct kv_reading, timestamp, FIELD_STRING),
+    FIELD(struct kv_reading, temperature, FIELD_NUMBER),
+    FIELD(struct kv_reading, humidity, FIELD_NUMBER),
+    FIELD(struct kv_reading, pressure, FIELD_NUMBER),
+};
+
+static const struct field change_fields[] = {
+    FIELD(struct kv_ip_change, ip, FIELD_STRING),
+    FIELD(struct kv_ip_change, timestamp, FIELD_STRING),
+};
+
+static const struct field record_fields[] = {
+    FIELD(struct kv_ip_record, ip, FIELD_STRING),
+    FIELD(struct kv_ip_record, last_updated, FIELD_STRING),
+    FIELD(struct kv_ip_record, changed, FIELD_BOOL),
+    FIELD(struct kv_ip_record, previous_ip, FIELD_STRING),
+    FIELD(struct kv_ip_record, history, FIELD_HISTORY),
+};
+
+#define FIELDS(table) (sizeof(table) / sizeof((table)[0]))
+
+/* ---- decoding ---- */
+
+struct cursor {
+    const char *p;
+    const char *end;
+};
+
+static int peek(struct cursor *c) {
+    while(c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\n' || *c->p == '\r')) {
+        c->p++;
+    }
+    return c->p < c->end ? (unsigned char)*c->p : -1;
+}
+
+static int expect(struct cursor *c, int ch) {
+    if(peek(c) != ch) return 0;
+    c->p++;
+    return 1;
+}
+
+static int literal(struct cursor *c, const char *word) {
+    size_t len = strlen(word);
+    if((size_t)(c->end - c->p) < len || memcmp(c->p, word, len) != 0) return 0;
+    c->p += len;
+    return 1;
+}
+
+static int hex4(struct cursor *c, unsigned *value) {
+    if(c->end - c->p < 4) return 0;
+    *value = 0;
+    for(int i = 0; i < 4; i++) {
+        char ch = *c->p++;
+        int digit = ch >= '0' && ch <= '9' ? ch - '0' :
+                    ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 :
+                    ch >= 'A' && ch <= 'F' ? ch - 'A' + 10 : -1;
+        if(digit < 0) return 0;
+        *value = *value << 4 | (unsigned)digit;
+    }
+    return 1;
+}
+
+/* Decode the string at the cursor into out (size bytes, NUL included), or
+ * just skip it if out is NULL. Returns 1, 0 if it is valid but does not
+ * fit, or -1 if it is not a valid string. */
+static int scan_string(struct cursor *c, char *out, size_t size) {
+    size_t len = 0;
+    int fits = 1;
+    if(!expect(c, '"')) return -1;
+
+    while(c->p < c->end) {
+        /* Copy the run up to the next quote, escape or control byte */
+        const char *run = c->p;
+        while(c->p < c->end && *c->p != '"' && *c->p != '\\' && (unsigned char)*c->p >= 0x20) c->p++;
+        size_t n = (size_t)(c->p - run);
+        if(out && fits) {
+            if(len + n < size) memcpy(out + len, run, n);
+            else fits = 0;
+        }
+        len += n;
+        if(c->p == c->end) break;
+
+        char ch = *c->p++;
+        if(ch == '"') {
+            if(out && fits) out[len] = '\0';
+            return fits;
+        }
+        if(ch != '\\' || c->p == c->end) return -1;
+
+        /* One escape, as up to 4 bytes of UTF-8 */
+        char utf8[4];
+        size_t k = 1;
+        switch(*c->p++) {
+        case '"':  utf8[0] = '"'; break;
+        case '\\': utf8[0] = '\\'; break;
+        case '/':  utf8[0] = '/'; break;
+        case 'b':  utf8[0] = '\b'; break;
+        case 'f':  utf8[0] = '\f'; break;
+        case 'n':  utf8[0] = '\n'; break;
+        case 'r':  utf8[0] = '\r'; break;
+        case 't':  utf8[0] = '\t'; break;
+        case 'u': {
+            unsigned code, low;
+            if(!hex4(c, &code) || (code >= 0xDC00 && code <= 0xDFFF)) return -1;
+            if(code >= 0xD800 && code <= 0xDBFF) {
+                if(!literal(c, "\\u") || !hex4(c, &low) || low < 0xDC00 || low > 0xDFFF) return -1;
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            }
+            if(code < 0x80) {
+                utf8[0] = (char)code;
+            } else if(code < 0x800) {
+                utf8[0] = (char)(0xC0 | code >> 6);
+                utf8[1] = (char)(0x80 | (code & 0x3F));
+                k = 2;
+            } else if(code < 0x10000) {
+                utf8[0] = (char)(0xE0 | code >> 12);
+                utf8[1] = (char)(0x80 | (code >> 6 & 0x3F));
+                utf8[2] = (char)(0x80 | (code & 0x3F));
+                k = 3;
+            } else {
+                utf8[0] = (char)(0xF0 | code >> 18);
+                utf8[1] = (char)(0x80 | (code >> 12 & 0x3F));
+                utf8[2] = (char)(0x80 | (code >> 6 & 0x3F));
+                utf8[3] = (char)(0x80 | (code & 0x3F));
+                k = 4;
+            }
+            break;
+        }
+        default:
+            return -1;
+        }
+        if(out && fits) {
+            if(len + k < size) memcpy(out + len, utf8, k);
+            else fits = 0;
+        }
+        len += k;
+    }
+    return -1;
+}
+
+static int scan_number(struct cursor *c, double *value) {
+    char text[KV_NUMBER_MAX];
+    int ch = peek(c);
+    if(ch != '-' && !(ch >= '0' && ch <= '9')) return 0;
+
+    const char *start = c->p;
+    while(c->p < c->end && ((*c->p >= '0' && *c->p <= '9') || *c->p == '-' || *c->p == '+' ||
+                            *c->p == '.' || *c->p == 'e' || *c->p == 'E')) {
+        c->p++;
+    }
+    size_t len = (size_t)(c->p - start);
+    if(len >= sizeof(text)) return 0;
+    memcpy(text, start, len);
+    text[len] = '\0';
+
+    char *end;
+    *value = strtod(text, &end);
+    return end == text + len;
+}
+
+/* Skip one value of any type */
+static int skip_value(struct cursor *c, int depth) {
+    double number;
+    int ch = peek(c);
+    if(depth > KV_CODEC_DEPTH) return 0;
+
+    if(ch == '"') return scan_string(c, NULL, 0) >= 0;
+    if(ch == 't') return literal(c, "true");
+    if(ch == 'f') return literal(c, "false");
+    if(ch == 'n') return literal(c, "null");
+    if(ch != '{' && ch != '[') return scan_number(c, &number);
+
+    int close = ch == '{' ? '}' : ']';
+    c->p++;
+    if(expect(c, close)) return 1;
+    do {
+        if(close == '}' && (scan_string(c, NULL, 0) < 0 || !expect(c, ':'))) return 0;
+        if(!skip_value(c, depth + 1)) return 0;
+    } while(expect(c, ','));
+    return expect(c, close);
+}
+
+static int decode_object(struct cursor *c, const struct field *fields, size_t count, void *base);
+
+static int decode_history(struct cursor *c, struct kv_ip_record *record) {
+    record->history_count = 0;
+    record->history_len = 0;
+    if(peek(c) == 'n') return literal(c, "null");
+    if(!expect(c, '[')) return 0;
+    if(expect(c, ']')) return 1;
+
+    do {
+        /* Full: the oldest entry makes room */
+        if(record->history_count == KV_IP_HISTORY_MAX) {
+            memmove(record->history, record->history + 1,
+                    sizeof(record->history[0]) * (KV_IP_HISTORY_MAX - 1));
+            record->history_count--;
+        }
+        struct kv_ip_change *change = &record->history[record->history_count];
+        memset(change, 0, sizeof(*change));
+        if(!decode_object(c, change_fields, FIELDS(change_fields), change)) return 0;
+        record->history_count++;
+        record->history_len++;
+    } while(expect(c, ','));
+    return expect(c, ']');
+}
+
+static int decode_field(struct cursor *c, const struct field *field, void *base) {
+    char *slot = (char *)base + field->offset;
+    int ch = peek(c);
+
+    switch(field->type) {
+    case FIELD_STRING:
+        if(ch == 'n') {
+            slot[0] = '\0';
+            return literal(c, "null");
+        }
+        return scan_string(c, slot, field->size) == 1;
+    case FIELD_NUMBER:
+        if(ch == 'n') {
+            *(double *)slot = NAN;
+            return literal(c, "null");
+        }
+        return scan_number(c, (double *)slot);
+    case FIELD_BOOL:
+        *(int *)slot = ch == 't';
+        return literal(c, ch == 't' ? "true" : ch == 'f' ? "false" : "null");
+    case FIELD_HISTORY:
+        return decode_history(c, (struct kv_ip_record *)base);
+    }
+    return 0;
+}
+
+static int decode_object(struct cursor *c, const struct field *fields, size_t count, void *base) {
+    char name[KV_NAME_MAX];
+    if(!expect(c, '{')) return 0;
+    if(expect(c, '}')) return 1;
+
+    do {
+        int known = scan_string(c, name, sizeof(name));
+        if(known < 0 || !expect(c, ':')) return 0;
+
+        const struct field *field = NULL;
+        for(size_t i = 0; known && i < count; i++) {
+            if(strcmp(fields[i].name, name) == 0) {
+                field = &fields[i];
+                break;
+            }
+        }
+        if(field ? !decode_field(c, field, base) : !skip_value(c, 0)) return 0;
+    } while(expect(c, ','));
+    return expect(c, '}');
+}
+
+/* A whole text holding one object of the table's shape */
+static int decode(const char *json, size_t len, const struct field *fields, size_t count, void *base) {
+    struct cursor c = { json, json + len };
+    return json && decode_object(&c, fields, count, base) && peek(&c) < 0;
+}
+
+int kv_reading_decode(const char *json, size_t len, struct kv_reading *reading) {
+    reading->timestamp[0] = '\0';
+    reading->temperature = NAN;
+    reading->humidity = NAN;
+    reading->pressure = NAN;
+    return decode(json, len, reading_fields, FIELDS(reading_fields), reading);
+}
+
+int kv_ip_record_decode(const char *json, size_t len, struct kv_ip_record *record) {
+    memset(record, 0, sizeof(*record));
+    return decode(json, len, record_fields, FIELDS(record_fields), record);
+}
+
+const char *kv_json_member(const char *json, size_t len, const char *name, size_t *value_len) {
+    struct cursor c = { json, json + len };
+    char key[KV_NAME_MAX];
+    if(!json || !expect(&c, '{') || expect(&c, '}')) return NULL;
+
+    do {
+        int fits = scan_string(&c, key, sizeof(key));
+        if(fits < 0 || !expect(&c, ':')) return NULL;
+
+        peek(&c);
+        const char *value = c.p;
+        if(!skip_value(&c, 0)) return NULL;
+        if(fits && strcmp(key, name) == 0) {
+            *value_len = (size_t)(c.p - value);
+            return value;
+        }
+    } while(expect(&c, ','));
+    return NULL;
+}
+
+/* ---- encoding ---- */
+
+/* Output with snprintf semantics: len counts everything, whether it fit
+ * or not */
+struct writer {
+    char *out;
+    size_t size;
+    size_t len;
+};
+
+static void put(struct writer *w, const char *text, size_t n) {
+    if(w->len < w->size) {
+        size_t room = w->size - w->len;
+        memcpy(w->out + w->len, text, n < room ? n : room);
+    }
+    w->len += n;
+}
+
+static void put_string(struct writer *w, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    put(w, "\"", 1);
+    while(*s) {
+        const char *run = s;
+        while(*s && *s != '"' && *s != '\\' && (unsigned char)*s >= 0x20) s++;
+        put(w, run, (size_t)(s - run));
+        if(!*s) break;
+
+        unsigned char ch = (unsigned char)*s++;
+        char escape[6] = { '\\', (char)ch };
+        size_t n = 2;
+        if(ch == '\n') escape[1] = 'n';
+        else if(ch == '\r') escape[1] = 'r';
+        else if(ch == '\t') escape[1] = 't';
+        else if(ch == '\b') escape[1] = 'b';
+        else if(ch == '\f') escape[1] = 'f';
+        else if(ch < 0x20) {
+            memcpy(escape + 1, "u00", 3);
+            escape[4] = hex[ch >> 4];
+            escape[5] = hex[ch & 0xF];
+            n = 6;
+        }
+        put(w, escape, n);
+    }
+    put(w, "\"", 1);
+}
+
+/* The shortest text that reads back as the same double */
+static void put_number(struct writer *w, double value) {
+    char text[32];
+    int n = 0;
+    for(int precision = 15; precision <= 17; precision++) {
+        n = snprintf(text, sizeof(text), "%.*g", precision, value);
+        if(strtod(text, NULL) == value) break;
+    }
+    put(w, text, (size_t)n);
+    /* Keep it a double for json-c readers, as json-c writes them */
+    if(!strpbrk(text, ".eE")) put(w, ".0", 2);
+}
+
+static void put_name(struct writer *w, int *first, const char *name) {
+    if(!*first) put(w, ",", 1);
+    *first = 0;
+    put_string(w, name);
+    put(w, ":", 1);
+}
+
+static void encode_object(struct writer *w, const struct field *fields, size_t count, const void *base) {
+    int first = 1;
+    put(w, "{", 1);
+    for(size_t i = 0; i < count; i++) {
+        const char *slot = (const char *)base + fields[i].offset;
+        switch(fields[i].type) {
+        case FIELD_STRING:
+            if(!slot[0]) break;
+            put_name(w, &first, fields[i].name);
+            put_string(w, slot);
+            break;
+        case FIELD_NUMBER:
+            if(!isfinite(*(const double *)slot)) break;
+            put_name(w, &first, fields[i].name);
+            put_number(w, *(const double *)slot);
+            break;
+        case FIELD_BOOL:
+            put_name(w, &first, fields[i].name);
+            if(*(const int *)slot) put(w, "true", 4);
+            else put(w, "false", 5);
+            break;
+        case FIELD_HISTORY: {
+            const struct kv_ip_record *record = (const struct kv_ip_record *)base;
+            int n = record->history_count < 0 ? 0 :
+                    record->history_count > KV_IP_HISTORY_MAX ? KV_IP_HISTORY_MAX : record->history_count;
+            put_name(w, &first, fields[i].name);
+            put(w, "[", 1);
+            for(int j = 0; j < n; j++) {
+                if(j > 0) put(w, ",", 1);
+                encode_object(w, change_fields, FIELDS(change_fields), &record->history[j]);
+            }
+            put(w, "]", 1);
+            break;
+        }
+        }
+    }
+    put(w, "}", 1);
+}
+
+static int encode(const struct field *fields, size_t count, const void *base, char *out, size_t size) {
+    struct writer w = { out, size, 0 };
+    encode_object(&w, fields, count, base);
+    if(size > 0) out[w.len < size ? w.len : size - 1] = '\0';
+    return (int)w.len;
+}
+
+int kv_reading_encode(const struct kv_reading *reading, char *out, size_t size) {
+    return encode(reading_fields, FIELDS(reading_fields), reading, out, size);
+}
+
+int kv_ip_record_encode(const struct kv_ip_record *record, char *out, size_t size) {
+    return encode(record_fields, FIELDS(record_fields), record, out, size);
+}
@@ -0,0 +1,203 @@
+/*
+ * libkv request body compression: gzip through zlib (KV_WITH_ZLIB) and
+ * zstd with an optional dictionary (KV_WITH_ZSTD). Either can be left out
+ * of the build; kv_compress_available reports what is there.
+ *
+ * The compressor and the output buffer belong to the client and are reset
+ * rather than recreated for each request, so a steady store loop does not
+ * reallocate them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef KV_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef KV_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "kv_internal.h"
+
+#define KV_ZSTD_LEVEL 3
+
+/* curl_slist data is not const, though libcurl only reads header lines */
+static char gzip_header[] = "Content-Encoding: gzip";
+static char zstd_header[] = "Content-Encoding: zstd";
+
+#ifdef KV_WITH_ZLIB
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size) {
+    (void)opaque;
+    return kv_calloc(items, size);
+}
+
+static void zlib_free(voidpf opaque, voidpf ptr) {
+    (void)opaque;
+    kv_free(ptr);
+}
+
+static int gzip_body(struct kv_compress *compress, const struct kv_upload *body, size_t total) {
+    z_stream *zs = (z_stream *)compress->zlib;
+
+    if(!zs) {
+        zs = kv_calloc(1, sizeof(*zs));
+        if(!zs) return 0;
+        zs->zalloc = zlib_alloc;
+        zs->zfree = zlib_free;
+        /* windowBits 15 + 16 selects the gzip wrapper instead of zlib's */
+        if(deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            kv_free(zs);
+            return 0;
+        }
+        compress->zlib = zs;
+    } else if(deflateReset(zs) != Z_OK) {
+        return 0;
+    }
+
+    kv_buffer_reset(&compress->out);
+    if(!kv_buffer_reserve(&compress->out, deflateBound(zs, (uLong)total))) return 0;
+    zs->next_out = (Bytef *)compress->out.data;
+    zs->avail_out = (uInt)(compress->out.capacity - 1);
+
+    int res = Z_OK;
+    for(int i = 0; i < KV_UPLOAD_PARTS && res == Z_OK; i++) {
+        int last = i == KV_UPLOAD_PARTS - 1;
+        /* deflate reports Z_BUF_ERROR when given nothing to do */
+        if(body->lens[i] == 0 && !last) continue;
+        zs->next_in = (Bytef *)body->parts[i];
+        zs->avail_in = (uInt)body->lens[i];
+        res = deflate(zs, last ? Z_FINISH : Z_NO_FLUSH);
+    }
+    if(res != Z_STREAM_END) return 0;
+
+    compress->out.size = zs->total_out;
+    return 1;
+}
+#endif
+
+#ifdef KV_WITH_ZSTD
+static int zstd_body(struct kv_compress *compress, const struct kv_upload *body, size_t total) {
+    ZSTD_CCtx *cctx = (ZSTD_CCtx *)compress->zstd;
+
+    if(!cctx) {
+        cctx = ZSTD_createCCtx();
+        if(!cctx) return 0;
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, KV_ZSTD_LEVEL);
+        compress->zstd = cctx;
+    } else {
+        ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+    }
+    if(ZSTD_isError(ZSTD_CCtx_refCDict(cctx, (ZSTD_CDict *)compress->dictionary))) return 0;
+    ZSTD_CCtx_setPledgedSrcSize(cctx, total);
+
+    kv_buffer_reset(&compress->out);
+    if(!kv_buffer_reserve(&compress->out, ZSTD_compressBound(total))) return 0;
+    ZSTD_outBuffer out = { compress->out.data, compress->out.capacity - 1, 0 };
+
+    for(int i = 0; i < KV_UPLOAD_PARTS; i++) {
+        ZSTD_inBuffer in = { body->parts[i], body->lens[i], 0 };
+        ZSTD_EndDirective mode = i == KV_UPLOAD_PARTS - 1 ? ZSTD_e_end : ZSTD_e_continue;
+        size_t left;
+        do {
+            left = ZSTD_compressStream2(cctx, &out, &in, mode);
+            if(ZSTD_isError(left)) return 0;
+        } while(mode == ZSTD_e_end ? left != 0 && out.pos < out.size : in.pos < in.size);
+        if(mode == ZSTD_e_end && left != 0) return 0;
+    }
+
+    compress->out.size = out.pos;
+    return 1;
+}
+#endif
+
+int kv_compress_available(int method) {
+    switch(method) {
+    case KV_COMPRESS_NONE:
+        return 1;
+#ifdef KV_WITH_ZLIB
+    case KV_COMPRESS_GZIP:
+        return 1;
+#endif
+#ifdef KV_WITH_ZSTD
+    case KV_COMPRESS_ZSTD:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+int kv_client_set_compression(kv_client *client, int method, size_t min_size) {
+    if(!kv_compress_available(method)) {
+        snprintf(client->error, sizeof(client->error), "Compression method %d not built in", method);
+        return 0;
+    }
+    client->compress.method = method;
+    client->compress.min_size = min_size;
+    return 1;
+}
+
+int kv_client_set_compression_dictionary(kv_client *client, const void *dict, size_t len) {
+#ifdef KV_WITH_ZSTD
+    ZSTD_CDict *dictionary = NULL;
+    if(dict && len > 0) {
+        dictionary = ZSTD_createCDict(dict, len, KV_ZSTD_LEVEL);
+        if(!dictionary) {
+            snprintf(client->error, sizeof(client->error), "Invalid compression dictionary");
+            return 0;
+        }
+    }
+    ZSTD_freeCDict((ZSTD_CDict *)client->compress.dictionary);
+    client->compress.dictionary = dictionary;
+    return 1;
+#else
+    (void)dict;
+    (void)len;
+    snprintf(client->error, sizeof(client->error), "zstd not built in");
+    return 0;
+#endif
+}
+
+void kv_client_accept_compressed(kv_client *client, int enable) {
+    /* "" offers every encoding this libcurl can decode */
+    curl_easy_setopt(client->curl, CURLOPT_ACCEPT_ENCODING, enable ? "" : NULL);
+}
+
+char *kv_compress_body(kv_client *client, const struct kv_upload *body, size_t total) {
+    struct kv_compress *compress = &client->compress;
+    if(compress->method == KV_COMPRESS_NONE || total < compress->min_size) return NULL;
+
+    switch(compress->method) {
+#ifdef KV_WITH_ZLIB
+    case KV_COMPRESS_GZIP:
+        return gzip_body(compress, body, total) ? gzip_header : NULL;
+#endif
+#ifdef KV_WITH_ZSTD
+    case KV_COMPRESS_ZSTD:
+        return zstd_body(compress, body, total) ? zstd_header : NULL;
+#endif
+    default:
+        (void)body;
+        (void)gzip_header;
+        (void)zstd_header;
+        return NULL;
+    }
+}
+
+void kv_compress_free(struct kv_compress *compress) {
+#ifdef KV_WITH_ZLIB
+    if(compress->zlib) {
+        deflateEnd((z_stream *)compress->zlib);
+        kv_free(compress->zlib);
+    }
+#endif
+#ifdef KV_WITH_ZSTD
+    ZSTD_freeCCtx((ZSTD_CCtx *)compress->zstd);
+    ZSTD_freeCDict((ZSTD_CDict *)compress->dictionary);
+#endif
+    compress->zlib = NULL;
+    compress->zstd = NULL;
+    compress->dictionary = NULL;
+    kv_buffer_free(&compress->out);
+}
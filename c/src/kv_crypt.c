@@ -0,0 +1,592 @@
+/*
+ * libkv client-side encryption: AES-256-GCM and ChaCha20-Poly1305 through
+ * OpenSSL (KV_WITH_OPENSSL).
+ *
+ * A payload is base64 of: cipher id (1 byte), nonce (12), ciphertext, tag
+ * (16). Sealing runs the cipher over the document in KV_CRYPT_CHUNK blocks
+ * and base64-encodes each block straight into client->crypt->out.
+ * Opening is driven by kv_response_write: the response bytes around the
+ * payload string are kept in the response body, which is then only the
+ * small envelope, and the payload is decoded and decrypted as it arrives,
+ * holding back the last 16 bytes, which turn out to be the tag once the
+ * string ends.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef KV_WITH_OPENSSL
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#include "kv_crypt.h"
+#include "kv_codec.h"
+#include "kv_internal.h"
+
+#ifdef KV_WITH_OPENSSL
+
+#define KV_CRYPT_KEY   32
+#define KV_CRYPT_NONCE 12
+#define KV_CRYPT_HEAD  (1 + KV_CRYPT_NONCE)
+#define KV_CRYPT_TAG   16
+#define KV_CRYPT_KEYS  4            /* tokens whose keys a client keeps */
+#define KV_CRYPT_CHUNK 3072         /* a multiple of 3: whole base64 groups */
+
+/* Where the response scanner is */
+#define SCAN_KEY     0              /* looking for "payload" */
+#define SCAN_COLON   1
+#define SCAN_QUOTE   2              /* the opening quote of its value */
+#define SCAN_PAYLOAD 3
+#define SCAN_DONE    4
+
+static const char payload_key[] = "\"payload\"";
+static const char alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+struct kv_crypt_key {
+    char *token;                    /* NULL for an unused slot */
+    unsigned char key[KV_CRYPT_KEY];
+};
+
+struct kv_crypt {
+    int cipher;                     /* KV_CIPHER_* stores are sealed with */
+    char *password;
+    struct kv_crypt_key keys[KV_CRYPT_KEYS];
+    int next_key;                   /* slot derived into next */
+    EVP_CIPHER_CTX *ctx;            /* reused by every seal and open */
+    int ctx_cipher;                 /* what ctx is keyed for, to only */
+    const unsigned char *ctx_key;   /* change the nonce when it is the */
+    int ctx_encrypt;                /* same; ctx_key NULL for nothing */
+    struct kv_buffer out;           /* base64 payload of the current store */
+
+    /* The response being opened */
+    const unsigned char *key;
+    struct kv_buffer plain;         /* opened text of a raw retrieve */
+    int state;                      /* SCAN_* */
+    size_t matched;                 /* bytes of payload_key matched */
+    unsigned int bits;              /* base64 carry */
+    int nbits;
+    unsigned char head[KV_CRYPT_HEAD];
+    size_t head_len;
+    unsigned char tag[KV_CRYPT_TAG]; /* latest bytes, held back */
+    size_t tag_len;
+    int failed;
+};
+
+/* Base64 written into a buffer reserved for all of it */
+struct b64_out {
+    char *dst;
+    size_t len;
+    unsigned char carry[3];
+    int ncarry;
+};
+
+static void b64_group(struct b64_out *b, const unsigned char *in) {
+    char *d = b->dst + b->len;
+    d[0] = alphabet[in[0] >> 2];
+    d[1] = alphabet[((in[0] & 3) << 4) | (in[1] >> 4)];
+    d[2] = alphabet[((in[1] & 15) << 2) | (in[2] >> 6)];
+    d[3] = alphabet[in[2] & 63];
+    b->len += 4;
+}
+
+static void b64_put(struct b64_out *b, const unsigned char *src, size_t n) {
+    /* Top up a group left over from the last call first */
+    while(b->ncarry > 0 && n > 0) {
+        b->carry[b->ncarry++] = *src++;
+        n--;
+        if(b->ncarry == 3) {
+            b64_group(b, b->carry);
+            b->ncarry = 0;
+        }
+    }
+    for(; n >= 3; src += 3, n -= 3) b64_group(b, src);
+    while(n-- > 0) b->carry[b->ncarry++] = *src++;
+}
+
+static void b64_finish(struct b64_out *b) {
+    if(b->ncarry == 0) return;
+    int n = b->ncarry;
+    memset(b->carry + n, 0, 3 - (size_t)n);
+    b64_group(b, b->carry);
+    for(int i = n + 1; i < 4; i++) b->dst[b->len - 4 + (size_t)i] = '=';
+    b->ncarry = 0;
+}
+
+static int b64_value(unsigned char c) {
+    if(c >= 'A' && c <= 'Z') return c - 'A';
+    if(c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if(c >= '0' && c <= '9') return c - '0' + 52;
+    if(c == '+' || c == '-') return 62;
+    if(c == '/' || c == '_') return 63;
+    return -1;
+}
+
+static const EVP_CIPHER *cipher_for(int cipher) {
+    switch(cipher) {
+    case KV_CIPHER_AES_GCM:
+        return EVP_aes_256_gcm();
+#ifndef OPENSSL_NO_CHACHA
+    case KV_CIPHER_CHACHA20:
+        return EVP_chacha20_poly1305();
+#endif
+    default:
+        return NULL;
+    }
+}
+
+/* Whether the CPU has AES instructions, which OpenSSL's AES-GCM runs on */
+static int aes_hardware(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__) && defined(__linux__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    return (hwcap & HWCAP_AES) && (hwcap & HWCAP_PMULL);
+#else
+    return 0;
+#endif
+}
+
+int kv_cipher_available(int cipher) {
+    if(cipher == KV_CIPHER_AUTO) {
+        return kv_cipher_available(KV_CIPHER_AES_GCM) || kv_cipher_available(KV_CIPHER_CHACHA20);
+    }
+    return cipher_for(cipher) != NULL;
+}
+
+void kv_crypt_free(struct kv_crypt *crypt) {
+    if(!crypt) return;
+
+    for(int i = 0; i < KV_CRYPT_KEYS; i++) kv_free(crypt->keys[i].token);
+    if(crypt->password) OPENSSL_cleanse(crypt->password, strlen(crypt->password));
+    kv_free(crypt->password);
+    EVP_CIPHER_CTX_free(crypt->ctx);
+    if(crypt->plain.data) OPENSSL_cleanse(crypt->plain.data, crypt->plain.capacity);
+    kv_buffer_free(&crypt->out);
+    kv_buffer_free(&crypt->plain);
+    OPENSSL_cleanse(crypt, sizeof(*crypt));
+    kv_free(crypt);
+}
+
+int kv_client_set_encryption(kv_client *client, const char *password, int cipher) {
+    if(!password) {
+        kv_crypt_free(client->crypt);
+        client->crypt = NULL;
+        return 1;
+    }
+
+    if(cipher == KV_CIPHER_AUTO) {
+        int aes = kv_cipher_available(KV_CIPHER_AES_GCM);
+        int chacha = kv_cipher_available(KV_CIPHER_CHACHA20);
+        cipher = aes && (aes_hardware() || !chacha) ? KV_CIPHER_AES_GCM : KV_CIPHER_CHACHA20;
+    }
+    if(!kv_cipher_available(cipher)) {
+        snprintf(client->error, sizeof(client->error), "Cipher %d not built in", cipher);
+        return 0;
+    }
+
+    struct kv_crypt *crypt = kv_calloc(1, sizeof(*crypt));
+    if(crypt) crypt->password = kv_strdup(password);
+    if(!crypt || !crypt->password) {
+        kv_crypt_free(crypt);
+        snprintf(client->error, sizeof(client->error), "Out of memory");
+        return 0;
+    }
+    crypt->cipher = cipher;
+
+    kv_crypt_free(client->crypt);
+    client->crypt = crypt;
+    return 1;
+}
+
+int kv_client_cipher(const kv_client *client) {
+    return client->crypt ? client->crypt->cipher : 0;
+}
+
+/* The key for the client's token, derived on first use. NULL, with the
+ * client's error set, on failure. */
+static const unsigned char *key_for(kv_client *client) {
+    struct kv_crypt *crypt = client->crypt;
+    if(!client->token) {
+        snprintf(client->error, sizeof(client->error), "Token required");
+        return NULL;
+    }
+    for(int i = 0; i < KV_CRYPT_KEYS; i++) {
+        if(crypt->keys[i].token && strcmp(crypt->keys[i].token, client->token) == 0) {
+            return crypt->keys[i].key;
+        }
+    }
+
+    struct kv_crypt_key *slot = &crypt->keys[crypt->next_key];
+    crypt->next_key = (crypt->next_key + 1) % KV_CRYPT_KEYS;
+    if(crypt->ctx_key == slot->key) crypt->ctx_key = NULL;
+    kv_free(slot->token);
+    slot->token = kv_strdup(client->token);
+
+    /* The token salts the password, so each token gets its own key */
+    static const char prefix[] = "libkv-crypt:";
+    size_t token_len = strlen(client->token);
+    unsigned char *salt = kv_malloc(sizeof(prefix) - 1 + token_len);
+    int ok = slot->token && salt;
+    if(ok) {
+        memcpy(salt, prefix, sizeof(prefix) - 1);
+        memcpy(salt + sizeof(prefix) - 1, client->token, token_len);
+        ok = PKCS5_PBKDF2_HMAC(crypt->password, (int)strlen(crypt->password),
+                               salt, (int)(sizeof(prefix) - 1 + token_len),
+                               KV_CRYPT_ITERATIONS, EVP_sha256(), KV_CRYPT_KEY, slot->key) == 1;
+    }
+    kv_free(salt);
+    if(!ok) {
+        kv_free(slot->token);
+        slot->token = NULL;
+        snprintf(client->error, sizeof(client->error), "Key derivation failed");
+        return NULL;
+    }
+    return slot->key;
+}
+
+/* Key ctx for cipher and set its nonce; the key schedule is only redone
+ * when the cipher, key or direction changes */
+static int cipher_init(struct kv_crypt *crypt, int cipher, const unsigned char *key,
+                       const unsigned char *nonce, int encrypt) {
+    const EVP_CIPHER *evp = cipher_for(cipher);
+    if(!evp) return 0;
+    if(!crypt->ctx && !(crypt->ctx = EVP_CIPHER_CTX_new())) return 0;
+
+    if(crypt->ctx_key == key && crypt->ctx_cipher == cipher && crypt->ctx_encrypt == encrypt) {
+        return EVP_CipherInit_ex(crypt->ctx, NULL, NULL, NULL, nonce, encrypt) == 1;
+    }
+    crypt->ctx_key = NULL;
+    if(EVP_CipherInit_ex(crypt->ctx, evp, NULL, key, nonce, encrypt) != 1) return 0;
+    crypt->ctx_key = key;
+    crypt->ctx_cipher = cipher;
+    crypt->ctx_encrypt = encrypt;
+    return 1;
+}
+
+/* ---- sealing ---- */
+
+const char *kv_crypt_seal(kv_client *client, const char *text, size_t len, size_t *out_len) {
+    struct kv_crypt *crypt = client->crypt;
+    const unsigned char *key = key_for(client);
+    if(!key) return NULL;
+
+    unsigned char head[KV_CRYPT_HEAD];
+    head[0] = (unsigned char)crypt->cipher;
+    if(len > (size_t)INT32_MAX || RAND_bytes(head + 1, KV_CRYPT_NONCE) != 1 ||
+       !cipher_init(crypt, crypt->cipher, key, head + 1, 1)) {
+        crypt->ctx_key = NULL;
+        snprintf(client->error, sizeof(client->error), "Encryption failed");
+        return NULL;
+    }
+
+    size_t raw = KV_CRYPT_HEAD + len + KV_CRYPT_TAG;
+    kv_buffer_reset(&crypt->out);
+    if(!kv_buffer_reserve(&crypt->out, (raw + 2) / 3 * 4)) {
+        snprintf(client->error, sizeof(client->error), "Out of memory");
+        return NULL;
+    }
+
+    struct b64_out b64 = { crypt->out.data, 0, { 0 }, 0 };
+    b64_put(&b64, head, sizeof(head));
+
+    unsigned char block[KV_CRYPT_CHUNK];
+    int n, ok = 1;
+    for(size_t off = 0; ok && off < len; off += KV_CRYPT_CHUNK) {
+        size_t chunk = len - off < KV_CRYPT_CHUNK ? len - off : KV_CRYPT_CHUNK;
+        ok = EVP_EncryptUpdate(crypt->ctx, block, &n, (const unsigned char *)text + off, (int)chunk) == 1;
+        if(ok) b64_put(&b64, block, (size_t)n);
+    }
+
+    unsigned char tag[KV_CRYPT_TAG];
+    ok = ok && EVP_EncryptFinal_ex(crypt->ctx, block, &n) == 1;
+    if(ok && n > 0) b64_put(&b64, block, (size_t)n);
+    ok = ok && EVP_CIPHER_CTX_ctrl(crypt->ctx, EVP_CTRL_AEAD_GET_TAG, KV_CRYPT_TAG, tag) == 1;
+    OPENSSL_cleanse(block, sizeof(block));
+    if(!ok) {
+        crypt->ctx_key = NULL;
+        snprintf(client->error, sizeof(client->error), "Encryption failed");
+        return NULL;
+    }
+    b64_put(&b64, tag, sizeof(tag));
+    b64_finish(&b64);
+
+    crypt->out.size = b64.len;
+    crypt->out.data[b64.len] = 0;
+    *out_len = b64.len;
+    return crypt->out.data;
+}
+
+/* ---- opening ---- */
+
+int kv_crypt_begin(kv_client *client) {
+    struct kv_crypt *crypt = client->crypt;
+    crypt->key = key_for(client);
+    if(!crypt->key) return 0;
+
+    kv_crypt_reset(crypt);
+    client->response.crypt = crypt;
+    return 1;
+}
+
+void kv_crypt_reset(struct kv_crypt *crypt) {
+    crypt->state = SCAN_KEY;
+    crypt->matched = 0;
+    crypt->bits = 0;
+    crypt->nbits = 0;
+    crypt->head_len = 0;
+    crypt->tag_len = 0;
+    crypt->failed = 0;
+    kv_buffer_reset(&crypt->plain);
+}
+
+/* Decrypt n ciphertext bytes and pass the plaintext on */
+static void open_bytes(struct kv_response *response, const unsigned char *bytes, size_t n) {
+    struct kv_crypt *crypt = response->crypt;
+    unsigned char plain[KV_CRYPT_CHUNK];
+    int out;
+
+    while(n > 0 && !crypt->failed) {
+        size_t chunk = n < sizeof(plain) ? n : sizeof(plain);
+        if(EVP_DecryptUpdate(crypt->ctx, plain, &out, bytes, (int)chunk) != 1) {
+            crypt->failed = 1;
+        } else if(response->raw) {
+            if(!kv_buffer_append(&crypt->plain, plain, (size_t)out)) crypt->failed = 1;
+        } else if(response->state == KV_PARSE_PENDING) {
+            /* Parsed as it is opened; the result is only handed out once
+             * the tag has been checked */
+            kv_response_parse(response, (const char *)plain, out);
+        }
+        bytes += chunk;
+        n -= chunk;
+    }
+}
+
+/* Decoded payload bytes: header first, then ciphertext, of which the last
+ * KV_CRYPT_TAG bytes seen so far are held back as the possible tag */
+static void payload_bytes(struct kv_response *response, const unsigned char *bytes, size_t n) {
+    struct kv_crypt *crypt = response->crypt;
+
+    if(crypt->head_len < KV_CRYPT_HEAD) {
+        size_t take = KV_CRYPT_HEAD - crypt->head_len;
+        if(take > n) take = n;
+        memcpy(crypt->head + crypt->head_len, bytes, take);
+        crypt->head_len += take;
+        bytes += take;
+        n -= take;
+        if(crypt->head_len < KV_CRYPT_HEAD) return;
+        if(!cipher_init(crypt, crypt->head[0], crypt->key, crypt->head + 1, 0)) {
+            crypt->ctx_key = NULL;
+            crypt->failed = 1;
+        }
+    }
+    if(crypt->failed || n == 0) return;
+
+    size_t total = crypt->tag_len + n;
+    if(total <= KV_CRYPT_TAG) {
+        memcpy(crypt->tag + crypt->tag_len, bytes, n);
+        crypt->tag_len = total;
+        return;
+    }
+
+    /* Everything but the last KV_CRYPT_TAG bytes is ciphertext */
+    size_t release = total - KV_CRYPT_TAG;
+    size_t from_tag = release < crypt->tag_len ? release : crypt->tag_len;
+    open_bytes(response, crypt->tag, from_tag);
+    memmove(crypt->tag, crypt->tag + from_tag, crypt->tag_len - from_tag);
+    crypt->tag_len -= from_tag;
+
+    size_t from_new = release - from_tag;
+    open_bytes(response, bytes, from_new);
+    memcpy(crypt->tag + crypt->tag_len, bytes + from_new, n - from_new);
+    crypt->tag_len += n - from_new;
+}
+
+static int is_space(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+int kv_crypt_write(struct kv_response *response, const char *data, size_t len) {
+    struct kv_crypt *crypt = response->crypt;
+    const unsigned char *bytes = (const unsigned char *)data;
+    unsigned char decoded[KV_CRYPT_CHUNK];
+    size_t ndecoded = 0;
+    size_t kept = 0;                /* start of the bytes still to keep */
+
+    for(size_t i = 0; i < len; i++) {
+        unsigned char c = bytes[i];
+        switch(crypt->state) {
+        case SCAN_KEY:
+            if(c == (unsigned char)payload_key[crypt->matched]) {
+                if(++crypt->matched == sizeof(payload_key) - 1) crypt->state = SCAN_COLON;
+            } else {
+                crypt->matched = c == '"';
+            }
+            break;
+        case SCAN_COLON:
+        case SCAN_QUOTE:
+            if(crypt->state == SCAN_COLON && c == ':') {
+                crypt->state = SCAN_QUOTE;
+            } else if(crypt->state == SCAN_QUOTE && c == '"') {
+                /* The envelope up to the opening quote is kept */
+                if(!kv_buffer_append(&response->body, data + kept, i + 1 - kept)) return 0;
+                crypt->state = SCAN_PAYLOAD;
+            } else if(!is_space(c)) {
+                crypt->state = SCAN_KEY;
+                crypt->matched = c == '"';
+            }
+            break;
+        case SCAN_PAYLOAD:
+            if(c == '"') {
+                payload_bytes(response, decoded, ndecoded);
+                ndecoded = 0;
+                crypt->state = SCAN_DONE;
+                kept = i;
+            } else if(c != '\\' && c != '=') {
+                /* "\/" is how some encoders write '/' */
+                int v = b64_value(c);
+                if(v < 0) {
+                    crypt->failed = 1;
+                    break;
+                }
+                crypt->bits = (crypt->bits << 6) | (unsigned int)v;
+                crypt->nbits += 6;
+                if(crypt->nbits >= 8) {
+                    crypt->nbits -= 8;
+                    decoded[ndecoded++] = (unsigned char)(crypt->bits >> crypt->nbits);
+                    if(ndecoded == sizeof(decoded)) {
+                        payload_bytes(response, decoded, ndecoded);
+                        ndecoded = 0;
+                    }
+                }
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    if(crypt->state == SCAN_PAYLOAD) {
+        payload_bytes(response, decoded, ndecoded);
+        return 1;
+    }
+    return kv_buffer_append(&response->body, data + kept, len - kept);
+}
+
+/* Check the tag of the payload just read. Returns 1 if the plaintext
+ * handed on is authentic, else 0 with the client's error set. */
+static int open_finish(kv_client *client) {
+    struct kv_crypt *crypt = client->crypt;
+    struct kv_response *response = &client->response;
+    unsigned char rest[KV_CRYPT_TAG];
+    int n;
+
+    const char *body = kv_response_body(response);
+    size_t version_len;
+    const char *version = kv_json_member(body, response->body.size, "version", &version_len);
+    if(version) client->version = strtol(version, NULL, 10);
+
+    if(crypt->state != SCAN_DONE) {
+        snprintf(client->error, sizeof(client->error), "Data is not encrypted");
+        return 0;
+    }
+    int ok = !crypt->failed && crypt->head_len == KV_CRYPT_HEAD && crypt->tag_len == KV_CRYPT_TAG &&
+             EVP_CIPHER_CTX_ctrl(crypt->ctx, EVP_CTRL_AEAD_SET_TAG, KV_CRYPT_TAG, crypt->tag) == 1 &&
+             EVP_DecryptFinal_ex(crypt->ctx, rest, &n) == 1;
+    if(!ok) {
+        crypt->ctx_key = NULL;
+        snprintf(client->error, sizeof(client->error), "Decryption failed: wrong password or altered data");
+    }
+    return ok;
+}
+
+struct json_object *kv_crypt_data(kv_client *client) {
+    int ok = open_finish(client);
+    struct json_object *data = kv_response_take(&client->response);
+    if(!ok) {
+        json_object_put(data);
+        return NULL;
+    }
+    if(client->response.state == KV_PARSE_INVALID) {
+        snprintf(client->error, sizeof(client->error), "Encrypted data is not JSON");
+    }
+    return data;
+}
+
+const char *kv_crypt_text(kv_client *client, size_t *len) {
+    struct kv_crypt *crypt = client->crypt;
+    if(!open_finish(client)) return NULL;
+
+    *len = crypt->plain.size;
+    return crypt->plain.data ? crypt->plain.data : "";
+}
+
+#else /* !KV_WITH_OPENSSL */
+
+int kv_cipher_available(int cipher) {
+    (void)cipher;
+    return 0;
+}
+
+int kv_client_set_encryption(kv_client *client, const char *password, int cipher) {
+    (void)cipher;
+    if(!password) return 1;
+    snprintf(client->error, sizeof(client->error), "Encryption not built in");
+    return 0;
+}
+
+int kv_client_cipher(const kv_client *client) {
+    (void)client;
+    return 0;
+}
+
+/* client->crypt is never set, so the rest is never reached */
+
+const char *kv_crypt_seal(kv_client *client, const char *text, size_t len, size_t *out_len) {
+    (void)text;
+    (void)len;
+    (void)out_len;
+    snprintf(client->error, sizeof(client->error), "Encryption not built in");
+    return NULL;
+}
+
+int kv_crypt_begin(kv_client *client) {
+    snprintf(client->error, sizeof(client->error), "Encryption not built in");
+    return 0;
+}
+
+void kv_crypt_reset(struct kv_crypt *crypt) {
+    (void)crypt;
+}
+
+int kv_crypt_write(struct kv_response *response, const char *data, size_t len) {
+    (void)response;
+    (void)data;
+    (void)len;
+    return 0;
+}
+
+struct json_object *kv_crypt_data(kv_client *client) {
+    (void)client;
+    return NULL;
+}
+
+const char *kv_crypt_text(kv_client *client, size_t *len) {
+    (void)client;
+    (void)len;
+    return NULL;
+}
+
+void kv_crypt_free(struct kv_crypt *crypt) {
+    (void)crypt;
+}
+
+#endif /* KV_WITH_OPENSSL */
@@ -0,0 +1,374 @@
+/*
+ * libkv external IP discovery: racing providers on kv_async.
+ *
+ * Each provider's request carries its own probe as userdata, so the
+ * losers of a race are cancelled one by one with kv_async_cancel. Answers
+ * are normalised through inet_pton/inet_ntop before they are compared.
+ *
+ * The DNS provider sends an RFC 8484 GET: the query for myip.opendns.com
+ * (type A) in DNS wire format, base64url-encoded into the dns parameter.
+ * The query is built once, when the provider is added.
+ *
+ * The host fingerprint is a hash of every interface that is up, not a
+ * loopback, and has an address: its name, flags and address. Entries are
+ * hashed separately and summed, so the order getifaddrs lists them in
+ * does not matter.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+#include "kv_codec.h"
+#include "kv_extip.h"
+#include "kv_internal.h"
+
+#define KV_EXTIP_DNS_NAME "myip.opendns.com"
+#define KV_DNS_TYPE_A     1
+#define KV_DNS_TYPE_AAAA  28
+#define KV_DNS_MEDIA_TYPE "application/dns-message"
+
+struct probe {
+    kv_extip *finder;
+    int running;
+    int answered;                   /* ip holds its answer */
+    char ip[KV_EXTIP_ADDR_MAX];
+};
+
+struct provider {
+    int kind;
+    char *url;                      /* with the query, for KV_EXTIP_DNS */
+};
+
+struct kv_extip {
+    struct provider providers[KV_EXTIP_MAX_PROVIDERS];
+    struct probe probes[KV_EXTIP_MAX_PROVIDERS];
+    int count;
+    long timeout;
+    int agree;
+    long ttl_ms;
+
+    kv_async *async;                /* of the lookup running, else NULL */
+    int running;
+    kv_extip_callback callback;
+    void *userdata;
+    unsigned long long lookup_print;    /* the host when the lookup began */
+
+    char ip[KV_EXTIP_ADDR_MAX];     /* cached answer, "" for none */
+    long long found_ms;
+    unsigned long long found_print;
+};
+
+static unsigned long long fnv1a(unsigned long long hash, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    for(size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static unsigned long long host_fingerprint(void) {
+    struct ifaddrs *list;
+    unsigned long long print = 0;
+    if(getifaddrs(&list) != 0) return 0;
+
+    for(struct ifaddrs *ifa = list; ifa; ifa = ifa->ifa_next) {
+        if(!ifa->ifa_addr || !(ifa->ifa_flags & IFF_UP) || (ifa->ifa_flags & IFF_LOOPBACK)) continue;
+
+        const void *addr;
+        size_t len;
+        if(ifa->ifa_addr->sa_family == AF_INET) {
+            addr = &((const struct sockaddr_in *)ifa->ifa_addr)->sin_addr;
+            len = sizeof(struct in_addr);
+        } else if(ifa->ifa_addr->sa_family == AF_INET6) {
+            addr = &((const struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr;
+            len = sizeof(struct in6_addr);
+        } else {
+            continue;
+        }
+
+        unsigned long long hash = fnv1a(14695981039346656037ULL, ifa->ifa_name, strlen(ifa->ifa_name));
+        hash = fnv1a(hash, &ifa->ifa_flags, sizeof(ifa->ifa_flags));
+        print += fnv1a(hash, addr, len);
+    }
+    freeifaddrs(list);
+    return print;
+}
+
+/* Put the address in text[0..len) into out in canonical form; 0 if it is
+ * not an IPv4 or IPv6 address */
+static int normalise(const char *text, size_t len, char *out) {
+    char buf[KV_EXTIP_ADDR_MAX];
+    unsigned char addr[sizeof(struct in6_addr)];
+
+    while(len > 0 && (text[0] == ' ' || text[0] == '\t' || text[0] == '\r' || text[0] == '\n')) {
+        text++;
+        len--;
+    }
+    while(len > 0 && (text[len - 1] == ' ' || text[len - 1] == '\t' ||
+                      text[len - 1] == '\r' || text[len - 1] == '\n')) {
+        len--;
+    }
+    if(len == 0 || len >= sizeof(buf)) return 0;
+    memcpy(buf, text, len);
+    buf[len] = 0;
+
+    int family = strchr(buf, ':') ? AF_INET6 : AF_INET;
+    if(inet_pton(family, buf, addr) != 1) return 0;
+    return inet_ntop(family, addr, out, KV_EXTIP_ADDR_MAX) != NULL;
+}
+
+/* ---- DNS over HTTPS ---- */
+
+static const char base64url[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/* url?dns=<query for name, type A, base64url without padding> */
+char *kv_dns_query_url(const char *url, const char *name) {
+    unsigned char query[512];
+    size_t len = 0;
+
+    /* Header: ID 0 (RFC 8484 4.1, for caching), RD set, one question */
+    static const unsigned char header[12] = { 0, 0, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0 };
+    memcpy(query, header, sizeof(header));
+    len = sizeof(header);
+
+    for(const char *label = name; *label;) {
+        const char *dot = strchr(label, '.');
+        size_t label_len = dot ? (size_t)(dot - label) : strlen(label);
+        if(label_len == 0 || label_len > 63 || len + label_len + 6 > sizeof(query)) return NULL;
+        query[len++] = (unsigned char)label_len;
+        memcpy(query + len, label, label_len);
+        len += label_len;
+        label += label_len + (dot ? 1 : 0);
+    }
+    query[len++] = 0;
+    query[len++] = 0;
+    query[len++] = KV_DNS_TYPE_A;
+    query[len++] = 0;
+    query[len++] = 1;               /* class IN */
+
+    size_t url_len = strlen(url);
+    char *out = kv_malloc(url_len + 5 + (len + 2) / 3 * 4 + 1);
+    if(!out) return NULL;
+
+    char *p = out + sprintf(out, "%s%cdns=", url, strchr(url, '?') ? '&' : '?');
+    for(size_t i = 0; i < len; i += 3) {
+        unsigned long bits = (unsigned long)query[i] << 16;
+        if(i + 1 < len) bits |= (unsigned long)query[i + 1] << 8;
+        if(i + 2 < len) bits |= query[i + 2];
+
+        *p++ = base64url[(bits >> 18) & 63];
+        *p++ = base64url[(bits >> 12) & 63];
+        if(i + 1 < len) *p++ = base64url[(bits >> 6) & 63];
+        if(i + 2 < len) *p++ = base64url[bits & 63];
+    }
+    *p = 0;
+    return out;
+}
+
+/* Step over a possibly compressed name at msg[pos]; 0 if it runs off the end */
+static size_t dns_skip_name(const unsigned char *msg, size_t len, size_t pos) {
+    while(pos < len) {
+        unsigned char c = msg[pos];
+        if(c == 0) return pos + 1;
+        if((c & 0xc0) == 0xc0) return pos + 2 <= len ? pos + 2 : 0;
+        pos += (size_t)c + 1;
+    }
+    return 0;
+}
+
+/* The first A or AAAA record in the answer section of a DNS response */
+int kv_dns_answer(const unsigned char *msg, size_t len, char *out) {
+    if(len < 12) return 0;
+    if(!(msg[2] & 0x80) || (msg[3] & 0x0f) != 0) return 0;     /* not a response, or an error */
+
+    unsigned questions = (unsigned)msg[4] << 8 | msg[5];
+    unsigned answers = (unsigned)msg[6] << 8 | msg[7];
+    size_t pos = 12;
+
+    for(unsigned i = 0; i < questions; i++) {
+        pos = dns_skip_name(msg, len, pos);
+        if(!pos || pos + 4 > len) return 0;
+        pos += 4;
+    }
+
+    for(unsigned i = 0; i < answers; i++) {
+        pos = dns_skip_name(msg, len, pos);
+        if(!pos || pos + 10 > len) return 0;
+
+        unsigned type = (unsigned)msg[pos] << 8 | msg[pos + 1];
+        size_t rdlength = (size_t)msg[pos + 8] << 8 | msg[pos + 9];
+        pos += 10;
+        if(pos + rdlength > len) return 0;
+
+        if(type == KV_DNS_TYPE_A && rdlength == 4) {
+            return inet_ntop(AF_INET, msg + pos, out, KV_EXTIP_ADDR_MAX) != NULL;
+        }
+        if(type == KV_DNS_TYPE_AAAA && rdlength == 16) {
+            return inet_ntop(AF_INET6, msg + pos, out, KV_EXTIP_ADDR_MAX) != NULL;
+        }
+        pos += rdlength;
+    }
+    return 0;
+}
+
+/* ---- finder ---- */
+
+kv_extip *kv_extip_new(void) {
+    kv_extip *finder = kv_calloc(1, sizeof(*finder));
+    if(!finder) return NULL;
+
+    finder->timeout = 10L;
+    finder->agree = 1;
+    for(int i = 0; i < KV_EXTIP_MAX_PROVIDERS; i++) finder->probes[i].finder = finder;
+    return finder;
+}
+
+void kv_extip_free(kv_extip *finder) {
+    if(!finder) return;
+
+    for(int i = 0; i < finder->count; i++) kv_free(finder->providers[i].url);
+    kv_free(finder);
+}
+
+int kv_extip_add(kv_extip *finder, int kind, const char *url) {
+    if(finder->count >= KV_EXTIP_MAX_PROVIDERS || !url) return 0;
+
+    char *full;
+    switch(kind) {
+    case KV_EXTIP_JSON:
+    case KV_EXTIP_TEXT:
+        full = kv_strdup(url);
+        break;
+    case KV_EXTIP_DNS:
+        full = kv_dns_query_url(url, KV_EXTIP_DNS_NAME);
+        break;
+    default:
+        return 0;
+    }
+    if(!full) return 0;
+
+    finder->providers[finder->count].kind = kind;
+    finder->providers[finder->count].url = full;
+    finder->count++;
+    return 1;
+}
+
+void kv_extip_set_timeout(kv_extip *finder, long timeout) {
+    finder->timeout = timeout;
+}
+
+void kv_extip_set_agree(kv_extip *finder, int agree) {
+    finder->agree = agree > 0 ? agree : 1;
+}
+
+void kv_extip_set_cache(kv_extip *finder, long ttl_ms) {
+    finder->ttl_ms = ttl_ms > 0 ? ttl_ms : 0;
+    if(!finder->ttl_ms) finder->ip[0] = 0;
+}
+
+void kv_extip_forget(kv_extip *finder) {
+    finder->ip[0] = 0;
+}
+
+const char *kv_extip_cached(kv_extip *finder) {
+    if(!finder->ip[0] || kv_now_ms() - finder->found_ms >= finder->ttl_ms) return NULL;
+    if(host_fingerprint() != finder->found_print) return NULL;
+    return finder->ip;
+}
+
+/* The lookup is over: cancel what still runs, remember the answer, and
+ * report it */
+static void finish(kv_extip *finder, const char *ip) {
+    for(int i = 0; i < finder->count; i++) {
+        if(finder->probes[i].running) {
+            kv_async_cancel(finder->async, &finder->probes[i]);
+            finder->probes[i].running = 0;
+        }
+    }
+    finder->running = 0;
+    finder->async = NULL;
+
+    if(ip && finder->ttl_ms > 0) {
+        snprintf(finder->ip, sizeof(finder->ip), "%s", ip);
+        finder->found_ms = kv_now_ms();
+        finder->found_print = finder->lookup_print;
+    }
+
+    /* The callback may start the next lookup */
+    char answer[KV_EXTIP_ADDR_MAX];
+    if(ip) snprintf(answer, sizeof(answer), "%s", ip);
+    finder->callback(ip ? answer : NULL, finder->userdata);
+}
+
+static int parse_answer(int kind, const struct kv_async_result *result, char *out) {
+    if(result->status < 200 || result->status >= 300) return 0;
+
+    if(kind == KV_EXTIP_DNS) {
+        return kv_dns_answer((const unsigned char *)result->body, result->body_size, out);
+    }
+    if(kind == KV_EXTIP_TEXT) {
+        return normalise(result->body, result->body_size, out);
+    }
+
+    size_t len;
+    const char *value = kv_json_member(result->body, result->body_size, "ip", &len);
+    if(!value || len < 2 || value[0] != '"' || value[len - 1] != '"') return 0;
+    return normalise(value + 1, len - 2, out);
+}
+
+static void on_answer(const struct kv_async_result *result, void *userdata) {
+    struct probe *probe = (struct probe *)userdata;
+    kv_extip *finder = probe->finder;
+    int index = (int)(probe - finder->probes);
+
+    probe->running = 0;
+    finder->running--;
+    probe->answered = parse_answer(finder->providers[index].kind, result, probe->ip);
+
+    if(probe->answered) {
+        int same = 0;
+        for(int i = 0; i < finder->count; i++) {
+            if(finder->probes[i].answered && strcmp(finder->probes[i].ip, probe->ip) == 0) same++;
+        }
+        if(same >= finder->agree) {
+            finish(finder, probe->ip);
+            return;
+        }
+    }
+    if(finder->running == 0) finish(finder, NULL);
+}
+
+int kv_extip_lookup(kv_extip *finder, kv_async *async,
+                    kv_extip_callback callback, void *userdata) {
+    if(finder->running || !callback) return 0;
+
+    finder->async = async;
+    finder->callback = callback;
+    finder->userdata = userdata;
+    finder->lookup_print = finder->ttl_ms > 0 ? host_fingerprint() : 0;
+
+    /* Providers answer raw bytes of three formats; each decodes its own.
+     * A DoH server only answers a GET that accepts a DNS message (RFC
+     * 8484, section 4.1). */
+    for(int i = 0; i < finder->count; i++) {
+        struct probe *probe = &finder->probes[i];
+        const struct provider *provider = &finder->providers[i];
+        const char *accept = provider->kind == KV_EXTIP_DNS ? KV_DNS_MEDIA_TYPE : NULL;
+        probe->answered = 0;
+        probe->running = kv_async_get_raw(async, provider->url, finder->timeout, accept,
+                                          on_answer, probe);
+        finder->running += probe->running;
+    }
+
+    if(finder->running == 0) {
+        finder->async = NULL;
+        return 0;
+    }
+    return 1;
+}
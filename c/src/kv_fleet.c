@@ -0,0 +1,268 @@
+/*
+ * libkv fleet mode: a fixed worker pool running one job per device per
+ * pass, with work stealing between the workers' queues.
+ *
+ * Each pass deals the device indexes round-robin into the workers'
+ * queues. A worker takes from the front of its own queue and, once that
+ * is empty, from the back of the others', so the owner and a thief only
+ * meet on the last item. No work is added during a pass, so a worker that
+ * finds every queue empty is done.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "kv_fleet.h"
+#include "kv_internal.h"
+
+struct kv_fleet_device {
+    char *token;
+    void *device;
+};
+
+/* Device indexes for one worker in the current pass */
+struct kv_fleet_queue {
+    pthread_mutex_t lock;
+    int *items;
+    int begin;                      /* owner takes from here */
+    int end;                        /* thieves take from here */
+    int capacity;
+};
+
+struct kv_fleet_worker {
+    kv_fleet *fleet;
+    int index;
+    pthread_t thread;
+    kv_client *client;
+    struct kv_fleet_queue queue;
+};
+
+struct kv_fleet {
+    struct kv_fleet_device *devices;
+    int ndevices;
+    int capacity;
+
+    struct kv_fleet_worker *workers;
+    int nworkers;
+    int started;                    /* threads created so far */
+    kv_share *share;                /* DNS cache and TLS sessions for every worker */
+
+    /* Pass control, all under lock */
+    pthread_mutex_t lock;
+    pthread_cond_t start;           /* a new pass, or stopping */
+    pthread_cond_t done;            /* the last worker finished the pass */
+    long generation;                /* bumped once per pass */
+    int active;                     /* workers still busy in this pass */
+    int stopping;
+    kv_fleet_job job;
+    void *ctx;
+    int succeeded;
+    long steals;
+};
+
+/* Next device for worker: its own queue first, then the others' */
+static int next_device(struct kv_fleet_worker *worker, long *steals) {
+    kv_fleet *fleet = worker->fleet;
+    struct kv_fleet_queue *queue = &worker->queue;
+    int device = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    if(queue->begin < queue->end) device = queue->items[queue->begin++];
+    pthread_mutex_unlock(&queue->lock);
+    if(device >= 0) return device;
+
+    for(int k = 1; k < fleet->nworkers && device < 0; k++) {
+        struct kv_fleet_queue *victim = &fleet->workers[(worker->index + k) % fleet->nworkers].queue;
+        pthread_mutex_lock(&victim->lock);
+        if(victim->begin < victim->end) {
+            device = victim->items[--victim->end];
+            (*steals)++;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return device;
+}
+
+static void *worker_main(void *arg) {
+    struct kv_fleet_worker *worker = (struct kv_fleet_worker *)arg;
+    kv_fleet *fleet = worker->fleet;
+    long seen = 0;
+
+    pthread_mutex_lock(&fleet->lock);
+    for(;;) {
+        while(!fleet->stopping && fleet->generation == seen) {
+            pthread_cond_wait(&fleet->start, &fleet->lock);
+        }
+        if(fleet->stopping) break;
+        seen = fleet->generation;
+        kv_fleet_job job = fleet->job;
+        void *ctx = fleet->ctx;
+        pthread_mutex_unlock(&fleet->lock);
+
+        int succeeded = 0;
+        long steals = 0;
+        int index;
+        while((index = next_device(worker, &steals)) >= 0) {
+            struct kv_fleet_device *device = &fleet->devices[index];
+            if(kv_client_set_token(worker->client, device->token) &&
+               job(worker->client, device->token, device->device, ctx)) {
+                succeeded++;
+            }
+        }
+
+        pthread_mutex_lock(&fleet->lock);
+        fleet->succeeded += succeeded;
+        fleet->steals += steals;
+        if(--fleet->active == 0) pthread_cond_signal(&fleet->done);
+    }
+    pthread_mutex_unlock(&fleet->lock);
+    return NULL;
+}
+
+static void stop_workers(kv_fleet *fleet) {
+    pthread_mutex_lock(&fleet->lock);
+    fleet->stopping = 1;
+    pthread_cond_broadcast(&fleet->start);
+    pthread_mutex_unlock(&fleet->lock);
+
+    for(int i = 0; i < fleet->started; i++) {
+        pthread_join(fleet->workers[i].thread, NULL);
+    }
+    fleet->started = 0;
+}
+
+kv_fleet *kv_fleet_new(const char *base_url, int workers) {
+    if(workers < 1) workers = 1;
+
+    kv_fleet *fleet = kv_calloc(1, sizeof(*fleet));
+    if(!fleet) return NULL;
+    fleet->workers = kv_calloc((size_t)workers, sizeof(*fleet->workers));
+    if(!fleet->workers) {
+        kv_free(fleet);
+        return NULL;
+    }
+
+    pthread_mutex_init(&fleet->lock, NULL);
+    pthread_cond_init(&fleet->start, NULL);
+    pthread_cond_init(&fleet->done, NULL);
+    fleet->nworkers = workers;
+
+    for(int i = 0; i < workers; i++) {
+        fleet->workers[i].fleet = fleet;
+        fleet->workers[i].index = i;
+        pthread_mutex_init(&fleet->workers[i].queue.lock, NULL);
+    }
+
+    fleet->share = kv_share_new(KV_SHARE_DNS | KV_SHARE_TLS);
+    for(int i = 0; fleet->share && i < workers; i++) {
+        struct kv_fleet_worker *worker = &fleet->workers[i];
+        worker->client = kv_client_new(base_url, NULL);
+        if(!worker->client || !kv_client_set_share(worker->client, fleet->share)) {
+            kv_fleet_free(fleet);
+            return NULL;
+        }
+    }
+
+    for(int i = 0; i < workers; i++) {
+        if(!fleet->share || pthread_create(&fleet->workers[i].thread, NULL, worker_main, &fleet->workers[i]) != 0) {
+            kv_fleet_free(fleet);
+            return NULL;
+        }
+        fleet->started++;
+    }
+    return fleet;
+}
+
+void kv_fleet_free(kv_fleet *fleet) {
+    if(!fleet) return;
+
+    stop_workers(fleet);
+    for(int i = 0; i < fleet->nworkers; i++) {
+        struct kv_fleet_worker *worker = &fleet->workers[i];
+        kv_client_free(worker->client);
+        kv_free(worker->queue.items);
+        pthread_mutex_destroy(&worker->queue.lock);
+    }
+    for(int i = 0; i < fleet->ndevices; i++) {
+        kv_free(fleet->devices[i].token);
+    }
+    kv_share_free(fleet->share);
+
+    pthread_cond_destroy(&fleet->done);
+    pthread_cond_destroy(&fleet->start);
+    pthread_mutex_destroy(&fleet->lock);
+    kv_free(fleet->devices);
+    kv_free(fleet->workers);
+    kv_free(fleet);
+}
+
+int kv_fleet_add(kv_fleet *fleet, const char *token, void *device) {
+    if(!token) return 0;
+
+    if(fleet->ndevices == fleet->capacity) {
+        int capacity = fleet->capacity ? fleet->capacity * 2 : 16;
+        struct kv_fleet_device *grown = kv_realloc(fleet->devices, sizeof(*grown) * capacity);
+        if(!grown) return 0;
+        fleet->devices = grown;
+        fleet->capacity = capacity;
+    }
+
+    char *copy = kv_strdup(token);
+    if(!copy) return 0;
+    fleet->devices[fleet->ndevices].token = copy;
+    fleet->devices[fleet->ndevices].device = device;
+    fleet->ndevices++;
+    return 1;
+}
+
+int kv_fleet_devices(const kv_fleet *fleet) {
+    return fleet->ndevices;
+}
+
+int kv_fleet_workers(const kv_fleet *fleet) {
+    return fleet->nworkers;
+}
+
+kv_client *kv_fleet_client(kv_fleet *fleet, int worker) {
+    if(worker < 0 || worker >= fleet->nworkers) return NULL;
+    return fleet->workers[worker].client;
+}
+
+int kv_fleet_run(kv_fleet *fleet, kv_fleet_job job, void *ctx) {
+    if(fleet->ndevices == 0) return 0;
+
+    /* Deal devices round-robin, so device i stays on worker i % n */
+    int share = (fleet->ndevices + fleet->nworkers - 1) / fleet->nworkers;
+    for(int i = 0; i < fleet->nworkers; i++) {
+        struct kv_fleet_queue *queue = &fleet->workers[i].queue;
+        if(queue->capacity < share) {
+            int *grown = kv_realloc(queue->items, sizeof(int) * share);
+            if(!grown) return 0;
+            queue->items = grown;
+            queue->capacity = share;
+        }
+        queue->begin = queue->end = 0;
+    }
+    for(int i = 0; i < fleet->ndevices; i++) {
+        struct kv_fleet_queue *queue = &fleet->workers[i % fleet->nworkers].queue;
+        queue->items[queue->end++] = i;
+    }
+
+    pthread_mutex_lock(&fleet->lock);
+    fleet->job = job;
+    fleet->ctx = ctx;
+    fleet->succeeded = 0;
+    fleet->active = fleet->nworkers;
+    fleet->generation++;
+    pthread_cond_broadcast(&fleet->start);
+    while(fleet->active > 0) {
+        pthread_cond_wait(&fleet->done, &fleet->lock);
+    }
+    int succeeded = fleet->succeeded;
+    pthread_mutex_unlock(&fleet->lock);
+    return succeeded;
+}
+
+long kv_fleet_steals(const kv_fleet *fleet) {
+    return fleet->steals;
+}
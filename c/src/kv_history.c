@@ -0,0 +1,167 @@
+/*
+ * libkv event history: GET /api/history pages and a cursor iterator.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "kv_history.h"
+#include "kv_internal.h"
+
+#define KV_HISTORY_URL_MAX 768
+
+struct kv_history_iter {
+    kv_client *client;
+    struct kv_history_query query;  /* since and type owned */
+    struct json_object *page;       /* events of the current page */
+    int index;                      /* next event in page */
+    long next_before;               /* cursor for the next page, 0 if none */
+    int pages;
+    int failed;
+};
+
+/* Append text to out, percent-encoding all but RFC 3986 unreserved bytes
+ * when encode is set */
+static int url_append(char *out, size_t size, size_t *len, const char *text, int encode) {
+    static const char hex[] = "0123456789ABCDEF";
+
+    for(const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        int plain = !encode || (*c >= 'A' && *c <= 'Z') || (*c >= 'a' && *c <= 'z') ||
+                    (*c >= '0' && *c <= '9') || strchr("-._~", *c);
+        if(*len + (plain ? 1 : 3) >= size) return 0;
+        if(plain) {
+            out[(*len)++] = (char)*c;
+        } else {
+            out[(*len)++] = '%';
+            out[(*len)++] = hex[*c >> 4];
+            out[(*len)++] = hex[*c & 15];
+        }
+    }
+    out[*len] = 0;
+    return 1;
+}
+
+int kv_history_url(const kv_client *client, const struct kv_history_query *query,
+                   char *out, size_t size) {
+    char number[32];
+    size_t len = 0;
+    int limit = query->limit > 0 && query->limit < KV_HISTORY_PAGE_MAX ? query->limit : KV_HISTORY_PAGE_MAX;
+
+    snprintf(number, sizeof(number), "?limit=%d", limit);
+    int ok = url_append(out, size, &len, kv_client_endpoint(client, KV_ENDPOINT_HISTORY), 0) &&
+             url_append(out, size, &len, number, 0);
+    if(ok && query->before > 0) {
+        snprintf(number, sizeof(number), "&before=%ld", query->before);
+        ok = url_append(out, size, &len, number, 0);
+    }
+    if(ok && query->since) {
+        ok = url_append(out, size, &len, "&since=", 0) && url_append(out, size, &len, query->since, 1);
+    }
+    if(ok && query->type) {
+        ok = url_append(out, size, &len, "&type=", 0) && url_append(out, size, &len, query->type, 1);
+    }
+    return ok;
+}
+
+struct json_object *kv_history_page(kv_client *client, const struct kv_history_query *query,
+                                    long *next_before) {
+    char url[KV_HISTORY_URL_MAX];
+    *next_before = 0;
+
+    if(!kv_history_url(client, query, url, sizeof(url))) {
+        snprintf(client->error, sizeof(client->error), "History query too long");
+        return NULL;
+    }
+    if(!kv_perform(client, "GET", url, NULL, 1, 0)) return NULL;
+    if(client->status < 200 || client->status >= 300) {
+        snprintf(client->error, sizeof(client->error), "HTTP %ld", client->status);
+        return NULL;
+    }
+
+    struct json_object *root = kv_response_take(&client->response);
+    struct json_object *events, *pagination, *has_more;
+    if(!root || !json_object_object_get_ex(root, "events", &events) ||
+       !json_object_is_type(events, json_type_array)) {
+        snprintf(client->error, sizeof(client->error), "Invalid history response");
+        json_object_put(root);
+        return NULL;
+    }
+
+    /* Events come newest first, so the last one is the cursor */
+    int count = json_object_array_length(events);
+    if(count > 0 && json_object_object_get_ex(root, "pagination", &pagination) &&
+       json_object_object_get_ex(pagination, "has_more", &has_more) &&
+       json_object_get_boolean(has_more)) {
+        *next_before = kv_history_event_seq(json_object_array_get_idx(events, count - 1));
+    }
+
+    json_object_get(events);
+    json_object_put(root);
+    return events;
+}
+
+kv_history_iter *kv_history_iter_new(kv_client *client, const struct kv_history_query *query) {
+    kv_history_iter *iter = kv_calloc(1, sizeof(*iter));
+    if(!iter) return NULL;
+
+    iter->client = client;
+    if(query) iter->query = *query;
+    iter->query.since = query && query->since ? kv_strdup(query->since) : NULL;
+    iter->query.type = query && query->type ? kv_strdup(query->type) : NULL;
+    if((query && query->since && !iter->query.since) || (query && query->type && !iter->query.type)) {
+        kv_history_iter_free(iter);
+        return NULL;
+    }
+    return iter;
+}
+
+void kv_history_iter_free(kv_history_iter *iter) {
+    if(!iter) return;
+    json_object_put(iter->page);
+    kv_free((char *)iter->query.since);
+    kv_free((char *)iter->query.type);
+    kv_free(iter);
+}
+
+struct json_object *kv_history_next(kv_history_iter *iter) {
+    while(!iter->page || iter->index >= (int)json_object_array_length(iter->page)) {
+        if(iter->failed || (iter->pages > 0 && iter->next_before == 0)) return NULL;
+
+        if(iter->pages > 0) iter->query.before = iter->next_before;
+        json_object_put(iter->page);
+        iter->page = kv_history_page(iter->client, &iter->query, &iter->next_before);
+        iter->index = 0;
+        if(!iter->page) {
+            iter->failed = 1;
+            return NULL;
+        }
+        iter->pages++;
+    }
+    return json_object_array_get_idx(iter->page, iter->index++);
+}
+
+int kv_history_failed(const kv_history_iter *iter) {
+    return iter->failed;
+}
+
+int kv_history_pages(const kv_history_iter *iter) {
+    return iter->pages;
+}
+
+long kv_history_event_seq(struct json_object *event) {
+    struct json_object *seq;
+    if(!event || !json_object_object_get_ex(event, "seq", &seq)) return 0;
+    return (long)json_object_get_int64(seq);
+}
+
+const char *kv_history_event_time(struct json_object *event) {
+    struct json_object *created;
+    if(!event || !json_object_object_get_ex(event, "created_at", &created)) return NULL;
+    return json_object_get_string(created);
+}
+
+struct json_object *kv_history_event_payload(struct json_object *event) {
+    struct json_object *payload;
+    if(!event || !json_object_object_get_ex(event, "payload", &payload)) return NULL;
+    return payload;
+}
@@ -0,0 +1,510 @@
+/*
+ * libkv multi-producer ingest: bounded lock-free rings drained into
+ * kv_queues by a pool of I/O threads.
+ *
+ * Each shard is a ring of slots carrying a sequence number (Vyukov's
+ * bounded queue). A producer claims a position with a CAS on the tail,
+ * fills the slot and publishes it by setting its sequence to position + 1;
+ * the one I/O thread that owns the shard takes slots while their sequence
+ * says they are published and hands each back by setting it to position +
+ * capacity. The tail is the only word producers of a shard contend on, and
+ * the consumer's head lives on a cache line of its own.
+ *
+ * An I/O thread with nothing to do sleeps on its own condition variable.
+ * idle tells producers how it sleeps: with an empty queue any push wakes
+ * it, while it waits out a batch's linger time only every nudge-th push on
+ * a shard does, so the ring cannot fill behind its back. Producers and the
+ * thread each fence between their store (slot, idle) and their load (idle,
+ * slots), so either the thread sees the reading or the producer sees it
+ * asleep.
+ *
+ * Flushes are tracked per shard: done is the head the thread had reached
+ * the last time its queue was empty, so every reading before it is
+ * settled. A flush records the tails and waits for done to pass them.
+ */
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "kv_ingest.h"
+#include "kv_internal.h"
+
+/* A lingering I/O thread is woken at most once per this many pushes to a
+ * shard (or half the ring, if that is smaller) */
+#define KV_INGEST_NUDGE 64
+
+#define IDLE_AWAKE     0
+#define IDLE_ASLEEP    1                /* queue empty: any push wakes it */
+#define IDLE_LINGERING 2                /* batch waiting: only nudges wake it */
+
+struct kv_ingest_thread;
+
+struct kv_ingest_token {
+    struct kv_ingest_token *next;       /* registration list */
+    char *token;
+    int shard;
+    struct kv_ingest_thread *owner;     /* the shard's I/O thread */
+};
+
+struct kv_ingest_slot {
+    atomic_size_t seq;
+    kv_ingest_token *token;
+    struct json_object *reading;
+};
+
+struct kv_ingest_shard {
+    /* Producers' line */
+    _Alignas(64) atomic_size_t tail;    /* next position to claim */
+    atomic_long dropped;
+    struct kv_ingest_slot *slots;
+    size_t mask;
+
+    /* The owning I/O thread's line */
+    _Alignas(64) size_t head;           /* next position to take */
+    atomic_size_t done;                 /* every position before it is settled */
+};
+
+struct kv_ingest_thread {
+    kv_ingest *ingest;
+    int index;
+    pthread_t thread;
+    kv_client *client;
+    kv_queue *queue;
+    long flushed;                       /* flush generation last carried out */
+
+    _Alignas(64) atomic_int idle;       /* IDLE_* */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+
+    /* Outcomes, written by this thread only */
+    atomic_long sent;
+    atomic_long superseded;
+    atomic_long failed;
+};
+
+struct kv_ingest {
+    struct kv_ingest_shard *shards;
+    int nshards;
+    size_t nudge_mask;
+    struct kv_ingest_thread *threads;
+    int nthreads;
+    int started;                        /* threads created so far */
+    kv_share *share;
+    kv_batch_callback callback;
+    void *userdata;
+
+    atomic_long flush_generation;
+    atomic_int stopping;
+
+    /* Registration and flush waits */
+    pthread_mutex_t lock;
+    pthread_cond_t settled;             /* some shard's done moved */
+    kv_ingest_token *tokens;
+    int next_shard;
+};
+
+static void count(atomic_long *counter) {
+    atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+static long settled_count(struct kv_ingest_thread *thread) {
+    return atomic_load_explicit(&thread->sent, memory_order_relaxed) +
+           atomic_load_explicit(&thread->superseded, memory_order_relaxed) +
+           atomic_load_explicit(&thread->failed, memory_order_relaxed);
+}
+
+/* kv_queue callback, on the token's I/O thread */
+static void on_result(const struct kv_batch_result *result, void *userdata) {
+    kv_ingest_token *token = (kv_ingest_token *)userdata;
+    struct kv_ingest_thread *thread = token->owner;
+
+    if(result->superseded) count(&thread->superseded);
+    else if(result->success) count(&thread->sent);
+    else count(&thread->failed);
+
+    kv_ingest *ingest = thread->ingest;
+    if(ingest->callback) ingest->callback(result, ingest->userdata);
+}
+
+/* Wake thread if it sleeps; with nudge, also if it is lingering */
+static void wake(struct kv_ingest_thread *thread, int nudge) {
+    atomic_thread_fence(memory_order_seq_cst);
+    int idle = atomic_load_explicit(&thread->idle, memory_order_relaxed);
+    if(idle == IDLE_AWAKE || (idle == IDLE_LINGERING && !nudge)) return;
+    if(atomic_exchange(&thread->idle, IDLE_AWAKE) == IDLE_AWAKE) return;
+
+    pthread_mutex_lock(&thread->lock);
+    pthread_cond_signal(&thread->wake);
+    pthread_mutex_unlock(&thread->lock);
+}
+
+static int shard_ready(const struct kv_ingest_shard *shard) {
+    const struct kv_ingest_slot *slot = &shard->slots[shard->head & shard->mask];
+    return atomic_load_explicit(&slot->seq, memory_order_acquire) == shard->head + 1;
+}
+
+/* Move published readings from thread's shards into its queue, at most one
+ * ring's worth per shard so a busy shard cannot starve the others. Returns
+ * the number moved. */
+static int drain(struct kv_ingest_thread *thread) {
+    kv_ingest *ingest = thread->ingest;
+    int moved = 0;
+
+    for(int s = thread->index; s < ingest->nshards; s += ingest->nthreads) {
+        struct kv_ingest_shard *shard = &ingest->shards[s];
+        for(size_t n = 0; n <= shard->mask && shard_ready(shard); n++) {
+            struct kv_ingest_slot *slot = &shard->slots[shard->head & shard->mask];
+            kv_ingest_token *token = slot->token;
+            struct json_object *reading = slot->reading;
+            atomic_store_explicit(&slot->seq, shard->head + shard->mask + 1, memory_order_release);
+            shard->head++;
+
+            /* 0 with no callback run means the reading was never queued;
+             * a failed forced flush has reported it already */
+            long before = settled_count(thread);
+            if(!kv_queue_store(thread->queue, token->token, reading, on_result, token) &&
+               settled_count(thread) == before) {
+                count(&thread->failed);
+            }
+            json_object_put(reading);
+            moved++;
+        }
+    }
+    return moved;
+}
+
+/* With the queue empty, everything taken so far is settled */
+static void settle(struct kv_ingest_thread *thread) {
+    kv_ingest *ingest = thread->ingest;
+    if(kv_queue_pending(thread->queue) > 0) return;
+
+    int moved = 0;
+    for(int s = thread->index; s < ingest->nshards; s += ingest->nthreads) {
+        struct kv_ingest_shard *shard = &ingest->shards[s];
+        if(atomic_load_explicit(&shard->done, memory_order_relaxed) != shard->head) {
+            atomic_store_explicit(&shard->done, shard->head, memory_order_release);
+            moved = 1;
+        }
+    }
+    if(moved) {
+        pthread_mutex_lock(&ingest->lock);
+        pthread_cond_broadcast(&ingest->settled);
+        pthread_mutex_unlock(&ingest->lock);
+    }
+}
+
+static int has_work(struct kv_ingest_thread *thread) {
+    kv_ingest *ingest = thread->ingest;
+    if(atomic_load(&ingest->stopping) || atomic_load(&ingest->flush_generation) != thread->flushed) {
+        return 1;
+    }
+    for(int s = thread->index; s < ingest->nshards; s += ingest->nthreads) {
+        if(shard_ready(&ingest->shards[s])) return 1;
+    }
+    return 0;
+}
+
+/* Sleep until a push, a flush or a stop wakes thread, or until its queue's
+ * linger time is up */
+static void doze(struct kv_ingest_thread *thread) {
+    long timeout = kv_queue_timeout(thread->queue);
+    if(timeout == 0) return;
+
+    atomic_store(&thread->idle, timeout < 0 ? IDLE_ASLEEP : IDLE_LINGERING);
+    atomic_thread_fence(memory_order_seq_cst);
+    if(has_work(thread)) {
+        atomic_store(&thread->idle, IDLE_AWAKE);
+        return;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    if(timeout > 0) {
+        deadline.tv_sec += timeout / 1000;
+        deadline.tv_nsec += (timeout % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&thread->lock);
+    while(atomic_load(&thread->idle) != IDLE_AWAKE) {
+        if(timeout < 0) {
+            pthread_cond_wait(&thread->wake, &thread->lock);
+        } else if(pthread_cond_timedwait(&thread->wake, &thread->lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&thread->lock);
+    atomic_store(&thread->idle, IDLE_AWAKE);
+}
+
+static void *io_main(void *arg) {
+    struct kv_ingest_thread *thread = (struct kv_ingest_thread *)arg;
+    kv_ingest *ingest = thread->ingest;
+
+    for(;;) {
+        int moved = drain(thread);
+        long generation = atomic_load(&ingest->flush_generation);
+        int stopping = atomic_load(&ingest->stopping);
+
+        /* A flush stays wanted until a pass finds the rings empty */
+        if(stopping || generation != thread->flushed) {
+            kv_queue_flush(thread->queue);
+            if(!moved) thread->flushed = generation;
+        } else {
+            kv_queue_poll(thread->queue);
+        }
+        settle(thread);
+
+        if(moved) continue;
+        if(stopping) break;
+        doze(thread);
+    }
+    return NULL;
+}
+
+static void stop_threads(kv_ingest *ingest) {
+    atomic_store(&ingest->stopping, 1);
+    for(int i = 0; i < ingest->started; i++) {
+        wake(&ingest->threads[i], 1);
+    }
+    for(int i = 0; i < ingest->started; i++) {
+        pthread_join(ingest->threads[i].thread, NULL);
+    }
+    ingest->started = 0;
+}
+
+kv_ingest *kv_ingest_new(const char *base_url, int threads, int shards, int capacity,
+                         long linger_ms) {
+    if(threads < 1) threads = 1;
+    if(shards < threads) shards = threads;
+
+    size_t slots = 2;
+    while(slots < (size_t)(capacity > 0 ? capacity : 1)) slots <<= 1;
+
+    kv_ingest *ingest = kv_calloc(1, sizeof(*ingest));
+    if(!ingest) return NULL;
+    ingest->shards = kv_calloc((size_t)shards, sizeof(*ingest->shards));
+    ingest->threads = kv_calloc((size_t)threads, sizeof(*ingest->threads));
+    if(!ingest->shards || !ingest->threads) {
+        kv_free(ingest->shards);
+        kv_free(ingest->threads);
+        kv_free(ingest);
+        return NULL;
+    }
+
+    pthread_mutex_init(&ingest->lock, NULL);
+    pthread_cond_init(&ingest->settled, NULL);
+    ingest->nshards = shards;
+    ingest->nthreads = threads;
+    ingest->nudge_mask = (slots / 2 < KV_INGEST_NUDGE ? slots / 2 : KV_INGEST_NUDGE) - 1;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    for(int i = 0; i < threads; i++) {
+        struct kv_ingest_thread *thread = &ingest->threads[i];
+        thread->ingest = ingest;
+        thread->index = i;
+        pthread_mutex_init(&thread->lock, NULL);
+        pthread_cond_init(&thread->wake, &attr);
+    }
+    pthread_condattr_destroy(&attr);
+
+    for(int s = 0; s < shards; s++) {
+        struct kv_ingest_shard *shard = &ingest->shards[s];
+        shard->slots = kv_calloc(slots, sizeof(*shard->slots));
+        if(!shard->slots) {
+            kv_ingest_free(ingest);
+            return NULL;
+        }
+        shard->mask = slots - 1;
+        for(size_t n = 0; n < slots; n++) {
+            atomic_init(&shard->slots[n].seq, n);
+        }
+    }
+
+    ingest->share = kv_share_new(KV_SHARE_DNS | KV_SHARE_TLS);
+    for(int i = 0; ingest->share && i < threads; i++) {
+        struct kv_ingest_thread *thread = &ingest->threads[i];
+        thread->client = kv_client_new(base_url, NULL);
+        if(thread->client) thread->queue = kv_queue_new(thread->client, KV_BATCH_MAX, linger_ms);
+        if(!thread->queue || !kv_client_set_share(thread->client, ingest->share)) {
+            kv_ingest_free(ingest);
+            return NULL;
+        }
+    }
+
+    for(int i = 0; i < threads; i++) {
+        if(!ingest->share || pthread_create(&ingest->threads[i].thread, NULL, io_main, &ingest->threads[i]) != 0) {
+            kv_ingest_free(ingest);
+            return NULL;
+        }
+        ingest->started++;
+    }
+    return ingest;
+}
+
+void kv_ingest_free(kv_ingest *ingest) {
+    if(!ingest) return;
+
+    stop_threads(ingest);
+    for(int i = 0; i < ingest->nthreads; i++) {
+        struct kv_ingest_thread *thread = &ingest->threads[i];
+        kv_queue_free(thread->queue);
+        kv_client_free(thread->client);
+        pthread_cond_destroy(&thread->wake);
+        pthread_mutex_destroy(&thread->lock);
+    }
+    for(int s = 0; s < ingest->nshards; s++) {
+        kv_free(ingest->shards[s].slots);
+    }
+    while(ingest->tokens) {
+        kv_ingest_token *next = ingest->tokens->next;
+        kv_free(ingest->tokens->token);
+        kv_free(ingest->tokens);
+        ingest->tokens = next;
+    }
+    kv_share_free(ingest->share);
+
+    pthread_cond_destroy(&ingest->settled);
+    pthread_mutex_destroy(&ingest->lock);
+    kv_free(ingest->shards);
+    kv_free(ingest->threads);
+    kv_free(ingest);
+}
+
+kv_ingest_token *kv_ingest_add(kv_ingest *ingest, const char *token) {
+    if(!token) return NULL;
+
+    pthread_mutex_lock(&ingest->lock);
+    kv_ingest_token *entry = ingest->tokens;
+    while(entry && strcmp(entry->token, token) != 0) entry = entry->next;
+    if(!entry) {
+        entry = kv_calloc(1, sizeof(*entry));
+        if(entry) entry->token = kv_strdup(token);
+        if(entry && entry->token) {
+            /* Deal tokens round-robin, so shard s holds every nshards-th */
+            entry->shard = ingest->next_shard;
+            entry->owner = &ingest->threads[entry->shard % ingest->nthreads];
+            ingest->next_shard = (ingest->next_shard + 1) % ingest->nshards;
+            entry->next = ingest->tokens;
+            ingest->tokens = entry;
+        } else {
+            kv_free(entry);
+            entry = NULL;
+        }
+    }
+    pthread_mutex_unlock(&ingest->lock);
+    return entry;
+}
+
+int kv_ingest_push(kv_ingest *ingest, kv_ingest_token *token, struct json_object *reading) {
+    if(!token || !reading) {
+        json_object_put(reading);
+        return 0;
+    }
+
+    struct kv_ingest_shard *shard = &ingest->shards[token->shard];
+    size_t pos = atomic_load_explicit(&shard->tail, memory_order_relaxed);
+    struct kv_ingest_slot *slot;
+    for(;;) {
+        slot = &shard->slots[pos & shard->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0) {
+            if(atomic_compare_exchange_weak_explicit(&shard->tail, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if(diff < 0) {
+            /* Still holding a reading from a lap ago: full */
+            count(&shard->dropped);
+            json_object_put(reading);
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&shard->tail, memory_order_relaxed);
+        }
+    }
+
+    slot->token = token;
+    slot->reading = reading;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    wake(token->owner, ((pos + 1) & ingest->nudge_mask) == 0);
+    return 1;
+}
+
+int kv_ingest_flush(kv_ingest *ingest) {
+    size_t *targets = kv_malloc(sizeof(size_t) * ingest->nshards);
+    if(!targets) return 0;
+
+    long failed = 0;
+    for(int i = 0; i < ingest->nthreads; i++) {
+        failed += atomic_load(&ingest->threads[i].failed);
+    }
+    for(int s = 0; s < ingest->nshards; s++) {
+        targets[s] = atomic_load(&ingest->shards[s].tail);
+    }
+
+    atomic_fetch_add(&ingest->flush_generation, 1);
+    for(int i = 0; i < ingest->nthreads; i++) {
+        wake(&ingest->threads[i], 1);
+    }
+
+    pthread_mutex_lock(&ingest->lock);
+    for(int s = 0; s < ingest->nshards; s++) {
+        /* Positions only grow, so done passing target is final */
+        while((intptr_t)(atomic_load_explicit(&ingest->shards[s].done, memory_order_acquire) - targets[s]) < 0) {
+            pthread_cond_wait(&ingest->settled, &ingest->lock);
+        }
+    }
+    pthread_mutex_unlock(&ingest->lock);
+    kv_free(targets);
+
+    for(int i = 0; i < ingest->nthreads; i++) {
+        failed -= atomic_load(&ingest->threads[i].failed);
+    }
+    return failed == 0;
+}
+
+void kv_ingest_set_callback(kv_ingest *ingest, kv_batch_callback callback, void *userdata) {
+    ingest->callback = callback;
+    ingest->userdata = userdata;
+}
+
+kv_client *kv_ingest_client(kv_ingest *ingest, int thread) {
+    if(thread < 0 || thread >= ingest->nthreads) return NULL;
+    return ingest->threads[thread].client;
+}
+
+int kv_ingest_threads(const kv_ingest *ingest) {
+    return ingest->nthreads;
+}
+
+int kv_ingest_shards(const kv_ingest *ingest) {
+    return ingest->nshards;
+}
+
+void kv_ingest_stats(const kv_ingest *ingest, struct kv_ingest_stats *out) {
+    memset(out, 0, sizeof(*out));
+    /* Outcomes first: every reading they count was pushed before the tails
+     * are read, so pending never goes negative */
+    for(int i = 0; i < ingest->nthreads; i++) {
+        struct kv_ingest_thread *thread = &ingest->threads[i];
+        out->sent += atomic_load_explicit(&thread->sent, memory_order_relaxed);
+        out->superseded += atomic_load_explicit(&thread->superseded, memory_order_relaxed);
+        out->failed += atomic_load_explicit(&thread->failed, memory_order_relaxed);
+    }
+    for(int s = 0; s < ingest->nshards; s++) {
+        struct kv_ingest_shard *shard = &ingest->shards[s];
+        out->pushed += (long)atomic_load_explicit(&shard->tail, memory_order_relaxed);
+        out->dropped += atomic_load_explicit(&shard->dropped, memory_order_relaxed);
+    }
+    out->pending = out->pushed - out->sent - out->superseded - out->failed;
+}
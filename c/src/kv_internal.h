@@ -0,0 +1,367 @@
+/*
+ * Internal definitions shared by the libkv translation units.
+ * Not installed; applications only see include/kv.h.
+ */
+
+#ifndef KV_INTERNAL_H
+#define KV_INTERNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <curl/curl.h>
+
+#include "kv.h"
+
+/* Growable byte buffer, always NUL-terminated when data != NULL */
+struct kv_buffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+/* Response sink for libcurl. Each chunk is fed to a streaming tokener as
+ * it arrives, so parsing overlaps the download; the raw bytes are only
+ * kept when keep_body is set. */
+struct kv_response {
+    struct kv_buffer body;          /* raw body, empty unless keep_body */
+    json_tokener *tokener;          /* created on first use, reused after */
+    struct json_object *json;       /* parsed root once complete */
+    size_t size;                    /* bytes received, kept or not */
+    int state;                      /* KV_PARSE_* */
+    int keep_body;
+    int raw;                        /* keep the body but do not parse it */
+    int cbor;                       /* Content-Type application/cbor: kept, decoded at the end */
+    int timed;                      /* add the time spent parsing to parse_us */
+    long long parse_us;
+    struct kv_crypt *crypt;         /* set: read through kv_crypt_write */
+};
+
+#define KV_PARSE_PENDING 0          /* still waiting for the end of the document */
+#define KV_PARSE_DONE    1
+#define KV_PARSE_INVALID 2          /* not JSON; remaining chunks are not parsed */
+
+/* Request body streamed from up to KV_UPLOAD_PARTS pieces in order, so a
+ * fixed envelope can wrap a caller's buffer without joining them */
+#define KV_UPLOAD_PARTS 3
+
+struct kv_upload {
+    const char *parts[KV_UPLOAD_PARTS];
+    size_t lens[KV_UPLOAD_PARTS];
+    int part;                       /* piece being sent */
+    size_t offset;                  /* bytes of it already sent */
+};
+
+/* Request body compression (kv_compress.c). The compressor objects are
+ * opaque here so only kv_compress.c needs the zlib and zstd headers. */
+struct kv_compress {
+    int method;                     /* KV_COMPRESS_* */
+    size_t min_size;                /* shorter bodies are sent as they are */
+    struct kv_buffer out;           /* compressed body of the current request */
+    void *zlib;                     /* z_stream, created on first use */
+    void *zstd;                     /* ZSTD_CCtx, created on first use */
+    void *dictionary;               /* ZSTD_CDict, NULL for none */
+};
+
+/* Client-side encryption (kv_crypt.c), opaque here so only kv_crypt.c
+ * needs the OpenSSL headers */
+struct kv_crypt;
+
+/* Transport policy (kv_retry.c): timeouts, retries with backoff, and the
+ * circuit breaker that stops a failing client from calling at all */
+struct kv_retry {
+    long connect_timeout_ms;
+    long timeout_ms;                /* per attempt, 0 for none */
+    int max_attempts;               /* 1 for no retries */
+    long base_ms;                   /* smallest backoff */
+    long max_ms;                    /* largest backoff, and largest Retry-After waited for */
+    long last_delay_ms;             /* previous backoff of the current request */
+    long retry_after_ms;            /* Retry-After of the last response, -1 if none */
+    int attempts;                   /* made by the last request */
+    int breaker_failures;           /* failed requests in a row that open it, 0 for no breaker */
+    long breaker_open_ms;
+    int failures;                   /* failed requests in a row */
+    int breaker;                    /* KV_BREAKER_* */
+    long long open_until_ms;        /* while KV_BREAKER_OPEN */
+    unsigned long long random;      /* jitter state, seeded per client */
+};
+
+/* API endpoints whose absolute URLs each client builds once */
+#define KV_ENDPOINT_STORE    0
+#define KV_ENDPOINT_RETRIEVE 1
+#define KV_ENDPOINT_BATCH    2
+#define KV_ENDPOINT_HISTORY  3
+#define KV_ENDPOINTS         4
+
+/* Nodes of the client's request header lists; see kv_client_headers */
+#define KV_HEADER_BODY_TOKEN 0      /* Content-Type, then X-KV-Token */
+#define KV_HEADER_TOKEN      1      /* X-KV-Token */
+#define KV_HEADER_BODY       2      /* Content-Type */
+#define KV_HEADER_NODES      3
+
+struct kv_client {
+    CURL *curl;                     /* long-lived handle: keeps connection + TLS session */
+    char *base_url;
+    char *endpoints[KV_ENDPOINTS];  /* base_url + path, per KV_ENDPOINT_* */
+    char *token_header;             /* "X-KV-Token: <token>", NULL without a token */
+    char *token;                    /* points into token_header */
+    struct curl_slist header_nodes[KV_HEADER_NODES];
+    const char *url_set;            /* endpoint last given to CURLOPT_URL, NULL if another URL */
+    char method_set[8];             /* CURLOPT_CUSTOMREQUEST on the handle, "" if none */
+    struct kv_response response;    /* reused across requests */
+    struct kv_upload upload;        /* body of a kv_perform_parts request */
+    struct kv_compress compress;
+    struct kv_retry retry;
+    struct kv_metrics *metrics;     /* NULL unless kv_client_enable_metrics */
+    int wire;                       /* KV_WIRE_* */
+    int cbor_body;                  /* one-shot: the next request's body is CBOR */
+    struct kv_buffer cbor;          /* encoded body of the current request */
+    long status;
+    long version;                   /* last version reported by the server */
+    char etag[128];                 /* ETag header of the last response, "" if none */
+    const char *if_none_match;      /* one-shot: sent with the next request only */
+    struct kv_cache *cache;         /* NULL unless kv_client_enable_cache */
+    int cache_outcome;              /* KV_CACHE_* for the last retrieve */
+    char *snapshot_dir;             /* NULL unless kv_client_set_snapshot_dir */
+    struct kv_crypt *crypt;         /* NULL unless kv_client_set_encryption */
+    char error[CURL_ERROR_SIZE];
+};
+
+/* Allocation entry points for everything libkv allocates itself; they go
+ * through the allocator installed by kv_global_init_allocator/_pool */
+void *kv_malloc(size_t size);
+void kv_free(void *ptr);
+void *kv_realloc(void *ptr, size_t size);
+void *kv_calloc(size_t nmemb, size_t size);
+char *kv_strdup(const char *str);
+
+/* Release the pool and go back to the system allocator (kv_global_cleanup) */
+void kv_alloc_cleanup(void);
+
+/* kv_global_init: libcurl on the system allocator, through libkv's hooks */
+int kv_alloc_init(void);
+
+/* Allocations made so far by libkv and libcurl on the calling thread */
+unsigned long kv_alloc_count(void);
+
+int kv_buffer_reserve(struct kv_buffer *buf, size_t extra);
+int kv_buffer_append(struct kv_buffer *buf, const void *data, size_t len);
+void kv_buffer_reset(struct kv_buffer *buf);
+void kv_buffer_free(struct kv_buffer *buf);
+
+/* Monotonic clock in milliseconds, for deadlines and intervals */
+long long kv_now_ms(void);
+
+/* Sleep for ms (kv_retry.c). Returns 0 if a signal cut it short, so
+ * Ctrl+C is not held up by a backoff. */
+int kv_sleep_ms(long ms);
+
+/* Jitter generator (kv_retry.c): a seed that differs between processes
+ * and between salts (an object's address), and the next number from it */
+unsigned long long kv_random_seed(const void *salt);
+unsigned long long kv_random_next(unsigned long long *state);
+
+/* The same clock in microseconds, for timings */
+long long kv_now_us(void);
+
+/* Prepare for a new response, dropping anything left from the last one */
+void kv_response_reset(struct kv_response *response);
+void kv_response_free(struct kv_response *response);
+
+/* Raw body of the response, "" when it was not kept */
+const char *kv_response_body(const struct kv_response *response);
+
+/* libcurl write callback feeding a struct kv_response */
+size_t kv_response_write(void *data, size_t size, size_t nmemb, void *userp);
+
+/* Feed len bytes of JSON text to the response's streaming tokener */
+void kv_response_parse(struct kv_response *response, const char *data, int len);
+
+/* Finish parsing and return the parsed root (the caller puts it), or NULL
+ * if the body was empty or not JSON. Ownership moves to the caller, so
+ * this returns the root only once per response. */
+struct json_object *kv_response_take(struct kv_response *response);
+
+/* Build the absolute URL for an API path into out. Returns 1 on success. */
+int kv_client_url(const kv_client *client, const char *path, char *out, size_t out_size);
+
+/* Absolute URL of a KV_ENDPOINT_*, built when the client was created */
+const char *kv_client_endpoint(const kv_client *client, int endpoint);
+
+/* The client's own header list for a request: Content-Type when there is
+ * a body, X-KV-Token when with_token is set and there is a token. Owned by
+ * the client and valid until the token changes; NULL when empty. */
+struct curl_slist *kv_client_headers(kv_client *client, int with_body, int with_token);
+
+/* A copy of the header list for a request on another handle (kv_async),
+ * plus any pending If-None-Match. Caller frees with curl_slist_free_all. */
+struct curl_slist *kv_request_headers(const kv_client *client, int with_body, int with_token);
+
+/* Perform one request on the client's handle. method is "GET", "POST" or
+ * "PATCH"; body may be NULL for GET. When with_token is set the X-KV-Token
+ * header is sent. Returns 1 if the transfer completed (check client->status
+ * for the HTTP result), 0 on a transport failure with client->error set. */
+int kv_perform(kv_client *client, const char *method, const char *url,
+               const char *body, int with_token, long timeout);
+
+/* Like kv_perform, with the body sent as prefix, then len bytes of data,
+ * then suffix (prefix and suffix NUL-terminated, either may be NULL). The
+ * pieces are streamed to libcurl in place and must stay valid for the
+ * call. */
+int kv_perform_parts(kv_client *client, const char *method, const char *url,
+                     const char *prefix, const char *data, size_t len, const char *suffix,
+                     int with_token, long timeout);
+
+/* libcurl read and seek callbacks streaming a struct kv_upload; seeking
+ * (SEEK_SET only) rewinds it for a resend */
+size_t kv_upload_read(char *dest, size_t size, size_t nmemb, void *userp);
+int kv_upload_seek(void *userp, curl_off_t offset, int origin);
+
+/* Send obj as the body of a store, patch or batch request, in the
+ * client's wire format. envelope, if not NULL, wraps it as the only member
+ * of an object ({"data": obj} for a store); json_flags are for JSON
+ * text. A server that refuses CBOR with 415 gets the request again as
+ * JSON and the client stays on JSON after. Returns as kv_perform. */
+int kv_perform_document(kv_client *client, const char *method, const char *url,
+                        const char *envelope, struct json_object *obj, int json_flags,
+                        int with_token, long timeout);
+
+/* Compress a request body of total bytes (the parts in order) into
+ * client->compress.out if the client is set up for it and the body is
+ * large enough. Returns the Content-Encoding header line to send with it,
+ * or NULL to send the body as it is. */
+char *kv_compress_body(kv_client *client, const struct kv_upload *body, size_t total);
+void kv_compress_free(struct kv_compress *compress);
+
+/* Encryption hooks for kv_store and kv_retrieve (kv_crypt.c), only called
+ * with client->crypt set. kv_crypt_seal encrypts len bytes of text into
+ * the base64 payload of a store body, in client->crypt's reused buffer.
+ * kv_crypt_begin makes the next response go through kv_crypt_write, which
+ * keeps the envelope in the response body and decrypts the payload as it
+ * arrives, into the tokener or, for a raw response, into a text buffer;
+ * kv_response_reset calls kv_crypt_reset. kv_crypt_data and kv_crypt_text
+ * check the tag and return the document or its text (valid until the next
+ * request), and take the version from the envelope. All of these return
+ * NULL or 0 with the error set on failure. */
+const char *kv_crypt_seal(kv_client *client, const char *text, size_t len, size_t *out_len);
+int kv_crypt_begin(kv_client *client);
+int kv_crypt_write(struct kv_response *response, const char *data, size_t len);
+void kv_crypt_reset(struct kv_crypt *crypt);
+struct json_object *kv_crypt_data(kv_client *client);
+const char *kv_crypt_text(kv_client *client, size_t *len);
+void kv_crypt_free(struct kv_crypt *crypt);
+
+/* Transport policy hooks for kv_perform (kv_retry.c). kv_retry_init sets
+ * the defaults on a new client. kv_retry_begin returns 0, with the error
+ * set, if the breaker does not let a request through. After each attempt
+ * kv_retry_next decides whether to try again; if so it waits out the
+ * backoff and returns 1. kv_retry_end records the outcome of the whole
+ * request for the breaker. */
+void kv_retry_init(kv_client *client);
+int kv_retry_begin(kv_client *client);
+int kv_retry_next(kv_client *client, CURLcode res);
+void kv_retry_end(kv_client *client, CURLcode res);
+
+/* A Retry-After header value (delay-seconds or an HTTP date) */
+void kv_retry_after_header(kv_client *client, const char *value, size_t len);
+
+/* Decorrelated jitter: a random delay between base_ms and three times the
+ * last one, capped at max_ms */
+long kv_retry_backoff(struct kv_retry *retry, long last_ms);
+
+/* Apply the client's timeouts to another handle (kv_async) */
+void kv_retry_timeouts(const kv_client *client, CURL *curl);
+
+/* Request metrics (kv_metrics.c); all are no-ops with metrics off.
+ * kv_serialize is json_object_to_json_string_length, timed for the next
+ * request, and kv_serialize_cbor the same for kv_cbor_encode into
+ * client->cbor (NULL on failure). kv_perform calls kv_metrics_begin once the request is let
+ * through, kv_metrics_attempt after every attempt and kv_metrics_end with
+ * whether the request succeeded (2xx or 304). */
+const char *kv_serialize(kv_client *client, struct json_object *obj, int flags, size_t *len);
+const unsigned char *kv_serialize_cbor(kv_client *client, const char *envelope,
+                                       struct json_object *obj, size_t *len);
+void kv_metrics_begin(kv_client *client);
+void kv_metrics_attempt(kv_client *client, CURLcode res);
+void kv_metrics_end(kv_client *client, const char *method, const char *url, int ok);
+
+/* Local snapshots (kv_snapshot.c), of the client's current token; all of
+ * these are no-ops without a snapshot directory. save writes data (text
+ * of len bytes for save_text), confirm records a 304 for the snapshot's
+ * version, patched applies a patch sent against version to the snapshot
+ * and saves the result, drop removes it. Failures are ignored: the
+ * snapshot is only ever a copy. */
+struct kv_snapshot;
+void kv_snapshot_save(kv_client *client, const char *etag, long version, struct json_object *data);
+void kv_snapshot_save_text(kv_client *client, const char *etag, long version,
+                           const char *text, size_t len);
+void kv_snapshot_confirm(kv_client *client);
+/* As kv_snapshot_save_text, for token's snapshot in dir, without a client */
+void kv_snapshot_write(const char *dir, const char *token, const char *etag, long version,
+                       const char *text, size_t len);
+void kv_snapshot_patched(kv_client *client, long version, struct json_object *set,
+                         struct json_object *remove);
+void kv_snapshot_drop(kv_client *client);
+struct kv_snapshot *kv_snapshot_open_client(const kv_client *client);
+
+/* File helpers (kv_spool.c): CRC-32 (IEEE) continued from crc, bytes of
+ * a little-endian integer, and a pwrite that retries short writes and
+ * returns 1 or 0 */
+uint32_t kv_crc32(uint32_t crc, const unsigned char *data, size_t len);
+void kv_put_le(unsigned char *out, uint64_t value, int bytes);
+uint64_t kv_get_le(const unsigned char *in, int bytes);
+int kv_pwrite_full(int fd, const void *buf, size_t len, uint64_t offset);
+
+/* CBOR (kv_cbor.c). kv_cbor_encode replaces out with obj, wrapped as
+ * {envelope: obj} if envelope is not NULL. kv_cbor_decode takes exactly
+ * one item of len bytes and sets *out to a new reference (NULL for null).
+ * Both return 1 on success, 0 on failure. */
+int kv_cbor_encode(struct kv_buffer *out, const char *envelope, struct json_object *obj);
+int kv_cbor_decode(const void *data, size_t len, struct json_object **out);
+
+/* DNS over HTTPS (kv_extip.c). kv_dns_query_url returns url with the
+ * RFC 8484 dns parameter for an A query of name (kv_malloc'd, NULL on
+ * failure). kv_dns_answer puts the first A or AAAA record of a response
+ * of len bytes into out (KV_EXTIP_ADDR_MAX) and returns 1, or returns 0. */
+char *kv_dns_query_url(const char *url, const char *name);
+int kv_dns_answer(const unsigned char *msg, size_t len, char *out);
+
+/* Build the GET /api/history URL for a query (kv_history.c). Returns 1
+ * on success, 0 if it does not fit in size bytes. */
+struct kv_history_query;
+int kv_history_url(const kv_client *client, const struct kv_history_query *query,
+                   char *out, size_t size);
+
+/* Build the long-poll URL of a kv_watch request (kv_watch.c). Returns 1
+ * on success, 0 if it does not fit in size bytes. */
+int kv_watch_url(const kv_client *client, int wait_s, long version, char *out, size_t size);
+
+/* Take the parsed last response, recording its "version" member in the
+ * client. Returns the parsed root (caller puts) or NULL if not JSON. */
+struct json_object *kv_parse_response(kv_client *client);
+
+/* Retrieve cache (kv_cache.c). Entries are keyed by the client's current
+ * token; all of these are no-ops when the cache is disabled. */
+struct kv_cache_entry;
+
+void kv_cache_free(kv_client *client);
+struct kv_cache_entry *kv_cache_find(const kv_client *client);
+
+/* Whether entry is young enough to be served without a request */
+int kv_cache_fresh(const kv_client *client, const struct kv_cache_entry *entry);
+const char *kv_cache_etag(const struct kv_cache_entry *entry);
+
+/* Serve entry as the result of a retrieve: records its version and
+ * outcome in the client and returns a new reference to its data */
+struct json_object *kv_cache_hit(kv_client *client, struct kv_cache_entry *entry, int outcome);
+
+/* Remember data (takes its own reference) as the document for the token */
+void kv_cache_put(kv_client *client, const char *etag, long version, struct json_object *data);
+
+/* A patch against version succeeded: apply it to a copy of the entry, or
+ * drop the entry if it was not at that version */
+void kv_cache_patched(kv_client *client, long version, struct json_object *set,
+                      struct json_object *remove);
+
+void kv_cache_drop(kv_client *client);
+
+#endif /* KV_INTERNAL_H */
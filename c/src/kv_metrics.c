@@ -0,0 +1,452 @@
+/*
+ * libkv request metrics: per-attempt libcurl timings, JSON time, bytes and
+ * allocations, kept in log-linear histograms and exported as Prometheus
+ * text or StatsD lines.
+ *
+ * Bucket i < 16 holds the value i; above that, each power of two 2^k is
+ * split into 8 buckets by the three bits after the leading one. Quantiles
+ * report the upper bound of their bucket, capped at the largest value
+ * recorded.
+ */
+
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "kv_metrics.h"
+#include "kv_internal.h"
+
+#define KV_HIST_LINEAR  16
+#define KV_HIST_SUB     8           /* buckets per power of two */
+#define KV_HIST_POWERS  32          /* 2^4 up to 2^36 us */
+#define KV_HIST_BUCKETS (KV_HIST_LINEAR + KV_HIST_POWERS * KV_HIST_SUB)
+
+#define KV_STATSD_PACKET 1432       /* UDP payload that fits a 1500-byte MTU */
+
+struct histogram {
+    uint32_t counts[KV_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+};
+
+struct op_totals {
+    long requests;
+    long failures;
+    long long bytes_sent;
+    long long bytes_received;
+    long long allocations;
+};
+
+struct kv_metrics {
+    struct histogram ops[KV_OPS];           /* total time per operation */
+    struct histogram phases[KV_PHASES];
+    struct op_totals totals[KV_OPS];
+    struct op_totals exported[KV_OPS];      /* totals at the last StatsD export */
+    struct kv_timing last;
+    int measured;                           /* last holds a request */
+    struct kv_timing current;               /* being measured */
+    long long started_us;
+    unsigned long allocations_at_start;
+    long serialize_us;                      /* body serialized for the next request */
+};
+
+static const char *const op_names[KV_OPS] = {
+    "store", "retrieve", "patch", "batch", "history", "watch", "other"
+};
+
+static const char *const phase_names[KV_PHASES] = {
+    "dns", "connect", "tls", "wait", "receive", "parse", "serialize"
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char *const quantile_names[] = { "0.5", "0.9", "0.99", "0.999" };
+static const char *const quantile_keys[] = { "p50", "p90", "p99", "p999" };
+#define KV_QUANTILES 4
+
+static int bucket_of(uint64_t value) {
+    if(value < KV_HIST_LINEAR) return (int)value;
+
+    int k = 4;
+    while(k < 63 && (value >> (k + 1)) != 0) k++;
+    if(k >= 4 + KV_HIST_POWERS) return KV_HIST_BUCKETS - 1;
+    return KV_HIST_LINEAR + (k - 4) * KV_HIST_SUB + (int)((value >> (k - 3)) & (KV_HIST_SUB - 1));
+}
+
+static uint64_t bucket_upper(int bucket) {
+    if(bucket < KV_HIST_LINEAR) return (uint64_t)bucket;
+    int k = (bucket - KV_HIST_LINEAR) / KV_HIST_SUB + 4;
+    int sub = (bucket - KV_HIST_LINEAR) % KV_HIST_SUB;
+    return ((uint64_t)(KV_HIST_SUB + sub + 1) << (k - 3)) - 1;
+}
+
+static void record(struct histogram *hist, long value) {
+    uint64_t v = value > 0 ? (uint64_t)value : 0;
+    hist->counts[bucket_of(v)]++;
+    hist->count++;
+    hist->sum += v;
+    if(v > hist->max) hist->max = v;
+}
+
+static long quantile(const struct histogram *hist, double q) {
+    if(hist->count == 0) return -1;
+    if(q < 0) q = 0;
+    if(q > 1) q = 1;
+
+    uint64_t rank = (uint64_t)(q * (double)hist->count + 0.5);
+    if(rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for(int i = 0; i < KV_HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if(seen >= rank) {
+            uint64_t upper = bucket_upper(i);
+            return (long)(upper < hist->max ? upper : hist->max);
+        }
+    }
+    return (long)hist->max;
+}
+
+int kv_client_enable_metrics(kv_client *client, int enable) {
+    if(!enable) {
+        kv_free(client->metrics);
+        client->metrics = NULL;
+        client->response.timed = 0;
+        return 1;
+    }
+    if(!client->metrics) {
+        client->metrics = kv_calloc(1, sizeof(*client->metrics));
+        if(!client->metrics) return 0;
+    }
+    client->response.timed = 1;
+    return 1;
+}
+
+void kv_client_metrics_reset(kv_client *client) {
+    if(client->metrics) memset(client->metrics, 0, sizeof(*client->metrics));
+}
+
+int kv_client_last_timing(const kv_client *client, struct kv_timing *timing) {
+    if(!client->metrics || !client->metrics->measured) return 0;
+    *timing = client->metrics->last;
+    return 1;
+}
+
+int kv_client_op_metrics(const kv_client *client, int op, struct kv_op_metrics *metrics) {
+    if(!client->metrics || op < 0 || op >= KV_OPS) return 0;
+
+    const struct op_totals *totals = &client->metrics->totals[op];
+    const struct histogram *hist = &client->metrics->ops[op];
+    memset(metrics, 0, sizeof(*metrics));
+    metrics->requests = totals->requests;
+    metrics->failures = totals->failures;
+    metrics->bytes_sent = totals->bytes_sent;
+    metrics->bytes_received = totals->bytes_received;
+    metrics->allocations = totals->allocations;
+    metrics->total_us = (long long)hist->sum;
+    metrics->p50 = quantile(hist, 0.5);
+    metrics->p90 = quantile(hist, 0.9);
+    metrics->p99 = quantile(hist, 0.99);
+    metrics->p999 = quantile(hist, 0.999);
+    metrics->max = (long)hist->max;
+    return 1;
+}
+
+long kv_client_phase_quantile(const kv_client *client, int phase, double q) {
+    if(!client->metrics || phase < 0 || phase >= KV_PHASES) return -1;
+    return quantile(&client->metrics->phases[phase], q);
+}
+
+/* ---- hooks ---- */
+
+const char *kv_serialize(kv_client *client, struct json_object *obj, int flags, size_t *len) {
+    if(!client->metrics) return json_object_to_json_string_length(obj, flags, len);
+
+    long long start = kv_now_us();
+    const char *json = json_object_to_json_string_length(obj, flags, len);
+    client->metrics->serialize_us += (long)(kv_now_us() - start);
+    return json;
+}
+
+const unsigned char *kv_serialize_cbor(kv_client *client, const char *envelope,
+                                       struct json_object *obj, size_t *len) {
+    long long start = client->metrics ? kv_now_us() : 0;
+    int ok = kv_cbor_encode(&client->cbor, envelope, obj);
+    if(client->metrics) client->metrics->serialize_us += (long)(kv_now_us() - start);
+
+    *len = client->cbor.size;
+    return ok ? (const unsigned char *)client->cbor.data : NULL;
+}
+
+void kv_metrics_begin(kv_client *client) {
+    struct kv_metrics *metrics = client->metrics;
+    if(!metrics) return;
+
+    memset(&metrics->current, 0, sizeof(metrics->current));
+    metrics->current.phases[KV_PHASE_SERIALIZE] = metrics->serialize_us;
+    metrics->serialize_us = 0;
+    client->response.parse_us = 0;
+    metrics->allocations_at_start = kv_alloc_count();
+    metrics->started_us = kv_now_us();
+}
+
+void kv_metrics_attempt(kv_client *client, CURLcode res) {
+    struct kv_metrics *metrics = client->metrics;
+    if(!metrics) return;
+
+    CURL *curl = client->curl;
+    struct kv_timing *current = &metrics->current;
+    curl_off_t up = 0, down = 0;
+    long request_size = 0, header_size = 0;
+    curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &up);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &down);
+    curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &request_size);
+    curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &header_size);
+    current->bytes_sent += (long long)up + request_size;
+    current->bytes_received += (long long)down + header_size;
+    current->attempts++;
+    if(res != CURLE_OK) return;
+
+    /* libcurl reports when each phase ended, counted from the start */
+    curl_off_t dns = 0, connect = 0, tls = 0, pretransfer = 0, first_byte = 0, total = 0;
+    long connects = 0;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+
+    long *phases = current->phases;
+    phases[KV_PHASE_DNS] = phases[KV_PHASE_CONNECT] = phases[KV_PHASE_TLS] = 0;
+    if(connects > 0) {
+        phases[KV_PHASE_DNS] = (long)dns;
+        phases[KV_PHASE_CONNECT] = (long)(connect - dns);
+        if(tls > 0) phases[KV_PHASE_TLS] = (long)(tls - connect);
+        record(&metrics->phases[KV_PHASE_DNS], phases[KV_PHASE_DNS]);
+        record(&metrics->phases[KV_PHASE_CONNECT], phases[KV_PHASE_CONNECT]);
+        if(tls > 0) record(&metrics->phases[KV_PHASE_TLS], phases[KV_PHASE_TLS]);
+    }
+    phases[KV_PHASE_WAIT] = first_byte > pretransfer ? (long)(first_byte - pretransfer) : 0;
+    phases[KV_PHASE_RECEIVE] = total > first_byte && first_byte > 0 ? (long)(total - first_byte) : 0;
+    record(&metrics->phases[KV_PHASE_WAIT], phases[KV_PHASE_WAIT]);
+    record(&metrics->phases[KV_PHASE_RECEIVE], phases[KV_PHASE_RECEIVE]);
+}
+
+static int request_op(const kv_client *client, const char *method, const char *url) {
+    if(url == client->endpoints[KV_ENDPOINT_STORE]) {
+        return strcmp(method, "PATCH") == 0 ? KV_OP_PATCH : KV_OP_STORE;
+    }
+    if(url == client->endpoints[KV_ENDPOINT_RETRIEVE]) return KV_OP_RETRIEVE;
+    if(url == client->endpoints[KV_ENDPOINT_BATCH]) return KV_OP_BATCH;
+
+    const char *history = client->endpoints[KV_ENDPOINT_HISTORY];
+    if(strncmp(url, history, strlen(history)) == 0) return KV_OP_HISTORY;
+    const char *retrieve = client->endpoints[KV_ENDPOINT_RETRIEVE];
+    size_t len = strlen(retrieve);
+    if(strncmp(url, retrieve, len) == 0 && url[len] == '?') return KV_OP_WATCH;
+    return KV_OP_OTHER;
+}
+
+void kv_metrics_end(kv_client *client, const char *method, const char *url, int ok) {
+    struct kv_metrics *metrics = client->metrics;
+    if(!metrics) return;
+
+    struct kv_timing *current = &metrics->current;
+    current->op = request_op(client, method, url);
+    current->total = (long)(kv_now_us() - metrics->started_us);
+    current->allocations = (long)(kv_alloc_count() - metrics->allocations_at_start);
+    current->phases[KV_PHASE_PARSE] = (long)client->response.parse_us;
+
+    record(&metrics->ops[current->op], current->total);
+    if(current->phases[KV_PHASE_SERIALIZE] > 0) {
+        record(&metrics->phases[KV_PHASE_SERIALIZE], current->phases[KV_PHASE_SERIALIZE]);
+    }
+    if(client->response.size > 0) record(&metrics->phases[KV_PHASE_PARSE], current->phases[KV_PHASE_PARSE]);
+
+    struct op_totals *totals = &metrics->totals[current->op];
+    totals->requests++;
+    if(!ok) totals->failures++;
+    totals->bytes_sent += current->bytes_sent;
+    totals->bytes_received += current->bytes_received;
+    totals->allocations += current->allocations;
+
+    metrics->last = *current;
+    metrics->measured = 1;
+}
+
+/* ---- exporters ---- */
+
+/* Text built with snprintf semantics: len keeps counting past size */
+struct text {
+    char *out;
+    size_t size;
+    size_t len;
+};
+
+static void put(struct text *text, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int room = text->len < text->size;
+    int n = vsnprintf(room ? text->out + text->len : NULL, room ? text->size - text->len : 0, format, args);
+    va_end(args);
+    if(n > 0) text->len += (size_t)n;
+}
+
+/* {op="store",labels} and its variants */
+static void put_labels(struct text *text, const char *key, const char *value,
+                       const char *quantile, const char *labels) {
+    put(text, "{%s=\"%s\"", key, value);
+    if(quantile) put(text, ",quantile=\"%s\"", quantile);
+    if(labels && *labels) put(text, ",%s", labels);
+    put(text, "}");
+}
+
+static void put_summary(struct text *text, const char *name, const char *key, const char *value,
+                        const struct histogram *hist, const char *labels) {
+    for(int q = 0; q < KV_QUANTILES; q++) {
+        put(text, "%s", name);
+        put_labels(text, key, value, quantile_names[q], labels);
+        put(text, " %.6f\n", quantile(hist, quantiles[q]) / 1e6);
+    }
+    put(text, "%s_sum", name);
+    put_labels(text, key, value, NULL, labels);
+    put(text, " %.6f\n", (double)hist->sum / 1e6);
+    put(text, "%s_count", name);
+    put_labels(text, key, value, NULL, labels);
+    put(text, " %llu\n", (unsigned long long)hist->count);
+}
+
+int kv_metrics_prometheus(const kv_client *client, const char *labels, char *out, size_t size) {
+    struct text text = { out, size, 0 };
+    if(size > 0) out[0] = 0;
+    const struct kv_metrics *metrics = client->metrics;
+    if(!metrics) return 0;
+
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t offset;
+        int wide;
+    } counters[] = {
+        { "kv_requests_total", "Requests sent", offsetof(struct op_totals, requests), 0 },
+        { "kv_request_failures_total", "Requests that failed or got a non-2xx response",
+          offsetof(struct op_totals, failures), 0 },
+        { "kv_sent_bytes_total", "Bytes sent, headers included", offsetof(struct op_totals, bytes_sent), 1 },
+        { "kv_received_bytes_total", "Bytes received, headers included",
+          offsetof(struct op_totals, bytes_received), 1 },
+        { "kv_allocations_total", "Allocations by libkv and libcurl", offsetof(struct op_totals, allocations), 1 },
+    };
+
+    for(size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+        put(&text, "# HELP %s %s\n# TYPE %s counter\n", counters[c].name, counters[c].help, counters[c].name);
+        for(int op = 0; op < KV_OPS; op++) {
+            const char *field = (const char *)&metrics->totals[op] + counters[c].offset;
+            long long value = counters[c].wide ? *(const long long *)field : *(const long *)field;
+            if(metrics->totals[op].requests == 0) continue;
+            put(&text, "%s", counters[c].name);
+            put_labels(&text, "op", op_names[op], NULL, labels);
+            put(&text, " %lld\n", value);
+        }
+    }
+
+    put(&text, "# HELP kv_request_seconds Request time, retries included\n# TYPE kv_request_seconds summary\n");
+    for(int op = 0; op < KV_OPS; op++) {
+        if(metrics->ops[op].count == 0) continue;
+        put_summary(&text, "kv_request_seconds", "op", op_names[op], &metrics->ops[op], labels);
+    }
+
+    put(&text, "# HELP kv_phase_seconds Time per request phase\n# TYPE kv_phase_seconds summary\n");
+    for(int phase = 0; phase < KV_PHASES; phase++) {
+        if(metrics->phases[phase].count == 0) continue;
+        put_summary(&text, "kv_phase_seconds", "phase", phase_names[phase], &metrics->phases[phase], labels);
+    }
+    return (int)text.len;
+}
+
+/* StatsD lines for the counters since the last export, which is left
+ * for the caller to advance */
+static void statsd_text(const struct kv_metrics *metrics, const char *prefix, struct text *text) {
+    if(!prefix || !*prefix) prefix = "kv";
+
+    for(int op = 0; op < KV_OPS; op++) {
+        const struct op_totals *now = &metrics->totals[op], *then = &metrics->exported[op];
+        if(now->requests == then->requests) continue;
+
+        const char *name = op_names[op];
+        put(text, "%s.%s.requests:%ld|c\n", prefix, name, now->requests - then->requests);
+        put(text, "%s.%s.failures:%ld|c\n", prefix, name, now->failures - then->failures);
+        put(text, "%s.%s.sent_bytes:%lld|c\n", prefix, name, now->bytes_sent - then->bytes_sent);
+        put(text, "%s.%s.received_bytes:%lld|c\n", prefix, name, now->bytes_received - then->bytes_received);
+        put(text, "%s.%s.allocations:%lld|c\n", prefix, name, now->allocations - then->allocations);
+        for(int q = 0; q < KV_QUANTILES; q++) {
+            put(text, "%s.%s.%s_ms:%.3f|g\n", prefix, name, quantile_keys[q],
+                quantile(&metrics->ops[op], quantiles[q]) / 1e3);
+        }
+    }
+    for(int phase = 0; phase < KV_PHASES; phase++) {
+        const struct histogram *hist = &metrics->phases[phase];
+        if(hist->count == 0) continue;
+        for(int q = 0; q < KV_QUANTILES; q++) {
+            put(text, "%s.phase.%s.%s_ms:%.3f|g\n", prefix, phase_names[phase], quantile_keys[q],
+                quantile(hist, quantiles[q]) / 1e3);
+        }
+    }
+}
+
+int kv_metrics_statsd(kv_client *client, const char *prefix, char *out, size_t size) {
+    struct text text = { out, size, 0 };
+    if(size > 0) out[0] = 0;
+    struct kv_metrics *metrics = client->metrics;
+    if(!metrics) return 0;
+
+    statsd_text(metrics, prefix, &text);
+    if(text.len < size) memcpy(metrics->exported, metrics->totals, sizeof(metrics->totals));
+    return (int)text.len;
+}
+
+int kv_metrics_statsd_send(kv_client *client, const char *host, int port, const char *prefix) {
+    struct kv_metrics *metrics = client->metrics;
+    if(!metrics) return 0;
+
+    struct text text = { NULL, 0, 0 };
+    statsd_text(metrics, prefix, &text);
+    if(text.len == 0) return 1;
+
+    char *lines = kv_malloc(text.len + 1);
+    if(!lines) return 0;
+    struct text full = { lines, text.len + 1, 0 };
+    statsd_text(metrics, prefix, &full);
+
+    char service[16];
+    struct addrinfo hints, *addr = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    snprintf(service, sizeof(service), "%d", port);
+    int fd = -1, ok = getaddrinfo(host, service, &hints, &addr) == 0;
+    if(ok) fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol);
+    ok = ok && fd >= 0;
+
+    /* Whole lines per packet: StatsD servers split packets on newlines */
+    for(char *start = lines; ok && *start; ) {
+        char *end = start, *line;
+        while((line = strchr(end, '\n')) && line + 1 - start <= KV_STATSD_PACKET) end = line + 1;
+        if(end == start) end = line ? line + 1 : start + strlen(start);
+        ok = sendto(fd, start, (size_t)(end - start), 0, addr->ai_addr, addr->ai_addrlen) >= 0;
+        start = end;
+    }
+
+    /* Counters only move on once every packet is out, so a failed send
+     * leaves them for the next one */
+    if(ok) memcpy(metrics->exported, metrics->totals, sizeof(metrics->totals));
+    else snprintf(client->error, sizeof(client->error), "Cannot send metrics to %s:%d", host, port);
+    if(fd >= 0) close(fd);
+    if(addr) freeaddrinfo(addr);
+    kv_free(lines);
+    return ok;
+}
@@ -0,0 +1,298 @@
+/*
+ * libkv partial updates: PATCH /api/store with version-based optimistic
+ * concurrency, plus a local implementation of the same patch semantics.
+ *
+ * kv_update is the read-modify-write helper: instead of re-uploading the
+ * whole document after a local change, the caller describes only the
+ * delta and kv_update sends that, re-reading and retrying when another
+ * writer got there first (409 Conflict). kv_patch_if is the compare-and-set
+ * form: the delta only goes out while one member holds an expected value.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "kv_internal.h"
+
+#define KV_PATH_MAX 256
+#define KV_PATCH_IF_ATTEMPTS 3
+
+int kv_patch(kv_client *client, long version, struct json_object *set,
+             struct json_object *remove) {
+    if(client->crypt) {
+        client->status = 0;
+        snprintf(client->error, sizeof(client->error), "Cannot patch encrypted data");
+        return 0;
+    }
+
+    /* Build request: {"version": N, "patch": {"set": {...}, "remove": [...]}} */
+    struct json_object *request = json_object_new_object();
+    struct json_object *patch = json_object_new_object();
+    json_object_object_add(request, "version", json_object_new_int64(version));
+    if(set && json_object_object_length(set) > 0) {
+        json_object_object_add(patch, "set", json_object_get(set));
+    }
+    if(remove && json_object_array_length(remove) > 0) {
+        json_object_object_add(patch, "remove", json_object_get(remove));
+    }
+    json_object_object_add(request, "patch", patch);
+
+    int ok = kv_perform_document(client, "PATCH", kv_client_endpoint(client, KV_ENDPOINT_STORE),
+                                 NULL, request, JSON_C_TO_STRING_PLAIN, 1, 0);
+    json_object_put(request);
+
+    if(ok && (client->status < 200 || client->status >= 300)) {
+        if(client->status == 409) {
+            snprintf(client->error, sizeof(client->error), "HTTP 409: version conflict");
+        } else {
+            snprintf(client->error, sizeof(client->error), "HTTP %ld", client->status);
+        }
+        ok = 0;
+    }
+    if(ok) {
+        json_object_put(kv_parse_response(client));
+        kv_cache_patched(client, version, set, remove);
+    } else {
+        /* A conflict means a newer document exists; after a transport
+         * failure we cannot tell whether the patch went in */
+        kv_cache_drop(client);
+    }
+    return ok;
+}
+
+/* Parse a path segment as an array index; -1 if it is not numeric */
+static long segment_index(const char *segment) {
+    if(!*segment) return -1;
+    for(const char *p = segment; *p; p++) {
+        if(!isdigit((unsigned char)*p)) return -1;
+    }
+    return strtol(segment, NULL, 10);
+}
+
+/* Walk path up to its last segment, creating missing containers when
+ * create is set. Returns the parent container and points *last at the
+ * final segment inside buf, or NULL if the path does not resolve. */
+static struct json_object *resolve_parent(struct json_object *doc, const char *path,
+                                          char *buf, size_t buf_size, int create,
+                                          const char **last) {
+    if(strlen(path) >= buf_size) return NULL;
+    strcpy(buf, path);
+
+    struct json_object *node = doc;
+    char *segment = buf;
+    char *dot;
+
+    while((dot = strchr(segment, '.'))) {
+        *dot = 0;
+        const char *next_segment = dot + 1;
+        struct json_object *child = NULL;
+
+        if(json_object_is_type(node, json_type_array)) {
+            long idx = segment_index(segment);
+            if(idx < 0 || (size_t)idx >= json_object_array_length(node)) return NULL;
+            child = json_object_array_get_idx(node, idx);
+        } else if(json_object_is_type(node, json_type_object)) {
+            if(!json_object_object_get_ex(node, segment, &child) || !child) {
+                if(!create) return NULL;
+                /* A numeric next segment means the missing container is an array */
+                child = segment_index(next_segment) >= 0 ?
+                        json_object_new_array() : json_object_new_object();
+                json_object_object_add(node, segment, child);
+            }
+        } else {
+            return NULL;
+        }
+
+        node = child;
+        segment = dot + 1;
+    }
+
+    *last = segment;
+    return node;
+}
+
+static int apply_set(struct json_object *doc, const char *path, struct json_object *value) {
+    char buf[KV_PATH_MAX];
+    const char *last;
+    struct json_object *parent = resolve_parent(doc, path, buf, sizeof(buf), 1, &last);
+    if(!parent) return 0;
+
+    if(json_object_is_type(parent, json_type_array)) {
+        long idx = segment_index(last);
+        size_t len = json_object_array_length(parent);
+        if(idx < 0 || (size_t)idx > len) return 0;
+        if((size_t)idx == len) return json_object_array_add(parent, json_object_get(value)) == 0;
+        return json_object_array_put_idx(parent, idx, json_object_get(value)) == 0;
+    }
+    if(json_object_is_type(parent, json_type_object)) {
+        return json_object_object_add(parent, last, json_object_get(value)) == 0;
+    }
+    return 0;
+}
+
+static int apply_remove(struct json_object *doc, const char *path) {
+    char buf[KV_PATH_MAX];
+    const char *last;
+    struct json_object *parent = resolve_parent(doc, path, buf, sizeof(buf), 0, &last);
+    if(!parent) return 1; /* removing something absent is a no-op */
+
+    if(json_object_is_type(parent, json_type_array)) {
+        long idx = segment_index(last);
+        if(idx >= 0 && (size_t)idx < json_object_array_length(parent)) {
+            json_object_array_del_idx(parent, idx, 1);
+        }
+    } else if(json_object_is_type(parent, json_type_object)) {
+        json_object_object_del(parent, last);
+    }
+    return 1;
+}
+
+int kv_patch_apply(struct json_object *doc, struct json_object *set,
+                   struct json_object *remove) {
+    int ok = 1;
+
+    if(set) {
+        json_object_object_foreach(set, path, value) {
+            if(!apply_set(doc, path, value)) ok = 0;
+        }
+    }
+    if(remove) {
+        size_t len = json_object_array_length(remove);
+        for(size_t i = 0; i < len; i++) {
+            const char *path = json_object_get_string(json_object_array_get_idx(remove, i));
+            if(path && !apply_remove(doc, path)) ok = 0;
+        }
+    }
+    return ok;
+}
+
+/* Value at path in doc, or NULL if it does not exist */
+static struct json_object *lookup_path(struct json_object *doc, const char *path) {
+    char buf[KV_PATH_MAX];
+    const char *last;
+    struct json_object *parent = resolve_parent(doc, path, buf, sizeof(buf), 0, &last);
+    struct json_object *value = NULL;
+    if(!parent) return NULL;
+
+    if(json_object_is_type(parent, json_type_array)) {
+        long idx = segment_index(last);
+        if(idx >= 0 && (size_t)idx < json_object_array_length(parent)) {
+            value = json_object_array_get_idx(parent, idx);
+        }
+    } else if(json_object_is_type(parent, json_type_object)) {
+        json_object_object_get_ex(parent, last, &value);
+    }
+    return value;
+}
+
+int kv_patch_prune(struct json_object *current, struct json_object *set,
+                   struct json_object *remove) {
+    int left = 0;
+
+    if(set) {
+        /* Collect first: deleting while iterating would break the walk */
+        struct json_object *unchanged = json_object_new_array();
+        json_object_object_foreach(set, path, value) {
+            struct json_object *old = current ? lookup_path(current, path) : NULL;
+            if(old && json_object_equal(old, value)) {
+                json_object_array_add(unchanged, json_object_new_string(path));
+            }
+        }
+        size_t len = json_object_array_length(unchanged);
+        for(size_t i = 0; i < len; i++) {
+            json_object_object_del(set, json_object_get_string(json_object_array_get_idx(unchanged, i)));
+        }
+        json_object_put(unchanged);
+        left += json_object_object_length(set);
+    }
+
+    if(remove) {
+        for(size_t i = json_object_array_length(remove); i-- > 0;) {
+            const char *path = json_object_get_string(json_object_array_get_idx(remove, i));
+            if(!current || !path || !lookup_path(current, path)) {
+                json_object_array_del_idx(remove, i, 1);
+            }
+        }
+        left += json_object_array_length(remove);
+    }
+    return left;
+}
+
+int kv_update(kv_client *client, struct json_object *current, long version,
+              kv_patch_builder builder, void *userdata, int max_attempts) {
+    struct json_object *doc = current ? json_object_get(current) : NULL;
+    int have_doc = (doc != NULL);
+    int success = 0;
+
+    for(int attempt = 0; attempt < max_attempts; attempt++) {
+        if(!have_doc) {
+            doc = kv_retrieve(client);
+            /* A 404 (or a 2xx without data) just means nothing is stored yet */
+            if(!doc && client->status != 404 &&
+               (client->status < 200 || client->status >= 300)) break;
+            version = kv_client_version(client);
+        }
+        have_doc = 0;
+
+        struct json_object *set = json_object_new_object();
+        struct json_object *remove = json_object_new_array();
+        int build = builder(doc, set, remove, userdata);
+
+        int done = 0;
+        if(build <= 0) {
+            success = (build == 0);
+            done = 1;
+        } else if(!doc || client->crypt) {
+            /* Nothing stored yet, or nothing the server can patch: apply the
+             * delta here and store the document whole */
+            struct json_object *fresh = NULL;
+            if(!doc) fresh = json_object_new_object();
+            else if(json_object_deep_copy(doc, &fresh, NULL) != 0) fresh = NULL;
+            success = fresh && kv_patch_apply(fresh, set, remove) && kv_store(client, fresh);
+            json_object_put(fresh);
+            done = 1;
+        } else {
+            success = kv_patch(client, version, set, remove);
+            done = success || client->status != 409;
+        }
+
+        json_object_put(set);
+        json_object_put(remove);
+        if(doc) json_object_put(doc);
+        doc = NULL;
+
+        if(done) break;
+    }
+
+    if(doc) json_object_put(doc);
+    return success;
+}
+
+/* Equal JSON values, NULL standing for both null and absent */
+static int same_value(struct json_object *a, struct json_object *b) {
+    if(!a || !b) return a == b;
+    return json_object_equal(a, b);
+}
+
+int kv_patch_if(kv_client *client, long version, const char *path, struct json_object *expected,
+                struct json_object *set, struct json_object *remove) {
+    for(int attempt = 0; attempt < KV_PATCH_IF_ATTEMPTS; attempt++) {
+        /* The caller's version is trusted to hold expected; after a
+         * conflict the condition is checked again on the new document */
+        if(attempt > 0 || version <= 0) {
+            struct json_object *doc = kv_retrieve(client);
+            if(!doc) return client->status == 404 ? 0 : -1;
+
+            int match = same_value(lookup_path(doc, path), expected);
+            version = kv_client_version(client);
+            json_object_put(doc);
+            if(!match) return 0;
+        }
+
+        if(kv_patch(client, version, set, remove)) return 1;
+        if(client->status != 409) return -1;
+    }
+    return -1;
+}
@@ -0,0 +1,345 @@
+/*
+ * libkv column reductions.
+ *
+ * Every kernel makes the same single pass: it keeps min, max, a count and
+ * the sum and sum of squares of value - pivot, where the pivot is the
+ * column's first value. Shifting by a value from the column keeps the
+ * variance accurate from one pass for data such as sensor readings, whose
+ * spread is small next to their magnitude. The vector kernels skip NaNs
+ * without branches: the value itself drops out of min and max, since the
+ * min/max instructions return the other operand for a NaN, and an
+ * ordered-compare mask zeroes its share of the sums and the count. Each
+ * keeps two sets of accumulators so consecutive adds do not wait on each
+ * other, and leaves the last few values to the scalar loop.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "kv_reduce.h"
+#include "kv_internal.h"
+
+/* Running figures; sum and sq are of value - pivot, count is a double so
+ * the vector kernels can add their masks to it */
+struct reduce_acc {
+    double min;
+    double max;
+    double sum;
+    double sq;
+    double count;
+};
+
+typedef void (*reduce_fn)(const double *values, size_t n, double pivot, struct reduce_acc *acc);
+
+static void reduce_scalar(const double *values, size_t n, double pivot, struct reduce_acc *acc) {
+    struct reduce_acc a = *acc;
+    for(size_t i = 0; i < n; i++) {
+        double x = values[i];
+        if(isnan(x)) continue;
+        if(x < a.min) a.min = x;
+        if(x > a.max) a.max = x;
+        double d = x - pivot;
+        a.sum += d;
+        a.sq += d * d;
+        a.count += 1;
+    }
+    *acc = a;
+}
+
+/* Fold the lanes of a vector kernel's accumulators into acc */
+static void fold_lanes(struct reduce_acc *acc, const double *min, const double *max, const double *sum,
+                       const double *sq, const double *count, int lanes) {
+    for(int i = 0; i < lanes; i++) {
+        if(min[i] < acc->min) acc->min = min[i];
+        if(max[i] > acc->max) acc->max = max[i];
+        acc->sum += sum[i];
+        acc->sq += sq[i];
+        acc->count += count[i];
+    }
+}
+
+#if defined(__SSE2__)
+static void reduce_sse2(const double *values, size_t n, double pivot, struct reduce_acc *acc) {
+    const __m128d k = _mm_set1_pd(pivot), one = _mm_set1_pd(1.0);
+    __m128d mn[2], mx[2], s[2], q[2], c[2];
+    for(int j = 0; j < 2; j++) {
+        mn[j] = _mm_set1_pd(INFINITY);
+        mx[j] = _mm_set1_pd(-INFINITY);
+        s[j] = q[j] = c[j] = _mm_setzero_pd();
+    }
+
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4) {
+        for(int j = 0; j < 2; j++) {
+            __m128d x = _mm_loadu_pd(values + i + 2 * j);
+            __m128d ordered = _mm_cmpord_pd(x, x);
+            __m128d d = _mm_and_pd(_mm_sub_pd(x, k), ordered);
+            mn[j] = _mm_min_pd(x, mn[j]);
+            mx[j] = _mm_max_pd(x, mx[j]);
+            s[j] = _mm_add_pd(s[j], d);
+            q[j] = _mm_add_pd(q[j], _mm_mul_pd(d, d));
+            c[j] = _mm_add_pd(c[j], _mm_and_pd(ordered, one));
+        }
+    }
+
+    double lanes[5][2];
+    _mm_storeu_pd(lanes[0], _mm_min_pd(mn[0], mn[1]));
+    _mm_storeu_pd(lanes[1], _mm_max_pd(mx[0], mx[1]));
+    _mm_storeu_pd(lanes[2], _mm_add_pd(s[0], s[1]));
+    _mm_storeu_pd(lanes[3], _mm_add_pd(q[0], q[1]));
+    _mm_storeu_pd(lanes[4], _mm_add_pd(c[0], c[1]));
+    fold_lanes(acc, lanes[0], lanes[1], lanes[2], lanes[3], lanes[4], 2);
+    reduce_scalar(values + i, n - i, pivot, acc);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma")))
+static void reduce_avx2(const double *values, size_t n, double pivot, struct reduce_acc *acc) {
+    const __m256d k = _mm256_set1_pd(pivot), one = _mm256_set1_pd(1.0);
+    __m256d mn[2], mx[2], s[2], q[2], c[2];
+    for(int j = 0; j < 2; j++) {
+        mn[j] = _mm256_set1_pd(INFINITY);
+        mx[j] = _mm256_set1_pd(-INFINITY);
+        s[j] = q[j] = c[j] = _mm256_setzero_pd();
+    }
+
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8) {
+        for(int j = 0; j < 2; j++) {
+            __m256d x = _mm256_loadu_pd(values + i + 4 * j);
+            __m256d ordered = _mm256_cmp_pd(x, x, _CMP_ORD_Q);
+            __m256d d = _mm256_and_pd(_mm256_sub_pd(x, k), ordered);
+            mn[j] = _mm256_min_pd(x, mn[j]);
+            mx[j] = _mm256_max_pd(x, mx[j]);
+            s[j] = _mm256_add_pd(s[j], d);
+            q[j] = _mm256_fmadd_pd(d, d, q[j]);
+            c[j] = _mm256_add_pd(c[j], _mm256_and_pd(ordered, one));
+        }
+    }
+
+    double lanes[5][4];
+    _mm256_storeu_pd(lanes[0], _mm256_min_pd(mn[0], mn[1]));
+    _mm256_storeu_pd(lanes[1], _mm256_max_pd(mx[0], mx[1]));
+    _mm256_storeu_pd(lanes[2], _mm256_add_pd(s[0], s[1]));
+    _mm256_storeu_pd(lanes[3], _mm256_add_pd(q[0], q[1]));
+    _mm256_storeu_pd(lanes[4], _mm256_add_pd(c[0], c[1]));
+    fold_lanes(acc, lanes[0], lanes[1], lanes[2], lanes[3], lanes[4], 4);
+    reduce_scalar(values + i, n - i, pivot, acc);
+}
+
+static int has_avx2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+#endif
+
+#if defined(__aarch64__)
+static void reduce_neon(const double *values, size_t n, double pivot, struct reduce_acc *acc) {
+    const float64x2_t k = vdupq_n_f64(pivot), one = vdupq_n_f64(1.0);
+    float64x2_t mn[2], mx[2], s[2], q[2], c[2];
+    for(int j = 0; j < 2; j++) {
+        mn[j] = vdupq_n_f64(INFINITY);
+        mx[j] = vdupq_n_f64(-INFINITY);
+        s[j] = q[j] = c[j] = vdupq_n_f64(0.0);
+    }
+
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4) {
+        for(int j = 0; j < 2; j++) {
+            float64x2_t x = vld1q_f64(values + i + 2 * j);
+            uint64x2_t ordered = vceqq_f64(x, x);
+            float64x2_t d = vreinterpretq_f64_u64(vandq_u64(vreinterpretq_u64_f64(vsubq_f64(x, k)), ordered));
+            /* The "nm" forms are IEEE minNum/maxNum: a NaN loses */
+            mn[j] = vminnmq_f64(mn[j], x);
+            mx[j] = vmaxnmq_f64(mx[j], x);
+            s[j] = vaddq_f64(s[j], d);
+            q[j] = vfmaq_f64(q[j], d, d);
+            c[j] = vaddq_f64(c[j], vreinterpretq_f64_u64(vandq_u64(ordered, vreinterpretq_u64_f64(one))));
+        }
+    }
+
+    double lanes[5][2];
+    vst1q_f64(lanes[0], vminnmq_f64(mn[0], mn[1]));
+    vst1q_f64(lanes[1], vmaxnmq_f64(mx[0], mx[1]));
+    vst1q_f64(lanes[2], vaddq_f64(s[0], s[1]));
+    vst1q_f64(lanes[3], vaddq_f64(q[0], q[1]));
+    vst1q_f64(lanes[4], vaddq_f64(c[0], c[1]));
+    fold_lanes(acc, lanes[0], lanes[1], lanes[2], lanes[3], lanes[4], 2);
+    reduce_scalar(values + i, n - i, pivot, acc);
+}
+#endif
+
+static int always(void) {
+    return 1;
+}
+
+struct reduce_kernel {
+    const char *name;
+    reduce_fn fn;
+    int (*supported)(void);
+};
+
+/* Best first; the first one the CPU supports is used */
+static const struct reduce_kernel kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    { "avx2", reduce_avx2, has_avx2 },
+#endif
+#if defined(__SSE2__)
+    { "sse2", reduce_sse2, always },
+#endif
+#if defined(__aarch64__)
+    { "neon", reduce_neon, always },
+#endif
+    { "scalar", reduce_scalar, always },
+};
+
+#define KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static pthread_once_t picked_once = PTHREAD_ONCE_INIT;
+static const struct reduce_kernel *picked;
+static const struct reduce_kernel *forced;
+
+static void pick_kernel(void) {
+    for(size_t i = 0; i < KERNELS && !picked; i++) {
+        if(kernels[i].supported()) picked = &kernels[i];
+    }
+}
+
+static const struct reduce_kernel *active_kernel(void) {
+    pthread_once(&picked_once, pick_kernel);
+    return forced ? forced : picked;
+}
+
+const char *kv_reduce_kernel(void) {
+    return active_kernel()->name;
+}
+
+int kv_reduce_set_kernel(const char *name) {
+    if(!name) {
+        forced = NULL;
+        return 1;
+    }
+    for(size_t i = 0; i < KERNELS; i++) {
+        if(strcmp(kernels[i].name, name) == 0 && kernels[i].supported()) {
+            forced = &kernels[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* The figures over values[0..n), the first of which is not NaN */
+static struct reduce_acc reduce_from(const double *values, size_t n) {
+    struct reduce_acc acc = { INFINITY, -INFINITY, 0, 0, 0 };
+    active_kernel()->fn(values, n, values[0], &acc);
+    return acc;
+}
+
+void kv_reduce(const double *values, size_t n, struct kv_reduce *out) {
+    size_t first = 0;
+    while(first < n && isnan(values[first])) first++;
+    if(first == n) {
+        out->min = out->max = out->sum = out->mean = out->variance = NAN;
+        out->count = 0;
+        return;
+    }
+
+    double pivot = values[first];
+    struct reduce_acc acc = reduce_from(values + first, n - first);
+    double variance = (acc.sq - acc.sum * acc.sum / acc.count) / acc.count;
+
+    out->min = acc.min;
+    out->max = acc.max;
+    out->sum = pivot * acc.count + acc.sum;
+    out->mean = pivot + acc.sum / acc.count;
+    out->variance = variance > 0 ? variance : 0;
+    out->count = (size_t)acc.count;
+}
+
+/* Put the k-th smallest of a[lo..hi) at a[k], no larger ones before it
+ * and no smaller ones after. Three-way partitions, so the long runs of
+ * equal values fixed-point readings have finish a step early instead of
+ * degrading it. */
+static void select_nth(double *a, size_t lo, size_t hi, size_t k) {
+    while(hi - lo > 1) {
+        double x = a[lo], y = a[lo + (hi - lo) / 2], z = a[hi - 1];
+        double pivot = x < y ? (y < z ? y : (x < z ? z : x)) : (x < z ? x : (y < z ? z : y));
+
+        /* [lo, lt) < pivot, [lt, i) == pivot, [gt, hi) > pivot */
+        size_t lt = lo, i = lo, gt = hi;
+        while(i < gt) {
+            double v = a[i];
+            if(v < pivot) {
+                a[i++] = a[lt];
+                a[lt++] = v;
+            } else if(v > pivot) {
+                a[i] = a[--gt];
+                a[gt] = v;
+            } else {
+                i++;
+            }
+        }
+        if(k < lt) hi = lt;
+        else if(k >= gt) lo = gt;
+        else return;
+    }
+}
+
+int kv_reduce_percentiles(const double *values, size_t n, const double *ps, int nps, double *out) {
+    for(int i = 0; i < nps; i++) out[i] = NAN;
+    if(n == 0 || nps <= 0) return 1;
+
+    double *scratch = kv_malloc(n * sizeof(double));
+    int *order = kv_malloc((size_t)nps * sizeof(int));
+    if(!scratch || !order) {
+        kv_free(scratch);
+        kv_free(order);
+        return 0;
+    }
+
+    /* Compact the gaps away without a branch per value */
+    size_t count = 0;
+    for(size_t i = 0; i < n; i++) {
+        scratch[count] = values[i];
+        count += !isnan(values[i]);
+    }
+
+    /* Smallest p first: each rank is then selected among the values at
+     * or above the one before, which the last selection left in place */
+    for(int i = 0; i < nps; i++) {
+        int j = i;
+        for(; j > 0 && ps[order[j - 1]] > ps[i]; j--) order[j] = order[j - 1];
+        order[j] = i;
+    }
+
+    size_t lo = 0;
+    for(int i = 0; count > 0 && i < nps; i++) {
+        double p = ps[order[i]];
+        if(!(p >= 0 && p <= 100)) continue;
+
+        double rank = p / 100 * (double)(count - 1);
+        size_t r = (size_t)rank;
+        select_nth(scratch, lo, count, r);
+        double at = scratch[r];
+        if(rank > (double)r && r + 1 < count) {
+            /* The next rank up is the smallest value above r */
+            double next = reduce_from(scratch + r + 1, count - r - 1).min;
+            at += (next - at) * (rank - (double)r);
+        }
+        out[order[i]] = at;
+        lo = r;
+    }
+
+    kv_free(order);
+    kv_free(scratch);
+    return 1;
+}
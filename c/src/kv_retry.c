@@ -0,0 +1,222 @@
+/*
+ * libkv transport policy: per-attempt timeouts, retries with decorrelated
+ * jitter, Retry-After, and a circuit breaker.
+ *
+ * Every API call is safe to repeat: a store replaces the document, a
+ * patch's set and remove give the same result twice and a versioned patch
+ * is refused once applied, so kv_perform may retry any of them. Only
+ * failures that can pass are retried: network errors, timeouts, 429 and
+ * 5xx other than 501/505.
+ *
+ * Jitter is drawn from a generator seeded per client, so devices that
+ * lose the server at the same moment spread their retries instead of
+ * coming back together.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kv_internal.h"
+
+#define KV_CONNECT_TIMEOUT_MS 10000L
+#define KV_TIMEOUT_MS         30000L
+#define KV_RETRY_BASE_MS      200L
+#define KV_RETRY_MAX_MS       10000L
+#define KV_BREAKER_OPEN_MS    30000L
+
+/* xorshift64*: plenty for spreading delays, and no shared state */
+unsigned long long kv_random_next(unsigned long long *state) {
+    unsigned long long x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+unsigned long long kv_random_seed(const void *salt) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    unsigned long long seed = ((unsigned long long)ts.tv_nsec << 20) ^ (unsigned long long)ts.tv_sec ^
+                              ((unsigned long long)getpid() << 40) ^ (unsigned long long)(uintptr_t)salt;
+    return seed ? seed : 1;
+}
+
+/* A random length between half of ms and ms */
+static long spread(struct kv_retry *retry, long ms) {
+    return ms / 2 + (long)(kv_random_next(&retry->random) % (unsigned long long)(ms / 2 + 1));
+}
+
+void kv_retry_init(kv_client *client) {
+    struct kv_retry *retry = &client->retry;
+
+    retry->connect_timeout_ms = KV_CONNECT_TIMEOUT_MS;
+    retry->timeout_ms = KV_TIMEOUT_MS;
+    retry->max_attempts = 1;
+    retry->base_ms = KV_RETRY_BASE_MS;
+    retry->max_ms = KV_RETRY_MAX_MS;
+    retry->retry_after_ms = -1;
+    retry->breaker_open_ms = KV_BREAKER_OPEN_MS;
+    retry->breaker = KV_BREAKER_CLOSED;
+
+    retry->random = kv_random_seed(client);
+
+    curl_easy_setopt(client->curl, CURLOPT_CONNECTTIMEOUT_MS, retry->connect_timeout_ms);
+}
+
+void kv_client_set_timeouts(kv_client *client, long connect_ms, long total_ms) {
+    client->retry.connect_timeout_ms = connect_ms > 0 ? connect_ms : 0;
+    client->retry.timeout_ms = total_ms > 0 ? total_ms : 0;
+    curl_easy_setopt(client->curl, CURLOPT_CONNECTTIMEOUT_MS, client->retry.connect_timeout_ms);
+}
+
+void kv_client_set_retry(kv_client *client, int max_attempts, long base_ms, long max_ms) {
+    struct kv_retry *retry = &client->retry;
+    retry->max_attempts = max_attempts > 1 ? max_attempts : 1;
+    retry->base_ms = base_ms > 0 ? base_ms : KV_RETRY_BASE_MS;
+    retry->max_ms = max_ms > 0 ? max_ms : KV_RETRY_MAX_MS;
+    if(retry->max_ms < retry->base_ms) retry->max_ms = retry->base_ms;
+}
+
+void kv_client_set_breaker(kv_client *client, int failures, long open_ms) {
+    struct kv_retry *retry = &client->retry;
+    retry->breaker_failures = failures > 0 ? failures : 0;
+    retry->breaker_open_ms = open_ms > 0 ? open_ms : KV_BREAKER_OPEN_MS;
+    if(retry->breaker_failures == 0) {
+        retry->breaker = KV_BREAKER_CLOSED;
+        retry->failures = 0;
+    }
+}
+
+int kv_client_breaker_state(const kv_client *client) {
+    if(client->retry.breaker == KV_BREAKER_OPEN && kv_now_ms() >= client->retry.open_until_ms) {
+        return KV_BREAKER_HALF_OPEN;        /* the next request is the probe */
+    }
+    return client->retry.breaker;
+}
+
+int kv_client_attempts(const kv_client *client) {
+    return client->retry.attempts;
+}
+
+void kv_retry_timeouts(const kv_client *client, CURL *curl) {
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, client->retry.connect_timeout_ms);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, client->retry.timeout_ms);
+}
+
+long kv_retry_backoff(struct kv_retry *retry, long last_ms) {
+    long low = retry->base_ms;
+    long high = (last_ms > low ? last_ms : low) * 3;
+    if(high > retry->max_ms) high = retry->max_ms;
+    if(low > high) low = high;
+    return low + (long)(kv_random_next(&retry->random) % (unsigned long long)(high - low + 1));
+}
+
+void kv_retry_after_header(kv_client *client, const char *value, size_t len) {
+    char text[64];
+    if(len >= sizeof(text)) return;
+    memcpy(text, value, len);
+    text[len] = 0;
+
+    long long ms = -1;
+    if(text[0] >= '0' && text[0] <= '9') {
+        long long seconds = 0;
+        for(const char *c = text; *c >= '0' && *c <= '9' && seconds < 86400; c++) seconds = seconds * 10 + (*c - '0');
+        ms = seconds * 1000;
+    } else {
+        time_t when = curl_getdate(text, NULL);
+        if(when != (time_t)-1) {
+            time_t now = time(NULL);
+            ms = when > now ? (long long)(when - now) * 1000 : 0;
+        }
+    }
+    if(ms >= 0) client->retry.retry_after_ms = ms > 86400000LL ? 86400000L : (long)ms;
+}
+
+/* Whether the attempt failed in a way that may pass */
+static int transient_failure(const kv_client *client, CURLcode res) {
+    switch(res) {
+    case CURLE_OK:
+        return client->status == 429 ||
+               (client->status >= 500 && client->status != 501 && client->status != 505);
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+int kv_retry_begin(kv_client *client) {
+    struct kv_retry *retry = &client->retry;
+    retry->attempts = 0;
+    retry->last_delay_ms = 0;
+
+    if(retry->breaker == KV_BREAKER_OPEN) {
+        long long left = retry->open_until_ms - kv_now_ms();
+        if(left > 0) {
+            snprintf(client->error, sizeof(client->error), "Circuit open, next try in %lld ms", left);
+            return 0;
+        }
+        retry->breaker = KV_BREAKER_HALF_OPEN;
+    }
+    return 1;
+}
+
+int kv_sleep_ms(long ms) {
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    return nanosleep(&ts, NULL) == 0;
+}
+
+int kv_retry_next(kv_client *client, CURLcode res) {
+    struct kv_retry *retry = &client->retry;
+    retry->attempts++;
+
+    /* A half-open breaker lets exactly one attempt through */
+    if(!transient_failure(client, res) || retry->attempts >= retry->max_attempts ||
+       retry->breaker == KV_BREAKER_HALF_OPEN) return 0;
+
+    long delay = kv_retry_backoff(retry, retry->last_delay_ms);
+    if(retry->retry_after_ms >= 0) {
+        /* Asked to wait longer than we would back off: give up for now, and
+         * let the breaker hold off for that long */
+        if(retry->retry_after_ms > retry->max_ms) return 0;
+        if(retry->retry_after_ms > delay) delay = retry->retry_after_ms;
+    }
+    retry->last_delay_ms = delay;
+    return kv_sleep_ms(delay);
+}
+
+void kv_retry_end(kv_client *client, CURLcode res) {
+    struct kv_retry *retry = &client->retry;
+
+    if(!transient_failure(client, res)) {
+        retry->failures = 0;
+        retry->breaker = KV_BREAKER_CLOSED;
+        return;
+    }
+
+    retry->failures++;
+    if(retry->breaker_failures == 0) return;
+    if(retry->failures >= retry->breaker_failures || retry->breaker == KV_BREAKER_HALF_OPEN ||
+       retry->retry_after_ms > retry->max_ms) {
+        long open_ms = spread(retry, retry->breaker_open_ms);
+        if(retry->retry_after_ms > open_ms) open_ms = retry->retry_after_ms;
+        retry->breaker = KV_BREAKER_OPEN;
+        retry->open_until_ms = kv_now_ms() + open_ms;
+    }
+}
@@ -0,0 +1,276 @@
+/*
+ * libkv scheduler: periodic jobs at a fixed rate on a hashed timer wheel.
+ *
+ * The wheel has KV_SCHED_SLOTS slots of KV_SCHED_TICK_MS each; a job sits
+ * in the slot of the tick it is due in, whatever the revolution, so adding
+ * or moving one is O(1) and a poll only looks at the slots whose ticks
+ * have passed. Jobs due in a later revolution stay where they are until
+ * their time comes round.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "kv_sched.h"
+#include "kv_internal.h"
+
+#define KV_SCHED_SLOTS   256
+#define KV_SCHED_TICK_MS 10
+
+struct kv_sched_job {
+    struct kv_sched_job *next;      /* in its slot, or among the due jobs */
+    kv_sched_callback callback;
+    void *userdata;
+    long period_ms;
+    long jitter_ms;
+    long long tick_ms;              /* current tick of the fixed-rate schedule */
+    long long due_ms;               /* tick_ms plus this run's jitter */
+    int busy;
+    int queued;                     /* taken off the wheel, among the due jobs */
+    int running;                    /* its callback is running */
+    int cancelled;                  /* while queued or running: free it afterwards */
+    struct kv_sched_stats stats;
+};
+
+struct kv_sched {
+    kv_async *async;
+    struct kv_sched_job *slots[KV_SCHED_SLOTS];
+    long long tick;                 /* last wheel tick visited */
+    int jobs;
+    int stopped;
+    unsigned long long random;
+};
+
+static long jitter(kv_sched *sched, long jitter_ms) {
+    if(jitter_ms <= 0) return 0;
+    return (long)(kv_random_next(&sched->random) % (unsigned long long)(jitter_ms + 1));
+}
+
+/* Put job in the slot of its due tick; one already past goes into the
+ * current slot, which the next poll visits first */
+static void wheel_insert(kv_sched *sched, struct kv_sched_job *job) {
+    long long tick = job->due_ms / KV_SCHED_TICK_MS;
+    if(tick < sched->tick) tick = sched->tick;
+
+    struct kv_sched_job **slot = &sched->slots[tick % KV_SCHED_SLOTS];
+    job->next = *slot;
+    *slot = job;
+}
+
+static int wheel_remove(kv_sched *sched, struct kv_sched_job *job) {
+    for(int i = 0; i < KV_SCHED_SLOTS; i++) {
+        for(struct kv_sched_job **link = &sched->slots[i]; *link; link = &(*link)->next) {
+            if(*link == job) {
+                *link = job->next;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+kv_sched *kv_sched_new(kv_async *async) {
+    kv_sched *sched = kv_calloc(1, sizeof(*sched));
+    if(!sched) return NULL;
+
+    sched->async = async;
+    sched->tick = kv_now_ms() / KV_SCHED_TICK_MS;
+    sched->random = kv_random_seed(sched);
+    return sched;
+}
+
+void kv_sched_free(kv_sched *sched) {
+    if(!sched) return;
+
+    for(int i = 0; i < KV_SCHED_SLOTS; i++) {
+        while(sched->slots[i]) {
+            struct kv_sched_job *job = sched->slots[i];
+            sched->slots[i] = job->next;
+            kv_free(job);
+        }
+    }
+    kv_free(sched);
+}
+
+kv_sched_job *kv_sched_every(kv_sched *sched, long period_ms, long jitter_ms,
+                             kv_sched_callback callback, void *userdata) {
+    if(!callback) return NULL;
+
+    struct kv_sched_job *job = kv_calloc(1, sizeof(*job));
+    if(!job) return NULL;
+
+    job->callback = callback;
+    job->userdata = userdata;
+    job->period_ms = period_ms > 0 ? period_ms : 1;
+    job->jitter_ms = jitter_ms > 0 ? jitter_ms : 0;
+    job->tick_ms = kv_now_ms();
+    job->due_ms = job->tick_ms + jitter(sched, job->jitter_ms);
+    wheel_insert(sched, job);
+    sched->jobs++;
+    return job;
+}
+
+void kv_sched_cancel(kv_sched *sched, kv_sched_job *job) {
+    if(!job) return;
+
+    /* Off the wheel for this pass: run_due frees it instead */
+    if(job->queued || job->running) {
+        job->cancelled = 1;
+    } else if(wheel_remove(sched, job)) {
+        kv_free(job);
+        sched->jobs--;
+    }
+}
+
+void kv_sched_job_set_busy(kv_sched_job *job, int busy) {
+    job->busy = busy ? 1 : 0;
+}
+
+void kv_sched_job_stats(const kv_sched_job *job, struct kv_sched_stats *stats) {
+    *stats = job->stats;
+}
+
+/* Move job to its next tick after now. Ticks it is already late for are
+ * skipped, so an overrun costs runs instead of shifting the schedule. */
+static void reschedule(kv_sched *sched, struct kv_sched_job *job, long long now) {
+    job->tick_ms += job->period_ms;
+    if(job->tick_ms <= now) {
+        long long missed = (now - job->tick_ms) / job->period_ms + 1;
+        job->tick_ms += missed * job->period_ms;
+        job->stats.skipped += (long)missed;
+    }
+    job->due_ms = job->tick_ms + jitter(sched, job->jitter_ms);
+    wheel_insert(sched, job);
+}
+
+/* Take the jobs due by now off the wheel, in the order their ticks came */
+static struct kv_sched_job *take_due(kv_sched *sched, long long now) {
+    struct kv_sched_job *due = NULL, **tail = &due;
+    long long now_tick = now / KV_SCHED_TICK_MS;
+
+    /* More than a revolution behind: every slot once is enough */
+    long long first = sched->tick;
+    if(now_tick - first >= KV_SCHED_SLOTS) first = now_tick - KV_SCHED_SLOTS + 1;
+
+    for(long long tick = first; tick <= now_tick; tick++) {
+        struct kv_sched_job **link = &sched->slots[tick % KV_SCHED_SLOTS];
+        while(*link) {
+            struct kv_sched_job *job = *link;
+            if(job->due_ms > now) {
+                link = &job->next;
+                continue;
+            }
+            *link = job->next;
+            job->next = NULL;
+            job->queued = 1;
+            *tail = job;
+            tail = &job->next;
+        }
+    }
+
+    /* The current tick is visited again: jobs later in it are not due yet */
+    sched->tick = now_tick;
+    return due;
+}
+
+static void run_due(kv_sched *sched) {
+    long long now = kv_now_ms();
+    struct kv_sched_job *due = take_due(sched, now);
+
+    for(struct kv_sched_job *job = due; job; job = due) {
+        due = job->next;
+        job->queued = 0;
+
+        if(job->cancelled) {
+            /* Cancelled by a job that ran before it in this pass */
+        } else if(job->busy) {
+            job->stats.skipped++;
+        } else {
+            long long started = kv_now_ms();
+            job->stats.runs++;
+            job->stats.late_ms = (long)(started - job->due_ms);
+            if(job->stats.late_ms > job->stats.max_late_ms) job->stats.max_late_ms = job->stats.late_ms;
+
+            job->running = 1;
+            if(!job->callback(job, job->userdata)) job->cancelled = 1;
+            job->running = 0;
+        }
+
+        if(job->cancelled) {
+            kv_free(job);
+            sched->jobs--;
+        } else {
+            reschedule(sched, job, kv_now_ms());
+        }
+    }
+}
+
+long kv_sched_next_ms(kv_sched *sched) {
+    long long now = kv_now_ms();
+
+    /* The first slot from the current tick on with a job due in this
+     * revolution holds the earliest; if no slot has one, they are all
+     * further out and any may be */
+    long long best = -1;
+    for(int k = 0; k < KV_SCHED_SLOTS && best < 0; k++) {
+        long long tick = sched->tick + k;
+        for(struct kv_sched_job *job = sched->slots[tick % KV_SCHED_SLOTS]; job; job = job->next) {
+            if(job->due_ms / KV_SCHED_TICK_MS <= tick && (best < 0 || job->due_ms < best)) best = job->due_ms;
+        }
+    }
+    if(best < 0) {
+        for(int i = 0; i < KV_SCHED_SLOTS; i++) {
+            for(struct kv_sched_job *job = sched->slots[i]; job; job = job->next) {
+                if(best < 0 || job->due_ms < best) best = job->due_ms;
+            }
+        }
+    }
+
+    if(best < 0) return -1;
+    return best > now ? (long)(best - now) : 0;
+}
+
+int kv_sched_poll(kv_sched *sched, long timeout_ms) {
+    run_due(sched);
+
+    long wait = kv_sched_next_ms(sched);
+    if(wait < 0 || wait > timeout_ms) wait = timeout_ms > 0 ? timeout_ms : 0;
+
+    if(sched->async && kv_async_pending(sched->async) > 0) {
+        /* Completions may start more requests or free a busy job; either
+         * way go round again before sleeping */
+        errno = 0;
+        if(kv_async_poll(sched->async, (int)wait) < 0) return -1;
+        if(errno == EINTR) return 0;
+    } else if(wait > 0 && !kv_sleep_ms(wait)) {
+        return 0;
+    }
+
+    run_due(sched);
+    return 1;
+}
+
+int kv_sched_run(kv_sched *sched, long duration_ms) {
+    long long deadline = duration_ms > 0 ? kv_now_ms() + duration_ms : 0;
+    sched->stopped = 0;
+
+    for(;;) {
+        int pending = sched->async ? kv_async_pending(sched->async) : 0;
+        if(sched->stopped || (sched->jobs == 0 && pending == 0)) return 1;
+
+        long wait = KV_SCHED_TICK_MS * KV_SCHED_SLOTS;
+        if(deadline) {
+            long long left = deadline - kv_now_ms();
+            if(left <= 0) return 0;
+            if(left < wait) wait = (long)left;
+        }
+
+        int result = kv_sched_poll(sched, wait);
+        if(result <= 0) return result;
+    }
+}
+
+void kv_sched_stop(kv_sched *sched) {
+    sched->stopped = 1;
+}
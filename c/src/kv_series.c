@@ -0,0 +1,376 @@
+/*
+ * libkv columnar time series.
+ *
+ * In memory every slot holds an absolute epoch and, per column, the value
+ * already rounded to the column's fixed-point scale (NAN for a gap), so a
+ * series that is encoded and decoded again compares equal. Deltas are only
+ * computed for the stored form: slot s holds the seconds between its
+ * reading and the one before it in time, and "t0"/"t_last" anchor the
+ * oldest and newest readings, so overwriting the oldest slot touches the
+ * slot itself plus "t0", never its neighbours.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "kv_series.h"
+#include "kv_internal.h"
+
+#define KV_SERIES_PATH_MAX 256
+
+struct kv_series_column {
+    char *name;
+    long scale;
+    double *values;                 /* per slot */
+};
+
+struct kv_series {
+    int capacity;
+    int count;
+    int head;                       /* slot of the oldest reading once full */
+    long scale;                     /* for new columns */
+    int stored;                     /* came from kv_series_decode */
+    long long *times;               /* per slot */
+    struct kv_series_column *columns;
+    int ncolumns;
+    int column_capacity;
+};
+
+/* Slot of reading i, oldest first */
+static int slot_of(const kv_series *series, int i) {
+    int oldest = series->count < series->capacity ? 0 : series->head;
+    return (oldest + i) % series->capacity;
+}
+
+static double quantize(double value, long scale) {
+    return (double)llround(value * scale) / scale;
+}
+
+static struct json_object *value_json(double value, long scale) {
+    return isnan(value) ? NULL : json_object_new_int64(llround(value * scale));
+}
+
+static struct kv_series_column *column_find(const kv_series *series, const char *name) {
+    for(int i = 0; i < series->ncolumns; i++) {
+        if(strcmp(series->columns[i].name, name) == 0) return &series->columns[i];
+    }
+    return NULL;
+}
+
+static struct kv_series_column *column_add(kv_series *series, const char *name, long scale) {
+    if(series->ncolumns == series->column_capacity) {
+        int capacity = series->column_capacity ? series->column_capacity * 2 : 4;
+        struct kv_series_column *grown = kv_realloc(series->columns, sizeof(*grown) * capacity);
+        if(!grown) return NULL;
+        series->columns = grown;
+        series->column_capacity = capacity;
+    }
+
+    struct kv_series_column *column = &series->columns[series->ncolumns];
+    column->name = kv_strdup(name);
+    column->scale = scale > 0 ? scale : 1;
+    column->values = kv_malloc(sizeof(double) * series->capacity);
+    if(!column->name || !column->values) {
+        kv_free(column->name);
+        kv_free(column->values);
+        return NULL;
+    }
+    for(int i = 0; i < series->capacity; i++) column->values[i] = NAN;
+    series->ncolumns++;
+    return column;
+}
+
+kv_series *kv_series_new(int capacity, long scale) {
+    if(capacity < 1) return NULL;
+
+    kv_series *series = kv_calloc(1, sizeof(*series));
+    if(!series) return NULL;
+    series->times = kv_calloc((size_t)capacity, sizeof(long long));
+    if(!series->times) {
+        kv_free(series);
+        return NULL;
+    }
+    series->capacity = capacity;
+    series->scale = scale > 0 ? scale : 1;
+    return series;
+}
+
+void kv_series_free(kv_series *series) {
+    if(!series) return;
+
+    for(int i = 0; i < series->ncolumns; i++) {
+        kv_free(series->columns[i].name);
+        kv_free(series->columns[i].values);
+    }
+    kv_free(series->columns);
+    kv_free(series->times);
+    kv_free(series);
+}
+
+int kv_series_count(const kv_series *series) {
+    return series->count;
+}
+
+int kv_series_capacity(const kv_series *series) {
+    return series->capacity;
+}
+
+int kv_series_next_slot(const kv_series *series) {
+    return series->count < series->capacity ? series->count : series->head;
+}
+
+long long kv_series_time(const kv_series *series, int i) {
+    return series->times[slot_of(series, i)];
+}
+
+/* Values of one column in slot order, the way they are stored */
+static struct json_object *column_json(const kv_series *series, const struct kv_series_column *column) {
+    int len = series->count;
+    struct json_object *entry = json_object_new_object();
+    struct json_object *values = json_object_new_array_ext(len);
+
+    for(int s = 0; s < len; s++) {
+        json_object_array_add(values, value_json(column->values[s], column->scale));
+    }
+    json_object_object_add(entry, "scale", json_object_new_int64(column->scale));
+    json_object_object_add(entry, "values", values);
+    return entry;
+}
+
+/* Seconds between the reading in slot s and the one before it in time */
+static long long slot_delta(const kv_series *series, int s) {
+    int oldest = slot_of(series, 0);
+    if(s == oldest) return 0;
+    int prev = (s + series->capacity - 1) % series->capacity;
+    return series->times[s] - series->times[prev];
+}
+
+struct json_object *kv_series_encode(const kv_series *series) {
+    struct json_object *encoded = json_object_new_object();
+    struct json_object *dt = json_object_new_array_ext(series->count);
+    struct json_object *columns = json_object_new_object();
+    int len = series->count;
+
+    for(int s = 0; s < len; s++) {
+        json_object_array_add(dt, json_object_new_int64(slot_delta(series, s)));
+    }
+    for(int i = 0; i < series->ncolumns; i++) {
+        json_object_object_add(columns, series->columns[i].name, column_json(series, &series->columns[i]));
+    }
+
+    json_object_object_add(encoded, "capacity", json_object_new_int(series->capacity));
+    json_object_object_add(encoded, "count", json_object_new_int(series->count));
+    json_object_object_add(encoded, "head", json_object_new_int(series->head));
+    json_object_object_add(encoded, "scale", json_object_new_int64(series->scale));
+    json_object_object_add(encoded, "t0", json_object_new_int64(len ? kv_series_time(series, 0) : 0));
+    json_object_object_add(encoded, "t_last", json_object_new_int64(len ? kv_series_time(series, len - 1) : 0));
+    json_object_object_add(encoded, "dt", dt);
+    json_object_object_add(encoded, "columns", columns);
+    return encoded;
+}
+
+static long long member_int64(struct json_object *obj, const char *key, int *ok) {
+    struct json_object *value;
+    if(!json_object_object_get_ex(obj, key, &value) || !json_object_is_type(value, json_type_int)) {
+        *ok = 0;
+        return 0;
+    }
+    return json_object_get_int64(value);
+}
+
+kv_series *kv_series_decode(struct json_object *encoded) {
+    struct json_object *dt, *columns;
+    int ok = 1;
+
+    if(!encoded || !json_object_is_type(encoded, json_type_object)) return NULL;
+    long long capacity = member_int64(encoded, "capacity", &ok);
+    long long count = member_int64(encoded, "count", &ok);
+    long long head = member_int64(encoded, "head", &ok);
+    long long t0 = member_int64(encoded, "t0", &ok);
+    long long t_last = member_int64(encoded, "t_last", &ok);
+    if(!ok || capacity < 1 || capacity > 1000000 || count < 0 || count > capacity ||
+       head < 0 || head >= capacity || (count < capacity && head != 0)) return NULL;
+    if(!json_object_object_get_ex(encoded, "dt", &dt) || !json_object_is_type(dt, json_type_array) ||
+       (long long)json_object_array_length(dt) != count) return NULL;
+    if(!json_object_object_get_ex(encoded, "columns", &columns) ||
+       !json_object_is_type(columns, json_type_object)) return NULL;
+
+    /* The scale of columns still to come; a stored form without one
+     * predates it being kept */
+    long long scale = KV_SERIES_DEFAULT_SCALE;
+    if(json_object_object_get_ex(encoded, "scale", NULL)) scale = member_int64(encoded, "scale", &ok);
+    if(!ok || scale < 1) return NULL;
+
+    kv_series *series = kv_series_new((int)capacity, (long)scale);
+    if(!series) return NULL;
+    series->count = (int)count;
+    series->head = (int)head;
+    series->stored = 1;
+
+    /* Rebuild absolute times oldest first; the newest must land on t_last */
+    long long t = t0;
+    for(int i = 0; i < series->count; i++) {
+        int s = slot_of(series, i);
+        if(i > 0) t += json_object_get_int64(json_object_array_get_idx(dt, s));
+        series->times[s] = t;
+    }
+    if(series->count > 0 && t != t_last) {
+        kv_series_free(series);
+        return NULL;
+    }
+
+    json_object_object_foreach(columns, name, entry) {
+        struct json_object *values;
+        int scale_ok = 1;
+        long long scale = member_int64(entry, "scale", &scale_ok);
+        if(!scale_ok || scale < 1 || !json_object_object_get_ex(entry, "values", &values) ||
+           !json_object_is_type(values, json_type_array) ||
+           (long long)json_object_array_length(values) != count) {
+            kv_series_free(series);
+            return NULL;
+        }
+
+        struct kv_series_column *column = column_add(series, name, (long)scale);
+        if(!column) {
+            kv_series_free(series);
+            return NULL;
+        }
+        for(int s = 0; s < series->count; s++) {
+            struct json_object *value = json_object_array_get_idx(values, s);
+            if(value) column->values[s] = (double)json_object_get_int64(value) / column->scale;
+        }
+    }
+
+    return series;
+}
+
+static int is_number(struct json_object *value) {
+    return json_object_is_type(value, json_type_int) || json_object_is_type(value, json_type_double);
+}
+
+int kv_series_append(kv_series *series, long long epoch, struct json_object *reading,
+                     struct json_object *set, const char *prefix) {
+    int slot = kv_series_next_slot(series);
+    int evicting = (series->count == series->capacity);
+    int first_column = series->ncolumns;
+
+    /* Create columns first so a failure leaves the series untouched */
+    if(reading && json_object_is_type(reading, json_type_object)) {
+        json_object_object_foreach(reading, name, value) {
+            if(!is_number(value) || strchr(name, '.') || column_find(series, name)) continue;
+            if(!column_add(series, name, series->scale)) return 0;
+        }
+    }
+
+    series->times[slot] = epoch;
+    for(int i = 0; i < series->ncolumns; i++) {
+        struct kv_series_column *column = &series->columns[i];
+        struct json_object *value;
+        column->values[slot] = NAN;
+        if(reading && json_object_object_get_ex(reading, column->name, &value) && is_number(value)) {
+            column->values[slot] = quantize(json_object_get_double(value), column->scale);
+        }
+    }
+
+    if(evicting) {
+        series->head = (series->head + 1) % series->capacity;
+    } else {
+        series->count++;
+    }
+
+    if(!set) return 1;
+
+    /* Not stored yet, or already written whole earlier in this patch:
+     * (re)write it whole, since paths below it would race that entry */
+    if(!series->stored || json_object_object_get_ex(set, prefix, NULL)) {
+        json_object_object_add(set, prefix, kv_series_encode(series));
+        series->stored = 1;
+        return 1;
+    }
+
+    char path[KV_SERIES_PATH_MAX];
+    snprintf(path, sizeof(path), "%s.dt.%d", prefix, slot);
+    json_object_object_add(set, path, json_object_new_int64(slot_delta(series, slot)));
+    snprintf(path, sizeof(path), "%s.t_last", prefix);
+    json_object_object_add(set, path, json_object_new_int64(epoch));
+    if(evicting || series->count == 1) {
+        snprintf(path, sizeof(path), "%s.t0", prefix);
+        json_object_object_add(set, path, json_object_new_int64(kv_series_time(series, 0)));
+    }
+    if(evicting) {
+        snprintf(path, sizeof(path), "%s.head", prefix);
+        json_object_object_add(set, path, json_object_new_int(series->head));
+    } else {
+        snprintf(path, sizeof(path), "%s.count", prefix);
+        json_object_object_add(set, path, json_object_new_int(series->count));
+    }
+
+    for(int i = 0; i < series->ncolumns; i++) {
+        struct kv_series_column *column = &series->columns[i];
+        snprintf(path, sizeof(path), "%s.columns.%s", prefix, column->name);
+        if(i >= first_column || json_object_object_get_ex(set, path, NULL)) {
+            json_object_object_add(set, path, column_json(series, column));
+        } else {
+            snprintf(path, sizeof(path), "%s.columns.%s.values.%d", prefix, column->name, slot);
+            json_object_object_add(set, path, value_json(column->values[slot], column->scale));
+        }
+    }
+    return 1;
+}
+
+int kv_series_column(const kv_series *series, const char *name, double *out) {
+    const struct kv_series_column *column = column_find(series, name);
+    if(!column) return -1;
+
+    for(int i = 0; i < series->count; i++) out[i] = column->values[slot_of(series, i)];
+    return series->count;
+}
+
+/* A stored value as a JSON double printed with the column's precision,
+ * so 22.22 reads back as 22.22 rather than its nearest binary double */
+static struct json_object *value_view(double value, long scale) {
+    int digits = 0;
+    for(long s = scale; s >= 10; s /= 10) digits++;
+
+    char text[64];
+    snprintf(text, sizeof(text), "%.*f", digits, value);
+    if(digits > 0) {
+        /* Trim trailing zeros, keeping one decimal so it stays a double */
+        char *end = text + strlen(text) - 1;
+        while(end[0] == '0' && end[-1] != '.') *end-- = 0;
+    }
+    return json_object_new_double_s(value, text);
+}
+
+struct json_object *kv_series_reading(const kv_series *series, int i) {
+    if(i < 0 || i >= series->count) return NULL;
+
+    int s = slot_of(series, i);
+    time_t t = (time_t)series->times[s];
+    struct tm tm_info;
+    char timestamp[32];
+    gmtime_r(&t, &tm_info);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", &tm_info);
+
+    struct json_object *reading = json_object_new_object();
+    json_object_object_add(reading, "timestamp", json_object_new_string(timestamp));
+    for(int c = 0; c < series->ncolumns; c++) {
+        double value = series->columns[c].values[s];
+        if(!isnan(value)) {
+            json_object_object_add(reading, series->columns[c].name,
+                                   value_view(value, series->columns[c].scale));
+        }
+    }
+    return reading;
+}
+
+struct json_object *kv_series_to_json(const kv_series *series) {
+    struct json_object *readings = json_object_new_array_ext(series->count);
+    for(int i = 0; i < series->count; i++) {
+        json_object_array_add(readings, kv_series_reading(series, i));
+    }
+    return readings;
+}
@@ -0,0 +1,89 @@
+/*
+ * libkv shared caches: a CURLSH whose lock callbacks take one read-write
+ * lock per kind of shared data, so clients on different threads can use
+ * the DNS cache and TLS sessions together.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "kv_internal.h"
+
+struct kv_share {
+    CURLSH *curlsh;
+    pthread_rwlock_t locks[CURL_LOCK_DATA_LAST];
+};
+
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+    kv_share *share = (kv_share *)userptr;
+    (void)handle;
+
+    if(data < 0 || data >= CURL_LOCK_DATA_LAST) return;
+    if(access == CURL_LOCK_ACCESS_SHARED) {
+        pthread_rwlock_rdlock(&share->locks[data]);
+    } else {
+        pthread_rwlock_wrlock(&share->locks[data]);
+    }
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+    kv_share *share = (kv_share *)userptr;
+    (void)handle;
+
+    if(data < 0 || data >= CURL_LOCK_DATA_LAST) return;
+    pthread_rwlock_unlock(&share->locks[data]);
+}
+
+kv_share *kv_share_new(int what) {
+    kv_share *share = kv_calloc(1, sizeof(*share));
+    if(!share) return NULL;
+
+    share->curlsh = curl_share_init();
+    if(!share->curlsh) {
+        kv_free(share);
+        return NULL;
+    }
+    for(int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_rwlock_init(&share->locks[i], NULL);
+    }
+
+    CURLSHcode rc = CURLSHE_OK;
+    curl_share_setopt(share->curlsh, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(share->curlsh, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(share->curlsh, CURLSHOPT_USERDATA, (void *)share);
+    if(rc == CURLSHE_OK && (what & KV_SHARE_DNS)) {
+        rc = curl_share_setopt(share->curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    }
+    if(rc == CURLSHE_OK && (what & KV_SHARE_TLS)) {
+        rc = curl_share_setopt(share->curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+    if(rc == CURLSHE_OK && (what & KV_SHARE_CONNECTIONS)) {
+        rc = curl_share_setopt(share->curlsh, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
+
+    if(rc != CURLSHE_OK) {
+        kv_share_free(share);
+        return NULL;
+    }
+    return share;
+}
+
+void kv_share_free(kv_share *share) {
+    if(!share) return;
+
+    curl_share_cleanup(share->curlsh);
+    for(int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        pthread_rwlock_destroy(&share->locks[i]);
+    }
+    kv_free(share);
+}
+
+int kv_client_set_share(kv_client *client, kv_share *share) {
+    CURLcode rc = curl_easy_setopt(client->curl, CURLOPT_SHARE, share ? share->curlsh : NULL);
+    if(rc != CURLE_OK) {
+        snprintf(client->error, sizeof(client->error), "%s", curl_easy_strerror(rc));
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,257 @@
+/*
+ * libkv local snapshots: one mapped file per token.
+ *
+ * Saving writes header and strings to a temporary file next to the
+ * snapshot and renames it into place; there is no fsync, since a snapshot
+ * lost or torn by a crash only costs a download. Opening maps the whole
+ * file and checks its magic, lengths, CRC and token before any of it is
+ * used.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "kv_snapshot.h"
+#include "kv_internal.h"
+
+#define KV_SNAPSHOT_MAGIC "KVSNAP01"
+#define KV_SNAPSHOT_HEADER 48       /* magic, 3 x u64, 4 x u32 */
+#define KV_SNAPSHOT_CONFIRMED 24    /* offset of confirmed_ms */
+#define KV_SNAPSHOT_PATH_MAX 4096
+
+struct kv_snapshot {
+    void *map;
+    size_t size;
+    long version;
+    long long confirmed_ms;
+    const char *etag;
+    const char *data;
+    size_t data_len;
+};
+
+static long long wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* dir/<FNV-1a of token>.snap: the token itself stays out of the name */
+static int snapshot_path(char *out, size_t size, const char *dir, const char *token) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for(const unsigned char *p = (const unsigned char *)token; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    int n = snprintf(out, size, "%s/%016llx.snap", dir, hash);
+    return n > 0 && (size_t)n < size;
+}
+
+int kv_client_set_snapshot_dir(kv_client *client, const char *dir) {
+    kv_free(client->snapshot_dir);
+    client->snapshot_dir = NULL;
+    if(!dir) return 1;
+
+    if(mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        snprintf(client->error, sizeof(client->error), "Cannot create %s: %s", dir, strerror(errno));
+        return 0;
+    }
+    client->snapshot_dir = kv_strdup(dir);
+    return client->snapshot_dir != NULL;
+}
+
+kv_snapshot *kv_snapshot_open(const char *dir, const char *token) {
+    char path[KV_SNAPSHOT_PATH_MAX];
+    struct stat st;
+    if(!dir || !token || !snapshot_path(path, sizeof(path), dir, token)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return NULL;
+    if(fstat(fd, &st) != 0 || st.st_size < KV_SNAPSHOT_HEADER) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return NULL;
+
+    const unsigned char *bytes = (const unsigned char *)map;
+    uint64_t token_len = kv_get_le(bytes + 32, 4);
+    uint64_t etag_len = kv_get_le(bytes + 36, 4);
+    uint64_t data_len = kv_get_le(bytes + 40, 4);
+    uint32_t crc = (uint32_t)kv_get_le(bytes + 44, 4);
+    const unsigned char *strings = bytes + KV_SNAPSHOT_HEADER;
+
+    /* Every string is followed by its NUL, and the file ends after data's */
+    int valid = memcmp(bytes, KV_SNAPSHOT_MAGIC, 8) == 0 &&
+                KV_SNAPSHOT_HEADER + token_len + etag_len + data_len + 3 == size &&
+                strings[token_len] == 0 && strings[token_len + 1 + etag_len] == 0 &&
+                bytes[size - 1] == 0 &&
+                token_len == strlen(token) && memcmp(strings, token, token_len) == 0 &&
+                kv_crc32(0, strings, size - KV_SNAPSHOT_HEADER) == crc;
+
+    kv_snapshot *snapshot = valid ? kv_calloc(1, sizeof(*snapshot)) : NULL;
+    if(!snapshot) {
+        munmap(map, size);
+        errno = valid ? ENOMEM : EINVAL;
+        return NULL;
+    }
+
+    snapshot->map = map;
+    snapshot->size = size;
+    snapshot->version = (long)kv_get_le(bytes + 8, 8);
+    snapshot->confirmed_ms = (long long)kv_get_le(bytes + KV_SNAPSHOT_CONFIRMED, 8);
+    snapshot->etag = (const char *)strings + token_len + 1;
+    snapshot->data = snapshot->etag + etag_len + 1;
+    snapshot->data_len = (size_t)data_len;
+    return snapshot;
+}
+
+void kv_snapshot_close(kv_snapshot *snapshot) {
+    if(!snapshot) return;
+
+    munmap(snapshot->map, snapshot->size);
+    kv_free(snapshot);
+}
+
+const char *kv_snapshot_data(const kv_snapshot *snapshot, size_t *len) {
+    if(len) *len = snapshot->data_len;
+    return snapshot->data;
+}
+
+struct json_object *kv_snapshot_parse(const kv_snapshot *snapshot) {
+    struct json_tokener *tokener = json_tokener_new();
+    if(!tokener) return NULL;
+
+    struct json_object *data = json_tokener_parse_ex(tokener, snapshot->data,
+                                                     (int)snapshot->data_len + 1);
+    json_tokener_free(tokener);
+    return data;
+}
+
+long kv_snapshot_version(const kv_snapshot *snapshot) {
+    return snapshot->version;
+}
+
+const char *kv_snapshot_etag(const kv_snapshot *snapshot) {
+    return snapshot->etag;
+}
+
+long long kv_snapshot_age_ms(const kv_snapshot *snapshot) {
+    long long age = wall_ms() - snapshot->confirmed_ms;
+    return age > 0 ? age : 0;
+}
+
+/* ---- client side ---- */
+
+struct kv_snapshot *kv_snapshot_open_client(const kv_client *client) {
+    /* An encrypting client keeps its plaintext off the disk */
+    if(!client->snapshot_dir || !client->token || client->crypt) return NULL;
+    return kv_snapshot_open(client->snapshot_dir, client->token);
+}
+
+void kv_snapshot_write(const char *dir, const char *token, const char *etag, long version,
+                       const char *text, size_t len) {
+    char path[KV_SNAPSHOT_PATH_MAX], temp[KV_SNAPSHOT_PATH_MAX + 32];
+    if(!dir || !token || !text) return;
+    if(!snapshot_path(path, sizeof(path), dir, token)) return;
+    snprintf(temp, sizeof(temp), "%s.%ld.tmp", path, (long)getpid());
+
+    if(!etag) etag = "";
+    size_t token_len = strlen(token), etag_len = strlen(etag);
+    long long now = wall_ms();
+
+    unsigned char header[KV_SNAPSHOT_HEADER];
+    memcpy(header, KV_SNAPSHOT_MAGIC, 8);
+    kv_put_le(header + 8, (uint64_t)version, 8);
+    kv_put_le(header + 16, (uint64_t)now, 8);
+    kv_put_le(header + KV_SNAPSHOT_CONFIRMED, (uint64_t)now, 8);
+    kv_put_le(header + 32, token_len, 4);
+    kv_put_le(header + 36, etag_len, 4);
+    kv_put_le(header + 40, len, 4);
+
+    static const unsigned char nul = 0;
+    uint32_t crc = kv_crc32(0, (const unsigned char *)token, token_len);
+    crc = kv_crc32(crc, &nul, 1);
+    crc = kv_crc32(crc, (const unsigned char *)etag, etag_len);
+    crc = kv_crc32(crc, &nul, 1);
+    crc = kv_crc32(crc, (const unsigned char *)text, len);
+    crc = kv_crc32(crc, &nul, 1);
+    kv_put_le(header + 44, crc, 4);
+
+    struct iovec parts[7] = {
+        { header, sizeof(header) },
+        { (void *)token, token_len }, { (void *)&nul, 1 },
+        { (void *)etag, etag_len }, { (void *)&nul, 1 },
+        { (void *)text, len }, { (void *)&nul, 1 },
+    };
+    size_t total = sizeof(header) + token_len + etag_len + len + 3;
+
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd < 0) return;
+    ssize_t written = writev(fd, parts, 7);
+    int ok = written == (ssize_t)total;
+    close(fd);
+
+    if(!ok || rename(temp, path) != 0) unlink(temp);
+}
+
+void kv_snapshot_save_text(kv_client *client, const char *etag, long version,
+                           const char *text, size_t len) {
+    if(client->crypt) return;
+    kv_snapshot_write(client->snapshot_dir, client->token, etag, version, text, len);
+}
+
+void kv_snapshot_save(kv_client *client, const char *etag, long version, struct json_object *data) {
+    if(!client->snapshot_dir || client->crypt || !data) return;
+
+    size_t len;
+    const char *text = json_object_to_json_string_length(data, JSON_C_TO_STRING_PLAIN, &len);
+    kv_snapshot_save_text(client, etag, version, text, len);
+}
+
+void kv_snapshot_confirm(kv_client *client) {
+    char path[KV_SNAPSHOT_PATH_MAX];
+    if(!client->snapshot_dir || !client->token) return;
+    if(!snapshot_path(path, sizeof(path), client->snapshot_dir, client->token)) return;
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if(fd < 0) return;
+
+    unsigned char now[8];
+    kv_put_le(now, (uint64_t)wall_ms(), 8);
+    kv_pwrite_full(fd, now, sizeof(now), KV_SNAPSHOT_CONFIRMED);
+    close(fd);
+}
+
+void kv_snapshot_patched(kv_client *client, long version, struct json_object *set,
+                         struct json_object *remove) {
+    kv_snapshot *snapshot = kv_snapshot_open_client(client);
+    if(!snapshot) return;
+
+    /* As the cache: only a patch sent against this version applies */
+    struct json_object *doc = snapshot->version == version ? kv_snapshot_parse(snapshot) : NULL;
+    kv_snapshot_close(snapshot);
+
+    if(doc && kv_patch_apply(doc, set, remove)) {
+        kv_snapshot_save(client, client->etag, client->version, doc);
+    }
+    json_object_put(doc);
+}
+
+void kv_snapshot_drop(kv_client *client) {
+    char path[KV_SNAPSHOT_PATH_MAX];
+    if(!client->snapshot_dir || !client->token) return;
+    if(snapshot_path(path, sizeof(path), client->snapshot_dir, client->token)) unlink(path);
+}
@@ -0,0 +1,447 @@
+/*
+ * libkv durable spool: an append-only record file with a read position
+ * kept in its header.
+ *
+ * Records are appended at the end and consumed from the head. Once every
+ * record is consumed the file is truncated back to its header; when the
+ * consumed prefix grows past KV_SPOOL_COMPACT_BYTES and is larger than
+ * what is left, the live records are copied down over it. The copy never
+ * overlaps its source, and the header only points at the new position
+ * once the copy is synced, so a crash during compaction loses nothing.
+ * Until the file is cut back, the header also holds where the copied
+ * records end: what lies past them are old records that still pass
+ * their CRC, and a reopen must not read them.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kv_batch.h"
+#include "kv_spool.h"
+#include "kv_internal.h"
+
+#define KV_SPOOL_MAGIC "KVSPOOL1"
+#define KV_SPOOL_HEADER 24          /* magic + u64 head + u64 limit */
+#define KV_SPOOL_RECORD 10          /* u32 data length + u16 token length + u32 crc */
+#define KV_SPOOL_DATA_MAX (64 * 1024 * 1024)
+#define KV_SPOOL_COMPACT_BYTES (64 * 1024)
+
+struct kv_spool {
+    int fd;
+    uint64_t head;                  /* offset of the oldest record */
+    uint64_t end;                   /* end of the last complete record */
+    uint64_t *offsets;              /* offset of each waiting record, oldest first */
+    int first;                      /* index of the oldest in offsets */
+    int count;                      /* records waiting */
+    int capacity;
+    int sync_every;
+    long sync_ms;
+    int unsynced;                   /* changes since the last sync */
+    long long unsynced_since;       /* when the oldest of them was made */
+    int head_dirty;                 /* head changed since it was written */
+    struct kv_buffer scratch;       /* one record being written or read */
+    long rejected;
+};
+
+uint32_t kv_crc32(uint32_t crc, const unsigned char *data, size_t len) {
+    crc = ~crc;
+    for(size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for(int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+    }
+    return ~crc;
+}
+
+void kv_put_le(unsigned char *out, uint64_t value, int bytes) {
+    for(int i = 0; i < bytes; i++) out[i] = (unsigned char)(value >> (8 * i));
+}
+
+uint64_t kv_get_le(const unsigned char *in, int bytes) {
+    uint64_t value = 0;
+    for(int i = 0; i < bytes; i++) value |= (uint64_t)in[i] << (8 * i);
+    return value;
+}
+
+static int pread_full(int fd, void *buf, size_t len, uint64_t offset) {
+    size_t done = 0;
+    while(done < len) {
+        ssize_t n = pread(fd, (char *)buf + done, len - done, (off_t)(offset + done));
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return 0;
+        done += (size_t)n;
+    }
+    return 1;
+}
+
+int kv_pwrite_full(int fd, const void *buf, size_t len, uint64_t offset) {
+    size_t done = 0;
+    while(done < len) {
+        ssize_t n = pwrite(fd, (const char *)buf + done, len - done, (off_t)(offset + done));
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return 0;
+        done += (size_t)n;
+    }
+    return 1;
+}
+
+/* limit is where the records end while a compaction is cutting the file
+ * back, 0 otherwise */
+static int write_header(kv_spool *spool, uint64_t limit) {
+    unsigned char header[KV_SPOOL_HEADER];
+    memcpy(header, KV_SPOOL_MAGIC, 8);
+    kv_put_le(header + 8, spool->head, 8);
+    kv_put_le(header + 16, limit, 8);
+    if(!kv_pwrite_full(spool->fd, header, sizeof(header), 0)) return 0;
+    spool->head_dirty = 0;
+    return 1;
+}
+
+static int offsets_push(kv_spool *spool, uint64_t offset) {
+    if(spool->first + spool->count == spool->capacity) {
+        if(spool->first > 0) {
+            /* Reuse the slots of consumed records first */
+            memmove(spool->offsets, spool->offsets + spool->first, sizeof(uint64_t) * spool->count);
+            spool->first = 0;
+        } else {
+            int capacity = spool->capacity ? spool->capacity * 2 : 64;
+            uint64_t *grown = kv_realloc(spool->offsets, sizeof(uint64_t) * capacity);
+            if(!grown) return 0;
+            spool->offsets = grown;
+            spool->capacity = capacity;
+        }
+    }
+    spool->offsets[spool->first + spool->count++] = offset;
+    return 1;
+}
+
+/* Read the record at offset into scratch as header, token, NUL, data,
+ * NUL. Returns its total length on disk, or 0 if it is torn or corrupt. */
+static uint64_t read_record(kv_spool *spool, uint64_t offset, uint64_t limit) {
+    unsigned char header[KV_SPOOL_RECORD];
+    if(offset + KV_SPOOL_RECORD > limit || !pread_full(spool->fd, header, sizeof(header), offset)) return 0;
+
+    uint64_t data_len = kv_get_le(header, 4);
+    uint64_t token_len = kv_get_le(header + 4, 2);
+    uint32_t crc = (uint32_t)kv_get_le(header + 6, 4);
+    uint64_t length = KV_SPOOL_RECORD + token_len + data_len;
+    if(data_len > KV_SPOOL_DATA_MAX || offset + length > limit) return 0;
+
+    struct kv_buffer *buf = &spool->scratch;
+    kv_buffer_reset(buf);
+    if(!kv_buffer_reserve(buf, token_len + data_len + 2)) return 0;
+    char *token = buf->data;
+    char *data = buf->data + token_len + 1;
+    if(!pread_full(spool->fd, token, token_len, offset + KV_SPOOL_RECORD) ||
+       !pread_full(spool->fd, data, data_len, offset + KV_SPOOL_RECORD + token_len)) return 0;
+    token[token_len] = 0;
+    data[data_len] = 0;
+
+    uint32_t actual = kv_crc32(0, (const unsigned char *)token, token_len);
+    actual = kv_crc32(actual, (const unsigned char *)data, data_len);
+    return actual == crc ? length : 0;
+}
+
+/* Find the complete records after head, up to limit if it is set, and
+ * cut off a torn tail or what a compaction left past its copy */
+static int scan(kv_spool *spool, uint64_t size, uint64_t limit) {
+    uint64_t offset = spool->head, length;
+    uint64_t stop = limit > 0 && limit < size ? limit : size;
+    while((length = read_record(spool, offset, stop)) > 0) {
+        if(!offsets_push(spool, offset)) return 0;
+        offset += length;
+    }
+    spool->end = offset;
+    if(offset < size && ftruncate(spool->fd, (off_t)offset) != 0) return 0;
+    /* Once the file is cut, the limit may go */
+    if(limit > 0 && (!write_header(spool, 0) || fdatasync(spool->fd) != 0)) return 0;
+    return 1;
+}
+
+kv_spool *kv_spool_open(const char *path, int sync_every, long sync_ms) {
+    kv_spool *spool = kv_calloc(1, sizeof(*spool));
+    if(!spool) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    spool->sync_every = sync_every > 0 ? sync_every : 1;
+    spool->sync_ms = sync_ms > 0 ? sync_ms : 0;
+
+    spool->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat st;
+    if(spool->fd < 0 || fstat(spool->fd, &st) != 0) {
+        kv_spool_close(spool);
+        return NULL;
+    }
+
+    int ok;
+    if(st.st_size < KV_SPOOL_HEADER) {
+        /* New (or cut short before its header was complete) */
+        spool->head = spool->end = KV_SPOOL_HEADER;
+        ok = ftruncate(spool->fd, 0) == 0 && write_header(spool, 0) && fdatasync(spool->fd) == 0;
+    } else {
+        unsigned char header[KV_SPOOL_HEADER];
+        ok = pread_full(spool->fd, header, sizeof(header), 0);
+        if(ok && memcmp(header, KV_SPOOL_MAGIC, 8) != 0) {
+            errno = EINVAL;
+            ok = 0;
+        }
+        spool->head = ok ? kv_get_le(header + 8, 8) : 0;
+        uint64_t limit = ok ? kv_get_le(header + 16, 8) : 0;
+        if(ok && spool->head < KV_SPOOL_HEADER) {
+            errno = EINVAL;
+            ok = 0;
+        }
+        if(ok && spool->head >= (uint64_t)st.st_size) {
+            /* Drained: every record is consumed, or a crash let the
+             * truncation reach the disk before the header did */
+            spool->head = spool->end = KV_SPOOL_HEADER;
+            ok = ftruncate(spool->fd, KV_SPOOL_HEADER) == 0 && write_header(spool, 0) &&
+                 fdatasync(spool->fd) == 0;
+        } else {
+            ok = ok && scan(spool, (uint64_t)st.st_size, limit);
+        }
+    }
+
+    if(!ok) {
+        int saved = errno;
+        kv_spool_close(spool);
+        errno = saved;
+        return NULL;
+    }
+    return spool;
+}
+
+void kv_spool_close(kv_spool *spool) {
+    if(!spool) return;
+    if(spool->fd >= 0) {
+        kv_spool_sync(spool);
+        close(spool->fd);
+    }
+    kv_buffer_free(&spool->scratch);
+    kv_free(spool->offsets);
+    kv_free(spool);
+}
+
+/* Count a change towards the sync policy, syncing once it is due */
+static int changed(kv_spool *spool) {
+    if(spool->unsynced++ == 0) spool->unsynced_since = kv_now_ms();
+    if(spool->unsynced >= spool->sync_every) return kv_spool_sync(spool);
+    return kv_spool_poll(spool);
+}
+
+int kv_spool_append(kv_spool *spool, const char *token, struct json_object *record) {
+    size_t token_len = token ? strlen(token) : 0, data_len;
+    const char *data = json_object_to_json_string_length(record, JSON_C_TO_STRING_PLAIN, &data_len);
+    if(token_len > 0xFFFF || data_len > KV_SPOOL_DATA_MAX) return 0;
+
+    struct kv_buffer *buf = &spool->scratch;
+    kv_buffer_reset(buf);
+    if(!kv_buffer_reserve(buf, KV_SPOOL_RECORD + token_len + data_len)) return 0;
+
+    uint32_t crc = kv_crc32(0, (const unsigned char *)token, token_len);
+    crc = kv_crc32(crc, (const unsigned char *)data, data_len);
+    unsigned char *out = (unsigned char *)buf->data;
+    kv_put_le(out, data_len, 4);
+    kv_put_le(out + 4, token_len, 2);
+    kv_put_le(out + 6, crc, 4);
+    if(token_len) memcpy(out + KV_SPOOL_RECORD, token, token_len);
+    memcpy(out + KV_SPOOL_RECORD + token_len, data, data_len);
+
+    uint64_t length = KV_SPOOL_RECORD + token_len + data_len;
+    if(!offsets_push(spool, spool->end)) return 0;
+    if(!kv_pwrite_full(spool->fd, out, length, spool->end)) {
+        /* Drop whatever part made it, so the next record starts clean */
+        spool->count--;
+        if(ftruncate(spool->fd, (off_t)spool->end) != 0) {
+            /* The torn bytes fail their CRC and are cut off on reopen */
+        }
+        return 0;
+    }
+    spool->end += length;
+    changed(spool);
+    return 1;
+}
+
+int kv_spool_read(kv_spool *spool, int max, kv_spool_visitor visitor, void *userdata) {
+    int n = max > 0 && max < spool->count ? max : spool->count;
+
+    for(int i = 0; i < n; i++) {
+        uint64_t offset = spool->offsets[spool->first + i];
+        uint64_t length = read_record(spool, offset, spool->end);
+        if(length == 0) return -1;
+
+        const char *token = spool->scratch.data;
+        const char *data = token + strlen(token) + 1;
+        struct json_object *record = json_tokener_parse(data);
+        int more = record && visitor(token, record, userdata);
+        json_object_put(record);
+        if(!record) return -1;
+        if(!more) return i + 1;
+    }
+    return n;
+}
+
+/* Copy the waiting records down to just after the header */
+static int compact(kv_spool *spool) {
+    uint64_t live = spool->end - spool->head, delta = spool->head - KV_SPOOL_HEADER;
+    char chunk[4096];
+
+    for(uint64_t done = 0; done < live; ) {
+        size_t n = live - done < sizeof(chunk) ? (size_t)(live - done) : sizeof(chunk);
+        if(!pread_full(spool->fd, chunk, n, spool->head + done) ||
+           !kv_pwrite_full(spool->fd, chunk, n, KV_SPOOL_HEADER + done)) return 0;
+        done += n;
+    }
+    if(fdatasync(spool->fd) != 0) return 0;
+
+    spool->head = KV_SPOOL_HEADER;
+    spool->end = KV_SPOOL_HEADER + live;
+    for(int i = 0; i < spool->count; i++) spool->offsets[spool->first + i] -= delta;
+    /* The limit keeps a crash before the cut from reading the old records
+     * past the copy; it is dropped again only once the cut is synced */
+    return write_header(spool, spool->end) && fdatasync(spool->fd) == 0 &&
+           ftruncate(spool->fd, (off_t)spool->end) == 0 &&
+           write_header(spool, 0) && fdatasync(spool->fd) == 0;
+}
+
+int kv_spool_consume(kv_spool *spool, int n) {
+    if(n <= 0) return 1;
+    if(n > spool->count) n = spool->count;
+
+    spool->first += n;
+    spool->count -= n;
+    spool->head = spool->count > 0 ? spool->offsets[spool->first] : spool->end;
+    spool->head_dirty = 1;
+
+    if(spool->count == 0) {
+        /* Nothing left: start over right after the header */
+        spool->first = 0;
+        spool->head = spool->end = KV_SPOOL_HEADER;
+        /* The header must be on disk before the records it points past
+         * are cut off */
+        if(!write_header(spool, 0) || fdatasync(spool->fd) != 0 ||
+           ftruncate(spool->fd, KV_SPOOL_HEADER) != 0) return 0;
+        spool->head_dirty = 1;
+    } else if(spool->head - KV_SPOOL_HEADER >= KV_SPOOL_COMPACT_BYTES &&
+              spool->head - KV_SPOOL_HEADER >= spool->end - spool->head) {
+        if(!compact(spool)) return 0;
+    }
+    return changed(spool);
+}
+
+int kv_spool_sync(kv_spool *spool) {
+    if(spool->unsynced == 0 && !spool->head_dirty) return 1;
+    if(spool->head_dirty && !write_header(spool, 0)) return 0;
+    if(fdatasync(spool->fd) != 0) return 0;
+    spool->unsynced = 0;
+    return 1;
+}
+
+int kv_spool_poll(kv_spool *spool) {
+    if(spool->unsynced == 0 && !spool->head_dirty) return 1;
+    if(spool->sync_ms == 0 || kv_now_ms() - spool->unsynced_since < spool->sync_ms) return 1;
+    return kv_spool_sync(spool);
+}
+
+int kv_spool_count(const kv_spool *spool) {
+    return spool->count;
+}
+
+long kv_spool_rejected(const kv_spool *spool) {
+    return spool->rejected;
+}
+
+/* Up to KV_BATCH_MAX records for one replay request, one store per token */
+struct replay_request {
+    kv_batch *batch;
+    const char *tokens[KV_BATCH_MAX];
+    struct json_object *records[KV_BATCH_MAX];
+    char *owned[KV_BATCH_MAX];
+    int ntokens;
+    int nrecords;                   /* records collected, collapsed or not */
+    int short_read;                 /* a record could not be collected */
+};
+
+static int replay_collect(const char *token, struct json_object *record, void *userdata) {
+    struct replay_request *request = (struct replay_request *)userdata;
+
+    for(int i = 0; i < request->ntokens; i++) {
+        if(strcmp(request->tokens[i], token) == 0) {
+            /* A newer store for the same token replaces the older one */
+            json_object_put(request->records[i]);
+            request->records[i] = json_object_get(record);
+            request->nrecords++;
+            return 1;
+        }
+    }
+
+    /* Not counted, so it stays in the spool for the next pass */
+    char *copy = kv_strdup(token);
+    if(!copy) {
+        request->short_read = 1;
+        return 0;
+    }
+    request->owned[request->ntokens] = copy;
+    request->tokens[request->ntokens] = copy;
+    request->records[request->ntokens++] = json_object_get(record);
+    request->nrecords++;
+    return 1;
+}
+
+static void replay_result(const struct kv_batch_result *result, void *userdata) {
+    kv_spool *spool = (kv_spool *)userdata;
+    if(!result->success) spool->rejected++;
+}
+
+static void replay_request_clear(struct replay_request *request) {
+    for(int i = 0; i < request->ntokens; i++) {
+        json_object_put(request->records[i]);
+        kv_free(request->owned[i]);
+    }
+    request->ntokens = 0;
+    request->nrecords = 0;
+    request->short_read = 0;
+}
+
+int kv_spool_replay(kv_spool *spool, kv_client *client, int max_requests) {
+    if(spool->count == 0) return 0;
+
+    struct replay_request request;
+    memset(&request, 0, sizeof(request));
+    request.batch = kv_batch_new();
+    if(!request.batch) return -1;
+
+    int consumed = 0, failed = 0;
+    for(int sent = 0; sent < max_requests && spool->count > 0 && !failed; sent++) {
+        int read = kv_spool_read(spool, KV_BATCH_MAX, replay_collect, &request);
+        /* A record that does not parse would block the spool for good */
+        if(read < 0 && request.nrecords == 0) {
+            spool->rejected++;
+            failed = !kv_spool_consume(spool, 1);
+            consumed++;
+            continue;
+        }
+
+        for(int i = 0; i < request.ntokens; i++) {
+            kv_batch_store(request.batch, request.tokens[i], request.records[i], 0, replay_result, spool);
+        }
+        if(request.ntokens > 0 && kv_batch_execute(request.batch, client) < 0) {
+            failed = 1;
+        } else {
+            failed = !kv_spool_consume(spool, request.nrecords);
+            consumed += request.nrecords;
+        }
+        /* Out of memory: send what was collected and stop the pass */
+        if(request.short_read) failed = 1;
+        replay_request_clear(&request);
+    }
+
+    kv_batch_free(request.batch);
+    kv_spool_sync(spool);
+    return consumed == 0 && failed ? -1 : consumed;
+}
@@ -0,0 +1,285 @@
+/*
+ * libkv rolling statistics.
+ *
+ * Readings are numbered in arrival order. Each series keeps a running sum
+ * and count over the window, and two monotonic deques of (number, value)
+ * pairs: min holds increasing values, max decreasing ones, so the front of
+ * each is the windowed extreme. A new sample pops the back entries it
+ * dominates and the front falls off once its reading leaves the window,
+ * so every sample is pushed and popped at most once per deque.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "kv_stats.h"
+#include "kv_internal.h"
+
+struct kv_sample {
+    long long seq;
+    double value;
+};
+
+/* Ring of at most window samples */
+struct kv_deque {
+    struct kv_sample *items;
+    int head;
+    int len;
+};
+
+struct kv_stat_series {
+    char *key;
+    double sum;
+    int count;
+    struct kv_deque min;
+    struct kv_deque max;
+};
+
+struct kv_stats {
+    int window;
+    long long total;                /* readings added so far */
+    struct kv_stat_series *series;
+    int nseries;
+    int capacity;
+};
+
+static struct kv_sample *deque_at(const struct kv_deque *dq, int i, int window) {
+    return &dq->items[(dq->head + i) % window];
+}
+
+static void deque_push(struct kv_deque *dq, int window, long long seq, double value, int is_min) {
+    /* Drop samples the new one makes irrelevant: a later, smaller (min)
+     * or larger (max) value outlives them in the window */
+    while(dq->len > 0) {
+        double back = deque_at(dq, dq->len - 1, window)->value;
+        if(is_min ? back < value : back > value) break;
+        dq->len--;
+    }
+    struct kv_sample *slot = deque_at(dq, dq->len++, window);
+    slot->seq = seq;
+    slot->value = value;
+}
+
+static void deque_expire(struct kv_deque *dq, int window, long long oldest) {
+    while(dq->len > 0 && dq->items[dq->head].seq < oldest) {
+        dq->head = (dq->head + 1) % window;
+        dq->len--;
+    }
+}
+
+static int is_number(struct json_object *value) {
+    return json_object_is_type(value, json_type_int) || json_object_is_type(value, json_type_double);
+}
+
+static struct kv_stat_series *series_find(const kv_stats *stats, const char *key) {
+    for(int i = 0; i < stats->nseries; i++) {
+        if(strcmp(stats->series[i].key, key) == 0) return &stats->series[i];
+    }
+    return NULL;
+}
+
+static struct kv_stat_series *series_add(kv_stats *stats, const char *key) {
+    if(stats->nseries == stats->capacity) {
+        int capacity = stats->capacity ? stats->capacity * 2 : 4;
+        struct kv_stat_series *grown = kv_realloc(stats->series, sizeof(*grown) * capacity);
+        if(!grown) return NULL;
+        stats->series = grown;
+        stats->capacity = capacity;
+    }
+
+    struct kv_stat_series *series = &stats->series[stats->nseries];
+    memset(series, 0, sizeof(*series));
+    series->key = kv_strdup(key);
+    series->min.items = kv_malloc(sizeof(struct kv_sample) * stats->window);
+    series->max.items = kv_malloc(sizeof(struct kv_sample) * stats->window);
+    if(!series->key || !series->min.items || !series->max.items) {
+        kv_free(series->key);
+        kv_free(series->min.items);
+        kv_free(series->max.items);
+        return NULL;
+    }
+    stats->nseries++;
+    return series;
+}
+
+kv_stats *kv_stats_new(int window) {
+    if(window < 1) return NULL;
+
+    kv_stats *stats = kv_calloc(1, sizeof(*stats));
+    if(!stats) return NULL;
+    stats->window = window;
+    return stats;
+}
+
+void kv_stats_free(kv_stats *stats) {
+    if(!stats) return;
+
+    for(int i = 0; i < stats->nseries; i++) {
+        kv_free(stats->series[i].key);
+        kv_free(stats->series[i].min.items);
+        kv_free(stats->series[i].max.items);
+    }
+    kv_free(stats->series);
+    kv_free(stats);
+}
+
+int kv_stats_add(kv_stats *stats, struct json_object *reading, struct json_object *evicted) {
+    long long seq = stats->total;
+    long long oldest = seq - stats->window + 1;   /* first reading still in the window */
+
+    if(evicted && json_object_is_type(evicted, json_type_object)) {
+        json_object_object_foreach(evicted, key, value) {
+            struct kv_stat_series *series = series_find(stats, key);
+            if(!series || !is_number(value) || series->count == 0) continue;
+            series->sum -= json_object_get_double(value);
+            /* Start from an exact zero again instead of carrying rounding */
+            if(--series->count == 0) series->sum = 0;
+        }
+    }
+
+    for(int i = 0; i < stats->nseries; i++) {
+        deque_expire(&stats->series[i].min, stats->window, oldest);
+        deque_expire(&stats->series[i].max, stats->window, oldest);
+    }
+
+    if(reading && json_object_is_type(reading, json_type_object)) {
+        json_object_object_foreach(reading, key, value) {
+            if(!is_number(value)) continue;
+
+            struct kv_stat_series *series = series_find(stats, key);
+            if(!series) series = series_add(stats, key);
+            if(!series) return 0;
+
+            double v = json_object_get_double(value);
+            series->sum += v;
+            series->count++;
+            deque_push(&series->min, stats->window, seq, v, 1);
+            deque_push(&series->max, stats->window, seq, v, 0);
+        }
+    }
+
+    stats->total++;
+    return 1;
+}
+
+int kv_stats_get(const kv_stats *stats, const char *key, struct kv_series_stats *out) {
+    const struct kv_stat_series *series = series_find(stats, key);
+    if(!series || series->count == 0 || series->min.len == 0) return 0;
+
+    out->min = series->min.items[series->min.head].value;
+    out->max = series->max.items[series->max.head].value;
+    out->sum = series->sum;
+    out->count = series->count;
+    out->avg = series->sum / series->count;
+    return 1;
+}
+
+long long kv_stats_total(const kv_stats *stats) {
+    return stats->total;
+}
+
+int kv_stats_window_count(const kv_stats *stats) {
+    return stats->total < stats->window ? (int)stats->total : stats->window;
+}
+
+struct json_object *kv_stats_to_json(const kv_stats *stats) {
+    struct json_object *summary = json_object_new_object();
+
+    for(int i = 0; i < stats->nseries; i++) {
+        struct kv_series_stats figures;
+        if(!kv_stats_get(stats, stats->series[i].key, &figures)) continue;
+
+        struct json_object *sensor_stats = json_object_new_object();
+        json_object_object_add(sensor_stats, "min", json_object_new_double(figures.min));
+        json_object_object_add(sensor_stats, "max", json_object_new_double(figures.max));
+        json_object_object_add(sensor_stats, "avg", json_object_new_double(figures.avg));
+        json_object_object_add(sensor_stats, "count", json_object_new_int(figures.count));
+        json_object_object_add(summary, stats->series[i].key, sensor_stats);
+    }
+
+    json_object_object_add(summary, "total_readings", json_object_new_int(kv_stats_window_count(stats)));
+    return summary;
+}
+
+/* Deque as a flat [seq, value, seq, value, ...] array */
+static struct json_object *deque_to_json(const struct kv_deque *dq, int window) {
+    struct json_object *array = json_object_new_array_ext(dq->len * 2);
+    for(int i = 0; i < dq->len; i++) {
+        const struct kv_sample *sample = deque_at(dq, i, window);
+        json_object_array_add(array, json_object_new_int64(sample->seq));
+        json_object_array_add(array, json_object_new_double(sample->value));
+    }
+    return array;
+}
+
+struct json_object *kv_stats_state(const kv_stats *stats) {
+    struct json_object *state = json_object_new_object();
+    struct json_object *series_obj = json_object_new_object();
+
+    json_object_object_add(state, "window", json_object_new_int(stats->window));
+    json_object_object_add(state, "total", json_object_new_int64(stats->total));
+
+    for(int i = 0; i < stats->nseries; i++) {
+        const struct kv_stat_series *series = &stats->series[i];
+        struct json_object *entry = json_object_new_object();
+        json_object_object_add(entry, "sum", json_object_new_double(series->sum));
+        json_object_object_add(entry, "count", json_object_new_int(series->count));
+        json_object_object_add(entry, "min", deque_to_json(&series->min, stats->window));
+        json_object_object_add(entry, "max", deque_to_json(&series->max, stats->window));
+        json_object_object_add(series_obj, series->key, entry);
+    }
+
+    json_object_object_add(state, "series", series_obj);
+    return state;
+}
+
+static int deque_from_json(struct kv_deque *dq, struct json_object *array, int window,
+                           long long total) {
+    if(!json_object_is_type(array, json_type_array)) return 0;
+
+    size_t len = json_object_array_length(array);
+    if(len % 2 != 0 || len / 2 > (size_t)window) return 0;
+
+    dq->head = 0;
+    dq->len = 0;
+    for(size_t i = 0; i < len; i += 2) {
+        long long seq = json_object_get_int64(json_object_array_get_idx(array, i));
+        if(seq < total - window || seq >= total) return 0;
+        dq->items[dq->len].seq = seq;
+        dq->items[dq->len].value = json_object_get_double(json_object_array_get_idx(array, i + 1));
+        dq->len++;
+    }
+    return 1;
+}
+
+kv_stats *kv_stats_from_state(struct json_object *state, int window) {
+    struct json_object *value, *series_obj;
+
+    if(!state || !json_object_object_get_ex(state, "window", &value) ||
+       json_object_get_int(value) != window) return NULL;
+    if(!json_object_object_get_ex(state, "series", &series_obj) ||
+       !json_object_is_type(series_obj, json_type_object)) return NULL;
+
+    kv_stats *stats = kv_stats_new(window);
+    if(!stats) return NULL;
+    if(json_object_object_get_ex(state, "total", &value)) {
+        stats->total = json_object_get_int64(value);
+    }
+
+    json_object_object_foreach(series_obj, key, entry) {
+        struct json_object *min_obj, *max_obj;
+        struct kv_stat_series *series = series_add(stats, key);
+        if(!series ||
+           !json_object_object_get_ex(entry, "min", &min_obj) ||
+           !json_object_object_get_ex(entry, "max", &max_obj) ||
+           !deque_from_json(&series->min, min_obj, window, stats->total) ||
+           !deque_from_json(&series->max, max_obj, window, stats->total)) {
+            kv_stats_free(stats);
+            return NULL;
+        }
+        if(json_object_object_get_ex(entry, "sum", &value)) series->sum = json_object_get_double(value);
+        if(json_object_object_get_ex(entry, "count", &value)) series->count = json_object_get_int(value);
+    }
+
+    return stats;
+}
@@ -0,0 +1,151 @@
+/*
+ * libkv change watch: long polls of GET /api/retrieve on the last version
+ * seen, falling back to spaced conditional retrieves when the server
+ * answers them at once.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "kv_watch.h"
+#include "kv_internal.h"
+
+#define KV_WATCH_URL_MAX 640
+#define KV_WATCH_SLACK_S 15         /* request timeout beyond the hold */
+
+struct kv_watch {
+    kv_client *client;
+    kv_watch_callback callback;
+    void *userdata;
+    long version;                   /* last delivered, 0 for none */
+    char etag[128];                 /* ETag of that version, "" if unknown */
+    int wait_s;
+    long poll_ms;
+    int held;                       /* see kv_watch_held */
+    int stopped;                    /* the callback returned 0 */
+};
+
+int kv_watch_url(const kv_client *client, int wait_s, long version, char *out, size_t size) {
+    int len = snprintf(out, size, "%s?wait=%d&version=%ld",
+                       kv_client_endpoint(client, KV_ENDPOINT_RETRIEVE), wait_s, version);
+    return len > 0 && (size_t)len < size;
+}
+
+kv_watch *kv_watch_new(kv_client *client, long since_version,
+                       kv_watch_callback callback, void *userdata) {
+    if(!client || !callback) return NULL;
+
+    kv_watch *watch = kv_calloc(1, sizeof(*watch));
+    if(!watch) return NULL;
+
+    watch->client = client;
+    watch->callback = callback;
+    watch->userdata = userdata;
+    watch->version = since_version > 0 ? since_version : 0;
+    watch->wait_s = KV_WATCH_WAIT_S;
+    watch->poll_ms = KV_WATCH_POLL_MS;
+    watch->held = -1;
+    return watch;
+}
+
+void kv_watch_free(kv_watch *watch) {
+    kv_free(watch);
+}
+
+void kv_watch_set_wait(kv_watch *watch, int wait_s, long poll_ms) {
+    watch->wait_s = wait_s > 0 ? wait_s : 1;
+    watch->poll_ms = poll_ms > 0 ? poll_ms : 0;
+}
+
+static int deliver(kv_watch *watch, struct json_object *data, long version) {
+    watch->version = version;
+    if(!watch->callback(data, version, watch->userdata)) watch->stopped = 1;
+    return 1;
+}
+
+/* Nothing new. The server held the request if it took most of the wait. */
+static int unchanged(kv_watch *watch, long long elapsed_ms, int wait_s) {
+    watch->held = elapsed_ms >= wait_s * 1000LL / 2;
+    return 0;
+}
+
+static int watch_poll(kv_watch *watch, int wait_s) {
+    kv_client *client = watch->client;
+    char url[KV_WATCH_URL_MAX];
+
+    if(!kv_watch_url(client, wait_s, watch->version, url, sizeof(url))) {
+        snprintf(client->error, sizeof(client->error), "Watch URL too long");
+        return -1;
+    }
+
+    if(watch->etag[0]) client->if_none_match = watch->etag;
+    long long start = kv_now_ms();
+    if(!kv_perform(client, "GET", url, NULL, 1, wait_s + KV_WATCH_SLACK_S)) return -1;
+    long long elapsed = kv_now_ms() - start;
+
+    if(client->status == 304) return unchanged(watch, elapsed, wait_s);
+    if(client->status == 404) {
+        watch->etag[0] = 0;
+        kv_cache_drop(client);
+        return watch->version == 0 ? unchanged(watch, elapsed, wait_s) : deliver(watch, NULL, 0);
+    }
+    if(client->status < 200 || client->status >= 300) {
+        snprintf(client->error, sizeof(client->error), "HTTP %ld", client->status);
+        return -1;
+    }
+
+    struct json_object *root = kv_parse_response(client), *data;
+    if(!root || !json_object_object_get_ex(root, "data", &data)) {
+        snprintf(client->error, sizeof(client->error), "Invalid retrieve response");
+        json_object_put(root);
+        return -1;
+    }
+
+    /* A server that ignores the version answers with the one we have */
+    snprintf(watch->etag, sizeof(watch->etag), "%s", client->etag);
+    int changed = client->version != watch->version;
+    if(changed) {
+        kv_cache_put(client, client->etag, client->version, data);
+        deliver(watch, data, client->version);
+    }
+    json_object_put(root);
+    return changed ? 1 : unchanged(watch, elapsed, wait_s);
+}
+
+int kv_watch_poll(kv_watch *watch) {
+    return watch_poll(watch, watch->wait_s);
+}
+
+int kv_watch_run(kv_watch *watch, long duration_ms) {
+    long long deadline = duration_ms > 0 ? kv_now_ms() + duration_ms : 0;
+    watch->stopped = 0;
+
+    for(;;) {
+        /* Never ask the server to hold past the deadline */
+        long long left = deadline ? deadline - kv_now_ms() : 0;
+        if(deadline && left <= 0) return 0;
+        int wait_s = watch->wait_s;
+        if(deadline && left < wait_s * 1000LL) wait_s = (int)((left + 999) / 1000);
+
+        int result = watch_poll(watch, wait_s);
+        if(result < 0) return -1;
+        if(watch->stopped) return 1;
+
+        if(result == 0 && watch->held == 0) {
+            long long pause = watch->poll_ms;
+            if(deadline) {
+                left = deadline - kv_now_ms();
+                if(left < pause) pause = left > 0 ? left : 0;
+            }
+            if(pause > 0 && !kv_sleep_ms((long)pause)) return 0;
+        }
+    }
+}
+
+long kv_watch_version(const kv_watch *watch) {
+    return watch->version;
+}
+
+int kv_watch_held(const kv_watch *watch) {
+    return watch->held;
+}
@@ -0,0 +1,167 @@
+/*
+ * libkv write-behind: samples accumulate in a JSON array and are folded
+ * into the stored document by one kv_update per flush.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "kv_writer.h"
+#include "kv_internal.h"
+
+struct kv_writer {
+    kv_client *client;
+    kv_writer_builder builder;
+    void *userdata;
+    long flush_ms;
+    int max_samples;
+    int flags;
+    struct json_object *samples;    /* buffered samples, oldest first */
+    long long due_ms;               /* when the next write is due */
+    int failing;                    /* last write failed: wait for due_ms even when full */
+    int aborted;                    /* builder returned -1 during this flush */
+    kv_spool *spool;                /* holds the buffered samples too, NULL if none */
+    long dropped;
+    long skipped;
+};
+
+kv_writer *kv_writer_new(kv_client *client, kv_writer_builder builder, void *userdata,
+                         long flush_ms, int max_samples, int flags) {
+    if(!client || !builder) return NULL;
+
+    kv_writer *writer = kv_calloc(1, sizeof(*writer));
+    if(!writer) return NULL;
+
+    writer->samples = json_object_new_array();
+    if(!writer->samples) {
+        kv_free(writer);
+        return NULL;
+    }
+    writer->client = client;
+    writer->builder = builder;
+    writer->userdata = userdata;
+    writer->flush_ms = flush_ms > 0 ? flush_ms : 0;
+    writer->max_samples = max_samples > 0 ? max_samples : 1;
+    writer->flags = flags;
+    return writer;
+}
+
+static int spool_load(const char *token, struct json_object *record, void *userdata) {
+    kv_writer *writer = (kv_writer *)userdata;
+    (void)token;
+    return json_object_array_add(writer->samples, json_object_get(record)) == 0;
+}
+
+int kv_writer_set_spool(kv_writer *writer, kv_spool *spool) {
+    if(spool && writer->client->crypt) {
+        writer->client->status = 0;
+        snprintf(writer->client->error, sizeof(writer->client->error),
+                 "Cannot spool encrypted data");
+        return 0;
+    }
+    writer->spool = spool;
+    if(!spool) return 1;
+
+    /* Keep the newest max_samples, as a full buffer would have */
+    int excess = kv_spool_count(spool) - writer->max_samples;
+    if(excess > 0) {
+        if(!kv_spool_consume(spool, excess)) return 0;
+        writer->dropped += excess;
+    }
+    if(kv_spool_read(spool, 0, spool_load, writer) < 0) {
+        json_object_put(writer->samples);
+        writer->samples = json_object_new_array();
+        return 0;
+    }
+    if(json_object_array_length(writer->samples) > 0) writer->due_ms = kv_now_ms();
+    return 1;
+}
+
+void kv_writer_free(kv_writer *writer) {
+    if(!writer) return;
+    kv_writer_flush(writer);
+    json_object_put(writer->samples);
+    kv_free(writer);
+}
+
+int kv_writer_add(kv_writer *writer, struct json_object *sample) {
+    int count = json_object_array_length(writer->samples);
+
+    if(writer->spool && !kv_spool_append(writer->spool, writer->client->token, sample)) return 0;
+    if(count >= writer->max_samples) {
+        json_object_array_del_idx(writer->samples, 0, 1);
+        if(writer->spool) kv_spool_consume(writer->spool, 1);
+        writer->dropped++;
+        count--;
+    }
+    if(json_object_array_add(writer->samples, json_object_get(sample)) != 0) {
+        json_object_put(sample);
+        return 0;
+    }
+    if(count == 0 && !writer->failing) writer->due_ms = kv_now_ms() + writer->flush_ms;
+
+    if(count + 1 >= writer->max_samples && !writer->failing) {
+        return kv_writer_flush(writer) >= 0;
+    }
+    return 1;
+}
+
+/* kv_update builder: the caller's builder over every buffered sample */
+static int writer_build(struct json_object *current, struct json_object *set,
+                        struct json_object *remove, void *userdata) {
+    kv_writer *writer = (kv_writer *)userdata;
+
+    int build = writer->builder(current, writer->samples, set, remove, writer->userdata);
+    if(build < 0) writer->aborted = 1;
+    if(build > 0 && (writer->flags & KV_WRITER_DEDUPE) &&
+       kv_patch_prune(current, set, remove) == 0) {
+        writer->skipped++;
+        return 0;
+    }
+    return build;
+}
+
+int kv_writer_flush(kv_writer *writer) {
+    int count = json_object_array_length(writer->samples);
+    if(count == 0) return 0;
+
+    writer->aborted = 0;
+    int ok = kv_update(writer->client, NULL, 0, writer_build, writer, 3);
+
+    if(!ok && !writer->aborted) {
+        /* Keep the samples and back off for another interval */
+        writer->failing = 1;
+        writer->due_ms = kv_now_ms() + writer->flush_ms;
+        return -1;
+    }
+
+    json_object_put(writer->samples);
+    writer->samples = json_object_new_array();
+    writer->failing = 0;
+    if(writer->spool) kv_spool_consume(writer->spool, count);
+    return ok ? count : -1;
+}
+
+long kv_writer_timeout(const kv_writer *writer) {
+    if(json_object_array_length(writer->samples) == 0) return -1;
+
+    long long remaining = writer->due_ms - kv_now_ms();
+    return remaining > 0 ? (long)remaining : 0;
+}
+
+int kv_writer_poll(kv_writer *writer) {
+    if(kv_writer_timeout(writer) != 0) return 0;
+    return kv_writer_flush(writer);
+}
+
+int kv_writer_pending(const kv_writer *writer) {
+    return json_object_array_length(writer->samples);
+}
+
+long kv_writer_dropped(const kv_writer *writer) {
+    return writer->dropped;
+}
+
+long kv_writer_skipped(const kv_writer *writer) {
+    return writer->skipped;
+}
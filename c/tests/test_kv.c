@@ -0,0 +1,2230 @@
+/*
+ * Unit tests for libkv
+ *
+ * Covers the parts of the library that work without a server, including a
+ * few internals from kv_internal.h. Run with:
+ *   make test
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef KV_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef KV_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "kv.h"
+#include "kv_alloc.h"
+#include "kv_batch.h"
+#include "kv_codec.h"
+#include "kv_crypt.h"
+#include "kv_extip.h"
+#include "kv_fleet.h"
+#include "kv_history.h"
+#include "kv_ingest.h"
+#include "kv_metrics.h"
+#include "kv_reduce.h"
+#include "kv_sched.h"
+#include "kv_series.h"
+#include "kv_snapshot.h"
+#include "kv_spool.h"
+#include "kv_stats.h"
+#include "kv_watch.h"
+#include "kv_writer.h"
+#include "kv_internal.h"
+
+static int failures = 0;
+static int checks = 0;
+
+#define CHECK(cond) do { \
+    checks++; \
+    if(!(cond)) { \
+        failures++; \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+} while(0)
+
+#define CHECK_JSON(obj, expected) do { \
+    const char *actual_ = json_object_to_json_string_ext((obj), JSON_C_TO_STRING_PLAIN); \
+    checks++; \
+    if(strcmp(actual_, (expected)) != 0) { \
+        failures++; \
+        fprintf(stderr, "%s:%d: expected %s, got %s\n", __FILE__, __LINE__, (expected), actual_); \
+    } \
+} while(0)
+
+/* ---- kv_patch_apply ---- */
+
+static void test_patch_apply_set_nested(void) {
+    struct json_object *doc = json_tokener_parse("{\"profile\":{\"name\":\"bob\"}}");
+    struct json_object *set = json_tokener_parse("{\"profile.name\":\"alice\",\"stats.count\":42}");
+
+    CHECK(kv_patch_apply(doc, set, NULL));
+    CHECK_JSON(doc, "{\"profile\":{\"name\":\"alice\"},\"stats\":{\"count\":42}}");
+
+    json_object_put(set);
+    json_object_put(doc);
+}
+
+static void test_patch_apply_array_slots(void) {
+    struct json_object *doc = json_tokener_parse("{\"history\":[1,2]}");
+    struct json_object *set = json_tokener_parse("{\"history.0\":10,\"history.2\":3}");
+
+    CHECK(kv_patch_apply(doc, set, NULL));
+    CHECK_JSON(doc, "{\"history\":[10,2,3]}");
+
+    struct json_object *past_end = json_tokener_parse("{\"history.9\":0}");
+    CHECK(!kv_patch_apply(doc, past_end, NULL));
+
+    json_object_put(past_end);
+    json_object_put(set);
+    json_object_put(doc);
+}
+
+static void test_patch_apply_creates_array_for_index(void) {
+    struct json_object *doc = json_object_new_object();
+    struct json_object *set = json_tokener_parse("{\"history.0\":{\"t\":1}}");
+
+    CHECK(kv_patch_apply(doc, set, NULL));
+    CHECK_JSON(doc, "{\"history\":[{\"t\":1}]}");
+
+    json_object_put(set);
+    json_object_put(doc);
+}
+
+static void test_patch_apply_remove(void) {
+    struct json_object *doc = json_tokener_parse("{\"a\":{\"b\":1,\"c\":2},\"list\":[1,2,3]}");
+    struct json_object *remove = json_tokener_parse("[\"a.b\",\"list.1\",\"missing.path\"]");
+
+    CHECK(kv_patch_apply(doc, NULL, remove));
+    CHECK_JSON(doc, "{\"a\":{\"c\":2},\"list\":[1,3]}");
+
+    json_object_put(remove);
+    json_object_put(doc);
+}
+
+/* ---- kv_batch / kv_queue ---- */
+
+static void count_superseded(const struct kv_batch_result *result, void *userdata) {
+    if(result->superseded) (*(int *)userdata)++;
+}
+
+static void test_patch_prune(void) {
+    struct json_object *doc = json_tokener_parse("{\"ip\":\"1.2.3.4\",\"changed\":false,\"h\":[1,2]}");
+    struct json_object *set = json_tokener_parse("{\"ip\":\"1.2.3.4\",\"changed\":true,\"h.1\":2,\"h.2\":3}");
+    struct json_object *remove = json_tokener_parse("[\"gone\",\"h.0\"]");
+
+    CHECK(kv_patch_prune(doc, set, remove) == 3);
+    CHECK_JSON(set, "{\"changed\":true,\"h.2\":3}");
+    CHECK_JSON(remove, "[\"h.0\"]");
+
+    json_object_put(set);
+    set = json_tokener_parse("{\"changed\":false}");
+    CHECK(kv_patch_prune(doc, set, NULL) == 0);
+
+    json_object_put(doc);
+    json_object_put(set);
+    json_object_put(remove);
+}
+
+static void test_batch_limit(void) {
+    kv_batch *batch = kv_batch_new();
+
+    int queued = 0;
+    for(int i = 0; i < KV_BATCH_MAX; i++) {
+        queued += kv_batch_retrieve(batch, "token", NULL, NULL);
+    }
+    CHECK(queued == KV_BATCH_MAX);
+    CHECK(!kv_batch_retrieve(batch, "token", NULL, NULL));
+    CHECK(kv_batch_count(batch) == KV_BATCH_MAX);
+
+    kv_batch_clear(batch);
+    CHECK(kv_batch_count(batch) == 0);
+    kv_batch_free(batch);
+}
+
+static void test_queue_last_write_wins(void) {
+    kv_client *client = kv_client_new("http://127.0.0.1:9", NULL);
+    kv_queue *queue = kv_queue_new(client, KV_BATCH_MAX, 60000);
+    struct json_object *first = json_tokener_parse("{\"v\":1}");
+    struct json_object *second = json_tokener_parse("{\"v\":2}");
+    int superseded = 0;
+
+    CHECK(kv_queue_store(queue, "a", first, count_superseded, &superseded));
+    CHECK(kv_queue_store(queue, "b", first, count_superseded, &superseded));
+    CHECK(kv_queue_store(queue, "a", second, count_superseded, &superseded));
+    CHECK(kv_queue_pending(queue) == 2);
+    CHECK(superseded == 1);
+    CHECK(kv_queue_timeout(queue) > 0);
+    CHECK(kv_queue_poll(queue) == 0);
+
+    json_object_put(first);
+    json_object_put(second);
+    /* Nothing listens on the discard port, so the flush fails fast */
+    CHECK(kv_queue_flush(queue) == -1);
+    CHECK(kv_queue_pending(queue) == 0);
+    kv_queue_free(queue);
+    kv_client_free(client);
+}
+
+/* ---- streaming response parse ---- */
+
+/* Deliver text to the sink in chunks of at most chunk bytes. Returns 1 if
+ * every chunk was accepted. */
+static int feed(struct kv_response *response, const char *text, size_t chunk) {
+    size_t len = strlen(text);
+    for(size_t off = 0; off < len; off += chunk) {
+        size_t n = len - off < chunk ? len - off : chunk;
+        if(kv_response_write((void *)(text + off), 1, n, response) != n) return 0;
+    }
+    return 1;
+}
+
+static int build_nothing(struct json_object *current, struct json_object *samples,
+                         struct json_object *set, struct json_object *remove, void *userdata) {
+    (void)current; (void)samples; (void)set; (void)remove; (void)userdata;
+    return 1;
+}
+
+static void test_writer_keeps_samples_on_failure(void) {
+    kv_client *client = kv_client_new("http://127.0.0.1:9", "token");
+    kv_writer *writer = kv_writer_new(client, build_nothing, NULL, 60000, 2, 0);
+    struct json_object *sample = json_tokener_parse("{\"v\":1}");
+
+    CHECK(kv_writer_add(writer, sample));
+    CHECK(kv_writer_timeout(writer) > 0);
+    CHECK(kv_writer_poll(writer) == 0);
+
+    /* Full: the forced write fails, and the samples wait for a retry */
+    CHECK(!kv_writer_add(writer, sample));
+    CHECK(kv_writer_pending(writer) == 2);
+    CHECK(kv_writer_timeout(writer) > 0);
+
+    /* Still backing off: the oldest makes room instead of another write */
+    CHECK(kv_writer_add(writer, sample));
+    CHECK(kv_writer_pending(writer) == 2 && kv_writer_dropped(writer) == 1);
+    CHECK(kv_writer_flush(writer) == -1);
+    CHECK(kv_writer_pending(writer) == 2);
+
+    json_object_put(sample);
+    kv_writer_free(writer);
+    kv_client_free(client);
+}
+
+/* Fleet job: count visits and check the client was switched to the token */
+static int visit_device(kv_client *client, const char *token, void *device, void *ctx) {
+    int *visits = (int *)device;
+    (*visits)++;
+    if(*visits == 1 && token[0] == '0') usleep(20000);   /* unbalance worker 0 */
+    return strcmp(kv_client_token(client), token) == 0 && ctx == NULL;
+}
+
+static void test_fleet_runs_every_device_once(void) {
+    kv_fleet *fleet = kv_fleet_new("http://127.0.0.1:9", 3);
+    int visits[30] = {0};
+    char token[16];
+
+    CHECK(fleet != NULL);
+    if(!fleet) return;
+    for(int i = 0; i < 30; i++) {
+        snprintf(token, sizeof(token), "%d-token", i % 3);
+        kv_fleet_add(fleet, token, &visits[i]);
+    }
+
+    CHECK(kv_fleet_run(fleet, visit_device, NULL) == 30);
+    CHECK(kv_fleet_run(fleet, visit_device, NULL) == 30);
+    int ok = 1;
+    for(int i = 0; i < 30; i++) ok &= (visits[i] == 2);
+    CHECK(ok);
+    /* Worker 0 sleeps on each of its first-pass devices, so others steal */
+    CHECK(kv_fleet_steals(fleet) > 0);
+    kv_fleet_free(fleet);
+}
+
+/* Producer for test_ingest_accounts_every_reading: 500 readings over its
+ * tokens, never waiting on the (unreachable) server */
+struct ingest_producer {
+    kv_ingest *ingest;
+    kv_ingest_token *tokens[4];
+    int accepted;
+};
+
+static void *produce_readings(void *arg) {
+    struct ingest_producer *producer = (struct ingest_producer *)arg;
+    for(int i = 0; i < 500; i++) {
+        struct json_object *reading = json_object_new_object();
+        json_object_object_add(reading, "n", json_object_new_int(i));
+        producer->accepted += kv_ingest_push(producer->ingest, producer->tokens[i % 4], reading);
+    }
+    return NULL;
+}
+
+static void count_outcome(const struct kv_batch_result *result, void *userdata) {
+    (void)result;
+    __atomic_fetch_add((int *)userdata, 1, __ATOMIC_RELAXED);
+}
+
+static void test_ingest_accounts_every_reading(void) {
+    kv_ingest *ingest = kv_ingest_new("http://127.0.0.1:9", 2, 3, 64, 50);
+    struct ingest_producer producers[4];
+    pthread_t threads[4];
+    char token[16];
+    int outcomes = 0;
+
+    CHECK(ingest != NULL);
+    if(!ingest) return;
+    CHECK(kv_ingest_threads(ingest) == 2 && kv_ingest_shards(ingest) == 3);
+    kv_ingest_set_callback(ingest, count_outcome, &outcomes);
+    for(int i = 0; i < 2; i++) {
+        kv_client_set_timeouts(kv_ingest_client(ingest, i), 1000, 1000);
+    }
+    CHECK(kv_ingest_add(ingest, "0-token") == kv_ingest_add(ingest, "0-token"));
+    CHECK(!kv_ingest_push(ingest, NULL, json_object_new_object()));
+
+    /* Producers share tokens, so rings and queues see concurrent pushes */
+    for(int p = 0; p < 4; p++) {
+        producers[p].ingest = ingest;
+        producers[p].accepted = 0;
+        for(int t = 0; t < 4; t++) {
+            snprintf(token, sizeof(token), "%d-token", (p + t) % 6);
+            producers[p].tokens[t] = kv_ingest_add(ingest, token);
+        }
+        pthread_create(&threads[p], NULL, produce_readings, &producers[p]);
+    }
+    int accepted = 0;
+    for(int p = 0; p < 4; p++) {
+        pthread_join(threads[p], NULL);
+        accepted += producers[p].accepted;
+    }
+
+    /* Nothing listens on the discard port: every batch fails */
+    CHECK(kv_ingest_flush(ingest) == 0);
+    struct kv_ingest_stats stats;
+    kv_ingest_stats(ingest, &stats);
+    CHECK(stats.pushed == accepted && stats.pushed + stats.dropped == 2000);
+    CHECK(stats.pending == 0 && stats.sent == 0);
+    CHECK(stats.superseded + stats.failed == stats.pushed && stats.failed > 0);
+    CHECK(__atomic_load_n(&outcomes, __ATOMIC_RELAXED) == accepted);
+
+    /* A flush with nothing new returns at once */
+    CHECK(kv_ingest_flush(ingest) == 1);
+    kv_ingest_free(ingest);
+}
+
+static void test_share_attach_detach(void) {
+    kv_share *share = kv_share_new(KV_SHARE_DNS | KV_SHARE_TLS | KV_SHARE_CONNECTIONS);
+    kv_client *a = kv_client_new("http://127.0.0.1:9", "token");
+    kv_client *b = kv_client_new("http://127.0.0.1:9", "token");
+
+    CHECK(share != NULL);
+    CHECK(kv_client_set_share(a, share) && kv_client_set_share(b, share));
+    /* Transfers through the share still fail cleanly */
+    CHECK(kv_retrieve(a) == NULL && kv_client_status(a) == 0);
+    CHECK(kv_client_set_share(a, NULL));
+
+    kv_client_free(a);
+    kv_client_free(b);
+    kv_share_free(share);
+}
+
+static void test_response_chunked_parse(void) {
+    struct kv_response response = {0};
+    const char *body = "{\"data\":{\"history\":[1,2,3],\"name\":\"a b\"},\"version\":7}";
+
+    kv_response_reset(&response);
+    CHECK(feed(&response, body, 3));
+    CHECK(response.state == KV_PARSE_DONE);
+    CHECK(strcmp(kv_response_body(&response), "") == 0);
+    CHECK(response.size == strlen(body));
+
+    struct json_object *json = kv_response_take(&response);
+    CHECK_JSON(json, body);
+    CHECK(kv_response_take(&response) == NULL);
+    json_object_put(json);
+
+    /* The same sink is reused for the next response */
+    response.keep_body = 1;
+    kv_response_reset(&response);
+    CHECK(feed(&response, "42", 1));
+    json = kv_response_take(&response);
+    CHECK(json && json_object_get_int(json) == 42);
+    CHECK(strcmp(kv_response_body(&response), "42") == 0);
+    json_object_put(json);
+
+    kv_response_free(&response);
+}
+
+static void test_response_not_json(void) {
+    struct kv_response response = {0};
+
+    kv_response_reset(&response);
+    CHECK(feed(&response, "<html>Bad Gateway</html>", 4));
+    CHECK(response.state == KV_PARSE_INVALID);
+    CHECK(kv_response_take(&response) == NULL);
+
+    kv_response_reset(&response);
+    CHECK(kv_response_take(&response) == NULL);
+
+    kv_response_free(&response);
+}
+
+/* ---- loopback HTTP server ---- */
+
+/* A loopback socket that listens but never answers: connections complete
+ * in the backlog and their requests wait. Returns the fd, port in *port. */
+static int silent_listener(int *port) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0 ||
+       getsockname(fd, (struct sockaddr *)&addr, &len) != 0) {
+        close(fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+/* Keep-alive HTTP/1.1 on 127.0.0.1 for tests that need real transfers.
+ * Every request is recorded; a store is answered with a version, a
+ * retrieve with a fixed document and anything else with plain text. Each
+ * connection gets a thread of its own. */
+#define TEST_SERVER_CONNECTIONS 8
+
+struct test_server {
+    int fd;
+    int port;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int conns[TEST_SERVER_CONNECTIONS];
+    pthread_t conn_threads[TEST_SERVER_CONNECTIONS];
+    int nconns;
+    char request[8192];                 /* the last request, head and body */
+    size_t request_len;
+    int requests;
+};
+
+struct test_connection {
+    struct test_server *server;
+    int fd;
+};
+
+static int send_all(int fd, const char *data, size_t len) {
+    while(len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if(n <= 0) return 0;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static void *test_serve(void *arg) {
+    struct test_connection *conn = (struct test_connection *)arg;
+    struct test_server *server = conn->server;
+    int fd = conn->fd;
+    char buf[8192];
+    size_t have = 0;
+    free(conn);
+
+    for(;;) {
+        /* Bodies are text, so buf is kept NUL-terminated for strstr */
+        char *end;
+        buf[have] = 0;
+        while(!(end = strstr(buf, "\r\n\r\n"))) {
+            ssize_t n = have + 1 < sizeof(buf) ? recv(fd, buf + have, sizeof(buf) - 1 - have, 0) : 0;
+            if(n <= 0) return NULL;
+            have += (size_t)n;
+            buf[have] = 0;
+        }
+        size_t head_len = (size_t)(end - buf) + 4, body_len = 0;
+        const char *length = strstr(buf, "\r\nContent-Length:");
+        if(length && length < end) body_len = strtoul(length + 17, NULL, 10);
+        if(head_len + body_len >= sizeof(buf)) return NULL;
+        const char *expect = strstr(buf, "\r\nExpect: 100-continue");
+        if(have < head_len + body_len && expect && expect < end) {
+            send_all(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+        }
+        while(have < head_len + body_len) {
+            ssize_t n = recv(fd, buf + have, sizeof(buf) - 1 - have, 0);
+            if(n <= 0) return NULL;
+            have += (size_t)n;
+        }
+
+        pthread_mutex_lock(&server->lock);
+        memcpy(server->request, buf, head_len + body_len);
+        server->request_len = head_len + body_len;
+        server->request[server->request_len] = 0;
+        server->requests++;
+        pthread_mutex_unlock(&server->lock);
+
+        const char *type = "application/json", *body;
+        if(strncmp(buf, "POST /api/store ", 16) == 0) {
+            body = "{\"success\":true,\"version\":2}";
+        } else if(strncmp(buf, "GET /api/retrieve ", 18) == 0) {
+            body = "{\"data\":{\"v\":1},\"version\":2}";
+        } else {
+            type = "text/plain";
+            body = "pong";
+        }
+        char head[256];
+        int n = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+                         "Content-Length: %zu\r\n\r\n", type, strlen(body));
+        if(!send_all(fd, head, (size_t)n) || !send_all(fd, body, strlen(body))) return NULL;
+
+        memmove(buf, buf + head_len + body_len, have - head_len - body_len);
+        have -= head_len + body_len;
+    }
+}
+
+static void *test_accept(void *arg) {
+    struct test_server *server = (struct test_server *)arg;
+    int fd;
+
+    /* accept fails once test_server_stop shuts the socket down */
+    while((fd = accept(server->fd, NULL, NULL)) >= 0) {
+        struct test_connection *conn = malloc(sizeof(*conn));
+        pthread_mutex_lock(&server->lock);
+        int slot = server->nconns;
+        if(conn && slot < TEST_SERVER_CONNECTIONS) {
+            conn->server = server;
+            conn->fd = fd;
+            server->conns[slot] = fd;
+            if(pthread_create(&server->conn_threads[slot], NULL, test_serve, conn) == 0) {
+                server->nconns++;
+                conn = NULL;
+                fd = -1;
+            }
+        }
+        pthread_mutex_unlock(&server->lock);
+        free(conn);
+        if(fd >= 0) close(fd);
+    }
+    return NULL;
+}
+
+static int test_server_start(struct test_server *server) {
+    memset(server, 0, sizeof(*server));
+    pthread_mutex_init(&server->lock, NULL);
+    server->fd = silent_listener(&server->port);
+    if(server->fd < 0) return 0;
+    if(pthread_create(&server->thread, NULL, test_accept, server) != 0) {
+        close(server->fd);
+        return 0;
+    }
+    return 1;
+}
+
+/* Free the clients first: their connections are closed from this end */
+static void test_server_stop(struct test_server *server) {
+    shutdown(server->fd, SHUT_RDWR);
+    pthread_join(server->thread, NULL);
+    close(server->fd);
+    for(int i = 0; i < server->nconns; i++) {
+        shutdown(server->conns[i], SHUT_RDWR);
+        pthread_join(server->conn_threads[i], NULL);
+        close(server->conns[i]);
+    }
+    pthread_mutex_destroy(&server->lock);
+}
+
+static void test_server_url(const struct test_server *server, char *url, size_t size) {
+    snprintf(url, size, "http://127.0.0.1:%d", server->port);
+}
+
+/* Body of the last request, after the blank line */
+static const char *test_server_body(struct test_server *server) {
+    const char *body = strstr(server->request, "\r\n\r\n");
+    return body ? body + 4 : "";
+}
+
+/* ---- streamed upload ---- */
+
+/* Read everything left in upload, chunk bytes per call, after out */
+static size_t drain_upload(struct kv_upload *upload, size_t chunk, char *out, size_t size) {
+    size_t len = 0, n;
+    while(len + chunk < size && (n = kv_upload_read(out + len, 1, chunk, upload)) > 0) len += n;
+    out[len] = 0;
+    return len;
+}
+
+static void test_upload_streams_parts(void) {
+    const char *doc = "{\"v\":12345,\"s\":\"text\"}";
+    const char *whole = "{\"data\":{\"v\":12345,\"s\":\"text\"}}";
+    struct kv_upload upload = { { "{\"data\":", doc, "}" }, { 8, strlen(doc), 1 }, 0, 0 };
+    char out[128];
+
+    /* Small reads cross every part boundary */
+    CHECK(drain_upload(&upload, 3, out, sizeof(out)) == strlen(whole) && strcmp(out, whole) == 0);
+    CHECK(kv_upload_read(out, 1, 16, &upload) == 0);
+
+    /* Rewound halfway, the whole body comes again */
+    CHECK(kv_upload_seek(&upload, 0, SEEK_SET) == CURL_SEEKFUNC_OK);
+    CHECK(kv_upload_read(out, 1, 10, &upload) == 10 && memcmp(out, whole, 10) == 0);
+    CHECK(kv_upload_seek(&upload, 0, SEEK_SET) == CURL_SEEKFUNC_OK);
+    CHECK(drain_upload(&upload, 5, out, sizeof(out)) == strlen(whole) && strcmp(out, whole) == 0);
+
+    /* Into the middle of a part, to the end, and past it */
+    CHECK(kv_upload_seek(&upload, 9, SEEK_SET) == CURL_SEEKFUNC_OK);
+    CHECK(drain_upload(&upload, 4, out, sizeof(out)) == strlen(whole) - 9 && strcmp(out, whole + 9) == 0);
+    CHECK(kv_upload_seek(&upload, (curl_off_t)strlen(whole), SEEK_SET) == CURL_SEEKFUNC_OK);
+    CHECK(kv_upload_read(out, 1, 16, &upload) == 0);
+    CHECK(kv_upload_seek(&upload, (curl_off_t)strlen(whole) + 1, SEEK_SET) == CURL_SEEKFUNC_FAIL);
+    CHECK(kv_upload_seek(&upload, 0, SEEK_CUR) == CURL_SEEKFUNC_CANTSEEK);
+}
+
+static void test_store_body_on_the_wire(void) {
+    struct test_server server;
+    char url[64];
+
+    CHECK(test_server_start(&server));
+    test_server_url(&server, url, sizeof(url));
+    kv_client *client = kv_client_new(url, "token");
+    struct json_object *doc = json_tokener_parse("{\"v\":1,\"list\":[1,2,3],\"s\":\"x y\"}");
+
+    /* The envelope and the document go out as one plain body, twice over
+     * the same connection */
+    for(int i = 0; i < 2; i++) {
+        CHECK(kv_store(client, doc) && kv_client_status(client) == 200);
+        CHECK(strcmp(test_server_body(&server), "{\"data\":{\"v\":1,\"list\":[1,2,3],\"s\":\"x y\"}}") == 0);
+        CHECK(strstr(server.request, "\r\nContent-Length: 41\r\n") != NULL);
+    }
+    CHECK(server.requests == 2 && server.nconns == 1);
+
+    json_object_put(doc);
+    kv_client_free(client);
+    test_server_stop(&server);
+}
+
+/* ---- persistent handle ---- */
+
+static void test_client_reuses_connection(void) {
+    struct test_server server;
+    char url[64], ping[80];
+
+    CHECK(test_server_start(&server));
+    test_server_url(&server, url, sizeof(url));
+    snprintf(ping, sizeof(ping), "%s/ping", url);
+    kv_client *client = kv_client_new(url, "token");
+    struct json_object *doc = json_tokener_parse("{\"v\":1}");
+
+    CHECK(kv_store(client, doc));
+    struct json_object *got = kv_retrieve(client);
+    CHECK_JSON(got, "{\"v\":1}");
+    json_object_put(got);
+
+    /* A plain GET after the store leaves neither its method, body nor
+     * headers behind on the handle */
+    CHECK(kv_get_json(client, ping, 5L) == NULL && kv_client_status(client) == 200);
+    CHECK(strncmp(server.request, "GET /ping ", 10) == 0);
+    CHECK(strstr(server.request, "\r\nX-KV-Token:") == NULL);
+    CHECK(strstr(server.request, "\r\nContent-Type:") == NULL);
+    CHECK(strstr(server.request, "\r\nContent-Length:") == NULL);
+
+    CHECK(kv_store(client, doc) && strcmp(test_server_body(&server), "{\"data\":{\"v\":1}}") == 0);
+    CHECK(server.requests == 4 && server.nconns == 1);
+
+    json_object_put(doc);
+    kv_client_free(client);
+    test_server_stop(&server);
+}
+
+/* ---- kv_arena / pool ---- */
+
+static void test_arena(void) {
+    kv_arena *arena = kv_arena_new(64);
+
+    char *a = kv_arena_strdup(arena, "203.0.113.42");
+    void *b = kv_arena_alloc(arena, 8);
+    CHECK(a && strcmp(a, "203.0.113.42") == 0);
+    CHECK(b && ((size_t)b % 16) == 0);
+    CHECK(kv_arena_alloc(arena, 64) == NULL);
+
+    kv_arena_reset(arena);
+    CHECK(kv_arena_used(arena) == 0);
+    CHECK(kv_arena_strdup(arena, "x") == a);
+
+    kv_arena_free(arena);
+}
+
+static void test_pool(void) {
+    const struct kv_pool_class classes[] = { {64, 4}, {4096, 2} };
+    struct kv_pool_stats stats;
+
+    CHECK(!kv_global_init_pool(classes + 1, 0));
+    CHECK(kv_global_init_pool(classes, 2));
+
+    kv_pool_get_stats(&stats);
+    CHECK(stats.capacity == 64 * 4 + 4096 * 2);
+
+    /* A kv_batch (~2.4 KB) only fits the 4 KB class; the third spills to malloc */
+    kv_batch *batch = kv_batch_new();
+    kv_batch *more = kv_batch_new();
+    kv_batch *spill = kv_batch_new();
+    kv_pool_get_stats(&stats);
+    CHECK(stats.in_use == 2);
+    CHECK(stats.fallbacks == 1);
+
+    kv_batch_free(spill);
+    kv_batch_free(more);
+    kv_batch_free(batch);
+    kv_pool_get_stats(&stats);
+    CHECK(stats.in_use == 0);
+    CHECK(stats.peak == 2);
+
+    /* Freed blocks are reused rather than falling back again */
+    batch = kv_batch_new();
+    kv_pool_get_stats(&stats);
+    CHECK(stats.fallbacks == 1);
+    kv_batch_free(batch);
+
+    kv_global_cleanup();
+    kv_pool_get_stats(&stats);
+    CHECK(stats.capacity == 0);
+}
+
+/* ---- retrieve cache ---- */
+
+static void test_cache_tracks_patches(void) {
+    kv_client *client = kv_client_new("http://127.0.0.1:9", "token-a");
+    struct json_object *doc = json_tokener_parse("{\"n\":1,\"list\":[1]}");
+    struct json_object *set = json_tokener_parse("{\"n\":2,\"list.1\":2}");
+
+    CHECK(kv_cache_find(client) == NULL);
+    CHECK(kv_client_enable_cache(client, 2, 60000));
+    kv_cache_put(client, "\"3\"", 3, doc);
+
+    struct kv_cache_entry *entry = kv_cache_find(client);
+    CHECK(entry && kv_cache_fresh(client, entry));
+    CHECK(entry && strcmp(kv_cache_etag(entry), "\"3\"") == 0);
+
+    /* A patch against the cached version is applied to a copy */
+    client->version = 4;
+    kv_cache_patched(client, 3, set, NULL);
+    entry = kv_cache_find(client);
+    struct json_object *cached = entry ? kv_cache_hit(client, entry, KV_CACHE_FRESH) : NULL;
+    CHECK_JSON(cached, "{\"n\":2,\"list\":[1,2]}");
+    CHECK_JSON(doc, "{\"n\":1,\"list\":[1]}");
+    CHECK(kv_client_version(client) == 4);
+    json_object_put(cached);
+
+    /* Other tokens have their own entries */
+    kv_client_set_token(client, "token-b");
+    CHECK(kv_cache_find(client) == NULL);
+    kv_client_set_token(client, "token-a");
+
+    /* A patch against some other version leaves the entry of unknown age */
+    kv_cache_patched(client, 9, set, NULL);
+    CHECK(kv_cache_find(client) == NULL);
+
+    json_object_put(set);
+    json_object_put(doc);
+    kv_client_free(client);
+}
+
+static void test_patch_if_checks_cached_document(void) {
+    kv_client *client = kv_client_new("http://127.0.0.1:9", "token-a");
+    struct json_object *doc = json_tokener_parse("{\"ip\":\"a\",\"changed\":true}");
+    struct json_object *set = json_tokener_parse("{\"changed\":false}");
+    struct json_object *other = json_object_new_string("b");
+
+    CHECK(kv_client_enable_cache(client, 2, 60000));
+    kv_cache_put(client, "\"3\"", 3, doc);
+
+    /* A mismatch is seen in the fresh copy, and nothing is sent */
+    CHECK(kv_patch_if(client, 0, "ip", other, set, NULL) == 0);
+    CHECK(kv_cache_find(client) != NULL);
+
+    /* A match goes on to the patch, which cannot connect */
+    CHECK(kv_patch_if(client, 0, "previous_ip", NULL, set, NULL) == -1);
+    CHECK(kv_cache_find(client) == NULL);
+
+    json_object_put(other);
+    json_object_put(set);
+    json_object_put(doc);
+    kv_client_free(client);
+}
+
+/* ---- request setup ---- */
+
+static void test_client_headers_follow_token(void) {
+    kv_client *client = kv_client_new("http://127.0.0.1:9//", NULL);
+
+    CHECK(strcmp(kv_client_endpoint(client, KV_ENDPOINT_STORE), "http://127.0.0.1:9/api/store") == 0);
+    CHECK(kv_client_headers(client, 0, 1) == NULL);
+
+    kv_client_set_token(client, "token-a");
+    struct curl_slist *headers = kv_client_headers(client, 1, 1);
+    CHECK(headers && strcmp(headers->data, "Content-Type: application/json") == 0 &&
+          headers->next && strcmp(headers->next->data, "X-KV-Token: token-a") == 0 &&
+          !headers->next->next);
+
+    /* The same nodes are repointed, so the list stays valid across tokens */
+    kv_client_set_token(client, "token-b");
+    CHECK(kv_client_headers(client, 1, 1) == headers);
+    CHECK(strcmp(kv_client_headers(client, 0, 1)->data, "X-KV-Token: token-b") == 0);
+    CHECK(strcmp(kv_client_token(client), "token-b") == 0);
+
+    kv_client_free(client);
+}
+
+static void test_retry_backoff_spreads(void) {
+    kv_client *client = kv_client_new("http://127.0.0.1:9", "token");
+    kv_client_set_retry(client, 5, 100, 2000);
+
+    /* Each delay lies between base and three times the last, under max */
+    long last = 0, lowest = 2000, highest = 0;
+    int ok = 1;
+    for(int i = 0; i < 1000; i++) {
+        long delay = kv_retry_backoff(&client->retry, last);
+        long high = (last > 100 ? last : 100) * 3;
+        ok &= delay >= 100 && delay <= (high < 2000 ? high : 2000);
+        if(delay < lowest) lowest = delay;
+        if(delay > highest) highest = delay;
+        last = delay;
+    }
+    CHECK(ok);
+    CHECK(lowest < 300 && highest > 1500);
+
+    /* Two clients do not draw the same delays */
+    kv_client *other = kv_client_new("http://127.0.0.1:9", "token");
+    kv_client_set_retry(other, 5, 100, 2000);
+    int same = 0;
+    for(int i = 0; i < 20; i++) {
+        same += kv_retry_backoff(&client->retry, 1000) == kv_retry_backoff(&other->retry, 1000);
+    }
+    CHECK(same < 5);
+
+    kv_retry_after_header(client, "3", 1);
+    CHECK(client->retry.retry_after_ms == 3000);
+    kv_retry_after_header(client, "Wed, 21 Oct 2015 07:28:00 GMT", 29);
+    CHECK(client->retry.retry_after_ms == 0);
+
+    kv_client_free(other);
+    kv_client_free(client);
+}
+
+static void test_breaker_fails_fast(void) {
+    kv_client *client = kv_client_new("http://127.0.0.1:9", "token");
+    kv_client_set_retry(client, 3, 1, 2);
+    kv_client_set_breaker(client, 2, 60000);
+
+    CHECK(kv_retrieve(client) == NULL && kv_client_attempts(client) == 3);
+    CHECK(kv_client_breaker_state(client) == KV_BREAKER_CLOSED);
+    CHECK(kv_retrieve(client) == NULL && kv_client_breaker_state(client) == KV_BREAKER_OPEN);
+
+    /* Open: nothing is sent */
+    CHECK(!kv_store_string(client, "{\"v\":1}") && kv_client_attempts(client) == 0);
+    CHECK(strncmp(kv_client_error(client), "Circuit open", 12) == 0);
+
+    /* Once it is due, one probe goes out, and failing reopens it */
+    client->retry.open_until_ms = kv_now_ms();
+    CHECK(kv_client_breaker_state(client) == KV_BREAKER_HALF_OPEN);
+    CHECK(kv_retrieve(client) == NULL && kv_client_attempts(client) == 1);
+    CHECK(kv_client_breaker_state(client) == KV_BREAKER_OPEN);
+
+    /* Disabling the breaker closes it */
+    kv_client_set_breaker(client, 0, 0);
+    CHECK(kv_client_breaker_state(client) == KV_BREAKER_CLOSED);
+    CHECK(kv_retrieve(client) == NULL && kv_client_attempts(client) == 3);
+
+    kv_client_free(client);
+}
+
+/* Whether out holds the gzip or zstd encoding of the parts of body */
+static int decodes_to(const struct kv_buffer *out, int method, const struct kv_upload *body) {
+    char expected[256], decoded[256];
+    size_t len = 0, n = 0;
+    for(int i = 0; i < KV_UPLOAD_PARTS; i++) {
+        memcpy(expected + len, body->parts[i], body->lens[i]);
+        len += body->lens[i];
+    }
+
+#ifdef KV_WITH_ZLIB
+    if(method == KV_COMPRESS_GZIP) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if(inflateInit2(&zs, 15 + 16) != Z_OK) return 0;
+        zs.next_in = (Bytef *)out->data;
+        zs.avail_in = (uInt)out->size;
+        zs.next_out = (Bytef *)decoded;
+        zs.avail_out = sizeof(decoded);
+        if(inflate(&zs, Z_FINISH) == Z_STREAM_END) n = zs.total_out;
+        inflateEnd(&zs);
+    }
+#endif
+#ifdef KV_WITH_ZSTD
+    if(method == KV_COMPRESS_ZSTD) {
+        n = ZSTD_decompress(decoded, sizeof(decoded), out->data, out->size);
+        if(ZSTD_isError(n)) n = 0;
+    }
+#endif
+    (void)out;
+    (void)method;
+    return n == len && memcmp(decoded, expected, len) == 0;
+}
+
+static void test_compress_bodies(void) {
+    kv_client *client = kv_client_new("http://127.0.0.1:9", "token-a");
+    const char *doc = "{\"history\":[{\"t\":21.5},{\"t\":21.5},{\"t\":21.5},{\"t\":21.5}]}";
+    /* Bodies as kv_perform_parts and kv_perform hand them over */
+    struct kv_upload bodies[2] = {
+        { { "{\"data\":", doc, "}" }, { 8, strlen(doc), 1 }, 0, 0 },
+        { { doc, "", "" }, { strlen(doc), 0, 0 }, 0, 0 },
+    };
+    size_t total = 9 + strlen(doc);
+
+    CHECK(kv_client_set_compression(client, 99, 0) == 0);
+    CHECK(kv_compress_body(client, &bodies[0], total) == NULL);
+
+    if(kv_client_set_compression(client, KV_COMPRESS_GZIP, total + 1)) {
+        /* Below the threshold the body goes out as it is */
+        CHECK(kv_compress_body(client, &bodies[0], total) == NULL);
+    }
+
+    const int methods[] = { KV_COMPRESS_GZIP, KV_COMPRESS_ZSTD };
+    const char *headers[] = { "Content-Encoding: gzip", "Content-Encoding: zstd" };
+    for(int m = 0; m < 2; m++) {
+        if(!kv_compress_available(methods[m])) continue;
+        CHECK(kv_client_set_compression(client, methods[m], 0));
+
+        /* The second body reuses the compressor state */
+        int ok = 1;
+        for(int b = 0; b < 2; b++) {
+            size_t len = bodies[b].lens[0] + bodies[b].lens[1] + bodies[b].lens[2];
+            char *header = kv_compress_body(client, &bodies[b], len);
+            ok &= header && strcmp(header, headers[m]) == 0 &&
+                  decodes_to(&client->compress.out, methods[m], &bodies[b]);
+        }
+        CHECK(ok);
+    }
+
+    kv_client_free(client);
+}
+
+/* A fresh temporary file for a spool */
+static char *spool_path(void) {
+    static char path[] = "/tmp/test_kv_spool.XXXXXX";
+    strcpy(path + sizeof(path) - 7, "XXXXXX");
+    int fd = mkstemp(path);
+    if(fd >= 0) close(fd);
+    return path;
+}
+
+/* ---- kv_crypt ---- */
+
+/* Read a retrieve response whose data is {"encrypted":true,"payload":
+ * payload} through the client's cipher, chunk bytes at a time */
+static int open_response(kv_client *client, const char *payload, size_t chunk, int raw) {
+    size_t size = strlen(payload) + 96;
+    char *text = malloc(size);
+    snprintf(text, size, "{\"data\":{\"encrypted\":true,\"payload\": \"%s\"},\"version\":7}", payload);
+
+    int ok = kv_crypt_begin(client);
+    client->response.raw = raw;
+    kv_response_reset(&client->response);
+    ok = ok && feed(&client->response, text, chunk);
+    client->response.crypt = NULL;
+    client->response.raw = 0;
+    free(text);
+    return ok;
+}
+
+static void test_crypt_round_trip(void) {
+    kv_client *client = kv_client_new("http://127.0.0.1:9", "token-a");
+    CHECK(kv_client_cipher(client) == 0);
+    if(!kv_cipher_available(KV_CIPHER_AUTO)) {
+        CHECK(kv_client_set_encryption(client, "secret", KV_CIPHER_AUTO) == 0);
+        kv_client_free(client);
+        return;
+    }
+
+    /* Over a few KV_CRYPT_CHUNK blocks, so blocks and base64 groups meet */
+    struct json_object *readings = json_object_new_array();
+    for(int i = 0; i < 400; i++) {
+        struct json_object *reading = json_object_new_object();
+        json_object_object_add(reading, "t", json_object_new_int(i));
+        json_object_object_add(reading, "h", json_object_new_int(40 + i % 7));
+        json_object_array_add(readings, reading);
+    }
+    char *doc = strdup(json_object_to_json_string_ext(readings, JSON_C_TO_STRING_PLAIN));
+    json_object_put(readings);
+    size_t doc_len = strlen(doc);
+
+    const int ciphers[] = { KV_CIPHER_AES_GCM, KV_CIPHER_CHACHA20 };
+    for(int c = 0; c < 2; c++) {
+        if(!kv_cipher_available(ciphers[c])) continue;
+        CHECK(kv_client_set_encryption(client, "secret", ciphers[c]));
+        CHECK(kv_client_cipher(client) == ciphers[c]);
+
+        size_t len;
+        const char *sealed = kv_crypt_seal(client, doc, doc_len, &len);
+        CHECK(sealed && len == strlen(sealed) && len == (13 + doc_len + 16 + 2) / 3 * 4);
+        if(!sealed) continue;
+        char *payload = strdup(sealed);
+
+        /* Parsed as it is opened, whatever the chunking */
+        const size_t chunks[] = { 1, 7, 1000, 1 << 16 };
+        for(int k = 0; k < 4; k++) {
+            CHECK(open_response(client, payload, chunks[k], 0));
+            struct json_object *data = kv_crypt_data(client);
+            CHECK(data && kv_client_version(client) == 7);
+            if(data) CHECK_JSON(data, doc);
+            json_object_put(data);
+        }
+
+        size_t text_len = 0;
+        CHECK(open_response(client, payload, 333, 1));
+        const char *text = kv_crypt_text(client, &text_len);
+        CHECK(text && text_len == doc_len && memcmp(text, doc, doc_len) == 0);
+
+        /* The envelope is kept, without the payload */
+        CHECK(strcmp(kv_response_body(&client->response),
+                     "{\"data\":{\"encrypted\":true,\"payload\": \"\"},\"version\":7}") == 0);
+
+        /* One altered character fails the tag, and nothing is returned */
+        payload[len / 2] = payload[len / 2] == 'A' ? 'B' : 'A';
+        CHECK(open_response(client, payload, 512, 0));
+        CHECK(kv_crypt_data(client) == NULL);
+        CHECK(strstr(kv_client_error(client), "Decryption failed") != NULL);
+        payload[len / 2] = sealed[len / 2];
+
+        /* Another token has another key */
+        kv_client_set_token(client, "token-b");
+        CHECK(open_response(client, payload, 512, 0));
+        CHECK(kv_crypt_data(client) == NULL);
+        kv_client_set_token(client, "token-a");
+
+        /* So has another password; the other cipher still opens it */
+        CHECK(kv_client_set_encryption(client, "not the secret", ciphers[c]));
+        CHECK(open_response(client, payload, 512, 0));
+        CHECK(kv_crypt_data(client) == NULL);
+        if(kv_client_set_encryption(client, "secret", ciphers[1 - c])) {
+            CHECK(open_response(client, payload, 512, 0));
+            struct json_object *data = kv_crypt_data(client);
+            CHECK(data != NULL);
+            json_object_put(data);
+        }
+        free(payload);
+    }
+
+    /* Plaintext is refused rather than handed out */
+    CHECK(kv_crypt_begin(client));
+    kv_response_reset(&client->response);
+    CHECK(feed(&client->response, "{\"data\":{\"user\":\"alice\"},\"version\":3}", 5));
+    client->response.crypt = NULL;
+    CHECK(kv_crypt_data(client) == NULL);
+    CHECK(strcmp(kv_client_error(client), "Data is not encrypted") == 0);
+
+    /* The server cannot patch ciphertext */
+    struct json_object *set = json_tokener_parse("{\"user\":\"bob\"}");
+    CHECK(kv_patch(client, 3, set, NULL) == 0);
+    CHECK(strcmp(kv_client_error(client), "Cannot patch encrypted data") == 0);
+    json_object_put(set);
+
+    /* Nor may plaintext leave by the side doors */
+    kv_async *async = kv_async_new();
+    set = json_tokener_parse("{\"user\":\"bob\"}");
+    CHECK(async && !kv_async_store(async, client, set, NULL, NULL));
+    json_object_put(set);
+    kv_async_free(async);
+    char *path = spool_path();
+    kv_spool *spool = kv_spool_open(path, 1, 0);
+    kv_writer *writer = kv_writer_new(client, build_nothing, NULL, 60000, 2, 0);
+    CHECK(spool && writer && !kv_writer_set_spool(writer, spool));
+    CHECK(strcmp(kv_client_error(client), "Cannot spool encrypted data") == 0);
+    kv_writer_free(writer);
+    kv_spool_close(spool);
+    unlink(path);
+
+    CHECK(kv_client_set_encryption(client, NULL, KV_CIPHER_AUTO) && kv_client_cipher(client) == 0);
+    free(doc);
+    kv_client_free(client);
+}
+
+/* ---- kv_history ---- */
+
+static void test_history_url(void) {
+    kv_client *client = kv_client_new("http://127.0.0.1:9", "token-a");
+    struct kv_history_query query = { 0 };
+    char url[256];
+
+    CHECK(kv_history_url(client, &query, url, sizeof(url)) &&
+          strcmp(url, "http://127.0.0.1:9/api/history?limit=200") == 0);
+
+    query.limit = 20;
+    query.before = 41;
+    query.since = "2025-10-23T12:00:00+02:00";
+    query.type = "sensor reading";
+    CHECK(kv_history_url(client, &query, url, sizeof(url)) &&
+          strcmp(url, "http://127.0.0.1:9/api/history?limit=20&before=41"
+                      "&since=2025-10-23T12%3A00%3A00%2B02%3A00&type=sensor%20reading") == 0);
+    CHECK(kv_history_url(client, &query, url, 60) == 0);
+
+    kv_client_free(client);
+}
+
+static void test_history_iter_stops_on_failure(void) {
+    kv_client *client = kv_client_new("http://127.0.0.1:9", "token-a");
+    struct kv_history_query query = { 0 };
+    query.since = "2025-10-23T00:00:00Z";
+
+    kv_history_iter *iter = kv_history_iter_new(client, &query);
+    CHECK(iter && kv_history_next(iter) == NULL);
+    CHECK(iter && kv_history_failed(iter) && kv_history_pages(iter) == 0);
+    /* A failed iterator stays finished instead of retrying */
+    CHECK(iter && kv_history_next(iter) == NULL);
+    kv_history_iter_free(iter);
+
+    struct json_object *event = json_tokener_parse(
+        "{\"seq\":7,\"created_at\":\"2025-10-23T12:00:00Z\",\"payload\":{\"type\":\"store\"}}");
+    CHECK(kv_history_event_seq(event) == 7 && kv_history_event_seq(NULL) == 0);
+    CHECK(strcmp(kv_history_event_time(event), "2025-10-23T12:00:00Z") == 0);
+    CHECK_JSON(kv_history_event_payload(event), "{\"type\":\"store\"}");
+    json_object_put(event);
+
+    kv_client_free(client);
+}
+
+/* ---- kv_spool ---- */
+
+static int collect_spooled(const char *token, struct json_object *record, void *userdata) {
+    struct json_object *items = (struct json_object *)userdata;
+    struct json_object *item = json_object_new_object();
+    json_object_object_add(item, token, json_object_get(record));
+    json_object_array_add(items, item);
+    return 1;
+}
+
+static void test_spool_survives_reopen(void) {
+    char *path = spool_path();
+    struct json_object *record = json_tokener_parse("{\"v\":1}");
+
+    kv_spool *spool = kv_spool_open(path, 100, 0);
+    CHECK(spool && kv_spool_count(spool) == 0);
+    int ok = 1;
+    for(int i = 0; i < 3; i++) {
+        json_object_object_add(record, "v", json_object_new_int(i));
+        ok &= kv_spool_append(spool, i == 1 ? "token-b" : "token-a", record);
+    }
+    CHECK(ok && kv_spool_count(spool) == 3);
+    CHECK(kv_spool_consume(spool, 1) && kv_spool_count(spool) == 2);
+    kv_spool_close(spool);
+
+    /* The read position is kept along with the records */
+    spool = kv_spool_open(path, 100, 0);
+    struct json_object *items = json_object_new_array();
+    CHECK(spool && kv_spool_read(spool, 0, collect_spooled, items) == 2);
+    CHECK_JSON(items, "[{\"token-b\":{\"v\":1}},{\"token-a\":{\"v\":2}}]");
+    json_object_put(items);
+
+    /* Emptied, the file shrinks back to its header */
+    CHECK(kv_spool_consume(spool, 5) && kv_spool_count(spool) == 0);
+    struct stat st;
+    CHECK(stat(path, &st) == 0 && st.st_size == 24);
+    kv_spool_close(spool);
+
+    json_object_put(record);
+    unlink(path);
+}
+
+static void test_spool_cuts_torn_tail(void) {
+    char *path = spool_path();
+    struct json_object *record = json_tokener_parse("{\"reading\":22.5}");
+
+    kv_spool *spool = kv_spool_open(path, 1, 0);
+    CHECK(spool && kv_spool_append(spool, "token", record) && kv_spool_append(spool, "token", record));
+    kv_spool_close(spool);
+
+    /* A crash halfway through the second record */
+    struct stat st;
+    CHECK(stat(path, &st) == 0 && truncate(path, st.st_size - 4) == 0);
+    spool = kv_spool_open(path, 1, 0);
+    CHECK(spool && kv_spool_count(spool) == 1);
+    CHECK(spool && kv_spool_append(spool, "token", record) && kv_spool_count(spool) == 2);
+    kv_spool_close(spool);
+    spool = kv_spool_open(path, 1, 0);
+    CHECK(spool && kv_spool_count(spool) == 2);
+    kv_spool_close(spool);
+
+    /* Drained, but the crash kept the old header and not the records */
+    FILE *file = fopen(path, "w");
+    if(file) {
+        unsigned char header[24] = "KVSPOOL1";
+        header[8] = 100;
+        fwrite(header, 1, sizeof(header), file);
+        fclose(file);
+    }
+    spool = kv_spool_open(path, 1, 0);
+    CHECK(spool && kv_spool_count(spool) == 0);
+    CHECK(spool && kv_spool_append(spool, "token", record) && kv_spool_count(spool) == 1);
+    kv_spool_close(spool);
+    spool = kv_spool_open(path, 1, 0);
+    CHECK(spool && kv_spool_count(spool) == 1);
+    kv_spool_close(spool);
+
+    /* Not a spool at all */
+    file = fopen(path, "w");
+    if(file) {
+        fputs("this is not a spool file", file);
+        fclose(file);
+    }
+    CHECK(kv_spool_open(path, 1, 0) == NULL);
+
+    json_object_put(record);
+    unlink(path);
+}
+
+static void test_spool_compaction_cut_short(void) {
+    char *path = spool_path();
+    struct json_object *record = json_tokener_parse("{\"v\":0}");
+
+    kv_spool *spool = kv_spool_open(path, 1, 0);
+    int ok = spool != NULL;
+    for(int i = 0; ok && i < 4; i++) {
+        json_object_object_add(record, "v", json_object_new_int(i));
+        ok = kv_spool_append(spool, "token", record);
+    }
+    CHECK(ok && kv_spool_consume(spool, 2));
+    kv_spool_close(spool);
+
+    /* A crash in compaction after the two live records were copied down
+     * and the header moved to them, before the file was cut back: past
+     * the copy, the old records are still whole */
+    unsigned char buf[512];
+    int fd = open(path, O_RDWR);
+    ssize_t size = fd >= 0 ? pread(fd, buf, sizeof(buf), 0) : -1;
+    size_t record_len = size > 24 ? (size_t)(size - 24) / 4 : 0;
+    CHECK(record_len > 0 && (size_t)size == 24 + 4 * record_len);
+    if(record_len > 0) {
+        memmove(buf + 24, buf + 24 + 2 * record_len, 2 * record_len);
+        kv_put_le(buf + 8, 24, 8);
+        kv_put_le(buf + 16, 24 + 2 * record_len, 8);
+        CHECK(pwrite(fd, buf, (size_t)size, 0) == size);
+    }
+    if(fd >= 0) close(fd);
+
+    spool = kv_spool_open(path, 1, 0);
+    struct json_object *items = json_object_new_array();
+    CHECK(spool && kv_spool_read(spool, 0, collect_spooled, items) == 2);
+    CHECK_JSON(items, "[{\"token\":{\"v\":2}},{\"token\":{\"v\":3}}]");
+    json_object_put(items);
+    struct stat st;
+    CHECK(stat(path, &st) == 0 && (size_t)st.st_size == 24 + 2 * record_len);
+
+    /* With the file cut, records appended later are found again */
+    CHECK(spool && kv_spool_append(spool, "token", record));
+    kv_spool_close(spool);
+    spool = kv_spool_open(path, 1, 0);
+    CHECK(spool && kv_spool_count(spool) == 3);
+    kv_spool_close(spool);
+    unlink(path);
+
+    /* A compaction that runs to the end leaves no limit behind */
+    char text[1024];
+    memset(text, 'x', sizeof(text) - 1);
+    text[sizeof(text) - 1] = 0;
+    json_object_object_add(record, "v", json_object_new_string(text));
+    spool = kv_spool_open(path, 1000, 0);
+    ok = spool != NULL;
+    for(int i = 0; ok && i < 100; i++) ok = kv_spool_append(spool, "token", record);
+    CHECK(ok && kv_spool_consume(spool, 80) && kv_spool_count(spool) == 20);
+    CHECK(stat(path, &st) == 0 && st.st_size < 30 * 1024);
+    kv_spool_close(spool);
+    fd = open(path, O_RDONLY);
+    CHECK(fd >= 0 && pread(fd, buf, 24, 0) == 24 && kv_get_le(buf + 16, 8) == 0);
+    if(fd >= 0) close(fd);
+    spool = kv_spool_open(path, 1, 0);
+    CHECK(spool && kv_spool_count(spool) == 20 && kv_spool_append(spool, "token", record));
+    kv_spool_close(spool);
+    spool = kv_spool_open(path, 1, 0);
+    CHECK(spool && kv_spool_count(spool) == 21);
+    kv_spool_close(spool);
+
+    json_object_put(record);
+    unlink(path);
+}
+
+static void test_writer_spool_outlives_process(void) {
+    char *path = spool_path();
+    kv_client *client = kv_client_new("http://127.0.0.1:9", "token");
+    struct json_object *sample = json_tokener_parse("{\"v\":1}");
+
+    kv_spool *spool = kv_spool_open(path, 10, 0);
+    kv_writer *writer = kv_writer_new(client, build_nothing, NULL, 60000, 2, 0);
+    CHECK(spool && writer && kv_writer_set_spool(writer, spool));
+    CHECK(kv_writer_add(writer, sample) && kv_spool_count(spool) == 1);
+    /* While the server is down, a full buffer drops from the spool too */
+    CHECK(!kv_writer_add(writer, sample));
+    CHECK(kv_writer_add(writer, sample) && kv_writer_dropped(writer) == 1);
+    CHECK(kv_spool_count(spool) == 2);
+    kv_writer_free(writer);
+    kv_spool_close(spool);
+
+    /* The next run picks the samples up, due at once */
+    spool = kv_spool_open(path, 10, 0);
+    writer = kv_writer_new(client, build_nothing, NULL, 60000, 1, 0);
+    CHECK(spool && writer && kv_writer_set_spool(writer, spool));
+    CHECK(kv_writer_pending(writer) == 1 && kv_writer_dropped(writer) == 1);
+    CHECK(kv_spool_count(spool) == 1 && kv_writer_timeout(writer) == 0);
+    kv_writer_free(writer);
+    kv_spool_close(spool);
+
+    /* Nothing to deliver to: replay keeps every record */
+    spool = kv_spool_open(path, 10, 0);
+    CHECK(spool && kv_spool_replay(spool, client, 2) == -1 && kv_spool_count(spool) == 1);
+    kv_spool_close(spool);
+
+    json_object_put(sample);
+    kv_client_free(client);
+    unlink(path);
+}
+
+/* ---- kv_snapshot ---- */
+
+/* Run fn on each file in dir */
+static void for_each_file(const char *dir, void (*fn)(const char *path)) {
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    char path[512];
+    while(d && (e = readdir(d))) {
+        if(e->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        fn(path);
+    }
+    if(d) closedir(d);
+}
+
+static void tear_file(const char *path) {
+    if(truncate(path, 60) != 0) perror(path);
+}
+
+static void remove_file(const char *path) {
+    unlink(path);
+}
+
+static void test_snapshot_follows_writes(void) {
+    char dir[] = "/tmp/test_kv_snapshot.XXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+
+    kv_client *client = kv_client_new("http://127.0.0.1:9", "token-a");
+    struct json_object *doc = json_tokener_parse("{\"n\":1,\"list\":[1]}");
+    struct json_object *set = json_tokener_parse("{\"list.1\":2}");
+
+    CHECK(kv_snapshot_open(dir, "token-a") == NULL);
+    CHECK(kv_client_set_snapshot_dir(client, dir));
+    kv_snapshot_save(client, "\"3\"", 3, doc);
+
+    size_t len;
+    kv_snapshot *snapshot = kv_snapshot_open(dir, "token-a");
+    CHECK(snapshot && kv_snapshot_version(snapshot) == 3);
+    CHECK(snapshot && strcmp(kv_snapshot_etag(snapshot), "\"3\"") == 0);
+    CHECK(snapshot && strcmp(kv_snapshot_data(snapshot, &len), "{\"n\":1,\"list\":[1]}") == 0 && len == 18);
+    CHECK(snapshot && kv_snapshot_age_ms(snapshot) < 10000);
+    CHECK(kv_snapshot_open(dir, "token-b") == NULL);
+
+    /* A patch against the snapshot's version is applied to it; the open
+     * mapping keeps the version it was opened at */
+    client->version = 4;
+    client->etag[0] = 0;
+    kv_cache_patched(client, 3, set, NULL);
+    kv_snapshot *patched = kv_snapshot_open(dir, "token-a");
+    struct json_object *data = patched ? kv_snapshot_parse(patched) : NULL;
+    CHECK_JSON(data, "{\"n\":1,\"list\":[1,2]}");
+    CHECK(patched && kv_snapshot_version(patched) == 4 && kv_snapshot_etag(patched)[0] == 0);
+    CHECK(snapshot && strcmp(kv_snapshot_data(snapshot, NULL), "{\"n\":1,\"list\":[1]}") == 0);
+    json_object_put(data);
+    kv_snapshot_close(patched);
+    kv_snapshot_close(snapshot);
+
+    /* One against another version leaves it alone */
+    kv_cache_patched(client, 9, set, NULL);
+    patched = kv_snapshot_open(dir, "token-a");
+    CHECK(patched && kv_snapshot_version(patched) == 4);
+    kv_snapshot_close(patched);
+
+    /* Offline, a retrieve fails rather than returning the snapshot */
+    CHECK(kv_retrieve(client) == NULL);
+
+    /* A torn file is no snapshot */
+    for_each_file(dir, tear_file);
+    CHECK(kv_snapshot_open(dir, "token-a") == NULL);
+
+    for_each_file(dir, remove_file);
+    rmdir(dir);
+    json_object_put(set);
+    json_object_put(doc);
+    kv_client_free(client);
+}
+
+/* ---- kv_codec ---- */
+
+static void test_reading_codec_round_trip(void) {
+    struct kv_reading reading = { "2025-01-14T09:30:00Z", 20.1, 45.0, NAN }, back;
+    char text[KV_READING_TEXT_MAX], small[8];
+
+    int len = kv_reading_encode(&reading, text, sizeof(text));
+    CHECK(strcmp(text, "{\"timestamp\":\"2025-01-14T09:30:00Z\",\"temperature\":20.1,\"humidity\":45.0}") == 0);
+    CHECK(len == (int)strlen(text));
+    CHECK(kv_reading_encode(&reading, small, sizeof(small)) == len && strcmp(small, "{\"times") == 0);
+
+    /* json-c reads it the same way */
+    struct json_object *parsed = json_tokener_parse(text), *value;
+    CHECK(parsed && json_object_object_get_ex(parsed, "temperature", &value) &&
+          json_object_is_type(value, json_type_double) && json_object_get_double(value) == 20.1);
+    json_object_put(parsed);
+
+    CHECK(kv_reading_decode(text, len, &back));
+    CHECK(strcmp(back.timestamp, reading.timestamp) == 0 && back.temperature == 20.1 &&
+          back.humidity == 45.0 && isnan(back.pressure));
+
+    /* Escapes, nulls, whitespace and members of any shape it skips */
+    const char *other = " { \"extra\": {\"a\": [1, {\"b\": \"}\"}], \"c\": null}, \"timestamp\": \"t\\u00e9\\n\\\"\","
+                        " \"pressure\": -1.5e3, \"humidity\": null, \"flag\": true } ";
+    CHECK(kv_reading_decode(other, strlen(other), &back));
+    CHECK(strcmp(back.timestamp, "t\xc3\xa9\n\"") == 0 && back.pressure == -1500 &&
+          isnan(back.humidity) && isnan(back.temperature));
+    len = kv_reading_encode(&back, text, sizeof(text));
+    CHECK(strcmp(text, "{\"timestamp\":\"t\xc3\xa9\\n\\\"\",\"pressure\":-1500.0}") == 0);
+
+    /* Not of this shape: left for json-c */
+    const char *bad[] = {
+        "{\"temperature\":\"20\"}", "{\"timestamp\":5}", "{\"temperature\":20,}", "[1]",
+        "{\"temperature\":20} x", "{\"timestamp\":\"0123456789012345678901234567890123\"}",
+        "{\"timestamp\":\"\\ud800\"}", "{\"a\":[1,2}",
+    };
+    int rejected = 1;
+    for(size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        rejected &= !kv_reading_decode(bad[i], strlen(bad[i]), &back);
+    }
+    CHECK(rejected);
+}
+
+static void test_ip_record_codec(void) {
+    struct kv_ip_record record, back;
+    char text[2048];
+    size_t len;
+
+    /* A longer history keeps its newest entries */
+    int n = snprintf(text, sizeof(text), "{\"ip\":\"10.0.0.12\",\"changed\":false,\"history\":[");
+    for(int i = 0; i < 12; i++) {
+        n += snprintf(text + n, sizeof(text) - n, "%s{\"ip\":\"10.0.0.%d\",\"timestamp\":\"t%d\"}",
+                      i ? "," : "", i, i);
+    }
+    snprintf(text + n, sizeof(text) - n, "],\"previous_ip\":\"10.0.0.11\"}");
+    CHECK(kv_ip_record_decode(text, strlen(text), &record));
+    CHECK(strcmp(record.ip, "10.0.0.12") == 0 && !record.changed && !record.last_updated[0]);
+    CHECK(record.history_count == KV_IP_HISTORY_MAX && strcmp(record.history[0].ip, "10.0.0.2") == 0);
+    CHECK(strcmp(record.history[KV_IP_HISTORY_MAX - 1].timestamp, "t11") == 0);
+    CHECK(record.history_len == 12);
+
+    int encoded = kv_ip_record_encode(&record, text, sizeof(text));
+    CHECK(encoded > 0 && encoded < (int)sizeof(text));
+    CHECK(strncmp(text, "{\"ip\":\"10.0.0.12\",\"changed\":false,\"previous_ip\":\"10.0.0.11\",\"history\":[{", 72) == 0);
+    CHECK(kv_ip_record_decode(text, encoded, &back) && back.history_len == KV_IP_HISTORY_MAX);
+    back.history_len = record.history_len;
+    CHECK(memcmp(&back, &record, sizeof(back)) == 0);
+
+    /* Finding one member of an envelope */
+    const char *envelope = "{\"version\":7,\"data\":{\"ip\":\"1.2.3.4\",\"history\":[]},\"x\":1}";
+    const char *data = kv_json_member(envelope, strlen(envelope), "data", &len);
+    CHECK(data && len == 29 && kv_ip_record_decode(data, len, &back) && strcmp(back.ip, "1.2.3.4") == 0);
+    CHECK(kv_json_member(envelope, strlen(envelope), "missing", &len) == NULL);
+    CHECK(kv_json_member("[]", 2, "data", &len) == NULL);
+}
+
+/* ---- CBOR wire format ---- */
+
+static int bytes_equal(const struct kv_buffer *buf, const char *expected, size_t len) {
+    return buf->size == len && memcmp(buf->data, expected, len) == 0;
+}
+
+static void test_cbor_encoding(void) {
+    struct kv_buffer out = { 0 };
+    struct json_object *doc = json_tokener_parse("{\"a\":1}");
+
+    /* Shortest heads; doubles as float32 only when that is exact */
+    CHECK(kv_cbor_encode(&out, NULL, doc) && bytes_equal(&out, "\xA1\x61" "a\x01", 4));
+    json_object_put(doc);
+    doc = json_tokener_parse("[1.5,20.1,-1,-500,300,\"x\",true,false,null]");
+    CHECK(kv_cbor_encode(&out, "data", doc));
+    CHECK(bytes_equal(&out, "\xA1\x64" "data\x89\xFA\x3F\xC0\x00\x00\xFB\x40\x34\x19\x99\x99\x99\x99\x9A"
+                            "\x20\x39\x01\xF3\x19\x01\x2C\x61" "x\xF5\xF4\xF6", 33));
+
+    /* Decodes back to the same document, envelope included */
+    struct json_object *back, *data;
+    CHECK(kv_cbor_decode(out.data, out.size, &back));
+    CHECK(json_object_object_get_ex(back, "data", &data) && json_object_equal(data, doc));
+    json_object_put(back);
+
+    /* Truncated or trailing input is rejected */
+    CHECK(!kv_cbor_decode(out.data, out.size - 1, &back) && back == NULL);
+    CHECK(kv_buffer_append(&out, "\x00", 1) && !kv_cbor_decode(out.data, out.size, &back));
+
+    json_object_put(doc);
+    kv_buffer_free(&out);
+}
+
+static void test_cbor_decodes_other_encoders(void) {
+    /* Indefinite map, text, array and bytes; a half float; a tagged
+     * integer; undefined */
+    static const char input[] = "\xBF\x7F\x61k\x61" "e\xFF\x9F\xF9\x3E\x00\xC1\x1A\x00\x00\x00\x10\xF7"
+                                "\x5F\x41" "b\xFF\xFF\xFF";
+    struct json_object *doc;
+
+    CHECK(kv_cbor_decode(input, sizeof(input) - 1, &doc));
+    CHECK_JSON(doc, "{\"ke\":[1.5,16,null,\"b\"]}");
+    json_object_put(doc);
+
+    /* Nesting past the limit, a missing break and a non-string key */
+    char deep[100];
+    memset(deep, 0x81, sizeof(deep));
+    deep[sizeof(deep) - 1] = 0;
+    CHECK(!kv_cbor_decode(deep, sizeof(deep), &doc));
+    CHECK(!kv_cbor_decode("\x9F\x01", 2, &doc) && !kv_cbor_decode("\xA1\x01\x01", 3, &doc));
+}
+
+static void test_cbor_response(void) {
+    struct kv_response response = {0};
+    static const char body[] = "\xA2\x64" "data\xA1\x61" "t\xFA\x41\xA4\x00\x00\x67" "version\x07";
+
+    /* Kept whole, then decoded in one go */
+    kv_response_reset(&response);
+    response.cbor = 1;
+    CHECK(kv_response_write((void *)body, 1, 9, &response) == 9);
+    CHECK(kv_response_write((void *)(body + 9), 1, sizeof(body) - 10, &response) == sizeof(body) - 10);
+    CHECK(response.state == KV_PARSE_PENDING);
+    struct json_object *json = kv_response_take(&response);
+    CHECK_JSON(json, "{\"data\":{\"t\":20.5},\"version\":7}");
+    CHECK(response.body.size == 0 && kv_response_take(&response) == NULL);
+    json_object_put(json);
+
+    /* The next response on the sink is JSON again */
+    kv_response_reset(&response);
+    CHECK(!response.cbor && kv_response_write("[1]", 1, 3, &response) == 3);
+    json = kv_response_take(&response);
+    CHECK_JSON(json, "[1]");
+    json_object_put(json);
+    kv_response_free(&response);
+
+    kv_client *client = kv_client_new("http://127.0.0.1:9", "token");
+    CHECK(kv_client_wire_format(client) == KV_WIRE_JSON);
+    CHECK(!kv_client_set_wire_format(client, 7) && kv_client_set_wire_format(client, KV_WIRE_CBOR));
+    CHECK(!kv_store_string(client, "{\"t\":1}") && kv_client_status(client) == 0);
+    CHECK(kv_client_wire_format(client) == KV_WIRE_CBOR);
+    kv_client_free(client);
+}
+
+/* ---- kv_metrics ---- */
+
+static void test_metrics_count_and_export(void) {
+    kv_client *client = kv_client_new("http://127.0.0.1:9", "token");
+    struct kv_timing timing;
+    struct kv_op_metrics metrics;
+    char text[8192], small[16];
+
+    CHECK(!kv_client_last_timing(client, &timing) && kv_client_phase_quantile(client, KV_PHASE_WAIT, 0.5) == -1);
+    CHECK(kv_client_enable_metrics(client, 1) && !kv_client_last_timing(client, &timing));
+
+    kv_client_set_retry(client, 2, 1, 2);
+    CHECK(kv_retrieve(client) == NULL && kv_client_last_timing(client, &timing));
+    CHECK(timing.op == KV_OP_RETRIEVE && timing.attempts == 2 && timing.total >= 0);
+    CHECK(kv_client_op_metrics(client, KV_OP_RETRIEVE, &metrics));
+    CHECK(metrics.requests == 1 && metrics.failures == 1 && metrics.p50 <= metrics.max);
+    CHECK(kv_client_op_metrics(client, KV_OP_STORE, &metrics) && metrics.requests == 0);
+
+    int len = kv_metrics_prometheus(client, "device=\"42\"", text, sizeof(text));
+    CHECK(len > 0 && len < (int)sizeof(text) && (size_t)len == strlen(text));
+    CHECK(strstr(text, "kv_requests_total{op=\"retrieve\",device=\"42\"} 1") != NULL);
+    CHECK(kv_metrics_prometheus(client, NULL, small, sizeof(small)) > (int)sizeof(small) &&
+          strlen(small) == sizeof(small) - 1);
+
+    /* StatsD counters are deltas: a failed send or a truncated export
+     * leaves them, a complete one takes them */
+    CHECK(!kv_metrics_statsd_send(client, "127.0.0.1", 0, "kv"));
+    CHECK(kv_metrics_statsd(client, "kv", small, sizeof(small)) > (int)sizeof(small));
+    CHECK(kv_metrics_statsd(client, "kv", text, sizeof(text)) > 0);
+    CHECK(strstr(text, "kv.retrieve.requests:1|c") != NULL);
+    CHECK(kv_metrics_statsd(client, "kv", text, sizeof(text)) >= 0 && strstr(text, "|c") == NULL);
+
+    kv_client_metrics_reset(client);
+    CHECK(!kv_client_last_timing(client, &timing));
+    CHECK(kv_client_enable_metrics(client, 0) && !kv_client_op_metrics(client, KV_OP_RETRIEVE, &metrics));
+
+    kv_client_free(client);
+}
+
+/* ---- kv_watch ---- */
+
+static int count_change(struct json_object *data, long version, void *userdata) {
+    (void)data;
+    (void)version;
+    (*(int *)userdata)++;
+    return 1;
+}
+
+static void test_watch_resumes_after_failure(void) {
+    kv_client *client = kv_client_new("http://127.0.0.1:9", "token");
+    int changes = 0;
+    char url[128];
+
+    CHECK(kv_watch_url(client, 30, 17, url, sizeof(url)) &&
+          strcmp(url, "http://127.0.0.1:9/api/retrieve?wait=30&version=17") == 0);
+    CHECK(!kv_watch_url(client, 30, 17, url, 40));
+
+    kv_watch *watch = kv_watch_new(client, 17, count_change, &changes);
+    CHECK(watch && kv_watch_version(watch) == 17 && kv_watch_held(watch) == -1);
+
+    /* A failed request delivers nothing and keeps the version to resume
+     * from; the long polls are counted apart from retrieves */
+    kv_client_enable_metrics(client, 1);
+    kv_watch_set_wait(watch, 1, 10);
+    CHECK(kv_watch_poll(watch) == -1 && kv_watch_run(watch, 1000) == -1);
+    CHECK(changes == 0 && kv_watch_version(watch) == 17 && kv_watch_held(watch) == -1);
+
+    struct kv_op_metrics metrics;
+    CHECK(kv_client_op_metrics(client, KV_OP_WATCH, &metrics) && metrics.requests == 2 && metrics.failures == 2);
+    CHECK(kv_client_op_metrics(client, KV_OP_RETRIEVE, &metrics) && metrics.requests == 0);
+
+    kv_watch_free(watch);
+    kv_client_free(client);
+}
+
+/* ---- kv_sched ---- */
+
+struct sched_probe {
+    int runs;
+    int stop_after;                 /* cancel on this run, 0 never */
+    long work_ms;                   /* time each run takes */
+};
+
+static int probe_job(kv_sched_job *job, void *userdata) {
+    struct sched_probe *probe = (struct sched_probe *)userdata;
+    (void)job;
+
+    probe->runs++;
+    if(probe->work_ms > 0) kv_sleep_ms(probe->work_ms);
+    return probe->runs != probe->stop_after;
+}
+
+static void test_sched_fixed_rate(void) {
+    kv_sched *sched = kv_sched_new(NULL);
+    struct sched_probe quick = { 0, 0, 0 }, slow = { 0, 0, 45 };
+    struct kv_sched_stats stats;
+
+    CHECK(sched && kv_sched_next_ms(sched) == -1);
+    kv_sched_job *quick_job = kv_sched_every(sched, 20, 0, probe_job, &quick);
+    kv_sched_job *slow_job = kv_sched_every(sched, 20, 0, probe_job, &slow);
+    CHECK(quick_job && slow_job && kv_sched_next_ms(sched) == 0);
+
+    /* The slow job holds up the quick one, which still keeps its rate:
+     * every tick is either run or skipped, none shifted */
+    CHECK(kv_sched_run(sched, 300) == 0);
+    kv_sched_job_stats(quick_job, &stats);
+    CHECK(stats.runs == quick.runs && stats.runs >= 4 && stats.max_late_ms >= 20);
+    CHECK(stats.runs + stats.skipped >= 13 && stats.runs + stats.skipped <= 18);
+    kv_sched_job_stats(slow_job, &stats);
+    CHECK(stats.skipped >= stats.runs);
+
+    /* A busy job's ticks pass */
+    kv_sched_cancel(sched, slow_job);
+    kv_sched_job_set_busy(quick_job, 1);
+    int runs = quick.runs;
+    CHECK(kv_sched_run(sched, 60) == 0 && quick.runs == runs);
+    kv_sched_job_set_busy(quick_job, 0);
+
+    /* Jobs that cancel themselves leave the scheduler empty */
+    quick.stop_after = quick.runs + 2;
+    CHECK(kv_sched_run(sched, 1000) == 1 && quick.runs == quick.stop_after);
+    CHECK(kv_sched_next_ms(sched) == -1);
+    kv_sched_free(sched);
+}
+
+/* Sched job that cancels its rival on its first run */
+struct sched_rival {
+    kv_sched *sched;
+    kv_sched_job *rival;
+    int runs;
+};
+
+static int rival_job(kv_sched_job *job, void *userdata) {
+    struct sched_rival *self = (struct sched_rival *)userdata;
+    (void)job;
+    self->runs++;
+    if(self->rival) kv_sched_cancel(self->sched, self->rival);
+    self->rival = NULL;
+    return 1;
+}
+
+static void test_sched_cancel_due_job(void) {
+    kv_sched *sched = kv_sched_new(NULL);
+    struct sched_rival a = { sched, NULL, 0 }, b = { sched, NULL, 0 };
+
+    /* Both due in the same pass: whichever runs first cancels the other,
+     * which has already been taken off the wheel */
+    kv_sched_job *a_job = kv_sched_every(sched, 20, 0, rival_job, &a);
+    kv_sched_job *b_job = kv_sched_every(sched, 20, 0, rival_job, &b);
+    a.rival = b_job;
+    b.rival = a_job;
+    CHECK(kv_sched_run(sched, 100) == 0);
+    CHECK(a.runs + b.runs >= 2 && (a.runs == 0 || b.runs == 0));
+
+    kv_sched_cancel(sched, a.runs ? a_job : b_job);
+    CHECK(kv_sched_next_ms(sched) == -1 && kv_sched_run(sched, 0) == 1);
+    kv_sched_free(sched);
+}
+
+static void test_sched_jitter_and_far_jobs(void) {
+    kv_sched *sched = kv_sched_new(NULL);
+    struct sched_probe probe = { 0, 0, 0 };
+
+    /* First runs are spread within the jitter; a period longer than a
+     * wheel revolution still comes round on time */
+    kv_sched_job *hourly = kv_sched_every(sched, 3600 * 1000L, 500, probe_job, &probe);
+    long first = kv_sched_next_ms(sched);
+    CHECK(hourly && first >= 0 && first <= 500);
+    CHECK(kv_sched_poll(sched, first) == 1 && probe.runs == 1);
+    long next = kv_sched_next_ms(sched);
+    CHECK(next > 3600 * 1000L - 1000 && next <= 3600 * 1000L + 500);
+
+    kv_sched_cancel(sched, hourly);
+    CHECK(kv_sched_next_ms(sched) == -1 && kv_sched_run(sched, 0) == 1);
+    kv_sched_free(sched);
+}
+
+/* ---- kv_extip ---- */
+
+static int async_calls[2];
+
+static void count_call(const struct kv_async_result *result, void *userdata) {
+    (void)result;
+    async_calls[(int *)userdata - async_calls]++;
+}
+
+static void on_alarm(int sig) {
+    (void)sig;
+}
+
+static void test_async_poll_survives_signal(void) {
+    kv_async *async = kv_async_new();
+    int port, fd = silent_listener(&port);
+    char url[64];
+
+    CHECK(async && fd >= 0);
+    if(!async || fd < 0) return;
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/slow", port);
+    CHECK(kv_async_get(async, url, 5L, count_call, &async_calls[0]));
+
+    /* No SA_RESTART, so the alarm interrupts epoll_wait */
+    struct sigaction action, previous;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_alarm;
+    sigaction(SIGALRM, &action, &previous);
+    struct itimerval timer = { { 0, 0 }, { 0, 50000 } };
+    setitimer(ITIMER_REAL, &timer, NULL);
+
+    int pending = -1;
+    for(int i = 0; i < 20 && pending != 1; i++) {
+        errno = 0;
+        pending = kv_async_poll(async, 1000);
+        if(errno != EINTR) pending = -1;
+    }
+    CHECK(pending == 1 && kv_async_pending(async) == 1);
+    sigaction(SIGALRM, &previous, NULL);
+
+    CHECK(kv_async_cancel(async, &async_calls[0]) == 1 && async_calls[0] == 0);
+    kv_async_free(async);
+    close(fd);
+}
+
+static void test_async_cancel(void) {
+    kv_async *async = kv_async_new();
+
+    CHECK(kv_async_get(async, "http://127.0.0.1:9/a", 5L, count_call, &async_calls[0]));
+    CHECK(kv_async_get(async, "http://127.0.0.1:9/b", 5L, count_call, &async_calls[1]));
+    CHECK(kv_async_cancel(async, &async_calls[0]) == 1);
+    CHECK(kv_async_pending(async) == 1);
+    CHECK(kv_async_run(async));
+    CHECK(async_calls[0] == 0 && async_calls[1] == 1);
+    kv_async_free(async);
+}
+
+static struct {
+    int calls;
+    long status;
+    int parsed;
+    char body[64];
+} async_seen;
+
+static void record_result(const struct kv_async_result *result, void *userdata) {
+    (void)userdata;
+    async_seen.calls++;
+    async_seen.status = result->status;
+    async_seen.parsed = result->data != NULL;
+    snprintf(async_seen.body, sizeof(async_seen.body), "%.*s",
+             result->body ? (int)result->body_size : 0, result->body ? result->body : "");
+}
+
+static void test_async_recycles_handles(void) {
+    struct test_server server;
+    char url[64], ping[80];
+
+    CHECK(test_server_start(&server));
+    test_server_url(&server, url, sizeof(url));
+    snprintf(ping, sizeof(ping), "%s/ping", url);
+    kv_client *client = kv_client_new(url, "token");
+    kv_async *async = kv_async_new();
+
+    /* One request at a time, so each takes the handle the last one left
+     * on the free list */
+    CHECK(kv_async_retrieve(async, client, record_result, NULL) && kv_async_run(async));
+    CHECK(async_seen.calls == 1 && async_seen.status == 200 && async_seen.parsed);
+    CHECK(strstr(server.request, "\r\nX-KV-Token: token\r\n") != NULL);
+
+    CHECK(kv_async_get_raw(async, ping, 5L, NULL, record_result, NULL) && kv_async_run(async));
+    CHECK(async_seen.calls == 2 && async_seen.status == 200 && !async_seen.parsed);
+    CHECK(strcmp(async_seen.body, "pong") == 0);
+    CHECK(strncmp(server.request, "GET /ping ", 10) == 0);
+    CHECK(strstr(server.request, "\r\nX-KV-Token:") == NULL);
+
+    /* The body is the request's own: the document may go at once */
+    struct json_object *doc = json_tokener_parse("{\"v\":[1,2],\"s\":\"a b\"}");
+    CHECK(kv_async_store(async, client, doc, record_result, NULL));
+    json_object_put(doc);
+    CHECK(kv_async_run(async) && async_seen.calls == 3);
+    CHECK(strcmp(test_server_body(&server), "{\"data\":{\"v\":[1,2],\"s\":\"a b\"}}") == 0);
+    CHECK(strstr(server.request, "\r\nContent-Length: 30\r\n") != NULL);
+
+    /* Nor does a store leave its method, body or content type behind */
+    CHECK(kv_async_get_raw(async, ping, 5L, NULL, record_result, NULL) && kv_async_run(async));
+    CHECK(async_seen.calls == 4 && strcmp(async_seen.body, "pong") == 0);
+    CHECK(strncmp(server.request, "GET /ping ", 10) == 0);
+    CHECK(strstr(server.request, "\r\nContent-Type:") == NULL);
+    CHECK(strstr(server.request, "\r\nContent-Length:") == NULL);
+    CHECK(server.requests == 4);
+
+    kv_async_free(async);
+    kv_client_free(client);
+    test_server_stop(&server);
+}
+
+/* Two GETs race; whichever completes first cancels the other, whose
+ * completion may already be waiting in the same dispatch, and submits a
+ * third that likely reuses the cancelled one's handle */
+static struct {
+    kv_async *async;
+    char url[80];
+    int calls[3];
+    int cancelled;
+    int self_cancelled;
+} rivals;
+
+static void cancel_rival(const struct kv_async_result *result, void *userdata) {
+    (void)result;
+    int i = (int)((int *)userdata - rivals.calls);
+    rivals.calls[i]++;
+    if(i == 2) return;
+
+    rivals.cancelled += kv_async_cancel(rivals.async, &rivals.calls[1 - i]);
+    rivals.self_cancelled += kv_async_cancel(rivals.async, userdata);
+    kv_async_get_raw(rivals.async, rivals.url, 5L, NULL, cancel_rival, &rivals.calls[2]);
+}
+
+static void test_async_cancel_from_callback(void) {
+    struct test_server server;
+    char url[64];
+
+    CHECK(test_server_start(&server));
+    test_server_url(&server, url, sizeof(url));
+    snprintf(rivals.url, sizeof(rivals.url), "%s/ping", url);
+    rivals.async = kv_async_new();
+
+    CHECK(kv_async_get_raw(rivals.async, rivals.url, 5L, NULL, cancel_rival, &rivals.calls[0]));
+    CHECK(kv_async_get_raw(rivals.async, rivals.url, 5L, NULL, cancel_rival, &rivals.calls[1]));
+    CHECK(kv_async_run(rivals.async) && kv_async_pending(rivals.async) == 0);
+    CHECK(rivals.calls[0] + rivals.calls[1] == 1 && rivals.calls[2] == 1);
+    CHECK(rivals.cancelled == 1 && rivals.self_cancelled == 0);
+
+    kv_async_free(rivals.async);
+    test_server_stop(&server);
+}
+
+static void test_dns_query_and_answer(void) {
+    char *url = kv_dns_query_url("https://doh.example/dns-query", "myip.opendns.com");
+    CHECK(url && strcmp(url, "https://doh.example/dns-query?dns=AAABAAABAAAAAAAABG15aXAHb3BlbmRucwNjb20AAAEAAQ") == 0);
+    kv_free(url);
+
+    /* The question with its answer as a pointer back to the name */
+    static const unsigned char response[] = {
+        0, 0, 0x81, 0x80, 0, 1, 0, 1, 0, 0, 0, 0,
+        4, 'm', 'y', 'i', 'p', 7, 'o', 'p', 'e', 'n', 'd', 'n', 's', 3, 'c', 'o', 'm', 0, 0, 1, 0, 1,
+        0xc0, 0x0c, 0, 1, 0, 1, 0, 0, 0, 60, 0, 4, 203, 0, 113, 42
+    };
+    char ip[KV_EXTIP_ADDR_MAX];
+    CHECK(kv_dns_answer(response, sizeof(response), ip) && strcmp(ip, "203.0.113.42") == 0);
+    CHECK(!kv_dns_answer(response, sizeof(response) - 1, ip));
+
+    unsigned char failed[sizeof(response)];
+    memcpy(failed, response, sizeof(response));
+    failed[3] = 0x83;               /* NXDOMAIN */
+    CHECK(!kv_dns_answer(failed, sizeof(failed), ip));
+}
+
+static int extip_calls;
+static char extip_answer[KV_EXTIP_ADDR_MAX];
+
+static void on_extip(const char *ip, void *userdata) {
+    (void)userdata;
+    extip_calls++;
+    snprintf(extip_answer, sizeof(extip_answer), "%s", ip ? ip : "none");
+}
+
+static void test_extip_all_providers_fail(void) {
+    kv_extip *finder = kv_extip_new();
+    kv_async *async = kv_async_new();
+
+    CHECK(!kv_extip_lookup(finder, async, on_extip, NULL));
+    CHECK(kv_extip_add(finder, KV_EXTIP_JSON, "http://127.0.0.1:9/json"));
+    CHECK(kv_extip_add(finder, KV_EXTIP_DNS, "http://127.0.0.1:9/dns-query"));
+    CHECK(!kv_extip_add(finder, 7, "http://127.0.0.1:9/other"));
+    kv_extip_set_cache(finder, 60000);
+
+    CHECK(kv_extip_lookup(finder, async, on_extip, NULL));
+    CHECK(!kv_extip_lookup(finder, async, on_extip, NULL));
+    CHECK(kv_async_run(async));
+    CHECK(extip_calls == 1 && strcmp(extip_answer, "none") == 0);
+    CHECK(kv_extip_cached(finder) == NULL);
+
+    kv_async_free(async);
+    kv_extip_free(finder);
+}
+
+static void test_extip_doh_accepts_dns_message(void) {
+    struct test_server server;
+    char url[64], doh[80];
+
+    CHECK(test_server_start(&server));
+    test_server_url(&server, url, sizeof(url));
+    snprintf(doh, sizeof(doh), "%s/dns-query", url);
+    kv_extip *finder = kv_extip_new();
+    kv_async *async = kv_async_new();
+
+    /* The server's plain text is no DNS message, so the lookup fails,
+     * but only after the query went out asking for one */
+    extip_calls = 0;
+    CHECK(kv_extip_add(finder, KV_EXTIP_DNS, doh));
+    CHECK(kv_extip_lookup(finder, async, on_extip, NULL) && kv_async_run(async));
+    CHECK(extip_calls == 1 && strcmp(extip_answer, "none") == 0);
+    CHECK(strncmp(server.request, "GET /dns-query?dns=", 19) == 0);
+    CHECK(strstr(server.request, "\r\nAccept: application/dns-message\r\n") != NULL);
+
+    /* Nor does the header stay on the handle for the next GET */
+    CHECK(kv_async_get_raw(async, url, 5L, NULL, count_call, &async_calls[1]) && kv_async_run(async));
+    CHECK(strstr(server.request, "\r\nAccept: application/dns-message\r\n") == NULL);
+
+    kv_async_free(async);
+    kv_extip_free(finder);
+    test_server_stop(&server);
+}
+
+/* ---- kv_stats ---- */
+
+static void test_stats_window(void) {
+    const char *readings[] = {
+        "{\"t\":5,\"h\":50,\"at\":\"x\"}", "{\"t\":1}", "{\"t\":3,\"h\":40}",
+        "{\"t\":4}", "{\"t\":2,\"h\":60}"
+    };
+    struct json_object *history[5];
+    struct kv_series_stats t, h;
+    kv_stats *stats = kv_stats_new(3);
+
+    for(int i = 0; i < 5; i++) {
+        history[i] = json_tokener_parse(readings[i]);
+        CHECK(kv_stats_add(stats, history[i], i >= 3 ? history[i - 3] : NULL));
+    }
+
+    /* Window is now readings 2..4: t = {3,4,2}, h = {40,60} */
+    CHECK(kv_stats_get(stats, "t", &t));
+    CHECK(t.min == 2 && t.max == 4 && t.count == 3 && t.avg == 3);
+    CHECK(kv_stats_get(stats, "h", &h));
+    CHECK(h.min == 40 && h.max == 60 && h.count == 2);
+    CHECK(!kv_stats_get(stats, "at", &h));
+    CHECK(kv_stats_window_count(stats) == 3);
+
+    /* A restored aggregator carries on exactly where the original was */
+    struct json_object *state = kv_stats_state(stats);
+    kv_stats *restored = kv_stats_from_state(state, 3);
+    CHECK(restored != NULL);
+    CHECK(kv_stats_from_state(state, 4) == NULL);
+
+    struct json_object *next = json_tokener_parse("{\"t\":9}");
+    kv_stats_add(stats, next, history[2]);
+    if(restored) {
+        kv_stats_add(restored, next, history[2]);
+        struct json_object *a = kv_stats_to_json(stats);
+        struct json_object *b = kv_stats_to_json(restored);
+        CHECK_JSON(b, json_object_to_json_string_ext(a, JSON_C_TO_STRING_PLAIN));
+        CHECK_JSON(a, "{\"t\":{\"min\":2.0,\"max\":9.0,\"avg\":5.0,\"count\":3},"
+                      "\"h\":{\"min\":60.0,\"max\":60.0,\"avg\":60.0,\"count\":1},"
+                      "\"total_readings\":3}");
+        json_object_put(a);
+        json_object_put(b);
+    }
+
+    json_object_put(next);
+    json_object_put(state);
+    for(int i = 0; i < 5; i++) json_object_put(history[i]);
+    kv_stats_free(restored);
+    kv_stats_free(stats);
+}
+
+/* ---- kv_reduce ---- */
+
+static int close_to(double a, double b) {
+    return fabs(a - b) <= 1e-9 * (fabs(b) > 1 ? fabs(b) : 1);
+}
+
+static void test_reduce_kernels_agree(void) {
+    /* Readings around 1013 hPa, a gap every seventh, and a length that
+     * leaves a tail for every kernel's scalar loop */
+    size_t n = 10007;
+    double *values = malloc(n * sizeof(double));
+    unsigned long long seed = 42;
+    for(size_t i = 0; i < n; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        values[i] = i % 7 == 3 ? NAN : 1013.0 + (double)(seed >> 40) / (1 << 24) - 0.5;
+    }
+    values[0] = NAN;
+
+    struct kv_reduce expected;
+    CHECK(kv_reduce_set_kernel("scalar"));
+    kv_reduce(values, n, &expected);
+    CHECK(expected.count == n - 1 - (n + 3) / 7);
+
+    double sum = 0, sq = 0;
+    for(size_t i = 0; i < n; i++) if(!isnan(values[i])) sum += values[i];
+    for(size_t i = 0; i < n; i++) if(!isnan(values[i])) sq += (values[i] - sum / expected.count) * (values[i] - sum / expected.count);
+    CHECK(close_to(expected.sum, sum) && close_to(expected.mean, sum / expected.count));
+    CHECK(close_to(expected.variance, sq / expected.count));
+
+    /* Every kernel this CPU runs gives the same figures, also on short
+     * columns that never reach the vector loop */
+    const char *names[] = { "sse2", "avx2", "neon" };
+    const size_t lengths[] = { n, 3, 9 };
+    for(int k = 0; k < 3; k++) {
+        if(!kv_reduce_set_kernel(names[k])) continue;
+        CHECK(strcmp(kv_reduce_kernel(), names[k]) == 0);
+        for(int l = 0; l < 3; l++) {
+            struct kv_reduce want, got;
+            kv_reduce_set_kernel("scalar");
+            kv_reduce(values, lengths[l], &want);
+            kv_reduce_set_kernel(names[k]);
+            kv_reduce(values, lengths[l], &got);
+            CHECK(got.count == want.count && got.min == want.min && got.max == want.max);
+            CHECK(close_to(got.sum, want.sum) && close_to(got.mean, want.mean) &&
+                  close_to(got.variance, want.variance));
+        }
+    }
+    CHECK(kv_reduce_set_kernel("mmx") == 0);
+    CHECK(kv_reduce_set_kernel(NULL));
+
+    /* Nothing but gaps */
+    struct kv_reduce empty;
+    kv_reduce(values, 1, &empty);
+    CHECK(empty.count == 0 && isnan(empty.min) && isnan(empty.mean));
+    kv_reduce(values, 0, &empty);
+    CHECK(empty.count == 0);
+    free(values);
+}
+
+static void test_reduce_percentiles(void) {
+    /* 1..100, shuffled, with gaps in between */
+    double values[150];
+    for(int i = 0; i < 150; i++) values[i] = NAN;
+    for(int i = 0; i < 100; i++) values[(i * 37) % 150] = i + 1;
+
+    const double ps[] = { 95, 0, 50, 100, 25, 101 };
+    double at[6];
+    CHECK(kv_reduce_percentiles(values, 150, ps, 6, at));
+    CHECK(close_to(at[0], 95.05) && at[1] == 1 && close_to(at[2], 50.5));
+    CHECK(at[3] == 100 && close_to(at[4], 25.75) && isnan(at[5]));
+    CHECK(values[37] == 2 && isnan(values[2]));
+
+    /* Long runs of one value, as fixed-point readings have */
+    double flat[1000];
+    for(int i = 0; i < 1000; i++) flat[i] = i < 900 ? 21.5 : 22.0;
+    const double high[] = { 50, 95 };
+    CHECK(kv_reduce_percentiles(flat, 1000, high, 2, at));
+    CHECK(at[0] == 21.5 && at[1] == 22.0);
+
+    CHECK(kv_reduce_percentiles(values + 2, 1, ps, 1, at) && isnan(at[0]));
+}
+
+/* ---- kv_series ---- */
+
+static void test_series_patches_track_stored_form(void) {
+    kv_series *series = kv_series_new(3, 100);
+    struct json_object *doc = json_object_new_object();
+    char text[64];
+    int ok = 1;
+
+    /* Keep a stored copy current purely from the emitted patches */
+    for(int i = 0; i < 5; i++) {
+        struct json_object *set = json_object_new_object();
+        snprintf(text, sizeof(text), i == 2 ? "{\"t\":%d.25,\"co2\":400}" : "{\"t\":%d.25}", i);
+        struct json_object *reading = json_tokener_parse(text);
+
+        ok &= kv_series_append(series, 1000 + i * 60, reading, set, "series");
+        ok &= kv_patch_apply(doc, set, NULL);
+
+        json_object_put(reading);
+        json_object_put(set);
+    }
+    CHECK(ok);
+
+    struct json_object *stored = NULL;
+    json_object_object_get_ex(doc, "series", &stored);
+    kv_series *decoded = kv_series_decode(stored);
+    CHECK(decoded != NULL);
+    if(decoded) {
+        struct json_object *a = kv_series_to_json(series);
+        struct json_object *b = kv_series_to_json(decoded);
+        CHECK_JSON(b, json_object_to_json_string_ext(a, JSON_C_TO_STRING_PLAIN));
+        CHECK_JSON(a, "[{\"timestamp\":\"1970-01-01T00:18:40Z\",\"t\":2.25,\"co2\":400.0},"
+                      "{\"timestamp\":\"1970-01-01T00:19:40Z\",\"t\":3.25},"
+                      "{\"timestamp\":\"1970-01-01T00:20:40Z\",\"t\":4.25}]");
+        json_object_put(a);
+        json_object_put(b);
+
+        double column[3];
+        CHECK(kv_series_column(decoded, "co2", column) == 3);
+        CHECK(column[0] == 400 && isnan(column[1]) && isnan(column[2]));
+        CHECK(kv_series_time(decoded, 2) == 1240);
+        CHECK(kv_series_next_slot(decoded) == 2);
+    }
+
+    /* Inconsistent timestamps are rejected rather than misread */
+    if(stored) {
+        json_object_object_add(stored, "t_last", json_object_new_int64(1));
+        CHECK(kv_series_decode(stored) == NULL);
+    }
+
+    kv_series_free(decoded);
+    kv_series_free(series);
+    json_object_put(doc);
+}
+
+static void test_series_keeps_scale(void) {
+    kv_series *series = kv_series_new(4, 1000);
+    struct json_object *reading = json_tokener_parse("{\"a\":1.2345}");
+    CHECK(kv_series_append(series, 1000, reading, NULL, NULL));
+    json_object_put(reading);
+
+    /* A column that first appears after decoding keeps three decimals too */
+    struct json_object *stored = kv_series_encode(series);
+    kv_series *decoded = kv_series_decode(stored);
+    reading = json_tokener_parse("{\"a\":2.5,\"b\":1.2345}");
+    double column[2];
+    CHECK(decoded && kv_series_append(decoded, 1060, reading, NULL, NULL));
+    CHECK(decoded && kv_series_column(decoded, "b", column) == 2 && isnan(column[0]) && column[1] == 1.235);
+    json_object_put(reading);
+    json_object_put(stored);
+
+    /* Without a scale of its own, a stored form gets the default */
+    stored = kv_series_encode(series);
+    json_object_object_del(stored, "scale");
+    kv_series_free(decoded);
+    decoded = kv_series_decode(stored);
+    reading = json_tokener_parse("{\"b\":1.2345}");
+    CHECK(decoded && kv_series_append(decoded, 1060, reading, NULL, NULL));
+    CHECK(decoded && kv_series_column(decoded, "b", column) == 2 && column[1] == 1.23);
+    json_object_put(reading);
+    json_object_put(stored);
+
+    kv_series_free(decoded);
+    kv_series_free(series);
+}
+
+int main(void) {
+    test_patch_apply_set_nested();
+    test_patch_apply_array_slots();
+    test_patch_apply_creates_array_for_index();
+    test_patch_apply_remove();
+    test_batch_limit();
+    test_patch_prune();
+    test_queue_last_write_wins();
+    test_writer_keeps_samples_on_failure();
+    test_fleet_runs_every_device_once();
+    test_ingest_accounts_every_reading();
+    test_share_attach_detach();
+    test_response_chunked_parse();
+    test_response_not_json();
+    test_upload_streams_parts();
+    test_store_body_on_the_wire();
+    test_client_reuses_connection();
+    test_cache_tracks_patches();
+    test_patch_if_checks_cached_document();
+    test_client_headers_follow_token();
+    test_retry_backoff_spreads();
+    test_breaker_fails_fast();
+    test_compress_bodies();
+    test_crypt_round_trip();
+    test_history_url();
+    test_history_iter_stops_on_failure();
+    test_spool_survives_reopen();
+    test_spool_cuts_torn_tail();
+    test_spool_compaction_cut_short();
+    test_writer_spool_outlives_process();
+    test_snapshot_follows_writes();
+    test_reading_codec_round_trip();
+    test_ip_record_codec();
+    test_cbor_encoding();
+    test_cbor_decodes_other_encoders();
+    test_cbor_response();
+    test_metrics_count_and_export();
+    test_watch_resumes_after_failure();
+    test_sched_fixed_rate();
+    test_sched_cancel_due_job();
+    test_sched_jitter_and_far_jobs();
+    test_async_cancel();
+    test_async_poll_survives_signal();
+    test_async_recycles_handles();
+    test_async_cancel_from_callback();
+    test_dns_query_and_answer();
+    test_extip_all_providers_fail();
+    test_extip_doh_accepts_dns_message();
+    test_stats_window();
+    test_reduce_kernels_agree();
+    test_reduce_percentiles();
+    test_series_patches_track_stored_form();
+    test_series_keeps_scale();
+    test_arena();
+    test_pool();
+
+    if(failures) {
+        fprintf(stderr, "%d of %d checks failed\n", failures, checks);
+        return 1;
+    }
+    printf("All %d checks passed\n", checks);
+    return 0;
+}